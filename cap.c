@@ -19,6 +19,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <ctype.h>
 #include <malloc.h>
@@ -27,6 +29,9 @@
 #include <stdlib.h>
 
 #include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 
 /* The following are requied for the Linux fork()/exec()/wait()
  * functions.
@@ -34,13 +39,23 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
 
 #include <unistd.h>
 
-//#include <sys/stat.h>
-//#include <sys/fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <dlfcn.h>
 //#include <sched.h>
 
+#include "cap_plugin.h"
+
 
 
 static char *cap_version = "$Revision: 1.138 $" ;
@@ -102,6 +117,12 @@ static char *return_macro = NULL ;
 static int apply_return_macro = FALSE ;
 
 
+/* With --strip-comments the comments the engine passes through are
+ * dropped
+ */
+static boolean_t strip_comments = FALSE ;
+
+
 /* File streaming macros used mostly for brevity and consistency
  */
 
@@ -116,2459 +137,14147 @@ static FILE *fout = NULL ;
                         (fs) = NULL ; \
                     }
 
-#define FPUT(c)     { if( (c) != -1 ){ fputc( (int)(c), fout ) ; } }
+/* Output line tracking.
+ *
+ * outlinenum is the physical line of fout being written and out_at_bol
+ * is TRUE while nothing has been written on that line.  All output has
+ * to go through FPUT(), FPUTS(), fout_write() or fout_printf() to keep
+ * these up to date.
+ */
+static unsigned int outlinenum = 1 ;
+static boolean_t out_at_bol = TRUE ;
+
+/* A #line marker is held back until something is written after it, so
+ * a marker that another one replaces first ( an included file starting
+ * with another #capinclude, a directive that writes nothing ) never
+ * reaches the output.  outline_delta already counts it.
+ */
+struct line_marker_s {
+    char        *text ;
+    size_t      len ;       /* 0 when no marker is held back */
+    size_t      size ;
+    boolean_t   recorded ;  /* it made the last source map record */
+    } ;
 
-#define FPUTS(b)    { if( (b) != NULL ){ fputs( (b), fout ) ; } }
+typedef struct line_marker_s    line_marker_t ;
 
+static line_marker_t held_marker ;
 
-/* Track source line numbers and use #linenum inserted into the output to
- * enable subsequent passes by cpp or a compiler to report the correct
- * line numbers in our source files !
+static void marker_flush() ;
+
+/* With --squeeze-blank-lines all output goes through squeeze_write()
  */
-static unsigned int linenum = 1 ;
+static boolean_t squeeze_blank_lines = FALSE ;
+
+static void squeeze_write( const char *p, size_t len ) ;
+
+#define FPUT(c)     { \
+                        if( (c) != -1 ) \
+                        { \
+                            if( squeeze_blank_lines ) \
+                            { \
+                                char squeeze_c = (char)(c) ; \
+                                squeeze_write( &squeeze_c, 1 ) ; \
+                            } \
+                            else \
+                            { \
+                                if( held_marker.len != 0 ){ marker_flush() ; } \
+                                fputc( (int)(c), fout ) ; \
+                                out_at_bol = ( (c) == '\n' ) ; \
+                                if( out_at_bol ){ outlinenum++ ; } \
+                            } \
+                        } \
+                    }
 
+#define FPUTS(b)    { if( (b) != NULL ){ fout_puts( (b) ) ; } }
 
-static boolean_t skip_is_on = FALSE ;
 
-static boolean_t changes_made = FALSE ;
+static void fout_write( const char *p, size_t len )
+{
+    const char *q = p ;
+    const char *end = p + len ;
 
-#define DEFAULT_MACROCHAR '#'
+    if( len == 0 )
+        return ;
 
-static char initial_macrochar = DEFAULT_MACROCHAR ;
+    if( squeeze_blank_lines )
+    {
+        squeeze_write( p, len ) ;
+        return ;
+    }
 
-static char macrochar = DEFAULT_MACROCHAR ;
+    marker_flush() ;
 
+    fwrite( p, 1, len, fout ) ;
 
+    while( ( q = memchr( q, '\n', (size_t)( end - q ) ) ) != NULL )
+    {
+        outlinenum++ ;
+        q++ ;
+    };
 
-#define BUFFLEN 1023
+    out_at_bol = ( end[-1] == '\n' ) ;
+}
 
 
-/*
- */
+static void fout_puts( const char *str )
+{
+    fout_write( str, strlen( str ) ) ;
+}
 
 
-#define BUFFER_DECL( _sym ) \
-							static char _sym [ BUFFLEN + 1 ] ; \
-							static int _sym ## _idx = 0 ;
+static void fout_printf( const char *fmt, ... )
+{
+    char local[ 4096 ] ;
+    char *p = local ;
+    int len = 0 ;
+    va_list ap ;
 
-#define BUFFER_INDEX( _sym )	( _sym ## _idx )
+    va_start( ap, fmt ) ;
+    len = vsnprintf( local, sizeof(local), fmt, ap ) ;
+    va_end( ap ) ;
 
+    if( len < 0 )
+        return ;
 
+    if( (size_t)len >= sizeof(local) )
+    {
+        p = (char *)malloc( (size_t)len + 1 ) ;
 
-BUFFER_DECL( prebuff ) ;
-BUFFER_DECL( buff ) ;
-BUFFER_DECL( postbuff ) ;
+        if( p == NULL )
+            return ;
 
+        va_start( ap, fmt ) ;
+        vsnprintf( p, (size_t)len + 1, fmt, ap ) ;
+        va_end( ap ) ;
+    }
 
-#define BUFFER_INIT( _buff )	{ \
-									_buff [ 0 ] = 0 ; \
-									_buff [ BUFFLEN ] = 0 ; \
-									_buff ## _idx = 0 ; \
-								}
+    fout_write( p, (size_t)len ) ;
 
+    if( p != local )
+    {
+        free( p ) ;
+    }
+}
 
-#define BUFFER_AVAILABLE( _buff )	( _buff ## _idx < BUFFLEN )
 
+/* cap has two processing engines.
+ *
+ * ENGINE_REFERENCE is the original character at a time engine which
+ * reads all input through stdio.  It is kept as the definition of
+ * what cap's output should be.
+ *
+ * ENGINE_FAST is allowed to take short cuts ( e.g. reading the input
+ * from memory ) but must ALWAYS produce output byte identical to the
+ * reference engine.  Use --compare to check that it does.
+ */
+#define ENGINE_REFERENCE    0
+#define ENGINE_FAST         1
 
-#define appendc( _c, _buff )	appendc_fn( (_c), (_buff), BUFFLEN, &_buff ## _idx )
+static int engine = ENGINE_FAST ;
 
-#define appends( _s, _buff )	appends_fn( (_s), (_buff), BUFFLEN, &_buff ## _idx )
 
+/* With the fast engine the whole input is held in memory ( mmap()ed
+ * where possible ) and read from there instead of through fin.
+ *
+ * inbuf_eof mimics feof() - it is only set after a read is attempted
+ * at the end of the buffer.
+ */
+static const unsigned char *inbuf = NULL ;
+static size_t inbuf_len = 0 ;
+static size_t inbuf_pos = 0 ;
+static boolean_t inbuf_eof = FALSE ;
 
-/* appendc_fn() will append a char at the index position.
- * 
- * when the index points to the last char in the buffer
- * we always write the new character.  This does mean
- * that the buffer is filled and loose characters, but
- * may mean that we eventually get to an EOL, EOS or EOF
- * character, which is important.
+#define INBUF_BORROWED  0
+#define INBUF_MALLOCED  1
+#define INBUF_MAPPED    2
+
+static int inbuf_type = INBUF_BORROWED ;
+
+#define INGETC()    ( ( inbuf != NULL ) ? \
+                        ( ( inbuf_pos < inbuf_len ) ? (int)inbuf[ inbuf_pos++ ] : ( inbuf_eof = TRUE, -1 ) ) : \
+                        fgetc( fin ) )
+
+#define INEOF()     ( ( inbuf != NULL ) ? inbuf_eof : feof( fin ) )
+
+
+/* Set the in memory input to a buffer owned by someone else
  */
-static void appendc_fn( int c, char *buff, int buffsz, int *idxp )
+static void set_input_buffer( const char *data, size_t len )
 {
-	if( ( buff == NULL ) || ( idxp == NULL ) )
-		return ;
-	
-	if( *idxp < 0 )
-		return ;
-	
-	buff[*idxp] = (char)c ;
-	
-	if( *idxp < buffsz )
-	{
-		(*idxp)++ ;
-	}
+    inbuf       = (const unsigned char *)data ;
+    inbuf_len   = len ;
+    inbuf_pos   = 0 ;
+    inbuf_eof   = FALSE ;
+    inbuf_type  = INBUF_BORROWED ;
 }
 
-/* appends_fn() writes a string, terminated by a nul char,
- * to the buffer. Like appendc_fn() it always writes the
- * last character to the buffer, even if the buffer is filled.
+
+/* Release the in memory input, if any.  After this reading falls
+ * back to fin.
  */
-static void appends_fn( char *str, char *buff, int buffsz, int *idxp )
+static void unload_input()
 {
-	if( ( str == NULL ) || ( buff == NULL ) || ( idxp == NULL ) )
-		return ;
-	
-	if( *idxp < 0 )
-		return ;
-	
-	char *p = str ;
-	int k = *idxp ;
-	
-	while( *p != 0 )
-	{
-		buff[k] = *p ;
-		
-		if( k < buffsz )
-		{
-			k++ ;
-		}
-		
-		p++ ;
-	};
-	
-	/* make sure the buffer is nul terminated
-	 */
-	buff[k] = 0 ;
-	
-	/* update the index
-	 */
-	*idxp = k ;
-}
-
+    if( inbuf != NULL )
+    {
+        if( inbuf_type == INBUF_MAPPED )
+        {
+            munmap( (void *)inbuf, inbuf_len ) ;
+        }
+        else if( inbuf_type == INBUF_MALLOCED )
+        {
+            free( (void *)inbuf ) ;
+        }
+    }
 
-#define READ_FROM_BUFFER( _buff )	read_from_buffer_fn( (_buff), BUFFLEN, &_buff ## _idx )
+    inbuf       = NULL ;
+    inbuf_len   = 0 ;
+    inbuf_pos   = 0 ;
+    inbuf_eof   = FALSE ;
+    inbuf_type  = INBUF_BORROWED ;
+}
 
 
-/* read one character from a buffer if possible.
- * 
- * return -1 is reading is not possible
+/* Load all of the stream fs into memory for the fast engine.
+ *
+ * Regular files are mmap()ed, anything else ( e.g. a pipe on stdin )
+ * is read into a malloc()ed buffer.
+ *
+ * Returns 0 on success.  On failure inbuf is left NULL so reading
+ * carries on through stdio, which is always safe.
  */
-
-static int read_from_buffer_fn( char *buff, int buffsz, int *idxp )
+static int load_input( FILE *fs )
 {
-	int retv = 0 ;
-	
-	if( ( buff == NULL ) || ( idxp == NULL ) )
-	{
-		return -1 ;
-	}
-	
-	if( ( *idxp <= 0 ) || ( *idxp >= buffsz ) )
-	{
-		return -1 ;
-	}
-	
-	(*idxp)-- ;
-	
-	retv = buff[ *idxp ] ;
-	
-	return retv ;
-}
-
+    struct stat st ;
+    char *data = NULL ;
+    size_t len = 0 ;
+    size_t sz = 0 ;
+    size_t n = 0 ;
 
+    unload_input() ;
 
-/***********************************************************************
- */
+    if( fs == NULL )
+        return -1 ;
 
+    if( ( fstat( fileno(fs), &st ) == 0 ) && S_ISREG( st.st_mode ) && ( st.st_size > 0 ) )
+    {
+        data = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fs), 0 ) ;
 
-static int lastchar = -1 ;
+        if( data != MAP_FAILED )
+        {
+            madvise( data, (size_t)st.st_size, MADV_SEQUENTIAL ) ;
 
+            set_input_buffer( data, (size_t)st.st_size ) ;
+            inbuf_type = INBUF_MAPPED ;
 
-#define OUTPUTBUFFS_GEN( p1, p2, p3, lc )   \
-            { \
-                if( *(p1) != '\0' ) \
-                { \
-                    FPUTS( (p1) ) ; \
-                } \
-                if( *(p2) != '\0' ) \
-                { \
-                    FPUTS( (p2) ) ; \
-                } \
-                if( *(p3) != '\0' ) \
-                { \
-                    FPUTS( (p3) ) ; \
-                } \
-                if( (lc) != -1 ) \
-                { \
-                    FPUT( (lc) ) ; \
-                } \
-            }
+            return 0 ;
+        }
 
-#define OUTPUTBUFFS()               OUTPUTBUFFS_GEN( prebuff, buff, postbuff, lastchar )
+        data = NULL ;
+    }
 
-#define OUTPUTBUFFS_NOLASTCHAR()    OUTPUTBUFFS_GEN( prebuff, buff, postbuff, -1 )
+    sz = 65536 ;
 
+    data = (char *)malloc( sz ) ;
 
+    if( data == NULL )
+        return -1 ;
 
-#define iswhitespace(c)     ( ( (c) == ' ' ) || ( (c) == '\t' ) )
+    while( ( n = fread( data + len, 1, sz - len, fs ) ) > 0 )
+    {
+        len += n ;
 
-#define istrueeol()         ( ( currentchar_read == '\n' ) && ( lastchar_read != '\\' ) )
+        if( len == sz )
+        {
+            char *p = (char *)realloc( data, sz * 2 ) ;
 
-/*******************************************************
- */
+            if( p == NULL )
+            {
+                free( data ) ;
+                return -1 ;
+            }
 
-static int iskeyword( char *str )
-{
-    int retv = 0 ;
-    
-    if( buff[0] != macrochar )
-        return 0 ;
-    
-    /* need to avoid white spaces in comparisons
-     * as we'd like spacing to be allowed
-     *
-     * We assume that "keyword" is space trimmed
-     * which it should be.
-     */
-    int i = 1 ;
-    int j = 0 ;
-    
-    while( iswhitespace( buff[i] ) )
-        i++ ;
-    
-    while( buff[i] == str[j] )
-    {
-        if( str[j] == 0 )
-            break ;
-        
-        i++ ;
-        j++ ;
+            data = p ;
+            sz *= 2 ;
+        }
     };
-    
-    if( buff[i] == str[j] )
-    {
-        retv = 1 ;
-    }
-    else
-    {
-        retv = 0 ;
-    }
-    
-    return retv ;
+
+    set_input_buffer( data, len ) ;
+    inbuf_type = INBUF_MALLOCED ;
+
+    return 0 ;
 }
 
 
-/*******************************************************
+/* Track source line numbers and use #linenum inserted into the output to
+ * enable subsequent passes by cpp or a compiler to report the correct
+ * line numbers in our source files !
  */
+static unsigned int linenum = 1 ;
 
-struct wordstack_s {
-    struct wordstack_s  *next ;
-    char            *buff ;
-    } ;
 
-typedef struct wordstack_s  wordstack_t ;
+/* The name of the file being read, as written in #line markers
+ */
+static const char *infilename = "<stdin>" ;
 
 
-/* wordstackp is a stack for storing copies of
- * previously read symbols.
- *
- * It is used in e.g. the "#def" directive.
+/* Count of errors reported against the input.  Any error makes cap
+ * exit with a failure status once it has finished.
  */
-static wordstack_t *wordstackp = NULL ;
+static int cap_errors = 0 ;
 
+static void cap_error( const char *fmt, ... )
+{
+    va_list ap ;
 
-/*******************************************************
- */
+    fprintf( stderr, "%s:%u: ", infilename, linenum ) ;
 
+    va_start( ap, fmt ) ;
+    vfprintf( stderr, fmt, ap ) ;
+    va_end( ap ) ;
 
-/* copy the buffer str to the indicated buffer
+    fputc( '\n', stderr ) ;
+
+    cap_errors++ ;
+}
+
+
+/* ... and for an earlier line, e.g. the one a block started on
  */
+static void cap_error_at( unsigned int line, const char *fmt, ... )
+{
+    va_list ap ;
 
+    fprintf( stderr, "%s:%u: ", infilename, line ) ;
 
-#define copybuff( _dest )	strncpy( (_dest), buff, sizeof(buff) )
+    va_start( ap, fmt ) ;
+    vfprintf( stderr, fmt, ap ) ;
+    va_end( ap ) ;
 
+    fputc( '\n', stderr ) ;
 
-/*******************************************************
- */
+    cap_errors++ ;
+}
 
 
-/* read a symbol from the input stream returning it's
- * delimiter and the buffer containing the word
- * terminated by a '\0'
+/* #line markers are only written where the output line cpp would see
+ * differs from the input line, e.g. after a #comment or #constants
+ * block.  outline_delta is added to outlinenum to get the line cpp will
+ * believe it is on after the markers written so far.
  *
- * a symbol is anything like a variable or function name
- * it can start with and contain a digits or underscores
+ * With --no-line-markers nothing is written to the output and the
+ * mapping is only recorded in the source map ( see --source-map ).
+ */
+static int outline_delta = 0 ;
+
+static boolean_t line_markers = TRUE ;
+
+/* Set when the output is read under another name ( e.g. by --cc ) so
+ * every file has to start with a marker naming it
+ */
+static boolean_t mark_file_start = FALSE ;
+
+
+/* The optional source map sidecar.
  *
- * So a -1 return means EOF
+ * This is a compact binary file for tools that want to map output
+ * lines back to their source without markers in the text.  All values
+ * are 32 bit little endian :
  *
- * and anything else is a valid termination character
+ *      "CAPSMAP1"
+ *      <file count>    then for each file <name length> <name bytes>
+ *      <record count>  then for each record
+ *                      <output line> <file index> <input line>
  *
- * Note the need to defer the toggling of the inside_quotes
- * state until the next readsymbol operation starts.  This
- * is required or a stacked symbol could be read at the end
- * of a quotated section and incorrectly matched if we cleared
- * the inside_quotes flag early.  By using the delay
- * mechanism to toggle we can make the logic work simply for
- * calling code.
+ * Each record says that output lines from <output line> onwards come
+ * from consecutive lines of the file starting at <input line>, up to
+ * the next record.
  */
-static int inside_quotes = FALSE ;
-static int quote_pending = FALSE ;
+static char *srcmap_path = NULL ;
 
-static int escape_pending = FALSE ;
+static char **srcmap_files = NULL ;
+static uint32_t srcmap_nfiles = 0 ;
 
-/* the following is used to allow us to backtrack the last
- * characters we read
- *
- * if pendingchar is -1 then there is no character saved for
- * reading
+static uint32_t *srcmap_records = NULL ;
+static uint32_t srcmap_nrecords = 0 ;
+static uint32_t srcmap_maxrecords = 0 ;
+
+/* Only the main output is mapped, not the files written by #output
  */
+static boolean_t output_is_main = TRUE ;
 
-/*
-BUFFER_DECL( pendingchar ) ;
 
-#define pendcharbuffer( c )   appendc( c, pendingcharbuffer )
-*/
+static void srcmap_add( unsigned int outline, unsigned int inputline )
+{
+    uint32_t fileidx = 0 ;
+    uint32_t *p = NULL ;
 
-static int pendingchar = 0 ;
+    if( ( srcmap_path == NULL ) || ! output_is_main )
+        return ;
 
-#define pendcharbuffer( c )		{ pendingchar = (int)(c) ; }
+    /* files are added in order so the current file is usually last
+     */
+    if( ( srcmap_nfiles == 0 ) || ( strcmp( srcmap_files[ srcmap_nfiles - 1 ], infilename ) != 0 ) )
+    {
+        char **f = (char **)realloc( srcmap_files, ( srcmap_nfiles + 1 ) * sizeof(char *) ) ;
 
-#define pendchar( _ci )			{ pendingchar = (int)(_ci) ; }
+        if( f == NULL )
+            return ;
 
+        srcmap_files = f ;
+        srcmap_files[ srcmap_nfiles ] = strdup( infilename ) ;
 
-/*******************************************************
- */
+        if( srcmap_files[ srcmap_nfiles ] == NULL )
+            return ;
 
-BUFFER_DECL( deferredbuffer ) ;
+        srcmap_nfiles++ ;
+    }
 
-#define read_from_deferred_buffer()        READ_FROM_BUFFER( deferredbuffer )
+    fileidx = srcmap_nfiles - 1 ;
 
-#define append_to_deferredbuffer( _src )    append_to_deferredbuffer_fn( (_src) )
+    if( srcmap_nrecords == srcmap_maxrecords )
+    {
+        srcmap_maxrecords = ( srcmap_maxrecords == 0 ) ? 256 : srcmap_maxrecords * 2 ;
 
-static void append_to_deferredbuffer_fn( char *src )
+        p = (uint32_t *)realloc( srcmap_records, srcmap_maxrecords * 3 * sizeof(uint32_t) ) ;
+
+        if( p == NULL )
+            return ;
+
+        srcmap_records = p ;
+    }
+
+    srcmap_records[ srcmap_nrecords * 3 + 0 ] = outline ;
+    srcmap_records[ srcmap_nrecords * 3 + 1 ] = fileidx ;
+    srcmap_records[ srcmap_nrecords * 3 + 2 ] = inputline ;
+
+    srcmap_nrecords++ ;
+}
+
+
+#ifndef CAP_FUZZER
+
+static void srcmap_put32( FILE *fs, uint32_t v )
 {
-	/* We need to append this in reverse as we are going to read input from this
-	 */
-	if( ( src == NULL ) || ( deferredbuffer == NULL ) )
-		return ;
-	
-	int len = 0 ;
-	
-	len = strlen( src ) ;
-	
-	if( len <= 0 )
-		return ;
-	
-	int i = len - 1 ;
-	
-	int k = BUFFER_INDEX(deferredbuffer) ;
-	
-	while( i >= 0 )
-	{
-		deferredbuffer[k] = src[i] ;
-		
-		if( k < sizeof(deferredbuffer) )
-		{
-			k++ ;
-		}
-		
-		i-- ;
-	};
-	
-	/* make sure the buffer is nul terminated
-	 */
-	buff[k] = 0 ;
-	
-	/* update the index
-	 */
-    BUFFER_INDEX(deferredbuffer) = k ;
+    fputc( (int)( v & 0xFF ), fs ) ;
+    fputc( (int)( ( v >> 8 ) & 0xFF ), fs ) ;
+    fputc( (int)( ( v >> 16 ) & 0xFF ), fs ) ;
+    fputc( (int)( ( v >> 24 ) & 0xFF ), fs ) ;
 }
 
-/*******************************************************
- */
 
-static int in_comment = FALSE ;
+static int srcmap_write()
+{
+    FILE *fs = NULL ;
+    uint32_t i = 0 ;
+    uint32_t len = 0 ;
 
-static int lastchar_read = -1 ;
+    if( srcmap_path == NULL )
+        return 0 ;
 
-static int currentchar_read = -1 ;
+    fs = fopen( srcmap_path, "wb" ) ;
 
-static int in_quotes = FALSE ;
+    if( fs == NULL )
+        return -1 ;
 
-/* The rotatingbuffer simply stores the last BUFFLEN
- * characters read by rotating the index value.  Note
- * that cap can take input from stdin so we cannot
- * assume that the source can be preloaded to a
- * buffer or presume the ability to change file
- * position.
- *
- * At ALL times rotatingbuffer_idx points to the NEXT
- * character position to fill.
- *
- * It is initialized to ALL zeros.
- *
- * The extra character at the end of the buffer is NEVER
- * accessed by code but is there as a guard in case
- * the buffer is accessed by code expecting a nul terminator,
- * and so rotatingbuffe[BUFFLEN] == 0 at all times.
- */
+    fwrite( "CAPSMAP1", 1, 8, fs ) ;
 
+    srcmap_put32( fs, srcmap_nfiles ) ;
 
-BUFFER_DECL( rotatingbuffer ) ;
+    for( i = 0 ; i < srcmap_nfiles ; i++ )
+    {
+        len = (uint32_t)strlen( srcmap_files[i] ) ;
 
+        srcmap_put32( fs, len ) ;
+        fwrite( srcmap_files[i], 1, len, fs ) ;
+    }
 
-static char get_rotatingbuffer_char( int nidx )
-{
-    /* Takes a NEGATIVE index value and reads characters
-     * going back in the rotating buffer
-     */
-    
-    if( nidx > 0 )
-        return 0 ;
-    
-    if( nidx < BUFFLEN )
-        return 0 ;
-    
-    int j = rotatingbuffer_idx ;
-    
-    j += nidx ;
-    
-    if( j < 0 )
-        j += BUFFLEN ;
-    
-    return rotatingbuffer[j] ;
+    srcmap_put32( fs, srcmap_nrecords ) ;
+
+    for( i = 0 ; i < srcmap_nrecords * 3 ; i++ )
+    {
+        srcmap_put32( fs, srcmap_records[i] ) ;
+    }
+
+    FCLOSE( fs ) ;
+
+    return 0 ;
 }
 
+#endif /* CAP_FUZZER */
 
-/*******************************************************
+
+/* Make style dependency output ( -MD, -MF, -MT, -MP ) and ninja dyndep
+ * output ( --dyndep ).
+ *
+ * The input files, every file pulled in with #capinclude and every file
+ * named on a #command-deps line are recorded, in the order first seen.
  */
+static boolean_t dep_record = FALSE ;
 
-int nextchar()
+#ifndef CAP_FUZZER
+
+static boolean_t dep_output = FALSE ;
+static boolean_t dep_phony = FALSE ;
+
+static const char *dep_path = NULL ;
+static const char *dep_target = NULL ;
+static const char *dyndep_path = NULL ;
+
+static const char *output_path = NULL ;
+
+#endif /* CAP_FUZZER */
+
+static char **dep_files = NULL ;
+static int dep_nfiles = 0 ;
+
+static void include_dep_note( const char *path ) ;
+
+
+static void dep_add( const char *path )
 {
-    int retv = -1 ;
-    
+    char **p = NULL ;
     int i = 0 ;
-    
-    if( pendingchar != -1 )
+
+    include_dep_note( path ) ;
+
+    if( ! dep_record )
+        return ;
+
+    for( i = 0 ; i < dep_nfiles ; i++ )
     {
-        retv = pendingchar ;
-        pendingchar = -1 ;
+        if( strcmp( dep_files[i], path ) == 0 )
+            return ;
     }
-    else
-    {
-        retv = read_from_deferred_buffer() ;
-        
-        if( retv != -1 )
-            return retv ;
 
-        retv = fgetc( fin ) ;
-        
-        /* check if we're need to replace braces
-         */
-        if( ( ! in_quotes ) && ( ! in_comment ) && apply_brace_macros )
-        {
-            if( retv == (int)'{' )
-            {
-                append_to_deferredbuffer( open_brace_macro ) ;
-                
-                retv = read_from_deferred_buffer() ;
-            }
-            else if( retv == (int)'}' )
-            {
-                append_to_deferredbuffer( close_brace_macro ) ;
-                
-                retv = read_from_deferred_buffer() ;
-            }
-        }
-    }
-    
-    lastchar_read = currentchar_read ;
-    currentchar_read = retv ;
-    
-    if( /* ( ! in_quotes ) && */ ( ! in_comment ) )
+    p = (char **)realloc( dep_files, ( dep_nfiles + 1 ) * sizeof(char *) ) ;
+
+    if( p == NULL )
+        return ;
+
+    dep_files = p ;
+    dep_files[ dep_nfiles ] = strdup( path ) ;
+
+    if( dep_files[ dep_nfiles ] != NULL )
+        dep_nfiles++ ;
+}
+
+
+#ifndef CAP_FUZZER
+
+/* Write a file name escaped for make
+ */
+static void make_escape( FILE *fs, const char *s )
+{
+    for( ; *s != 0 ; s++ )
     {
-        rotatingbuffer[rotatingbuffer_idx] = (char)retv ;
-        rotatingbuffer_idx++ ;
-        rotatingbuffer_idx %= BUFFLEN ;
-        rotatingbuffer[rotatingbuffer_idx] = 0 ;
+        if( ( *s == ' ' ) || ( *s == '#' ) )
+            fputc( '\\', fs ) ;
+
+        if( *s == '$' )
+            fputc( '$', fs ) ;
+
+        fputc( *s, fs ) ;
     }
-    
-    if( lastchar_read == (int)'\n' )
+}
+
+
+/* Write a file name escaped for ninja
+ */
+static void ninja_escape( FILE *fs, const char *s )
+{
+    for( ; *s != 0 ; s++ )
     {
-        linenum++ ;
+        if( ( *s == ' ' ) || ( *s == ':' ) || ( *s == '$' ) )
+            fputc( '$', fs ) ;
+
+        fputc( *s, fs ) ;
     }
-    
-    // if( retv != -1 ){ fputc( retv, stderr ) ; }
-    
-    return retv ;
 }
 
-/*******************************************************
+
+/* Write the dependency list as the prerequisites of a make rule
  */
+static void dep_write_rule( FILE *fs, const char *target )
+{
+    int i = 0 ;
 
-BUFFER_DECL( escaped_char_seq ) ;
+    fputs( target, fs ) ;
+    fputc( ':', fs ) ;
 
+    for( i = 0 ; i < dep_nfiles ; i++ )
+    {
+        fputs( " \\\n ", fs ) ;
+        make_escape( fs, dep_files[i] ) ;
+    }
 
-int read_escaped_char( boolean_t writeout )
-{
-    int d = -1 ;
-    
-    BUFFER_INIT( escaped_char_seq ) ;
+    fputc( '\n', fs ) ;
 
-    d = nextchar() ;
-    
-    switch( d )
+    /* -MP adds an empty rule for each file other than the first input
+     * so make does not fail when one is removed
+     */
+    for( i = ( dep_phony ? 1 : dep_nfiles ) ; i < dep_nfiles ; i++ )
     {
-        case (int)'0' :
-        case (int)'1' :
-        case (int)'2' :
-        case (int)'3' :
-        case (int)'4' :
-        case (int)'5' :
-        case (int)'6' :
-        case (int)'7' :
-            /* octal : at nost 3 octal digits
+        fputc( '\n', fs ) ;
+        make_escape( fs, dep_files[i] ) ;
+        fputs( ":\n", fs ) ;
+    }
+}
+
+
+static int dep_write()
+{
+    FILE *fs = NULL ;
+    char *path = NULL ;
+    char *dot = NULL ;
+    int i = 0 ;
+
+    if( dep_output )
+    {
+        if( ( output_path == NULL ) && ( ( dep_target == NULL ) || ( dep_path == NULL ) ) )
+        {
+            fprintf( stderr, "cap: -MD needs -o, or -MT and -MF, to name the target and file\n" ) ;
+
+            return -1 ;
+        }
+
+        if( dep_path != NULL )
+        {
+            path = strdup( dep_path ) ;
+        }
+        else
+        {
+            /* like a compiler, the output name with its extension
+             * replaced by .d
              */
-            d = nextchar() ;
 
-            if( ( d < (int)'0' ) || ( d > (int)'7' ) )
+            path = (char *)malloc( strlen( output_path ) + 3 ) ;
+
+            if( path != NULL )
             {
-                pendchar( d ) ;
-                break ;
-            }
+                strcpy( path, output_path ) ;
 
-            if( writeout ) { FPUT( d ) ; }
+                dot = strrchr( path, '.' ) ;
 
-            d = nextchar() ;
+                if( ( dot == NULL ) || ( strchr( dot, '/' ) != NULL ) )
+                    dot = path + strlen( path ) ;
 
-            if( ( d < (int)'0' ) || ( d > (int)'7' ) )
-            {
-                pendchar( d ) ;
-                break ;
+                strcpy( dot, ".d" ) ;
             }
-            
-            if( writeout ) { FPUT( d ) ; }
+        }
 
-            break ;
-        
-        case 'x' :
-        case 'u' :
-        case 'U' :
-            /* all of these are arbitrarily long sequences of hex digits
+        if( path == NULL )
+            return -1 ;
+
+        fs = fopen( path, "w" ) ;
+
+        if( fs == NULL )
+        {
+            fprintf( stderr, "cap: cannot write dependency file %s\n", path ) ;
+
+            free( path ) ;
+
+            return -1 ;
+        }
+
+        safe_free( path ) ;
+
+        if( dep_target != NULL )
+        {
+            /* -MT is used as given, like a compiler does
              */
-            while( ( !feof(fin) ) && ( d != '\n' ) && isxdigit( d ) )
+            dep_write_rule( fs, dep_target ) ;
+        }
+        else
+        {
+            char *target = NULL ;
+            size_t tlen = 0 ;
+            FILE *ft = open_memstream( &target, &tlen ) ;
+
+            if( ft != NULL )
             {
-                if( writeout ) { FPUT( d ) ; }
+                make_escape( ft, output_path ) ;
+                fclose( ft ) ;
 
-                d = nextchar() ;
-            };
-            /* the last char read was a dud for some reason
-             * put it in the pending character store
-             */
-            pendchar( d ) ;
-            
-            break ;
-        
-        default:
-            /* The default handles both well defined single escaped chars
-             * and undefined single escaped chars the same - it
-             * assumes the char is valid and outputs it.
-             *
-             * This is typical behavior for C-like parsers.
-             */
-            if( writeout ) { FPUT( d ) ; }
+                dep_write_rule( fs, target ) ;
 
-            break ;
+                free( target ) ;
+            }
+        }
+
+        FCLOSE( fs ) ;
     }
-    
-    return d ;
-}
 
+    if( dyndep_path != NULL )
+    {
+        if( output_path == NULL )
+        {
+            fprintf( stderr, "cap: --dyndep needs -o to name the output\n" ) ;
 
-/* Read characters inside quotations until we either run out
- * ( which is an error and returns -1 ) or we reach the end
- * quotation mark, when we can return 0
- *
- * The characters are passed directly to the output stream
- *
- * This routine must allow for escaped charaters.
- *
- * Assumes we have already read the opening quotation mark
- */
-int pass_chars_in_quotes( int endquotechar )
-{
-    int retv = 0 ;
+            return -1 ;
+        }
 
-    int c = -1 ;
-    int d = -1 ;
+        fs = fopen( dyndep_path, "w" ) ;
 
-    c = nextchar() ;
-    
-    while( ( c != -1 ) && !feof(fin) )
-    {
-        FPUT( c ) ;
-        
-        if( c == endquotechar )
-            /* quote ended properly
-             */
-            break ;
-        
-        if( c == '\n' ) 
+        if( fs == NULL )
         {
+            fprintf( stderr, "cap: cannot write dyndep file %s\n", dyndep_path ) ;
+
             return -1 ;
         }
-        
-        if( c == '\\' )
+
+        fputs( "ninja_dyndep_version = 1\nbuild ", fs ) ;
+        ninja_escape( fs, output_path ) ;
+        fputs( ": dyndep", fs ) ;
+
+        for( i = 0 ; i < dep_nfiles ; i++ )
         {
-            // an escaped character - read the sequence
-            
-            d = nextchar() ;
-            
-            switch( d )
-            {
-                case (int)'0' :
-                case (int)'1' :
-                case (int)'2' :
-                case (int)'3' :
-                case (int)'4' :
-                case (int)'5' :
-                case (int)'6' :
-                case (int)'7' :
-                    /* octal : at most 3 octal digits
-                     */
-                    FPUT( d ) ;
-                    d = nextchar() ;
-                    if( ( d < (int)'0' ) || ( d > (int)'7' ) )
-                    {
-                        pendchar( d ) ;
-                        break ;
-                    }
-                    FPUT( d ) ;
-                    d = nextchar() ;
-                    if( ( d < (int)'0' ) || ( d > (int)'7' ) )
-                    {
-                        pendchar( d ) ;
-                        break ;
-                    }
-                    FPUT( d ) ;
-                    break ;
-                
-                case 'x' :
-                case 'u' :
-                case 'U' :
-                    /* all of these are arbitrarily long sequences of hex digits
-                     */
-                    while( ( !feof(fin) ) && ( d != '\n' ) && isxdigit( d ) )
-                    {
-                        FPUT( d ) ;
-                        d = nextchar() ;
-                    };
-                    /* the last char read was a dud for some reason
-                     * put it in the pending character store
-                     */
-                    pendchar( d ) ;
-                    break ;
-                
-                default:
-                    /* The default handles both well defined single escaped chars
-                     * and undefined single escaped chars the same - it
-                     * assumes the char is valid and outputs it.
-                     *
-                     * This is typical behavior for C-like parsers.
-                     */
-                    FPUT( d ) ;
-                    break ;
-            }
+            fputs( ( i == 0 ) ? " | " : " ", fs ) ;
+            ninja_escape( fs, dep_files[i] ) ;
         }
-        
-        c = nextchar() ;
-    };
-    
-    return retv ;
+
+        fputc( '\n', fs ) ;
+
+        FCLOSE( fs ) ;
+    }
+
+    return 0 ;
 }
 
-/*******************************************************
+#endif /* CAP_FUZZER */
+
+
+/* With --squeeze-blank-lines the output holds back blank lines, and
+ * the blanks that start a line until it is known not to be blank.  A
+ * run of blank lines is then written as newlines, or replaced by a
+ * #line marker where that is shorter.  The lines held back are counted
+ * in outline_delta, so the rest of cap sees the output in step.
  */
+#define SQUEEZE_MAX_WS      256
 
+struct squeeze_state_s {
+    unsigned int    blanks ;        /* blank lines held back */
+    size_t          nws ;           /* and the blanks of the next line */
+    char            ws[ SQUEEZE_MAX_WS ] ;
+    } ;
 
-/* readchar(c) reads input characters until it finds a
- * match to the one requested.
- *
- * it ONLY ignores isspace() characters.
- * 
- * If you pass a whitespace character to it ( ie. try
- * and match to a whitespace ) it simply returns immediately.
- *
- * a return of -1 is an error
- * a return matching the requested char is valid
+typedef struct squeeze_state_s      squeeze_state_t ;
+
+static squeeze_state_t squeeze ;
+
+
+/* Reset line tracking for a new output stream
  */
-int readchar( int cwanted )
+static void reset_output_lines()
 {
-    int retv = -1 ;
-    int c = 0 ;
-    
-    if( iswhitespace(cwanted) )
-    {
-		return retv ;
-	}
+    held_marker.len = 0 ;
 
-    c = nextchar() ;
+    outlinenum = 1 ;
+    out_at_bol = TRUE ;
+    outline_delta = 0 ;
 
-    while( ( c != -1 ) && !feof(fin) )
-    {
-        if( !iswhitespace(c) )
-        {
-            if( c == cwanted )
-            {
-                retv = c ;
-            }
+    squeeze.blanks = 0 ;
+    squeeze.nws = 0 ;
+}
 
-            break ;
-        }
 
-        c = nextchar() ;
-    };
+/* Write the marker held back, before the line it is for
+ */
+static void marker_flush()
+{
+    size_t len = held_marker.len ;
 
-    return retv ;
+    if( len == 0 )
+        return ;
+
+    held_marker.len = 0 ;
+
+    fwrite( held_marker.text, 1, len, fout ) ;
+
+    outlinenum++ ;
+    outline_delta-- ;
 }
 
-/*******************************************************
+
+/* Forget the marker held back, with its source map record.  The
+ * caller puts outline_delta right.
  */
+static void marker_drop()
+{
+    if( held_marker.len == 0 )
+        return ;
 
+    held_marker.len = 0 ;
 
-#define issymbolchar(c)     ( ( (c) == '_' ) || isalnum((c)) )
+    if( held_marker.recorded && ( srcmap_nrecords > 0 ) )
+        srcmap_nrecords-- ;
+}
 
-/* reads the next symbol
- *
- * the default behavior is to ignore spaces and output
- * them to fout.
- *
- * symbols only contain alpha-numerics and underscore
- *
- * trailing and lead whitespace is stored in the
- * prebuff and postbuff buffers.
+
+/* Take the marker held back out of the way while another output is
+ * written, and put it back
  */
+static void marker_save( line_marker_t *lm )
+{
+    *lm = held_marker ;
 
+    memset( &held_marker, 0, sizeof(held_marker) ) ;
+}
 
 
-int readsymbol()
+static void marker_restore( line_marker_t *lm )
 {
-    int retv = 0 ;
+    safe_free( held_marker.text ) ;
 
-    int c = 0 ;
-    
-    BUFFER_INIT( prebuff ) ;
-    BUFFER_INIT( buff ) ;
-    BUFFER_INIT( postbuff ) ;
+    held_marker = *lm ;
+}
 
-    if( quote_pending )
-    {
-        toggle(inside_quotes) ;
-        toggle(quote_pending) ;
-    }
 
-    c = nextchar() ;
+/* Say the next output line is input line want, holding the marker
+ * back until that line is written
+ */
+static void emit_line_marker( unsigned int want )
+{
+    const char *p = infilename ;
+    size_t need = 32 + 2 * strlen( infilename ) ;
+    char *t = NULL ;
+    uint32_t nrecords = srcmap_nrecords ;
 
-    while( BUFFER_AVAILABLE(buff) && BUFFER_AVAILABLE(prebuff) )
-    {
-        if( inside_quotes )
-        {
-            /* read chars until the buffer is full or we
-             * find an non-escaped matching quote to end
-             *
-             * inside quotes we need to check for escaped
-             * sequences.
-             */
+    /* any blank lines held back are replaced by the marker, and so is
+     * a marker held back
+     */
+    squeeze.blanks = 0 ;
+    squeeze.nws = 0 ;
 
-            if( escape_pending )
-            {
-                toggle(escape_pending) ;
-                
-                appendc( c, buff ) ;
-            }
-            else
-            {
-                if( c == '"' )
-                {
-                    toggle(quote_pending) ;
+    marker_drop() ;
 
-                    break ;
-                }
+    if( ! line_markers )
+    {
+        srcmap_add( outlinenum, want ) ;
 
-                if( c == '\\' )
-                {
-                    toggle(escape_pending) ;
-                }
+        outline_delta = (int)want - (int)outlinenum ;
 
-				appendc( c, buff ) ;
-            }
+        return ;
+    }
 
-            /* go back to start of loop
-             */
+    if( need > held_marker.size )
+    {
+        t = (char *)realloc( held_marker.text, need ) ;
 
-            c = nextchar() ;
+        if( t == NULL )
+            return ;
 
-            continue ;
-        }
+        held_marker.text = t ;
+        held_marker.size = need ;
+    }
 
+    t = held_marker.text + sprintf( held_marker.text, "#line %u \"", want ) ;
 
-        /* note that this only happens if we are not inside_quotes
-         */
+    while( *p != 0 )
+    {
+        if( ( *p == '"' ) || ( *p == '\\' ) )
+            *t++ = '\\' ;
 
-        if( ( BUFFER_INDEX(buff) == 0 ) && iswhitespace(c) )
-        {
-			appendc( c, prebuff ) ;
+        *t++ = *p++ ;
+    };
 
-            c = nextchar() ;
+    *t++ = '"' ;
+    *t++ = '\n' ;
 
-            continue ;
-        }
+    held_marker.len = (size_t)( t - held_marker.text ) ;
 
-        if( issymbolchar(c) )
-        {
-			appendc( c, buff ) ;
-        }
-        else
-        {
-            if( (char)c == '"' )
-            {
-                toggle(quote_pending) ;
-            }
+    /* the line it is for is the one after it
+     */
+    srcmap_add( outlinenum + 1, want ) ;
 
-            break ;
-        }
+    held_marker.recorded = ( srcmap_nrecords != nrecords ) ;
 
-        c = nextchar() ;
-    };
+    outline_delta = (int)want - (int)outlinenum ;
+}
 
-	appendc( 0, buff ) ;
-	appendc( 0, prebuff ) ;
-    
-    // k = 0 ;
 
-    while( BUFFER_AVAILABLE(postbuff) && iswhitespace(c) )
+/* Bring the output back in step with the input.
+ *
+ * want is the input line the next output line comes from.  If cpp
+ * would believe it is on another line then write a marker ( and a
+ * source map record ).  If the output is part way through a line then
+ * that line is finished first unless mid_line says the input is also
+ * part way through the same line.
+ */
+static void sync_output_line( unsigned int want, boolean_t mid_line )
+{
+    if( ! out_at_bol )
     {
-		appendc( c, postbuff ) ;
-
-        c = nextchar() ;
-    };
-
-    /* the last char read could be a valid char from the next symbol
-     * so we have to check and allow it to be stored for the next character
-     * reading.
-     */
+        if( mid_line && ( outlinenum + outline_delta == want ) )
+            return ;
 
-    if( issymbolchar(c) )
-    {
-        pendchar(c) ;
-        c = (int)' ' ;
+        FPUT( '\n' ) ;
     }
 
-	appendc( 0, postbuff ) ;
-
-    retv = c ;
-    
-    lastchar = c ;
-    
-    /*
-    if( c != (int)'\n' )
-    {
-        debugf( "readsymbol() ::     buff = [ %s ][ %s ][ %s ][ %c ]\n", prebuff, buff, postbuff, c ) ;
-    }
-    else
-    {
-        debugf( "readsymbol() ::     buff = [ %s ][ %s ][ %s ][ \\n ]\n", prebuff, buff, postbuff ) ;
-    }
-    */
+    if( outlinenum + outline_delta == want )
+        return ;
 
-    return retv ;
+    emit_line_marker( want ) ;
 }
 
 
-/*******************************************************
- */
-
-
-/* read everything up to the EOL into the buffer
+/* Write output for --squeeze-blank-lines
  */
-int read_to_eol()
+static void squeeze_write( const char *p, size_t len )
 {
-    int retv = 0 ;
-    int c = 0 ;
-    
-    BUFFER_INIT( buff ) ;
+    const char *end = p + len ;
+    const char *q = NULL ;
+    unsigned int blanks = 0 ;
+    size_t nws = 0 ;
 
-    while( BUFFER_AVAILABLE(buff) && ( c != -1 ) )
+    while( p < end )
     {
-        c = nextchar() ;
-
-        if( c == (int)'\n' )
-            break ;
-
-        if( c != -1 )
+        if( out_at_bol )
         {
-			appendc( c, buff ) ;
-        }
-    };
+            if( ( ( *p == ' ' ) || ( *p == '\t' ) || ( *p == '\r' ) ) && ( squeeze.nws < SQUEEZE_MAX_WS ) )
+            {
+                squeeze.ws[ squeeze.nws++ ] = *p++ ;
+                continue ;
+            }
 
-    appendc( 0, buff ) ;
+            if( *p == '\n' )
+            {
+                squeeze.nws = 0 ;
+                squeeze.blanks++ ;
+                outline_delta++ ;
+                p++ ;
+                continue ;
+            }
 
-    return retv ;
-}
+            /* the line is not blank, so out with what was held back
+             */
+            blanks = squeeze.blanks ;
+            squeeze.blanks = 0 ;
 
-/*******************************************************
- */
+            /* #line, the number, the name and quotes
+             */
+            if( ! line_markers || ( blanks > strlen( infilename ) + 16 ) )
+            {
+                nws = squeeze.nws ;
 
-/* this function pushes a copy of a buffer onto the stack
- *
- * basically it's a simple list for later checking
- *
- * the data structure supports these lists
- *
- * if checklen is nonzero then only copy the buffer if length
- * is greater than zero.  There may be situations when we
- * want to copy a zero-length string to the stack, so we need
- * the option.
- */
+                emit_line_marker( outlinenum + outline_delta ) ;
 
-void stackcopybuffer( char *buffer, int checklen )
-{
-    wordstack_t *node = NULL ;
-    int len = 0 ;
+                squeeze.nws = nws ;
+            }
+            else
+            {
+                marker_flush() ;
 
-    len = strlen(buffer) ;
+                outlinenum += blanks ;
+                outline_delta -= (int)blanks ;
 
-    if( ( checklen != 0 ) && ( len == 0 ) )
-        return ;
+                while( blanks-- > 0 )
+                    fputc( '\n', fout ) ;
+            }
 
-    len++ ;
+            marker_flush() ;
 
-    node = (wordstack_t *)malloc( sizeof(wordstack_t) ) ;
+            fwrite( squeeze.ws, 1, squeeze.nws, fout ) ;
 
-    if( node == NULL )
-        return ;
+            squeeze.nws = 0 ;
+            out_at_bol = FALSE ;
+        }
 
-    node->buff = NULL ;
-    node->next = wordstackp ;
-    wordstackp = node ;
+        q = memchr( p, '\n', (size_t)( end - p ) ) ;
 
-    node->buff = (char *)malloc( len ) ;
+        out_at_bol = ( q != NULL ) ;
+        q = ( q != NULL ) ? q + 1 : end ;
 
-    if( node->buff == NULL )
-        return ;
+        fwrite( p, 1, (size_t)( q - p ), fout ) ;
 
-    memcpy( node->buff, buffer, len ) ;
+        if( out_at_bol )
+            outlinenum++ ;
+
+        p = q ;
+    };
 }
 
-/*******************************************************
- */
 
+static boolean_t skip_is_on = FALSE ;
 
-#define stackcopy() stackcopybuffer(buff,1)
+static boolean_t changes_made = FALSE ;
 
-#define stackcopyall()  \
-            { \
-                stackcopybuffer(prebuff,0) ; \
-                stackcopybuffer(buff,0) ; \
-                stackcopybuffer(postbuff,0) ; \
-            }
+#define DEFAULT_MACROCHAR '#'
 
-/*******************************************************
- */
+static char initial_macrochar = DEFAULT_MACROCHAR ;
 
+static char macrochar = DEFAULT_MACROCHAR ;
 
-/* get a pointer to the buffer stored in the node
- * at the given index.
- *
- * 0 is stop of stack
- *
- * return NULL on error
- */
-char *stackbuffat( int index )
-{
-    char *retp = NULL ;
-    wordstack_t *curr = wordstackp ;
-    wordstack_t *next = NULL ;
-    int i = 0 ;
 
-    if( index < 0 )
-        return NULL ;
 
-    if( wordstackp == NULL )
-        return NULL ;
+#define BUFFLEN 1023
 
-    while( ( curr != NULL ) && ( i != index ) )
-    {
-        i++ ;
 
-        curr = curr->next ;
-    };
+/*
+ */
 
-    if( ( curr != NULL ) && ( i == index ) )
-    {
-        retp = curr->buff ;
 
-        /* debugf( "stackbuffat( %d ) = [ %s ]\n", index, retp ) ;
-         */
-    }
+#define BUFFER_DECL( _sym ) \
+							static char _sym [ BUFFLEN + 1 ] ; \
+							static int _sym ## _idx = 0 ;
 
-    return retp ;
-}
+#define BUFFER_INDEX( _sym )	( _sym ## _idx )
 
-/*******************************************************
- */
 
 
-/* pop the tos, freeing all memory for that node
- */
-void stackpop()
-{
-    wordstack_t *next = NULL ;
+BUFFER_DECL( prebuff ) ;
+BUFFER_DECL( buff ) ;
+BUFFER_DECL( postbuff ) ;
 
-    if( wordstackp == NULL )
-        return ;
 
-    next = wordstackp->next ;
+#define BUFFER_INIT( _buff )	{ \
+									_buff [ 0 ] = 0 ; \
+									_buff [ BUFFLEN ] = 0 ; \
+									_buff ## _idx = 0 ; \
+								}
 
-    free( wordstackp->buff ) ;
-    free( wordstackp ) ;
 
-    wordstackp = next ;
+#define BUFFER_AVAILABLE( _buff )	( _buff ## _idx < BUFFLEN )
+
+
+#define appendc( _c, _buff )	appendc_fn( (_c), (_buff), BUFFLEN, &_buff ## _idx )
+
+#define appends( _s, _buff )	appends_fn( (_s), (_buff), BUFFLEN, &_buff ## _idx )
+
+
+/* appendc_fn() will append a char at the index position.
+ * 
+ * when the index points to the last char in the buffer
+ * we always write the new character.  This does mean
+ * that the buffer is filled and loose characters, but
+ * may mean that we eventually get to an EOL, EOS or EOF
+ * character, which is important.
+ */
+static void appendc_fn( int c, char *buff, int buffsz, int *idxp )
+{
+	if( ( buff == NULL ) || ( idxp == NULL ) )
+		return ;
+	
+	if( *idxp < 0 )
+		return ;
+	
+	buff[*idxp] = (char)c ;
+	
+	if( *idxp < buffsz )
+	{
+		(*idxp)++ ;
+	}
 }
 
-/*******************************************************
+/* appends_fn() writes a string, terminated by a nul char,
+ * to the buffer. Like appendc_fn() it always writes the
+ * last character to the buffer, even if the buffer is filled.
  */
+static void appends_fn( char *str, char *buff, int buffsz, int *idxp )
+{
+	if( ( str == NULL ) || ( buff == NULL ) || ( idxp == NULL ) )
+		return ;
+	
+	if( *idxp < 0 )
+		return ;
+	
+	char *p = str ;
+	int k = *idxp ;
+	
+	while( *p != 0 )
+	{
+		buff[k] = *p ;
+		
+		if( k < buffsz )
+		{
+			k++ ;
+		}
+		
+		p++ ;
+	};
+	
+	/* make sure the buffer is nul terminated
+	 */
+	buff[k] = 0 ;
+	
+	/* update the index
+	 */
+	*idxp = k ;
+}
 
 
-/* release all memory used by the stack
- * and reset the stack pointer
+#define READ_FROM_BUFFER( _buff )	read_from_buffer_fn( (_buff), BUFFLEN, &_buff ## _idx )
+
+
+/* read one character from a buffer if possible.
+ * 
+ * return -1 is reading is not possible
  */
-void stackfree()
+
+static int read_from_buffer_fn( char *buff, int buffsz, int *idxp )
 {
-    wordstack_t *curr = wordstackp ;
-    wordstack_t *next = NULL ;
+	int retv = 0 ;
+	
+	if( ( buff == NULL ) || ( idxp == NULL ) )
+	{
+		return -1 ;
+	}
+	
+	if( ( *idxp <= 0 ) || ( *idxp >= buffsz ) )
+	{
+		return -1 ;
+	}
+	
+	(*idxp)-- ;
+	
+	retv = buff[ *idxp ] ;
+	
+	return retv ;
+}
 
-    while( curr != NULL )
-    {
-        free( curr->buff ) ;
-        next = curr->next ;
-        free( curr ) ;
-        curr = next ;
-    };
 
-    wordstackp = NULL ;
-}
 
-/*******************************************************
+/***********************************************************************
  */
 
 
-/* check if the stack contains the currently buffered symbol
- *
- * this function return TRUE if it is and FALSE if not
- * TRUE is normally 1 and FALSE should be 0, but use the
- * macros TRUE and FALSE and not explicit values.
- */
-int symbolonstack()
-{
-    int retv = FALSE ;
-    wordstack_t *curr = wordstackp ;
+static int lastchar = -1 ;
 
-    while( curr != NULL )
-    {
-        if( curr->buff != NULL )
-        {
-            if( strcmp( buff, curr->buff ) == 0 )
-            {
-                return TRUE ;
+
+#define OUTPUTBUFFS_GEN( p1, p2, p3, lc )   \
+            { \
+                if( *(p1) != '\0' ) \
+                { \
+                    FPUTS( (p1) ) ; \
+                } \
+                if( *(p2) != '\0' ) \
+                { \
+                    FPUTS( (p2) ) ; \
+                } \
+                if( *(p3) != '\0' ) \
+                { \
+                    FPUTS( (p3) ) ; \
+                } \
+                if( (lc) != -1 ) \
+                { \
+                    FPUT( (lc) ) ; \
+                } \
             }
-        }
 
-        curr = curr->next ;
-    };
+#define OUTPUTBUFFS()               OUTPUTBUFFS_GEN( prebuff, buff, postbuff, lastchar )
 
-    return retv ;
-}
+#define OUTPUTBUFFS_NOLASTCHAR()    OUTPUTBUFFS_GEN( prebuff, buff, postbuff, -1 )
 
-/*******************************************************
- */
 
 
-int process_macrochar()
-{
-    int retv = 0 ;
-    
-    macrochar = nextchar() ;
-    
-    return retv ;
-}
+#define iswhitespace(c)     ( ( (c) == ' ' ) || ( (c) == '\t' ) )
+
+#define istrueeol()         ( ( currentchar_read == '\n' ) && ( lastchar_read != '\\' ) )
 
 /*******************************************************
  */
 
-
-int process_simple_macro_def( char **macro )
+static int iskeyword( char *str )
 {
     int retv = 0 ;
-
-    safe_free( *macro ) ;
-    
-    int i = 0 ;
     
-    i = read_to_eol() ;
+    if( buff[0] != macrochar )
+        return 0 ;
     
-    i = strlen( buff ) ;
+    /* need to avoid white spaces in comparisons
+     * as we'd like spacing to be allowed
+     *
+     * We assume that "keyword" is space trimmed
+     * which it should be.
+     */
+    int i = 1 ;
+    int j = 0 ;
     
-    *macro = (char *)malloc( i+1 ) ;
+    while( iswhitespace( buff[i] ) )
+        i++ ;
     
-    if( *macro == NULL )
+    while( buff[i] == str[j] )
     {
-        /* could not get memory
-         */
+        if( str[j] == 0 )
+            break ;
+        
+        i++ ;
+        j++ ;
+    };
     
-        return -1 ;
+    if( buff[i] == str[j] )
+    {
+        retv = 1 ;
+    }
+    else
+    {
+        retv = 0 ;
     }
-    
-    memcpy( *macro, buff, i+1 ) ;
     
     return retv ;
 }
 
+
 /*******************************************************
  */
 
+struct wordstack_s {
+    struct wordstack_s  *next ;
+    struct wordstack_s  *hnext ;
+    unsigned int    hash ;
+    char            *buff ;
+    } ;
 
-int process_def_open_brace()
-{
-    int retv = 0 ;
-    
-    retv = process_simple_macro_def( &open_brace_macro ) ;
-    
-    return retv ;
-}
+typedef struct wordstack_s  wordstack_t ;
 
-/*******************************************************
- */
 
+/* wordstackp is a stack for storing copies of
+ * previously read symbols.
+ *
+ * It is used in e.g. the "#def" directive.
+ *
+ * Every node is also chained into wordstack_hash so symbolonstack()
+ * does not have to walk the whole stack for every symbol in a #def
+ * body, which made #def quadratic in its number of parameters.
+ * Nodes are only ever pushed and popped so the node being popped is
+ * always at the head of its hash chain.
+ */
+static wordstack_t *wordstackp = NULL ;
 
-int process_def_close_brace()
-{
-    int retv = 0 ;
-    
-    retv = process_simple_macro_def( &close_brace_macro ) ;
-    
-    return retv ;
-}
+#define WORDSTACK_HASH_SIZE 1024
 
-/*******************************************************
+/* the table doubles whenever there are more nodes than buckets so the
+ * chains stay short for #def bodies with very many parameters.
  */
+static wordstack_t **wordstack_hash = NULL ;
+static size_t wordstack_hash_size = 0 ;
+static size_t wordstack_count = 0 ;
 
 
-int process_def_return_macro()
+static unsigned int symbol_hash( const char *str )
 {
-    int retv = 0 ;
-    
-    retv = process_simple_macro_def( &return_macro ) ;
-    
-    return retv ;
+    unsigned int h = 2166136261u ;
+
+    while( *str != 0 )
+    {
+        h ^= (unsigned char)*str ;
+        h *= 16777619u ;
+        str++ ;
+    };
+
+    return h ;
 }
 
+
 /*******************************************************
  */
 
 
-int process_quote()
-{
-    int retv = 0 ;
-    int c = 0 ;
+/* copy the buffer str to the indicated buffer
+ */
 
-    /* take all input from now until either EOF or
-     * '#' at the start of a line and treat it as being part
-     * of one define
-     *
-     * basically pads ' \' unto the end of all lines except the
-     * last non-empty one.
-     */
-    
-    c = nextchar() ;
-
-    while( ( c != -1 ) && !feof(fin) )
-    {
-        if( c == (int)'\n' )
-        {
-            /* read the next char and see if it's a macrochar ( normally a hash )
-             *
-             * if it is we know this is the last line of the
-             * quoted section and we don't output the ' \'
-             */
-
-            /* output pending empty lines
-             */
-            
-            c = nextchar() ;
-
-            if( c == (int)macrochar )
-            {
-                c = nextchar() ;
-
-                if( c == (int)'\n' )
-                {
-                    FPUT( '\n' ) ;
-                    FPUT( '\n' ) ;
 
-                    return 0 ;
-                }
-                else
-                {
-                    /* not a single # followed by newline
-                     */
-
-                    FPUT( macrochar ) ;
-
-                    continue ;
-                }
-
-            }
-            else
-            {
-                FPUT( ' ' ) ;
-                FPUT( '\\' ) ;
-                FPUT( '\n' ) ;
-                
-                continue ;
-            }
-        }
-        else
-        {
-            /* not an EOL
-             */
-            
-            FPUT( c ) ;
-        }
-            
-        c = nextchar() ;
-    };
+#define copybuff( _dest )	strncpy( (_dest), buff, sizeof(buff) )
 
-    return retv ;
-}
 
 /*******************************************************
  */
 
 
-/* treat everything until the next line starting with '#' as a
- * comment.
+/* read a symbol from the input stream returning it's
+ * delimiter and the buffer containing the word
+ * terminated by a '\0'
  *
- * wraps the comment in a common comment style.
+ * a symbol is anything like a variable or function name
+ * it can start with and contain a digits or underscores
+ *
+ * So a -1 return means EOF
+ *
+ * and anything else is a valid termination character
+ *
+ * Note the need to defer the toggling of the inside_quotes
+ * state until the next readsymbol operation starts.  This
+ * is required or a stacked symbol could be read at the end
+ * of a quotated section and incorrectly matched if we cleared
+ * the inside_quotes flag early.  By using the delay
+ * mechanism to toggle we can make the logic work simply for
+ * calling code.
  */
-int process_comment()
-{
-    int retv = 0 ;
-    int c = 0 ;
+static int inside_quotes = FALSE ;
+static int quote_pending = FALSE ;
 
-    fprintf( fout, "\n/*\n * " ) ;
-    
-    c = nextchar() ;
+static int escape_pending = FALSE ;
 
-    while( ( c != -1 ) && !feof(fin) )
-    {
-        if( c == (int)macrochar )
-        {
-            c = nextchar() ;
+/* the following is used to allow us to backtrack the last
+ * characters we read
+ *
+ * if pendingchar is -1 then there is no character saved for
+ * reading
+ */
 
-            if( c == '\n' )
-                break ;
+/*
+BUFFER_DECL( pendingchar ) ;
 
-            FPUT( macrochar ) ;
+#define pendcharbuffer( c )   appendc( c, pendingcharbuffer )
+*/
 
-            continue ;
-        }
+static int pendingchar = 0 ;
 
-        if( c == '\n' )
-        {
-            fprintf( fout, "\n *" ) ;
+#define pendcharbuffer( c )		{ pendingchar = (int)(c) ; }
 
-            /* if we don't check for the hash symbol coming next we
-             * will add a space we don't want which sounds trivial
-             * but will cause the comment never to be terminated
-             * as the * and / will be separated by a space !
-             */
+#define pendchar( _ci )			{ pendingchar = (int)(_ci) ; }
 
-            c = nextchar() ;
-            pendchar(c) ;
 
-            if( c != (int)macrochar )
-                FPUT( ' ' ) ;
-        }
-        else
-        {
-            FPUT( c ) ;
-        }
+/*******************************************************
+ */
 
-        c = nextchar() ;
-    };
+BUFFER_DECL( deferredbuffer ) ;
+
+#define read_from_deferred_buffer()        READ_FROM_BUFFER( deferredbuffer )
 
-    fprintf( fout, "/\n" ) ;
+#define append_to_deferredbuffer( _src )    append_to_deferredbuffer_fn( (_src) )
 
-    return retv ;
+static void append_to_deferredbuffer_fn( char *src )
+{
+	/* We need to append this in reverse as we are going to read input from this
+	 */
+	if( ( src == NULL ) || ( deferredbuffer == NULL ) )
+		return ;
+	
+	int len = 0 ;
+	
+	len = strlen( src ) ;
+	
+	if( len <= 0 )
+		return ;
+	
+	int i = len - 1 ;
+	
+	int k = BUFFER_INDEX(deferredbuffer) ;
+	
+	while( i >= 0 )
+	{
+		deferredbuffer[k] = src[i] ;
+		
+		if( k < sizeof(deferredbuffer) )
+		{
+			k++ ;
+		}
+		
+		i-- ;
+	};
+	
+	/* make sure the buffer is nul terminated
+	 */
+	buff[k] = 0 ;
+	
+	/* update the index
+	 */
+    BUFFER_INDEX(deferredbuffer) = k ;
 }
 
 /*******************************************************
  */
 
+static int in_comment = FALSE ;
 
-static int ends_in_continuation()
+static int lastchar_read = -1 ;
+
+static int currentchar_read = -1 ;
+
+static int in_quotes = FALSE ;
+
+/* The rotatingbuffer simply stores the last BUFFLEN
+ * characters read by rotating the index value.  Note
+ * that cap can take input from stdin so we cannot
+ * assume that the source can be preloaded to a
+ * buffer or presume the ability to change file
+ * position.
+ *
+ * At ALL times rotatingbuffer_idx points to the NEXT
+ * character position to fill.
+ *
+ * It is initialized to ALL zeros.
+ *
+ * The extra character at the end of the buffer is NEVER
+ * accessed by code but is there as a guard in case
+ * the buffer is accessed by code expecting a nul terminator,
+ * and so rotatingbuffe[BUFFLEN] == 0 at all times.
+ */
+
+
+BUFFER_DECL( rotatingbuffer ) ;
+
+
+static char get_rotatingbuffer_char( int nidx )
 {
-    int len = 0 ;
+    /* Takes a NEGATIVE index value and reads characters
+     * going back in the rotating buffer
+     */
     
-    len = strlen( buff ) ;
+    if( nidx > 0 )
+        return 0 ;
     
-    if( len < 1 )
-        /* No continuation mark possible
-         */
+    if( nidx < BUFFLEN )
         return 0 ;
     
-    if( buff[len-1] == '\\' )
-        /* a continuation mark
-         */
-        return 1 ;
+    int j = rotatingbuffer_idx ;
     
-    return 0 ;
+    j += nidx ;
+    
+    if( j < 0 )
+        j += BUFFLEN ;
+    
+    return rotatingbuffer[j] ;
 }
 
+
 /*******************************************************
  */
 
-
-/* process a redefine
- *
- * The C preprocessor requires that you first undefine
- * a macro before redefining, but has no direct support
- * for doing that automatically.
- */
-int process_redefine()
+int nextchar()
 {
-    int retv = 0 ;
-    int i = 0 ;
-    int c = 0 ;
-    int newc = 0 ;
-
-    c = readsymbol() ;
-
-    fprintf( fout, "#undef %s%s%s\n", prebuff, buff, postbuff ) ;
-    fprintf( fout, "#define %s%s%s", prebuff, buff, postbuff ) ;
+    int retv = -1 ;
     
-    /* Now read to first EOL with no continuation before the new line
-     */
+    int i = 0 ;
     
-    i = read_to_eol() ;
+    if( pendingchar != -1 )
+    {
+        retv = pendingchar ;
+        pendingchar = -1 ;
+    }
+    else
+    {
+        retv = read_from_deferred_buffer() ;
+        
+        if( retv != -1 )
+            return retv ;
+
+        retv = INGETC() ;
+        
+        /* check if we're need to replace braces
+         */
+        if( apply_brace_macros && ( ! in_quotes ) && ( ! in_comment ) )
+        {
+            if( retv == (int)'{' )
+            {
+                append_to_deferredbuffer( open_brace_macro ) ;
+                
+                retv = read_from_deferred_buffer() ;
+            }
+            else if( retv == (int)'}' )
+            {
+                append_to_deferredbuffer( close_brace_macro ) ;
+                
+                retv = read_from_deferred_buffer() ;
+            }
+        }
+    }
     
-    while( ends_in_continuation() )
+    lastchar_read = currentchar_read ;
+    currentchar_read = retv ;
+    
+    if( /* ( ! in_quotes ) && */ ( ! in_comment ) )
     {
-        FPUTS( buff ) ;
-        FPUT( '\n' ) ;
+        rotatingbuffer[rotatingbuffer_idx] = (char)retv ;
+        rotatingbuffer_idx++ ;
+        rotatingbuffer_idx %= BUFFLEN ;
+        rotatingbuffer[rotatingbuffer_idx] = 0 ;
+    }
     
-        i = read_to_eol() ;
-    };
+    if( lastchar_read == (int)'\n' )
+    {
+        linenum++ ;
+    }
     
-    FPUTS( buff ) ;
-    FPUT( '\n' ) ;
+    // if( retv != -1 ){ fputc( retv, stderr ) ; }
     
     return retv ;
 }
 
-/*******************************************************
- */
-
 
-/* process a macro definition
- *
- * unlike quote creates the macro definition and substitutes all
- * the symbols used as paramater markers with '(<paramname>)'
- * which is the safe macro expansion version.
- *
- * Note that no attempt is made to parse the code so ANY token
- * matching the sequence will be converted.
+/* The character nextchar() will return next, without reading it.  A
+ * brace is given as it is, not as the start of its macro.
  */
-int process_def()
+int peekchar()
 {
-    int retv = 0 ;
-    int i = 0 ;
-    int c = 0 ;
-    int newc = 0 ;
-
-    boolean_t isbracketable = FALSE ;
-    
-    /* first we need to read the definition part
-     * which should be of the form <macroname>([<parametername>{,<parametername>}])
-     *
-     */
-
-    c = readsymbol() ;
-
-    if( c != (int)'(' )
-        /* this is a syntax error
-         */
-        return -1 ;
-
-    fprintf( fout, "#define %s%s%s(", prebuff, buff, postbuff ) ;
+    int c = -1 ;
 
-    i = 0 ;
+    if( pendingchar != -1 )
+        return pendingchar ;
 
-    c = readsymbol() ;
+    if( ( BUFFER_INDEX( deferredbuffer ) > 0 ) && ( BUFFER_INDEX( deferredbuffer ) < BUFFLEN ) )
+        return (int)(unsigned char)deferredbuffer[ BUFFER_INDEX( deferredbuffer ) - 1 ] ;
 
-    while( c == (int)',' )
+    if( inbuf != NULL )
     {
-        OUTPUTBUFFS() ;
+        if( inbuf_pos < inbuf_len )
+            return (int)inbuf[ inbuf_pos ] ;
 
-        /* need to keep a copy of buff
+        /* as feof() is after a failed fgetc()
          */
+        inbuf_eof = TRUE ;
 
-        stackcopy() ;
+        return -1 ;
+    }
 
-        c = readsymbol() ;
-    };
+    c = fgetc( fin ) ;
 
-    OUTPUTBUFFS() ;
+    if( c != EOF )
+        ungetc( c, fin ) ;
 
-    stackcopy() ;
+    return c ;
+}
 
-    /* definition has been read and output
-     *
-     * now output the text replacing the paramameter values until
-     * a macrochar ( normally a hash ) is read or EOF and adding
-     * the required ' \' EOL sequences 
-     */
+/*******************************************************
+ */
 
-    c = readsymbol() ;
+BUFFER_DECL( escaped_char_seq ) ;
 
-    while( c != -1 )
-    {
-        if( !inside_quotes )
-        {
-            if( c == (int)macrochar )
-            {
-                c = nextchar() ;
 
-                if( c == '\n' )
-                {
-                    FPUT( '\n' ) ;
-                    break ;
-                }
+int read_escaped_char( boolean_t writeout )
+{
+    int d = -1 ;
+    
+    BUFFER_INIT( escaped_char_seq ) ;
 
-                pendchar(c) ;
+    d = nextchar() ;
+    
+    switch( d )
+    {
+        case (int)'0' :
+        case (int)'1' :
+        case (int)'2' :
+        case (int)'3' :
+        case (int)'4' :
+        case (int)'5' :
+        case (int)'6' :
+        case (int)'7' :
+            /* octal : at nost 3 octal digits
+             */
+            d = nextchar() ;
 
-                c = (int)macrochar ;
-            }
-            
-            isbracketable = symbolonstack() ;
-            
-            if( isbracketable )
-            {
-                /* check following characters to see if the first non-whitespace
-                 * sequence is a double hash char
-                 */
-            }
-            
-            if( isbracketable )
-            {
-                FPUTS( prebuff ) ;
-                FPUT( '(' ) ;
-                FPUTS( buff ) ;
-                FPUT( ')' ) ;
-                FPUTS( postbuff ) ;
-            }
-            else
+            if( ( d < (int)'0' ) || ( d > (int)'7' ) )
             {
-                OUTPUTBUFFS_NOLASTCHAR() ;
+                pendchar( d ) ;
+                break ;
             }
 
-            newc = readsymbol() ;
+            if( writeout ) { FPUT( d ) ; }
 
-            if( ( c == (int)'\n' ) && ( newc != (int)macrochar ) )
-            {
-                FPUT( ' ' ) ;
-                FPUT( '\\' ) ;
-                FPUT( '\n' ) ;
-            }
-            else
+            d = nextchar() ;
+
+            if( ( d < (int)'0' ) || ( d > (int)'7' ) )
             {
-                FPUT( c ) ;
+                pendchar( d ) ;
+                break ;
             }
+            
+            if( writeout ) { FPUT( d ) ; }
 
-            c = newc ;
-
-            continue ;
-        }
-
-        /* the following only happens if we are inside quotes
-         */
-
-        OUTPUTBUFFS_NOLASTCHAR() ;
-
-        if( c == (int)'\n' )
-        {
-            FPUT( ' ' ) ;
-            FPUT( '\\' ) ;
-        }
-
-        FPUT( c ) ;
-
-        c = readsymbol() ;
-    };
-
-    /* tidy up
-     */
+            break ;
+        
+        case 'x' :
+        case 'u' :
+        case 'U' :
+            /* all of these are arbitrarily long sequences of hex digits
+             */
+            while( ( !INEOF() ) && ( d != '\n' ) && isxdigit( d ) )
+            {
+                if( writeout ) { FPUT( d ) ; }
 
-    stackfree() ;
+                d = nextchar() ;
+            };
+            /* the last char read was a dud for some reason
+             * put it in the pending character store
+             */
+            pendchar( d ) ;
+            
+            break ;
+        
+        default:
+            /* The default handles both well defined single escaped chars
+             * and undefined single escaped chars the same - it
+             * assumes the char is valid and outputs it.
+             *
+             * This is typical behavior for C-like parsers.
+             */
+            if( writeout ) { FPUT( d ) ; }
 
-    return retv ;
+            break ;
+    }
+    
+    return d ;
 }
 
-/*******************************************************
- */
 
-
-/* output a set of constants with the given pre- and post- identifiers
- * on the given list of name.
- *
- * type 0 flags are from 0 incremented by 1 ( a sequence ) output as
- *        sequences of the last constant+1.
- *
- * type 1 flags are power of two staring from 1
+/* Read characters inside quotations until we either run out
+ * ( which is an error and returns -1 ) or we reach the end
+ * quotation mark, when we can return 0
  *
- * type 2 flags are from 0 incremented by 1, but output as exlicit values.
+ * The characters are passed directly to the output stream
  *
- * type 3 flags are from 0 decremented by 1, as explicit values
+ * This routine must allow for escaped charaters.
  *
- * all the values are made relative to the base one so it is easy
- * to change later
+ * Assumes we have already read the opening quotation mark
  */
-int process_constants( int type )
+int pass_chars_in_quotes( int endquotechar )
 {
     int retv = 0 ;
-    int i = 0 ;
-    int c = 0 ;
-    char *pre = NULL ;
-    char *post = NULL ;
-    char *base = NULL ;
-
-
-    c = readsymbol() ;
-    stackcopy() ;
-    pre = wordstackp->buff ;
-
-    c = readsymbol() ;
-    stackcopy() ;
-    post = wordstackp->buff ;
 
-    c = readsymbol() ;
-    stackcopy() ;
-    base = wordstackp->buff ;
+    int c = -1 ;
+    int d = -1 ;
 
-    if( ( type == 0 ) || ( type == 2 ) )
+    c = nextchar() ;
+    
+    while( ( c != -1 ) && !INEOF() )
     {
-        fprintf( fout, "#define %s_%s_%s\t\t0\n", pre, base, post ) ;
-
-        i = 1 ;
-    }
+        FPUT( c ) ;
+        
+        if( c == endquotechar )
+            /* quote ended properly
+             */
+            break ;
+        
+        if( c == '\n' ) 
+        {
+            return -1 ;
+        }
+        
+        if( c == '\\' )
+        {
+            // an escaped character - read the sequence
+            
+            d = nextchar() ;
+            
+            switch( d )
+            {
+                case (int)'0' :
+                case (int)'1' :
+                case (int)'2' :
+                case (int)'3' :
+                case (int)'4' :
+                case (int)'5' :
+                case (int)'6' :
+                case (int)'7' :
+                    /* octal : at most 3 octal digits
+                     */
+                    FPUT( d ) ;
+                    d = nextchar() ;
+                    if( ( d < (int)'0' ) || ( d > (int)'7' ) )
+                    {
+                        pendchar( d ) ;
+                        break ;
+                    }
+                    FPUT( d ) ;
+                    d = nextchar() ;
+                    if( ( d < (int)'0' ) || ( d > (int)'7' ) )
+                    {
+                        pendchar( d ) ;
+                        break ;
+                    }
+                    FPUT( d ) ;
+                    break ;
+                
+                case 'x' :
+                case 'u' :
+                case 'U' :
+                    /* all of these are arbitrarily long sequences of hex digits
+                     */
+                    while( ( !INEOF() ) && ( d != '\n' ) && isxdigit( d ) )
+                    {
+                        FPUT( d ) ;
+                        d = nextchar() ;
+                    };
+                    /* the last char read was a dud for some reason
+                     * put it in the pending character store
+                     */
+                    pendchar( d ) ;
+                    break ;
+                
+                default:
+                    /* The default handles both well defined single escaped chars
+                     * and undefined single escaped chars the same - it
+                     * assumes the char is valid and outputs it.
+                     *
+                     * This is typical behavior for C-like parsers.
+                     */
+                    FPUT( d ) ;
+                    break ;
+            }
+        }
+        
+        c = nextchar() ;
+    };
+    
+    return retv ;
+}
 
-    if( type == 1 )
-    {
-        fprintf( fout, "#define %s_%s_%s\t\t0x01\n", pre, base, post ) ;
+/*******************************************************
+ */
 
-        i = 2 ;
-    }
 
-    if( type == 3 )
+/* readchar(c) reads input characters until it finds a
+ * match to the one requested.
+ *
+ * it ONLY ignores isspace() characters.
+ * 
+ * If you pass a whitespace character to it ( ie. try
+ * and match to a whitespace ) it simply returns immediately.
+ *
+ * a return of -1 is an error
+ * a return matching the requested char is valid
+ */
+int readchar( int cwanted )
+{
+    int retv = -1 ;
+    int c = 0 ;
+    
+    if( iswhitespace(cwanted) )
     {
-        fprintf( fout, "#define %s_%s_%s\t\t0\n", pre, base, post ) ;
+		return retv ;
+	}
 
-        i = -1 ;
-    }
+    c = nextchar() ;
 
-    while( ( c != -1 ) && ( (char)c != macrochar ) )
+    while( ( c != -1 ) && !INEOF() )
     {
-        c = readsymbol() ;
-
-        if( strlen(buff) > 0 )
+        if( !iswhitespace(c) )
         {
-            if( type == 0 )
-            {
-                fprintf( fout, "#define %s_%s_%s\t\t%s_%s_%s + %d\n", pre, buff, post, pre, base, post, i ) ;
-
-                i++ ;
-
-                continue ;
-            }
-
-            if( type == 1 )
-            {
-                fprintf( fout, "#define %s_%s_%s\t\t0x0%X\n", pre, buff, post, i ) ;
-
-                i *= 2 ;
-
-                continue ;
-            }
-
-            if( type == 2 )
+            if( c == cwanted )
             {
-                fprintf( fout, "#define %s_%s_%s\t\t%d\n", pre, buff, post, i ) ;
-
-                i++ ;
-
-                continue ;
+                retv = c ;
             }
 
-            if( type == 3 )
-            {
-                fprintf( fout, "#define %s_%s_%s\t\t%d\n", pre, buff, post, i ) ;
-
-                i-- ;
-
-                continue ;
-            }
+            break ;
         }
+
+        c = nextchar() ;
     };
 
     return retv ;
 }
 
-
 /*******************************************************
  */
 
 
-/* Send a command to the shell to process the following
- * block of text
+#define issymbolchar(c)     ( ( (c) == '_' ) || isalnum((c)) )
+
+/* reads the next symbol
  *
- * The shell command is everything up to EOL following the
- * #command directive
+ * the default behavior is to ignore spaces and output
+ * them to fout.
  *
- * Input to the command is send via a pipe.  Output from
- * the command is recieved via another pipe.
- * The command recieves input on it's stdin and sends
- * output to stdout.
+ * symbols only contain alpha-numerics and underscore
  *
- * The parent will have to wait until the child dies (!)
- * before it can continue, so we have to watch for that.
+ * trailing and lead whitespace is stored in the
+ * prebuff and postbuff buffers.
  */
 
-#define PARENT_READ readpipe[0]
-#define CHILD_WRITE readpipe[1]
-#define CHILD_READ  writepipe[0]
-#define PARENT_WRITE    writepipe[1]
 
-int process_command()
+
+int readsymbol()
 {
     int retv = 0 ;
 
-    int writepipe[2] = { -1, -1 } ;
-    int readpipe[2] = { -1, -1 } ;
-
-    pid_t childpid ;
-
     int c = 0 ;
+    
+    BUFFER_INIT( prebuff ) ;
+    BUFFER_INIT( buff ) ;
+    BUFFER_INIT( postbuff ) ;
 
-    FILE *fproc = NULL ;
-
-
-    /* get the command
-     */
-    retv = read_to_eol() ;
-
-    if( retv < 0 )
-        return retv ;
-
-    /* open the pipes
-     */
-
-    retv = pipe( writepipe ) ;
-    if( retv < 0 )
+    if( quote_pending )
     {
-        return -1 ;
+        toggle(inside_quotes) ;
+        toggle(quote_pending) ;
     }
 
-    retv = pipe( readpipe ) ;
-    if( retv < 0 )
+    c = nextchar() ;
+
+    while( BUFFER_AVAILABLE(buff) && BUFFER_AVAILABLE(prebuff) )
     {
-        close( writepipe[0] ) ;
-        close( writepipe[1] ) ;
-        return -1 ;
-    }
+        if( inside_quotes )
+        {
+            /* read chars until the buffer is full or we
+             * find an non-escaped matching quote to end
+             *
+             * inside quotes we need to check for escaped
+             * sequences.
+             */
 
-    /* now fork a child
-     */
+            if( escape_pending )
+            {
+                toggle(escape_pending) ;
+                
+                appendc( c, buff ) ;
+            }
+            else
+            {
+                if( c == '"' )
+                {
+                    toggle(quote_pending) ;
 
-    childpid = fork() ;
+                    break ;
+                }
 
-    if( childpid == 0 )
-    {
-        /* In child
-         */
+                if( c == '\\' )
+                {
+                    toggle(escape_pending) ;
+                }
 
-        close( PARENT_WRITE ) ;
-        close( PARENT_READ ) ;
+				appendc( c, buff ) ;
+            }
 
-        dup2( CHILD_READ, 0 ) ;
-        dup2( CHILD_WRITE, 1 ) ;
+            /* go back to start of loop
+             */
 
-        close( CHILD_READ ) ;
-        close( CHILD_WRITE ) ;
+            c = nextchar() ;
 
-        /* now start a command
-         */
-
-        retv = execlp( buff, buff, NULL ) ;
-
-        /* if we got here there was an error and we exit anyway
-         */
-
-        exit(-1) ;
-    }
-    else
-    {
-        /* In parent
-         */
+            continue ;
+        }
 
-        close( CHILD_READ ) ;
-        close( CHILD_WRITE ) ;
 
-        /* send input to child
+        /* note that this only happens if we are not inside_quotes
          */
 
-        fproc = fdopen( PARENT_WRITE, "w" ) ;
+        if( ( BUFFER_INDEX(buff) == 0 ) && iswhitespace(c) )
+        {
+			appendc( c, prebuff ) ;
 
-        if( fproc == NULL )
-            goto write_error ;
+            c = nextchar() ;
 
-        c = nextchar() ;
+            continue ;
+        }
 
-        while( c != -1 )
+        if( issymbolchar(c) )
         {
-            if( c == (int)macrochar )
+			appendc( c, buff ) ;
+        }
+        else
+        {
+            if( (char)c == '"' )
             {
-                c = nextchar() ;
+                toggle(quote_pending) ;
+            }
 
-                if( c == (int)'\n' )
-                {
-                    break ;
-                }
+            break ;
+        }
 
-                fputc( (int)macrochar, fproc ) ;
+        c = nextchar() ;
+    };
 
-                continue ;
-            }
+	appendc( 0, buff ) ;
+	appendc( 0, prebuff ) ;
+    
+    // k = 0 ;
 
-            fputc( c , fproc ) ;
+    while( BUFFER_AVAILABLE(postbuff) && iswhitespace(c) )
+    {
+		appendc( c, postbuff ) ;
 
-            c = nextchar() ;
-        };
+        c = nextchar() ;
+    };
 
-        /* fputc( (int)macrochar, fproc ) ;
-         */
+    /* the last char read could be a valid char from the next symbol
+     * so we have to check and allow it to be stored for the next character
+     * reading.
+     */
 
-        fclose( fproc ) ;
+    if( issymbolchar(c) )
+    {
+        pendchar(c) ;
+        c = (int)' ' ;
+    }
 
-write_error:
+	appendc( 0, postbuff ) ;
 
-        /* read output from command run by child
-         */
+    retv = c ;
+    
+    lastchar = c ;
+    
+    /*
+    if( c != (int)'\n' )
+    {
+        debugf( "readsymbol() ::     buff = [ %s ][ %s ][ %s ][ %c ]\n", prebuff, buff, postbuff, c ) ;
+    }
+    else
+    {
+        debugf( "readsymbol() ::     buff = [ %s ][ %s ][ %s ][ \\n ]\n", prebuff, buff, postbuff ) ;
+    }
+    */
 
-        fproc = fdopen( PARENT_READ, "r" ) ;
+    return retv ;
+}
 
-        c = fgetc( fproc ) ;
 
-        while( ( c != -1 ) && !feof(fproc) )
-        {
-            FPUT(c) ;
+/*******************************************************
+ */
 
-            c = fgetc( fproc ) ;
-        };
 
-        fclose( fproc ) ;
+/* read everything up to the EOL into the buffer
+ */
+int read_to_eol()
+{
+    int retv = 0 ;
+    int c = 0 ;
+    
+    BUFFER_INIT( buff ) ;
+
+    while( BUFFER_AVAILABLE(buff) && ( c != -1 ) )
+    {
+        c = nextchar() ;
 
-        /* wait for child to die
-         */
+        if( c == (int)'\n' )
+            break ;
 
-        childpid = wait( &retv ) ;
+        if( c != -1 )
+        {
+			appendc( c, buff ) ;
+        }
+    };
 
-        /* close pipes !
-         */
-        close( PARENT_READ ) ;
-        close( PARENT_WRITE ) ;
-    }
-    
+    appendc( 0, buff ) ;
 
     return retv ;
 }
 
-
 /*******************************************************
  */
 
+/* this function pushes a copy of a buffer onto the stack
+ *
+ * basically it's a simple list for later checking
+ *
+ * the data structure supports these lists
+ *
+ * if checklen is nonzero then only copy the buffer if length
+ * is greater than zero.  There may be situations when we
+ * want to copy a zero-length string to the stack, so we need
+ * the option.
+ */
 
-/* process checks the keyword we read in and if it finds a valid
- * word it does our extension processing
+/* double the hash table and rechain every node.
  *
- * This returns 0 if a keyword was found and processed and
- * -1 if processing failed or no keyword was found.
+ * Nodes are appended to their new chain walking from the top of the
+ * stack down, so every chain keeps the newest node at its head and
+ * stackpop() can still unlink in O(1).
  */
+static void wordstack_grow()
+{
+    size_t size = wordstack_hash_size ? wordstack_hash_size * 2 : WORDSTACK_HASH_SIZE ;
+    wordstack_t **table = NULL ;
+    wordstack_t **tails = NULL ;
+    wordstack_t *curr = NULL ;
+    size_t b = 0 ;
 
-#define process_keyword( _kw, _proc ) \
-    \
-    if( iskeyword( #_kw ) ) \
-    { \
-        changes_made = TRUE ; \
-        \
-        retv = process_ ## _proc ; \
-        \
-        debugf( "Accepted keyword :: " #_kw "\n" ) ; \
-        \
-        goto err_exit ; \
-    }
+    table = (wordstack_t **)calloc( size, sizeof(wordstack_t *) ) ;
+    tails = (wordstack_t **)calloc( size, sizeof(wordstack_t *) ) ;
 
-#define flag_keyword( _kw, _flag, _value ) \
-    \
-    if( iskeyword( #_kw ) ) \
-    { \
-        (_flag) = (_value) ; \
-        \
-        changes_made = TRUE ; \
-        \
-        debugf( "Accepted flag:: " #_kw "\n" ) ; \
-        \
-        retv = 0 ; \
-        \
-        goto err_exit ; \
-    }
-    
+    if( ( table == NULL ) || ( tails == NULL ) )
+        goto err_exit ;
 
-int process()
-{
-    int retv = -1 ;
+    for( curr = wordstackp ; curr != NULL ; curr = curr->next )
+    {
+        b = curr->hash % size ;
+        curr->hnext = NULL ;
 
-    /* for safety
-     */
-    buff[BUFFLEN] = '\0' ;
-    
-    // debugf( "prebuff  = [%s]\n", prebuff ) ;
-    // debugf( "buff     = [%s]\n", buff ) ;
-    // debugf( "postbuff = [%s]\n", postbuff ) ;
-    
-    flag_keyword( skipoff, skip_is_on, FALSE ) ;
-    
-    /* NOTE :
-     *
-     * The following check for skip_is_on must only be made
-     * AFTER checking for a skipoff directive.
-     *
-     * If it's done before that then we never check for skipoff
-     * and we could skip forever !
-     */
+        if( tails[ b ] == NULL )
+            table[ b ] = curr ;
+        else
+            tails[ b ]->hnext = curr ;
 
-    if( skip_is_on )
-    {
-        return -1 ;
+        tails[ b ] = curr ;
     }
 
-    flag_keyword( skipon, skip_is_on, TRUE ) ;
-    
-    process_keyword( macrochar, macrochar() ) ;
-    
-    if( iskeyword("debugon") )
-    {
-        /* turn on debug reporting from caps
-         */
-        debug_on() ;
+    free( wordstack_hash ) ;
+    wordstack_hash = table ;
+    wordstack_hash_size = size ;
+    table = NULL ;
 
-        changes_made = TRUE ;
+err_exit:
 
-        retv = 0 ;
-        
-        goto err_exit ;
-    }
+    free( table ) ;
+    free( tails ) ;
+}
 
-    if( iskeyword("debugoff") )
-    {
-        /* turn off debug reporting from caps
-         */
-        debug_off() ;
+/*******************************************************
+ */
 
-        changes_made = TRUE ;
 
-        retv = 0 ;
-        
-        goto err_exit ;
-    }
+void stackcopybuffer( char *buffer, int checklen )
+{
+    wordstack_t *node = NULL ;
+    int len = 0 ;
 
-    process_keyword( quote, quote() ) ;
+    len = strlen(buffer) ;
 
-    process_keyword( comment, comment() ) ;
+    if( ( checklen != 0 ) && ( len == 0 ) )
+        return ;
 
-    process_keyword( def, def() ) ;
-    
-    process_keyword( constants, constants(0) ) ;
+    len++ ;
 
-    process_keyword( flags, constants(1) ) ;
+    if( wordstack_count >= wordstack_hash_size )
+        wordstack_grow() ;
 
-    process_keyword( constants-values, constants(2) ) ;
+    if( wordstack_hash == NULL )
+        return ;
 
-    process_keyword( constants-negative, constants(3) ) ;
+    node = (wordstack_t *)malloc( sizeof(wordstack_t) ) ;
 
-    process_keyword( command, command() ) ;
-    
-    process_keyword( redefine, redefine() ) ;
+    if( node == NULL )
+        return ;
 
-    flag_keyword( brace_macros_on, apply_brace_macros, TRUE ) ;    
-    
-    flag_keyword( brace_macros_off, apply_brace_macros, FALSE ) ;    
-    
-    process_keyword( def_open_brace, def_open_brace() ) ;
-    
-    process_keyword( def_close_brace, def_close_brace() ) ;
-    
-    flag_keyword( return_macro_on, apply_return_macro, TRUE ) ;
-    
-    flag_keyword( return_macro_off, apply_return_macro, FALSE ) ;
-    
-    process_keyword( def_return_macro, def_return_macro() ) ;
-    
-err_exit:
-    
-    // if( ! changes_made )
-    // {
-        fprintf( fout, "#line %d\n", linenum ) ;
-    // }
-    
-    return retv ;
+    node->buff = NULL ;
+    node->next = wordstackp ;
+    wordstackp = node ;
+    wordstack_count++ ;
+
+    node->hash = symbol_hash( buffer ) ;
+    node->hnext = wordstack_hash[ node->hash % wordstack_hash_size ] ;
+    wordstack_hash[ node->hash % wordstack_hash_size ] = node ;
+
+    node->buff = (char *)malloc( len ) ;
+
+    if( node->buff == NULL )
+        return ;
+
+    memcpy( node->buff, buffer, len ) ;
 }
 
+/*******************************************************
+ */
+
 
-/*******************************************************************
+#define stackcopy() stackcopybuffer(buff,1)
+
+#define stackcopyall()  \
+            { \
+                stackcopybuffer(prebuff,0) ; \
+                stackcopybuffer(buff,0) ; \
+                stackcopybuffer(postbuff,0) ; \
+            }
+
+/*******************************************************
+ */
+
+
+/* get a pointer to the buffer stored in the node
+ * at the given index.
  *
- * main_process() processes each individual file passed to cap
- *
- * There is no cross-file communication.  Each file starts with a
- * clean state in cap.
+ * 0 is stop of stack
  *
+ * return NULL on error
  */
-int main_process()
+char *stackbuffat( int index )
 {
-    if( fin == NULL )
+    char *retp = NULL ;
+    wordstack_t *curr = wordstackp ;
+    wordstack_t *next = NULL ;
+    int i = 0 ;
+
+    if( index < 0 )
+        return NULL ;
+
+    if( wordstackp == NULL )
+        return NULL ;
+
+    while( ( curr != NULL ) && ( i != index ) )
     {
-        return 0 ;
+        i++ ;
+
+        curr = curr->next ;
+    };
+
+    if( ( curr != NULL ) && ( i == index ) )
+    {
+        retp = curr->buff ;
+
+        /* debugf( "stackbuffat( %d ) = [ %s ]\n", index, retp ) ;
+         */
     }
-    
+
+    return retp ;
+}
+
+/*******************************************************
+ */
+
+
+/* pop the tos, freeing all memory for that node
+ */
+void stackpop()
+{
+    wordstack_t *next = NULL ;
+
+    if( wordstackp == NULL )
+        return ;
+
+    next = wordstackp->next ;
+
+    wordstack_hash[ wordstackp->hash % wordstack_hash_size ] = wordstackp->hnext ;
+    wordstack_count-- ;
+
+    free( wordstackp->buff ) ;
+    free( wordstackp ) ;
+
+    wordstackp = next ;
+}
+
+/*******************************************************
+ */
+
+
+/* release all memory used by the stack
+ * and reset the stack pointer
+ */
+void stackfree()
+{
+    wordstack_t *curr = wordstackp ;
+    wordstack_t *next = NULL ;
+
+    while( curr != NULL )
+    {
+        free( curr->buff ) ;
+        next = curr->next ;
+        free( curr ) ;
+        curr = next ;
+    };
+
+    wordstackp = NULL ;
+    wordstack_count = 0 ;
+
+    if( wordstack_hash != NULL )
+        memset( wordstack_hash, 0, wordstack_hash_size * sizeof(wordstack_t *) ) ;
+}
+
+/*******************************************************
+ */
+
+
+/* check if the stack contains the given symbol
+ */
+static int symbol_on_stack( const char *str )
+{
+    int retv = FALSE ;
+    unsigned int h = symbol_hash( str ) ;
+    wordstack_t *curr = NULL ;
+
+    if( wordstack_hash == NULL )
+        return retv ;
+
+    curr = wordstack_hash[ h % wordstack_hash_size ] ;
+
+    while( curr != NULL )
+    {
+        if( ( curr->hash == h ) && ( curr->buff != NULL ) )
+        {
+            if( strcmp( str, curr->buff ) == 0 )
+            {
+                return TRUE ;
+            }
+        }
+
+        curr = curr->hnext ;
+    };
+
+    return retv ;
+}
+
+
+/* check if the stack contains the currently buffered symbol
+ *
+ * this function return TRUE if it is and FALSE if not
+ * TRUE is normally 1 and FALSE should be 0, but use the
+ * macros TRUE and FALSE and not explicit values.
+ */
+int symbolonstack()
+{
+    return symbol_on_stack( buff ) ;
+}
+
+/*******************************************************
+ */
+
+
+int process_macrochar()
+{
     int retv = 0 ;
-    int c = 0 ;
-    int i = 0 ;
-    int j = 0 ;
     
-    int leadingspaces = 0 ;
+    macrochar = nextchar() ;
     
-    /* blank chars is needed because a blank might be a character
-     * other than a space ( e.g. a tab ) and we want to output that
-     * character, not just a space.  So we have to record blank chars
-     */
-    char blankchars[BUFFLEN] ;
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+int process_simple_macro_def( char **macro )
+{
+    int retv = 0 ;
+
+    safe_free( *macro ) ;
     
-    /* Initialize the state variables for a new file
-     */
+    int i = 0 ;
     
-    apply_brace_macros = FALSE ;
+    i = read_to_eol() ;
     
-    BUFFER_INIT( deferredbuffer ) ;
+    i = strlen( buff ) ;
     
-    escape_pending = FALSE ;
+    *macro = (char *)malloc( i+1 ) ;
     
-    in_comment = FALSE ;
-    in_quotes = FALSE ;
+    if( *macro == NULL )
+    {
+        /* could not get memory
+         */
     
-    lastchar_read = -1 ;
-    currentchar_read = -1 ;
+        return -1 ;
+    }
     
-    BUFFER_INIT( prebuff ) ;
-    BUFFER_INIT( buff ) ;
-    BUFFER_INIT( postbuff ) ;
+    memcpy( *macro, buff, i+1 ) ;
+    
+    return retv ;
+}
+
+/*******************************************************
+ */
+
 
+int process_def_open_brace()
+{
+    int retv = 0 ;
     
-    BUFFER_INIT( rotatingbuffer ) ;
+    retv = process_simple_macro_def( &open_brace_macro ) ;
     
-    macrochar = initial_macrochar ;
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+int process_def_close_brace()
+{
+    int retv = 0 ;
     
-    pendingchar = -1 ;
+    retv = process_simple_macro_def( &close_brace_macro ) ;
     
-    quote_pending = FALSE ;
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+int process_def_return_macro()
+{
+    int retv = 0 ;
     
-    skip_is_on = FALSE ;
+    retv = process_simple_macro_def( &return_macro ) ;
     
-    linenum = 1 ;
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+static boolean_t comment_follows( int c ) ;
+
+static int strip_comment( boolean_t in_macro ) ;
 
-    /* Now process the file ... 
-     */
 
-    while( ( c != -1 ) && ( !feof(fin) ) )
+/* Follow the strings and character constants in text copied a
+ * character at a time, so --strip-comments leaves them alone.
+ * Returns the quote character the text is in after c, or 0.
+ */
+static int quote_after( int quote, int c, boolean_t *escaped )
+{
+    if( *escaped )
     {
-        // DBGLINE() ;
-        
-        c = nextchar() ;
-        
-        if( c == -1 )
-            break ;
-        
-        if( c != (int)macrochar )
-        {
-            /* not a macrochar ( normally hash ) as first char on line
-             * then output everything until we
-             * we reach EOL or EOF with special handling.
-             */
-            
-            // DBGLINE() ;
-            
-            FPUT(c) ;
+        *escaped = FALSE ;
+    }
+    else if( ( quote != 0 ) && ( c == (int)'\\' ) )
+    {
+        *escaped = TRUE ;
+    }
+    else if( c == quote )
+    {
+        quote = 0 ;
+    }
+    else if( ( quote == 0 ) && ( ( c == (int)'"' ) || ( c == (int)'\'' ) ) )
+    {
+        quote = c ;
+    }
 
-            while( ( c != '\n' ) && ( c != -1 ) && ( !feof(fin) ) )
-            {
-                c = nextchar() ;
+    return quote ;
+}
 
-                if( c == -1 )
-                    break ;
-                
-                if( ( c == '\'' ) && ( lastchar_read != '\\' ) )
-                {
-                    /* a single char in quotes - could be escaped
-                     * treat like a quoted string
-                     */
-                    
-                    FPUT( c ) ;
-                    
-                    pass_chars_in_quotes( '\'' ) ;
-                    
-                    c = currentchar_read ;
-                }
-                else if( ( c == '/' ) && ( lastchar_read == '/' ) )
-                {
-                    // Single line comment - read and output to EOL
-                    
-                    read_to_eol() ;
-                    
-                    FPUT( c ) ;
-                    FPUTS( buff ) ;
-                    FPUT( currentchar_read ) ;
-                    
-                    c = currentchar_read ;
-                    
-                    // fprintf( stderr, "single line comment at %d : [%c%s]\n", linenum, (char)c, buff ) ;
-                }
-                else if( ( c == '*' ) && ( lastchar_read == '/' ) )
+
+int process_quote()
+{
+    int retv = 0 ;
+    int c = 0 ;
+    int quote = 0 ;
+    boolean_t escaped = FALSE ;
+
+    /* take all input from now until either EOF or
+     * '#' at the start of a line and treat it as being part
+     * of one define
+     *
+     * basically pads ' \' unto the end of all lines except the
+     * last non-empty one.
+     */
+    
+    c = nextchar() ;
+
+    while( ( c != -1 ) && !INEOF() )
+    {
+        if( c == (int)'\n' )
+        {
+            /* read the next char and see if it's a macrochar ( normally a hash )
+             *
+             * if it is we know this is the last line of the
+             * quoted section and we don't output the ' \'
+             */
+
+            /* output pending empty lines
+             */
+            
+            quote = 0 ;
+            escaped = FALSE ;
+
+            c = nextchar() ;
+
+            if( c == (int)macrochar )
+            {
+                c = nextchar() ;
+
+                if( c == (int)'\n' )
                 {
-                    DBGLINE() ;
-                
-                    /* a C comment
-                     * read everything and output it unchanged until EOF
-                     * or we detect the end of comment pair of chars
-                     */
-                    
-                    in_comment = TRUE ;
-                    
-                    FPUT(c) ;
-                    
-                    while( ( c != -1 ) && ( !feof(fin) ) )
-                    {
-                        if( ( c == '/' ) && ( lastchar_read == '*' ) )
-                        {
-                            /* end of comment
-                             */
-                            
-                            break ;
-                        }
-                        
-                        c = nextchar() ;
-                        
-                        FPUT(c) ;
-                    };
-                    
-                    in_comment = FALSE ;
+                    FPUT( '\n' ) ;
+                    FPUT( '\n' ) ;
+
+                    return 0 ;
                 }
-                else if( ( ( c == '"' ) && ( lastchar_read != '\\' ) /* && ( lastchar_read != '\'' ) */ ) && ! in_quotes )
+                else
                 {
-                    DBGLINE() ;
-                    
-                    /* a double quotes character starting something in quotes
+                    /* not a single # followed by newline
                      */
-                    
-                    FPUT( c ) ;
-                    
-                    in_quotes = TRUE ;
-                    
-                    pass_chars_in_quotes( (int)'\"' ) ;
-                    
-                    c = currentchar_read ;
-                    
-                    in_quotes = FALSE ;
-                    
-                    if( c == -1 )
-                    {
-                        debugf( "c was -1\n" ) ;
-                    }
-                    
-                    DBGLINE() ;
+
+                    FPUT( macrochar ) ;
+
+                    continue ;
                 }
-                else if( apply_return_macro && ( c == 'r' ) && ( ( lastchar_read == '\n' ) || iswhitespace(lastchar_read) ) )
-                {
-                    DBGLINE() ;
+
+            }
+            else
+            {
+                FPUT( ' ' ) ;
+                FPUT( '\\' ) ;
+                FPUT( '\n' ) ;
                 
-                    /* check for possible return statement
-                     *
-                     * we don't do this if we're not applting brace macros
-                     */
-                    
-                    char tempbuff[BUFFLEN] ;
-                    
-                    char *returnstr = "return" ;
-                    
-                    memset( tempbuff, 0, 8 ) ;
-                    
-                    int k = 0 ;
-                    
-                    while( ( c == returnstr[k] ) && ( k < 6 ) )
-                    {
-                        tempbuff[k] = returnstr[k] ;
-                        k++ ;
-                        
-                        c = nextchar() ;
-                    };
-                    
-                    tempbuff[k] = c ;
-                    tempbuff[k+1] = 0 ;
-                    
-                    if( ( k == 6 ) && ( iswhitespace(c) || ( c == ';' ) || ( c == '(' ) ) )
-                    {
-                        /* a match to a the C return keyword !
-                         *
-                         * with brace macros on we need to ensure that the
-                         * closing brace macro is placed before the return
-                         *
-                         * There are three forms :
-                         *    return ;
-                         *    return(...) ;
-                         *    return x ;
-                         */
-                        
-                        FPUT( '{' ) ;
-                        
-                        FPUTS( return_macro ) ;
-                        
-                        if( c == ';' )
-                        {
-                            FPUTS( tempbuff ) ;
-                        }
-                        else
-                        {
-                            FPUTS( tempbuff ) ;
-                            
-                            c = nextchar() ;
-                            
-                            while( ( c != -1 ) && ( c != ';' ) && ( !feof(fin) ) )
-                            {
-                                FPUT( c ) ;
-                                c = nextchar() ;
-                            };
-                            
-                            FPUT( c ) ;
-                        }
-                        
-                        FPUT( '}' ) ;
-                    }
-                    else
-                    {
-                        /* Not a match - just output what we have
-                         */
-                        
-                        FPUTS( tempbuff ) ;
-                    }
-                }
-                else
-                {
-                    FPUT(c) ;
-                }
-            };
+                continue ;
+            }
+        }
+        else if( ( quote == 0 ) && comment_follows( c ) )
+        {
+            /* a line comment leaves its newline to be continued above
+             */
+            c = strip_comment( TRUE ) ;
 
-            if( c == -1 )
-                break ;
+            if( c == (int)'\n' )
+                continue ;
         }
         else
         {
-            /* a possible preprocessor directive
-             * check if it is one of our extension keywords
-             *
-             * If it is pass processing to the extension module
-             * and if not then output the directive
+            /* not an EOL
              */
+            
+            quote = quote_after( quote, c, &escaped ) ;
 
-            /* read characters into a buffer until EOL, EOF or a space
-             * check this string againsts the key word lists
-             *
-             * Note that isspace() also checks for EOL
-             *
-             * As we permit leading spaces after the hash and before the
-             * directive we need to first check for this.
-             */
+            FPUT( c ) ;
+        }
+            
+        c = nextchar() ;
+    };
 
-            *buff = macrochar ;
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* treat everything until the next line starting with '#' as a
+ * comment.
+ *
+ * wraps the comment in a common comment style.
+ */
+int process_comment()
+{
+    int retv = 0 ;
+    int c = 0 ;
+
+    /* with --strip-comments the block is only read, and the marker
+     * after it keeps the lines right
+     */
+    if( strip_comments )
+    {
+        c = nextchar() ;
+
+        while( ( c != -1 ) && !INEOF() )
+        {
+            if( c == (int)macrochar )
+            {
+                c = nextchar() ;
+
+                if( c == '\n' )
+                    break ;
+
+                continue ;
+            }
+
+            c = nextchar() ;
+        };
+
+        return retv ;
+    }
+
+    fout_printf( "\n/*\n * " ) ;
+    
+    c = nextchar() ;
+
+    while( ( c != -1 ) && !INEOF() )
+    {
+        if( c == (int)macrochar )
+        {
+            c = nextchar() ;
+
+            if( c == '\n' )
+                break ;
+
+            FPUT( macrochar ) ;
+
+            continue ;
+        }
+
+        if( c == '\n' )
+        {
+            fout_printf( "\n *" ) ;
+
+            /* if we don't check for the hash symbol coming next we
+             * will add a space we don't want which sounds trivial
+             * but will cause the comment never to be terminated
+             * as the * and / will be separated by a space !
+             */
+
+            c = nextchar() ;
+            pendchar(c) ;
+
+            if( c != (int)macrochar )
+                FPUT( ' ' ) ;
+        }
+        else
+        {
+            FPUT( c ) ;
+        }
+
+        c = nextchar() ;
+    };
+
+    fout_printf( "/\n" ) ;
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+static int ends_in_continuation()
+{
+    int len = 0 ;
+    
+    len = strlen( buff ) ;
+    
+    if( len < 1 )
+        /* No continuation mark possible
+         */
+        return 0 ;
+    
+    if( buff[len-1] == '\\' )
+        /* a continuation mark
+         */
+        return 1 ;
+    
+    return 0 ;
+}
+
+/*******************************************************
+ */
+
+
+/* process a redefine
+ *
+ * The C preprocessor requires that you first undefine
+ * a macro before redefining, but has no direct support
+ * for doing that automatically.
+ */
+int process_redefine()
+{
+    int retv = 0 ;
+    int i = 0 ;
+    int c = 0 ;
+    int newc = 0 ;
+
+    c = readsymbol() ;
+
+    fout_printf( "#undef %s%s%s\n", prebuff, buff, postbuff ) ;
+    fout_printf( "#define %s%s%s", prebuff, buff, postbuff ) ;
+    
+    /* Now read to first EOL with no continuation before the new line
+     */
+    
+    i = read_to_eol() ;
+    
+    while( ends_in_continuation() )
+    {
+        FPUTS( buff ) ;
+        FPUT( '\n' ) ;
+    
+        i = read_to_eol() ;
+    };
+    
+    FPUTS( buff ) ;
+    FPUT( '\n' ) ;
+    
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* process a macro definition
+ *
+ * unlike quote creates the macro definition and substitutes all
+ * the symbols used as paramater markers with '(<paramname>)'
+ * which is the safe macro expansion version.
+ *
+ * Note that no attempt is made to parse the code so ANY token
+ * matching the sequence will be converted.
+ */
+int process_def()
+{
+    int retv = 0 ;
+    int i = 0 ;
+    int c = 0 ;
+    int newc = 0 ;
+
+    wordstack_t *mark = wordstackp ;
+
+    boolean_t isbracketable = FALSE ;
+    
+    /* first we need to read the definition part
+     * which should be of the form <macroname>([<parametername>{,<parametername>}])
+     *
+     */
+
+    c = readsymbol() ;
+
+    if( c != (int)'(' )
+        /* this is a syntax error
+         */
+        return -1 ;
+
+    fout_printf( "#define %s%s%s(", prebuff, buff, postbuff ) ;
+
+    i = 0 ;
+
+    c = readsymbol() ;
+
+    while( c == (int)',' )
+    {
+        OUTPUTBUFFS() ;
+
+        /* need to keep a copy of buff
+         */
+
+        stackcopy() ;
+
+        c = readsymbol() ;
+    };
+
+    OUTPUTBUFFS() ;
+
+    stackcopy() ;
+
+    /* definition has been read and output
+     *
+     * now output the text replacing the paramameter values until
+     * a macrochar ( normally a hash ) is read or EOF and adding
+     * the required ' \' EOL sequences 
+     */
+
+    c = readsymbol() ;
+
+    while( c != -1 )
+    {
+        if( !inside_quotes )
+        {
+            if( c == (int)macrochar )
+            {
+                c = nextchar() ;
+
+                if( c == '\n' )
+                {
+                    FPUT( '\n' ) ;
+                    break ;
+                }
+
+                pendchar(c) ;
+
+                c = (int)macrochar ;
+            }
+            
+            isbracketable = symbolonstack() ;
+            
+            if( isbracketable )
+            {
+                /* check following characters to see if the first non-whitespace
+                 * sequence is a double hash char
+                 */
+            }
+            
+            if( isbracketable )
+            {
+                FPUTS( prebuff ) ;
+                FPUT( '(' ) ;
+                FPUTS( buff ) ;
+                FPUT( ')' ) ;
+                FPUTS( postbuff ) ;
+            }
+            else
+            {
+                OUTPUTBUFFS_NOLASTCHAR() ;
+            }
+
+            /* with --strip-comments a comment goes, but a line
+             * comment's newline is continued as the others are
+             */
+            if( comment_follows( c ) )
+            {
+                c = strip_comment( TRUE ) ;
+
+                if( c == (int)'/' )
+                    c = -1 ;
+            }
+
+            newc = readsymbol() ;
+
+            if( ( c == (int)'\n' ) && ( newc != (int)macrochar ) )
+            {
+                FPUT( ' ' ) ;
+                FPUT( '\\' ) ;
+                FPUT( '\n' ) ;
+            }
+            else
+            {
+                FPUT( c ) ;
+            }
+
+            c = newc ;
+
+            continue ;
+        }
+
+        /* the following only happens if we are inside quotes
+         */
+
+        OUTPUTBUFFS_NOLASTCHAR() ;
+
+        if( c == (int)'\n' )
+        {
+            FPUT( ' ' ) ;
+            FPUT( '\\' ) ;
+        }
+
+        FPUT( c ) ;
+
+        c = readsymbol() ;
+    };
+
+    /* tidy up, leaving what was stacked before ( e.g. the counter of
+     * a #repeat the #def is in )
+     */
+
+    while( ( wordstackp != NULL ) && ( wordstackp != mark ) )
+    {
+        stackpop() ;
+    };
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* output a set of constants with the given pre- and post- identifiers
+ * on the given list of name.
+ *
+ * type 0 flags are from 0 incremented by 1 ( a sequence ) output as
+ *        sequences of the last constant+1.
+ *
+ * type 1 flags are power of two staring from 1
+ *
+ * type 2 flags are from 0 incremented by 1, but output as exlicit values.
+ *
+ * type 3 flags are from 0 decremented by 1, as explicit values
+ *
+ * all the values are made relative to the base one so it is easy
+ * to change later
+ */
+int process_constants( int type )
+{
+    int retv = 0 ;
+    int i = 0 ;
+    int c = 0 ;
+    char *pre = NULL ;
+    char *post = NULL ;
+    char *base = NULL ;
+
+    wordstack_t *mark = wordstackp ;
+
+
+    /* an empty symbol is still stacked so pre, post and base
+     * always point at their own copies
+     */
+    c = readsymbol() ;
+    stackcopybuffer( buff, 0 ) ;
+    pre = wordstackp->buff ;
+
+    c = readsymbol() ;
+    stackcopybuffer( buff, 0 ) ;
+    post = wordstackp->buff ;
+
+    c = readsymbol() ;
+    stackcopybuffer( buff, 0 ) ;
+    base = wordstackp->buff ;
+
+    if( ( type == 0 ) || ( type == 2 ) )
+    {
+        fout_printf( "#define %s_%s_%s\t\t0\n", pre, base, post ) ;
+
+        i = 1 ;
+    }
+
+    if( type == 1 )
+    {
+        fout_printf( "#define %s_%s_%s\t\t0x01\n", pre, base, post ) ;
+
+        i = 2 ;
+    }
+
+    if( type == 3 )
+    {
+        fout_printf( "#define %s_%s_%s\t\t0\n", pre, base, post ) ;
+
+        i = -1 ;
+    }
+
+    while( ( c != -1 ) && ( (char)c != macrochar ) )
+    {
+        c = readsymbol() ;
+
+        if( strlen(buff) > 0 )
+        {
+            if( type == 0 )
+            {
+                fout_printf( "#define %s_%s_%s\t\t%s_%s_%s + %d\n", pre, buff, post, pre, base, post, i ) ;
+
+                i++ ;
+
+                continue ;
+            }
+
+            if( type == 1 )
+            {
+                fout_printf( "#define %s_%s_%s\t\t0x0%X\n", pre, buff, post, i ) ;
+
+                i *= 2 ;
+
+                continue ;
+            }
+
+            if( type == 2 )
+            {
+                fout_printf( "#define %s_%s_%s\t\t%d\n", pre, buff, post, i ) ;
+
+                i++ ;
+
+                continue ;
+            }
+
+            if( type == 3 )
+            {
+                fout_printf( "#define %s_%s_%s\t\t%d\n", pre, buff, post, i ) ;
+
+                i-- ;
+
+                continue ;
+            }
+        }
+    };
+
+    /* release pre, post and base so they do not leak onto the stack
+     * of a later #def
+     */
+    while( ( wordstackp != NULL ) && ( wordstackp != mark ) )
+    {
+        stackpop() ;
+    };
+
+    return retv ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* #perfect_hash <prefix> <postfix> <function>
+ *
+ * Takes the same list of symbols as #constants-values and writes the
+ * same constants, followed by a function
+ *
+ *      int <function>( const char *str, size_t len )
+ *
+ * which returns the constant for a symbol's name, or -1 for anything
+ * else.  It uses a minimal perfect hash built here with the CHD ( hash,
+ * displace ) method, so a lookup is two hashes, two table reads and a
+ * single memcmp() to check the match.
+ *
+ * The generated hash must give exactly the same values as ph_hash().
+ */
+
+#define PH_MAX_DISPLACEMENT     ( 1 << 20 )
+#define PH_MAX_ATTEMPTS         64
+
+
+static uint32_t ph_hash( uint32_t seed, const char *str, size_t len )
+{
+    uint32_t h = 2166136261u ^ ( seed * 0x9E3779B1u ) ;
+
+    while( len-- > 0 )
+    {
+        h = ( h ^ (unsigned char)*str++ ) * 16777619u ;
+    };
+
+    h ^= h >> 16 ;
+    h *= 0x85EBCA6Bu ;
+    h ^= h >> 13 ;
+
+    return h ;
+}
+
+
+/* Sort buckets largest first, as big buckets are hardest to place
+ */
+static uint32_t *ph_bucket_sizes = NULL ;
+
+static int ph_compare_buckets( const void *a, const void *b )
+{
+    uint32_t sa = ph_bucket_sizes[ *(const uint32_t *)a ] ;
+    uint32_t sb = ph_bucket_sizes[ *(const uint32_t *)b ] ;
+
+    if( sa != sb )
+        return ( sa > sb ) ? -1 : 1 ;
+
+    return ( *(const uint32_t *)a < *(const uint32_t *)b ) ? -1 : 1 ;
+}
+
+
+/* Build the hash for n keys.  On success fills in the bucket seed, the
+ * number of buckets, the displacement of each bucket and the key in
+ * each slot, and returns 0.
+ */
+static int ph_build( char **keys, uint32_t n, uint32_t *seedp, uint32_t *nbucketsp,
+                        uint32_t **dispp, uint32_t **slotsp )
+{
+    uint32_t nbuckets = ( n / 2 ) + 1 ;
+    uint32_t *bucket = (uint32_t *)malloc( n * sizeof(uint32_t) ) ;
+    uint32_t *members = (uint32_t *)malloc( n * sizeof(uint32_t) ) ;
+    size_t *lens = (size_t *)malloc( n * sizeof(size_t) ) ;
+    uint32_t *start = NULL ;
+    uint32_t *order = NULL ;
+    uint32_t *disp = NULL ;
+    uint32_t *slots = (uint32_t *)malloc( n * sizeof(uint32_t) ) ;
+    uint32_t *tried = (uint32_t *)malloc( n * sizeof(uint32_t) ) ;
+    uint32_t seed = 0 ;
+    uint32_t b = 0 ;
+    uint32_t d = 0 ;
+    uint32_t k = 0 ;
+    uint32_t j = 0 ;
+    uint32_t m = 0 ;
+    uint32_t size = 0 ;
+    uint32_t *keyp = NULL ;
+    int retv = -1 ;
+
+    if( ( bucket == NULL ) || ( members == NULL ) || ( lens == NULL ) || ( slots == NULL ) || ( tried == NULL ) )
+        goto err_exit ;
+
+    for( k = 0 ; k < n ; k++ )
+    {
+        lens[k] = strlen( keys[k] ) ;
+    }
+
+    for( seed = 0 ; seed < PH_MAX_ATTEMPTS ; seed++ )
+    {
+        safe_free( start ) ;
+        safe_free( order ) ;
+        safe_free( disp ) ;
+        safe_free( ph_bucket_sizes ) ;
+
+        start = (uint32_t *)calloc( nbuckets + 1, sizeof(uint32_t) ) ;
+        order = (uint32_t *)malloc( nbuckets * sizeof(uint32_t) ) ;
+        disp = (uint32_t *)calloc( nbuckets, sizeof(uint32_t) ) ;
+        ph_bucket_sizes = (uint32_t *)calloc( nbuckets, sizeof(uint32_t) ) ;
+
+        if( ( start == NULL ) || ( order == NULL ) || ( disp == NULL ) || ( ph_bucket_sizes == NULL ) )
+            goto err_exit ;
+
+        for( k = 0 ; k < n ; k++ )
+        {
+            bucket[k] = ph_hash( seed, keys[k], lens[k] ) % nbuckets ;
+            ph_bucket_sizes[ bucket[k] ]++ ;
+
+            slots[k] = n ;
+        }
+
+        /* list the keys of each bucket together
+         */
+        for( b = 0 ; b < nbuckets ; b++ )
+        {
+            start[ b + 1 ] = start[b] + ph_bucket_sizes[b] ;
+            order[b] = b ;
+        }
+
+        for( k = 0 ; k < n ; k++ )
+        {
+            members[ start[ bucket[k] ]++ ] = k ;
+        }
+
+        for( b = nbuckets ; b > 0 ; b-- )
+        {
+            start[b] = start[ b - 1 ] ;
+        }
+
+        start[0] = 0 ;
+
+        qsort( order, nbuckets, sizeof(uint32_t), ph_compare_buckets ) ;
+
+        /* slots[] holds the key in each slot, or n if it is free
+         */
+        for( b = 0 ; ( b < nbuckets ) && ( ph_bucket_sizes[ order[b] ] > 0 ) ; b++ )
+        {
+            size = ph_bucket_sizes[ order[b] ] ;
+            keyp = members + start[ order[b] ] ;
+
+            for( d = 1 ; d < PH_MAX_DISPLACEMENT ; d++ )
+            {
+                for( m = 0 ; m < size ; m++ )
+                {
+                    tried[m] = ph_hash( d, keys[ keyp[m] ], lens[ keyp[m] ] ) % n ;
+
+                    if( slots[ tried[m] ] != n )
+                        break ;
+
+                    for( j = 0 ; ( j < m ) && ( tried[j] != tried[m] ) ; j++ )
+                        ;
+
+                    if( j < m )
+                        break ;
+                }
+
+                if( m == size )
+                    break ;
+            }
+
+            if( d == PH_MAX_DISPLACEMENT )
+                break ;
+
+            disp[ order[b] ] = d ;
+
+            for( m = 0 ; m < size ; m++ )
+            {
+                slots[ tried[m] ] = keyp[m] ;
+            }
+        }
+
+        if( ( b == nbuckets ) || ( ph_bucket_sizes[ order[b] ] == 0 ) )
+        {
+            *seedp = seed ;
+            *nbucketsp = nbuckets ;
+            *dispp = disp ;
+            *slotsp = slots ;
+
+            disp = NULL ;
+            slots = NULL ;
+
+            retv = 0 ;
+
+            break ;
+        }
+
+        /* more buckets make each one easier to place
+         */
+        nbuckets += ( nbuckets / 4 ) + 1 ;
+    }
+
+err_exit:
+
+    safe_free( bucket ) ;
+    safe_free( members ) ;
+    safe_free( lens ) ;
+    safe_free( start ) ;
+    safe_free( order ) ;
+    safe_free( disp ) ;
+    safe_free( slots ) ;
+    safe_free( tried ) ;
+    safe_free( ph_bucket_sizes ) ;
+
+    return retv ;
+}
+
+
+/* Order key indexes by name, then by position
+ */
+static char **ph_sort_keys = NULL ;
+
+static int ph_compare_keys( const void *a, const void *b )
+{
+    int r = strcmp( ph_sort_keys[ *(const uint32_t *)a ], ph_sort_keys[ *(const uint32_t *)b ] ) ;
+
+    if( r != 0 )
+        return r ;
+
+    return ( *(const uint32_t *)a < *(const uint32_t *)b ) ? -1 : 1 ;
+}
+
+
+/* Drop repeated keys, keeping the first of each, and return the new
+ * number of keys
+ */
+static uint32_t ph_remove_duplicates( char **keys, uint32_t n, const char *func )
+{
+    uint32_t *idx = (uint32_t *)malloc( ( n + 1 ) * sizeof(uint32_t) ) ;
+    uint32_t k = 0 ;
+    uint32_t m = 0 ;
+
+    if( idx == NULL )
+        return n ;
+
+    for( k = 0 ; k < n ; k++ )
+    {
+        idx[k] = k ;
+    }
+
+    ph_sort_keys = keys ;
+
+    qsort( idx, n, sizeof(uint32_t), ph_compare_keys ) ;
+
+    for( k = 1 ; k < n ; k++ )
+    {
+        if( strcmp( keys[ idx[k] ], keys[ idx[ k - 1 ] ] ) == 0 )
+        {
+            cap_error( "#perfect_hash %s has '%s' twice", func, keys[ idx[k] ] ) ;
+
+            keys[ idx[k] ][0] = 0 ;
+        }
+    }
+
+    for( k = 0 ; k < n ; k++ )
+    {
+        if( keys[k][0] == 0 )
+        {
+            free( keys[k] ) ;
+        }
+        else
+        {
+            keys[ m++ ] = keys[k] ;
+        }
+    }
+
+    free( idx ) ;
+
+    return m ;
+}
+
+
+int process_perfect_hash()
+{
+    int retv = 0 ;
+    int c = 0 ;
+    char *pre = NULL ;
+    char *post = NULL ;
+    char *func = NULL ;
+    char **keys = NULL ;
+    uint32_t n = 0 ;
+    uint32_t k = 0 ;
+    uint32_t seed = 0 ;
+    uint32_t nbuckets = 0 ;
+    uint32_t *disp = NULL ;
+    uint32_t *slots = NULL ;
+
+    c = readsymbol() ;
+    pre = strdup( buff ) ;
+
+    c = readsymbol() ;
+    post = strdup( buff ) ;
+
+    c = readsymbol() ;
+    func = strdup( buff ) ;
+
+    if( ( pre == NULL ) || ( post == NULL ) || ( func == NULL ) )
+    {
+        retv = -1 ;
+        goto err_exit ;
+    }
+
+    while( ( c != -1 ) && ( (char)c != macrochar ) )
+    {
+        c = readsymbol() ;
+
+        if( strlen(buff) == 0 )
+            continue ;
+
+        {
+            char **p = (char **)realloc( keys, ( n + 1 ) * sizeof(char *) ) ;
+
+            if( p == NULL )
+            {
+                retv = -1 ;
+                goto err_exit ;
+            }
+
+            keys = p ;
+            keys[n] = strdup( buff ) ;
+
+            if( keys[n] == NULL )
+            {
+                retv = -1 ;
+                goto err_exit ;
+            }
+
+            n++ ;
+        }
+    };
+
+    n = ph_remove_duplicates( keys, n, func ) ;
+
+    for( k = 0 ; k < n ; k++ )
+    {
+        fout_printf( "#define %s_%s_%s\t\t%u\n", pre, keys[k], post, k ) ;
+    }
+
+    if( n == 0 )
+    {
+        fout_printf( "static int %s( const char *str, size_t len )\n{\n"
+                        "    return -1 ;\n}\n", func ) ;
+
+        goto err_exit ;
+    }
+
+    if( ph_build( keys, n, &seed, &nbuckets, &disp, &slots ) != 0 )
+    {
+        cap_error( "cannot build #perfect_hash %s", func ) ;
+
+        goto err_exit ;
+    }
+
+    fout_printf( "\nstatic const struct {\n"
+                    "    const char *key ;\n"
+                    "    size_t len ;\n"
+                    "    int value ;\n"
+                    "    } %s_table[%u] = {\n", func, n ) ;
+
+    for( k = 0 ; k < n ; k++ )
+    {
+        fout_printf( "        { \"%s\", %u, %s_%s_%s },\n", keys[ slots[k] ],
+                        (unsigned int)strlen( keys[ slots[k] ] ), pre, keys[ slots[k] ], post ) ;
+    }
+
+    fout_printf( "    } ;\n\nstatic const unsigned long %s_disp[%u] = {", func, nbuckets ) ;
+
+    for( k = 0 ; k < nbuckets ; k++ )
+    {
+        fout_printf( "%s%s%u", ( k == 0 ) ? "" : ",", ( ( k % 8 ) == 0 ) ? "\n        " : " ", disp[k] ) ;
+    }
+
+    fout_printf( "\n    } ;\n\n"
+                    "static unsigned long %s_hash( unsigned long seed, const char *str, size_t len )\n"
+                    "{\n"
+                    "    unsigned long h = ( 2166136261u ^ ( seed * 0x9E3779B1u ) ) & 0xFFFFFFFFu ;\n"
+                    "\n"
+                    "    while( len-- > 0 )\n"
+                    "        h = ( ( h ^ (unsigned char)*str++ ) * 16777619u ) & 0xFFFFFFFFu ;\n"
+                    "\n"
+                    "    h ^= h >> 16 ;\n"
+                    "    h = ( h * 0x85EBCA6Bu ) & 0xFFFFFFFFu ;\n"
+                    "    h ^= h >> 13 ;\n"
+                    "\n"
+                    "    return h ;\n"
+                    "}\n"
+                    "\n"
+                    "static int %s( const char *str, size_t len )\n"
+                    "{\n"
+                    "    unsigned long d = %s_disp[ %s_hash( %uu, str, len ) %% %uu ] ;\n"
+                    "    unsigned long i = %s_hash( d, str, len ) %% %uu ;\n"
+                    "\n"
+                    "    if( ( %s_table[i].len == len ) && ( memcmp( %s_table[i].key, str, len ) == 0 ) )\n"
+                    "        return %s_table[i].value ;\n"
+                    "\n"
+                    "    return -1 ;\n"
+                    "}\n",
+                    func, func, func, func, seed, nbuckets, func, n, func, func, func ) ;
+
+err_exit:
+
+    for( k = 0 ; k < n ; k++ )
+    {
+        free( keys[k] ) ;
+    }
+
+    safe_free( keys ) ;
+    safe_free( disp ) ;
+    safe_free( slots ) ;
+    safe_free( pre ) ;
+    safe_free( post ) ;
+    safe_free( func ) ;
+
+    return retv ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* The names given with -D name[=value], for #capif
+ */
+struct cap_define_s {
+    char    *name ;
+    char    *value ;
+    } ;
+
+static struct cap_define_s *cap_defines = NULL ;
+static int cap_ndefines = 0 ;
+
+
+#ifndef CAP_FUZZER
+
+/* Add a -D name, the value is 1 when not given.  A name given again
+ * takes its new value, as with cc.
+ */
+static void add_cap_define( const char *arg )
+{
+    const char *eq = strchr( arg, '=' ) ;
+    size_t len = ( eq != NULL ) ? (size_t)( eq - arg ) : strlen( arg ) ;
+    struct cap_define_s *p = NULL ;
+    int k = 0 ;
+
+    for( k = 0 ; k < cap_ndefines ; k++ )
+    {
+        if( ( strlen( cap_defines[k].name ) == len ) && ( strncmp( cap_defines[k].name, arg, len ) == 0 ) )
+            break ;
+    }
+
+    if( k == cap_ndefines )
+    {
+        p = (struct cap_define_s *)realloc( cap_defines, ( cap_ndefines + 1 ) * sizeof(struct cap_define_s) ) ;
+
+        if( p == NULL )
+            return ;
+
+        cap_defines = p ;
+        cap_defines[k].name = strndup( arg, len ) ;
+        cap_defines[k].value = NULL ;
+        cap_ndefines++ ;
+    }
+
+    free( cap_defines[k].value ) ;
+
+    cap_defines[k].value = strdup( ( eq != NULL ) ? eq + 1 : "1" ) ;
+}
+
+#endif /* CAP_FUZZER */
+
+
+static const char *find_cap_define( const char *name, size_t len )
+{
+    int k = 0 ;
+
+    for( k = 0 ; k < cap_ndefines ; k++ )
+    {
+        if( ( strncmp( cap_defines[k].name, name, len ) == 0 ) && ( cap_defines[k].name[len] == 0 ) )
+            return cap_defines[k].value ;
+    }
+
+    return NULL ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* #table <name> <type> <count> [hex|dec] [cols=N] [global] <expression>
+ *
+ * Writes a C array of count entries, each the value of the expression
+ * for its index :
+ *
+ *      #table crc32_table uint32_t 256 hex iter( 8, i, ( x >> 1 ) ^ ( ( x & 1 ) ? 0xEDB88320 : 0 ) )
+ *
+ * The expression is C like, on unsigned 64 bit integers, with these
+ * names :
+ *
+ *      i               the index of the entry
+ *      n               the number of entries
+ *      x, k            inside iter(), the value so far and the step
+ *
+ *      iter( c, v, e ) starts x at v and sets it to e for each k from
+ *                      0 to c - 1, giving the last x
+ *      popcount( v )   the number of bits set in v
+ *
+ * Division by zero gives zero and shifts of 64 or more give zero, so
+ * every expression has a value.  Values are cut to the size of the
+ * type when cap knows it ( e.g. uint8_t, int ) and written as signed
+ * numbers for signed types.
+ *
+ * The expression is compiled once to a small stack machine and the
+ * entries are formatted into a buffer, so large tables are quick.
+ */
+
+#define TABLE_STACK         64
+#define TABLE_MAX_ITER      ( 1 << 20 )
+#define TABLE_MAX_COUNT     ( 1 << 24 )
+#define TABLE_OUTBUFF       65536
+
+enum table_op_e {
+    TOP_NUM, TOP_I, TOP_N, TOP_X, TOP_K,
+    TOP_NEG, TOP_NOT, TOP_LNOT, TOP_POPCOUNT,
+    TOP_ADD, TOP_SUB, TOP_MUL, TOP_DIV, TOP_MOD, TOP_SHL, TOP_SHR,
+    TOP_AND, TOP_OR, TOP_XOR, TOP_LT, TOP_LE, TOP_GT, TOP_GE,
+    TOP_EQ, TOP_NE, TOP_LAND, TOP_LOR,
+    TOP_SELECT, TOP_ITER
+    } ;
+
+struct table_op_s {
+    int         op ;
+    uint64_t    value ;     /* the number, or the length of an iter() body */
+    } ;
+
+typedef struct table_op_s   table_op_t ;
+
+struct table_expr_s {
+    const char  *p ;        /* parse position */
+    const char  *error ;
+
+    table_op_t  *code ;
+    int         ncode ;
+    int         maxcode ;
+
+    int         depth ;     /* stack depth of the code so far */
+
+    uint64_t    n ;
+    boolean_t   iter_limited ;
+
+    boolean_t   constant_only ; /* no names, for #repeat ... */
+    const char  *var ;          /* ... except its counter */
+    size_t      varlen ;
+    uint64_t    var_value ;
+
+    boolean_t   defines ;       /* names are -D values, for #capif */
+    } ;
+
+typedef struct table_expr_s table_expr_t ;
+
+
+static void table_emit( table_expr_t *te, int op, uint64_t value, int stack_change )
+{
+    table_op_t *p = NULL ;
+
+    if( te->error != NULL )
+        return ;
+
+    if( te->ncode == te->maxcode )
+    {
+        te->maxcode = ( te->maxcode == 0 ) ? 64 : te->maxcode * 2 ;
+
+        p = (table_op_t *)realloc( te->code, (size_t)te->maxcode * sizeof(table_op_t) ) ;
+
+        if( p == NULL )
+        {
+            te->error = "out of memory" ;
+            return ;
+        }
+
+        te->code = p ;
+    }
+
+    te->code[ te->ncode ].op = op ;
+    te->code[ te->ncode ].value = value ;
+    te->ncode++ ;
+
+    te->depth += stack_change ;
+
+    if( te->depth > TABLE_STACK )
+        te->error = "expression too complicated" ;
+}
+
+
+static void table_skip_space( table_expr_t *te )
+{
+    while( isspace( (unsigned char)*te->p ) )
+        te->p++ ;
+}
+
+
+/* Check for an operator at the parse position and step over it
+ */
+static boolean_t table_accept( table_expr_t *te, const char *op )
+{
+    size_t len = strlen( op ) ;
+
+    table_skip_space( te ) ;
+
+    if( strncmp( te->p, op, len ) != 0 )
+        return FALSE ;
+
+    /* do not take the start of a longer operator ( e.g. < from << )
+     */
+    if( ( len == 1 ) && ( strchr( "<>&|=", op[0] ) != NULL ) && ( te->p[1] == op[0] ) )
+        return FALSE ;
+
+    if( ( len == 1 ) && ( strchr( "<>!", op[0] ) != NULL ) && ( te->p[1] == '=' ) )
+        return FALSE ;
+
+    te->p += len ;
+
+    return TRUE ;
+}
+
+
+static void table_expect( table_expr_t *te, const char *op )
+{
+    if( ! table_accept( te, op ) && ( te->error == NULL ) )
+        te->error = ( op[0] == ')' ) ? "missing )" : ( ( op[0] == ',' ) ? "missing ," : "missing :" ) ;
+}
+
+
+static void table_parse_expr( table_expr_t *te ) ;
+
+static boolean_t repeat_number( const char *str, long long *value ) ;
+
+
+/* A name in a #capif expression : defined( name ) or defined name says
+ * whether it was given with -D, otherwise it is its value, or 0 when
+ * it was not given or its value is not a number.
+ */
+static void table_parse_define( table_expr_t *te )
+{
+    const char *name = te->p ;
+    const char *value = NULL ;
+    size_t len = 0 ;
+    boolean_t paren = FALSE ;
+    long long v = 0 ;
+
+    while( issymbolchar( (unsigned char)name[len] ) )
+        len++ ;
+
+    te->p += len ;
+
+    if( ( len == 7 ) && ( strncmp( name, "defined", 7 ) == 0 ) )
+    {
+        paren = table_accept( te, "(" ) ;
+
+        table_skip_space( te ) ;
+
+        name = te->p ;
+
+        for( len = 0 ; issymbolchar( (unsigned char)name[len] ) ; len++ )
+            ;
+
+        if( len == 0 )
+        {
+            if( te->error == NULL )
+                te->error = "defined needs a name" ;
+
+            return ;
+        }
+
+        te->p += len ;
+
+        if( paren )
+            table_expect( te, ")" ) ;
+
+        table_emit( te, TOP_NUM, ( find_cap_define( name, len ) != NULL ), 1 ) ;
+
+        return ;
+    }
+
+    value = find_cap_define( name, len ) ;
+
+    if( ( value == NULL ) || ! repeat_number( value, &v ) )
+        v = 0 ;
+
+    table_emit( te, TOP_NUM, (uint64_t)v, 1 ) ;
+}
+
+
+static void table_parse_primary( table_expr_t *te )
+{
+    char name[16] ;
+    int k = 0 ;
+    int body = 0 ;
+
+    table_skip_space( te ) ;
+
+    if( te->error != NULL )
+        return ;
+
+    if( *te->p == '(' )
+    {
+        te->p++ ;
+
+        table_parse_expr( te ) ;
+        table_expect( te, ")" ) ;
+
+        return ;
+    }
+
+    if( isdigit( (unsigned char)*te->p ) )
+    {
+        char *end = NULL ;
+        uint64_t v = 0 ;
+
+        if( ( te->p[0] == '0' ) && ( ( te->p[1] == 'b' ) || ( te->p[1] == 'B' ) ) )
+        {
+            v = strtoull( te->p + 2, &end, 2 ) ;
+        }
+        else
+        {
+            v = strtoull( te->p, &end, 0 ) ;
+        }
+
+        te->p = end ;
+
+        /* allow C suffixes
+         */
+        while( ( *te->p == 'u' ) || ( *te->p == 'U' ) || ( *te->p == 'l' ) || ( *te->p == 'L' ) )
+            te->p++ ;
+
+        table_emit( te, TOP_NUM, v, 1 ) ;
+
+        return ;
+    }
+
+    if( ( te->p[0] == '\'' ) && ( te->p[1] != 0 ) && ( te->p[1] != '\\' ) && ( te->p[2] == '\'' ) )
+    {
+        table_emit( te, TOP_NUM, (unsigned char)te->p[1], 1 ) ;
+
+        te->p += 3 ;
+
+        return ;
+    }
+
+    if( te->defines && ( isalpha( (unsigned char)*te->p ) || ( *te->p == '_' ) ) )
+    {
+        table_parse_define( te ) ;
+
+        return ;
+    }
+
+    if( ( te->var != NULL ) && ( strncmp( te->p, te->var, te->varlen ) == 0 ) && ! issymbolchar( te->p[ te->varlen ] ) )
+    {
+        te->p += te->varlen ;
+
+        table_emit( te, TOP_NUM, te->var_value, 1 ) ;
+
+        return ;
+    }
+
+    for( k = 0 ; ( k < 15 ) && ( isalnum( (unsigned char)*te->p ) || ( *te->p == '_' ) ) ; k++ )
+    {
+        name[k] = *te->p++ ;
+    }
+
+    name[k] = 0 ;
+
+    if( te->constant_only && ( name[0] != 0 ) && ( strcmp( name, "popcount" ) != 0 ) )
+    {
+        if( te->error == NULL )
+            te->error = "unknown name" ;
+    }
+    else if( strcmp( name, "i" ) == 0 )
+    {
+        table_emit( te, TOP_I, 0, 1 ) ;
+    }
+    else if( strcmp( name, "n" ) == 0 )
+    {
+        table_emit( te, TOP_N, 0, 1 ) ;
+    }
+    else if( strcmp( name, "x" ) == 0 )
+    {
+        table_emit( te, TOP_X, 0, 1 ) ;
+    }
+    else if( strcmp( name, "k" ) == 0 )
+    {
+        table_emit( te, TOP_K, 0, 1 ) ;
+    }
+    else if( strcmp( name, "popcount" ) == 0 )
+    {
+        table_expect( te, "(" ) ;
+        table_parse_expr( te ) ;
+        table_expect( te, ")" ) ;
+
+        table_emit( te, TOP_POPCOUNT, 0, 0 ) ;
+    }
+    else if( strcmp( name, "iter" ) == 0 )
+    {
+        /* count and start are pushed, then the iter op is followed
+         * by its body, which runs with a stack of its own
+         */
+        table_expect( te, "(" ) ;
+        table_parse_expr( te ) ;
+        table_expect( te, "," ) ;
+        table_parse_expr( te ) ;
+        table_expect( te, "," ) ;
+
+        table_emit( te, TOP_ITER, 0, -1 ) ;
+
+        body = te->ncode ;
+
+        table_parse_expr( te ) ;
+        table_expect( te, ")" ) ;
+
+        if( te->error == NULL )
+        {
+            te->code[ body - 1 ].value = (uint64_t)( te->ncode - body ) ;
+        }
+
+        te->depth-- ;
+    }
+    else if( te->error == NULL )
+    {
+        te->error = ( name[0] == 0 ) ? "expected a value" : "unknown name" ;
+    }
+}
+
+
+static void table_parse_unary( table_expr_t *te )
+{
+    if( table_accept( te, "-" ) )
+    {
+        table_parse_unary( te ) ;
+        table_emit( te, TOP_NEG, 0, 0 ) ;
+    }
+    else if( table_accept( te, "~" ) )
+    {
+        table_parse_unary( te ) ;
+        table_emit( te, TOP_NOT, 0, 0 ) ;
+    }
+    else if( table_accept( te, "!" ) )
+    {
+        table_parse_unary( te ) ;
+        table_emit( te, TOP_LNOT, 0, 0 ) ;
+    }
+    else if( table_accept( te, "+" ) )
+    {
+        table_parse_unary( te ) ;
+    }
+    else
+    {
+        table_parse_primary( te ) ;
+    }
+}
+
+
+/* Binary operators, lowest precedence first
+ */
+struct table_binop_s {
+    const char  *op ;
+    int         code ;
+    int         level ;
+    } ;
+
+static const struct table_binop_s table_binops[] = {
+        { "||", TOP_LOR, 0 },
+        { "&&", TOP_LAND, 1 },
+        { "|", TOP_OR, 2 },
+        { "^", TOP_XOR, 3 },
+        { "&", TOP_AND, 4 },
+        { "==", TOP_EQ, 5 }, { "!=", TOP_NE, 5 },
+        { "<=", TOP_LE, 6 }, { ">=", TOP_GE, 6 }, { "<", TOP_LT, 6 }, { ">", TOP_GT, 6 },
+        { "<<", TOP_SHL, 7 }, { ">>", TOP_SHR, 7 },
+        { "+", TOP_ADD, 8 }, { "-", TOP_SUB, 8 },
+        { "*", TOP_MUL, 9 }, { "/", TOP_DIV, 9 }, { "%", TOP_MOD, 9 },
+        { NULL, 0, 0 }
+    } ;
+
+#define TABLE_LEVELS    10
+
+
+static void table_parse_binary( table_expr_t *te, int level )
+{
+    int k = 0 ;
+
+    if( level == TABLE_LEVELS )
+    {
+        table_parse_unary( te ) ;
+        return ;
+    }
+
+    table_parse_binary( te, level + 1 ) ;
+
+    while( te->error == NULL )
+    {
+        for( k = 0 ; table_binops[k].op != NULL ; k++ )
+        {
+            if( ( table_binops[k].level == level ) && table_accept( te, table_binops[k].op ) )
+                break ;
+        }
+
+        if( table_binops[k].op == NULL )
+            break ;
+
+        table_parse_binary( te, level + 1 ) ;
+        table_emit( te, table_binops[k].code, 0, -1 ) ;
+    };
+}
+
+
+static void table_parse_expr( table_expr_t *te )
+{
+    table_parse_binary( te, 0 ) ;
+
+    if( table_accept( te, "?" ) )
+    {
+        table_parse_expr( te ) ;
+        table_expect( te, ":" ) ;
+        table_parse_expr( te ) ;
+
+        table_emit( te, TOP_SELECT, 0, -2 ) ;
+    }
+}
+
+
+static uint64_t table_eval( table_expr_t *te, int start, int end, uint64_t i, uint64_t x, uint64_t k )
+{
+    uint64_t st[ TABLE_STACK + 1 ] ;
+    uint64_t a = 0 ;
+    uint64_t b = 0 ;
+    uint64_t j = 0 ;
+    int sp = 0 ;
+    int pc = 0 ;
+    int len = 0 ;
+
+    for( pc = start ; pc < end ; pc++ )
+    {
+        switch( te->code[pc].op )
+        {
+            case TOP_NUM :  st[ sp++ ] = te->code[pc].value ;   continue ;
+            case TOP_I :    st[ sp++ ] = i ;                    continue ;
+            case TOP_N :    st[ sp++ ] = te->n ;                continue ;
+            case TOP_X :    st[ sp++ ] = x ;                    continue ;
+            case TOP_K :    st[ sp++ ] = k ;                    continue ;
+
+            case TOP_NEG :  st[ sp - 1 ] = - st[ sp - 1 ] ;                     continue ;
+            case TOP_NOT :  st[ sp - 1 ] = ~ st[ sp - 1 ] ;                     continue ;
+            case TOP_LNOT : st[ sp - 1 ] = ! st[ sp - 1 ] ;                     continue ;
+            case TOP_POPCOUNT : st[ sp - 1 ] = __builtin_popcountll( st[ sp - 1 ] ) ;   continue ;
+
+            case TOP_SELECT :
+                sp -= 2 ;
+                st[ sp - 1 ] = st[ sp - 1 ] ? st[ sp ] : st[ sp + 1 ] ;
+                continue ;
+
+            case TOP_ITER :
+                len = (int)te->code[pc].value ;
+                a = st[ --sp ] ;
+                b = st[ sp - 1 ] ;
+
+                if( b > TABLE_MAX_ITER )
+                {
+                    b = TABLE_MAX_ITER ;
+                    te->iter_limited = TRUE ;
+                }
+
+                for( j = 0 ; j < b ; j++ )
+                {
+                    a = table_eval( te, pc + 1, pc + 1 + len, i, a, j ) ;
+                }
+
+                st[ sp - 1 ] = a ;
+                pc += len ;
+                continue ;
+        }
+
+        /* the rest are binary
+         */
+        b = st[ --sp ] ;
+        a = st[ sp - 1 ] ;
+
+        switch( te->code[pc].op )
+        {
+            case TOP_ADD :  a = a + b ;     break ;
+            case TOP_SUB :  a = a - b ;     break ;
+            case TOP_MUL :  a = a * b ;     break ;
+            case TOP_DIV :  a = ( b == 0 ) ? 0 : a / b ;    break ;
+            case TOP_MOD :  a = ( b == 0 ) ? 0 : a % b ;    break ;
+            case TOP_SHL :  a = ( b >= 64 ) ? 0 : a << b ;  break ;
+            case TOP_SHR :  a = ( b >= 64 ) ? 0 : a >> b ;  break ;
+            case TOP_AND :  a = a & b ;     break ;
+            case TOP_OR :   a = a | b ;     break ;
+            case TOP_XOR :  a = a ^ b ;     break ;
+            case TOP_LT :   a = ( a < b ) ;     break ;
+            case TOP_LE :   a = ( a <= b ) ;    break ;
+            case TOP_GT :   a = ( a > b ) ;     break ;
+            case TOP_GE :   a = ( a >= b ) ;    break ;
+            case TOP_EQ :   a = ( a == b ) ;    break ;
+            case TOP_NE :   a = ( a != b ) ;    break ;
+            case TOP_LAND : a = ( a && b ) ;    break ;
+            case TOP_LOR :  a = ( a || b ) ;    break ;
+        }
+
+        st[ sp - 1 ] = a ;
+    }
+
+    return ( sp > 0 ) ? st[ sp - 1 ] : 0 ;
+}
+
+
+/* The types cap knows the size of
+ */
+struct table_type_s {
+    const char  *name ;
+    int         bits ;
+    boolean_t   is_signed ;
+    } ;
+
+static const struct table_type_s table_types[] = {
+        { "uint8_t", 8, FALSE }, { "int8_t", 8, TRUE },
+        { "uint16_t", 16, FALSE }, { "int16_t", 16, TRUE },
+        { "uint32_t", 32, FALSE }, { "int32_t", 32, TRUE },
+        { "uint64_t", 64, FALSE }, { "int64_t", 64, TRUE },
+        { "char", 8, TRUE }, { "short", 16, TRUE },
+        { "int", 32, TRUE }, { "unsigned", 32, FALSE },
+        { "size_t", 64, FALSE }, { "boolean_t", 32, TRUE },
+        { NULL, 0, FALSE }
+    } ;
+
+
+/* Format a value into p, returning the number of characters
+ */
+static int table_format( char *p, uint64_t v, boolean_t hex, int bits, boolean_t is_signed )
+{
+    static const char digits[] = "0123456789ABCDEF" ;
+    char tmp[24] ;
+    int len = 0 ;
+    int width = 0 ;
+    int k = 0 ;
+
+    if( bits < 64 )
+    {
+        v &= ( (uint64_t)1 << bits ) - 1 ;
+    }
+
+    if( hex )
+    {
+        width = ( bits + 3 ) / 4 ;
+
+        do
+        {
+            tmp[ len++ ] = digits[ v & 0xF ] ;
+            v >>= 4 ;
+        }
+        while( ( v != 0 ) || ( len < width ) ) ;
+
+        p[ k++ ] = '0' ;
+        p[ k++ ] = 'x' ;
+    }
+    else
+    {
+        if( is_signed && ( bits > 0 ) && ( v & ( (uint64_t)1 << ( bits - 1 ) ) ) )
+        {
+            /* sign extend and write the magnitude
+             */
+            if( bits < 64 )
+                v |= ~( ( (uint64_t)1 << bits ) - 1 ) ;
+
+            v = - v ;
+
+            p[ k++ ] = '-' ;
+        }
+
+        do
+        {
+            tmp[ len++ ] = (char)( '0' + ( v % 10 ) ) ;
+            v /= 10 ;
+        }
+        while( v != 0 ) ;
+    }
+
+    while( len > 0 )
+    {
+        p[ k++ ] = tmp[ --len ] ;
+    }
+
+    return k ;
+}
+
+
+int process_table()
+{
+    int retv = 0 ;
+    char *p = NULL ;
+    char *name = NULL ;
+    char *type = NULL ;
+    char *end = NULL ;
+    uint64_t count = 0 ;
+    uint64_t i = 0 ;
+    boolean_t hex = FALSE ;
+    boolean_t global = FALSE ;
+    int cols = 8 ;
+    int bits = 64 ;
+    boolean_t is_signed = FALSE ;
+    int k = 0 ;
+    char *out = NULL ;
+    size_t used = 0 ;
+    table_expr_t te ;
+
+    memset( &te, 0, sizeof(te) ) ;
+
+    retv = read_to_eol() ;
+
+    if( retv < 0 )
+        return retv ;
+
+    p = buff ;
+
+    /* name, type and count
+     */
+    name = strtok_r( p, " \t", &p ) ;
+    type = strtok_r( NULL, " \t", &p ) ;
+    end = strtok_r( NULL, " \t", &p ) ;
+
+    if( ( name == NULL ) || ( type == NULL ) || ( end == NULL ) )
+    {
+        cap_error( "#table needs a name, a type, a count and an expression" ) ;
+
+        return 0 ;
+    }
+
+    /* a zero length array is not C, and strtoull() would take a
+     * negative count as a huge one
+     */
+    errno = 0 ;
+
+    count = ( *end == '-' ) ? 0 : strtoull( end, &end, 0 ) ;
+
+    if( ( *end != 0 ) || ( count == 0 ) || ( errno == ERANGE ) )
+    {
+        cap_error( "#table %s has a bad count", name ) ;
+
+        return 0 ;
+    }
+
+    if( count > TABLE_MAX_COUNT )
+    {
+        cap_error( "#table %s would have %llu entries, more than %d", name, (unsigned long long)count, TABLE_MAX_COUNT ) ;
+
+        return 0 ;
+    }
+
+    /* then any options
+     */
+    while( TRUE )
+    {
+        while( iswhitespace( *p ) )
+            p++ ;
+
+        if( ( strncmp( p, "hex", 3 ) == 0 ) && isspace( (unsigned char)p[3] ) )
+        {
+            hex = TRUE ;
+            p += 3 ;
+        }
+        else if( ( strncmp( p, "dec", 3 ) == 0 ) && isspace( (unsigned char)p[3] ) )
+        {
+            hex = FALSE ;
+            p += 3 ;
+        }
+        else if( ( strncmp( p, "global", 6 ) == 0 ) && isspace( (unsigned char)p[6] ) )
+        {
+            global = TRUE ;
+            p += 6 ;
+        }
+        else if( strncmp( p, "cols=", 5 ) == 0 )
+        {
+            cols = (int)strtol( p + 5, &p, 10 ) ;
+
+            if( cols < 1 )
+                cols = 1 ;
+        }
+        else
+        {
+            break ;
+        }
+    };
+
+    for( k = 0 ; table_types[k].name != NULL ; k++ )
+    {
+        if( strcmp( table_types[k].name, type ) == 0 )
+        {
+            bits = table_types[k].bits ;
+            is_signed = table_types[k].is_signed ;
+        }
+    }
+
+    te.p = p ;
+    te.n = count ;
+
+    table_parse_expr( &te ) ;
+
+    table_skip_space( &te ) ;
+
+    if( ( te.error == NULL ) && ( *te.p != 0 ) )
+        te.error = "unexpected text" ;
+
+    if( te.error != NULL )
+    {
+        cap_error( "#table %s : %s at '%.20s'", name, te.error, te.p ) ;
+
+        goto err_exit ;
+    }
+
+    out = (char *)malloc( TABLE_OUTBUFF ) ;
+
+    if( out == NULL )
+    {
+        retv = -1 ;
+        goto err_exit ;
+    }
+
+    fout_printf( "%sconst %s %s[%llu] = {", global ? "" : "static ", type, name, (unsigned long long)count ) ;
+
+    for( i = 0 ; i < count ; i++ )
+    {
+        if( used > TABLE_OUTBUFF - 64 )
+        {
+            fout_write( out, used ) ;
+            used = 0 ;
+        }
+
+        if( ( i % (uint64_t)cols ) == 0 )
+        {
+            memcpy( out + used, "\n        ", 9 ) ;
+            used += 9 ;
+        }
+        else
+        {
+            out[ used++ ] = ' ' ;
+        }
+
+        used += table_format( out + used, table_eval( &te, 0, te.ncode, i, 0, 0 ), hex, bits, is_signed ) ;
+
+        if( i + 1 < count )
+        {
+            out[ used++ ] = ',' ;
+        }
+    }
+
+    fout_write( out, used ) ;
+
+    fout_printf( "\n    } ;\n" ) ;
+
+    if( te.iter_limited )
+    {
+        cap_error( "#table %s : iter() count limited to %d", name, TABLE_MAX_ITER ) ;
+    }
+
+err_exit:
+
+    safe_free( out ) ;
+    safe_free( te.code ) ;
+
+    return retv ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* Send a command to the shell to process the following
+ * block of text
+ *
+ * The shell command is everything up to EOL following the
+ * #command directive
+ *
+ * Input to the command is send via a pipe.  Output from
+ * the command is recieved via another pipe.
+ * The command recieves input on it's stdin and sends
+ * output to stdout.
+ *
+ * The block is read first, then written to the command while its
+ * output is read, so neither side can block the other, and then the
+ * parent waits for the child to die.
+ */
+
+/* #command can be turned off when cap is run over untrusted input
+ */
+static boolean_t allow_commands = TRUE ;
+
+/* Limits on a #command child.  The defaults come from the --command-*
+ * options and a block can set its own before the command :
+ *
+ *      #command timeout=10 memory=512M cpu=5 max-output=1M gen
+ *
+ * 0 is no limit.  After the timeout the child, and anything it has
+ * started, is sent SIGTERM and a second later SIGKILL.
+ */
+struct command_limits_s {
+    double              timeout ;       /* seconds of wall clock time */
+    unsigned long long  memory ;        /* RLIMIT_AS in bytes */
+    unsigned long long  cpu ;           /* RLIMIT_CPU in seconds */
+    unsigned long long  max_output ;    /* bytes */
+    } ;
+
+typedef struct command_limits_s     command_limits_t ;
+
+static command_limits_t command_limits = { 0, 0, 0, 0 } ;
+
+#define COMMAND_KILL_DELAY  1.0
+
+/* why a command was stopped
+ */
+#define COMMAND_RAN         0
+#define COMMAND_TIMED_OUT   1
+#define COMMAND_TOO_MUCH    2
+
+/* The exit status of the first #command that failed, which cap exits
+ * with.  128 + the signal for one killed, and 124 for a timeout as
+ * with timeout(1).
+ */
+static int command_exit_status = 0 ;
+
+static double time_now() ;
+
+static void repeat_process_text( char *text, size_t len, unsigned int line ) ;
+
+static void expand_process_text( char *text, size_t len, unsigned int line, const char *keyword ) ;
+
+/* #command-expand processes what its command writes, which may hold
+ * another #command-expand
+ */
+#define COMMAND_EXPAND_MAX_DEPTH    16
+
+static int command_expand_depth = 0 ;
+
+
+/* Read a size with an optional K, M or G
+ */
+static boolean_t parse_size( const char *str, unsigned long long *value )
+{
+    char *end = NULL ;
+
+    if( ! isdigit( (unsigned char)*str ) )
+        return FALSE ;
+
+    *value = strtoull( str, &end, 0 ) ;
+
+    switch( toupper( (unsigned char)*end ) )
+    {
+        case 'G' :  *value <<= 10 ;     /* fall through */
+        case 'M' :  *value <<= 10 ;     /* fall through */
+        case 'K' :  *value <<= 10 ;     end++ ;     break ;
+    }
+
+    return ( *end == 0 ) ;
+}
+
+
+/* Set a limit from a word like timeout=10.  Returns 1 if it was one,
+ * 0 if it is not a limit and -1 if its value is wrong.
+ */
+static int command_limit_word( command_limits_t *cl, const char *word )
+{
+    char *end = NULL ;
+
+    if( strncmp( word, "timeout=", 8 ) == 0 )
+    {
+        cl->timeout = strtod( word + 8, &end ) ;
+
+        return ( ( end != word + 8 ) && ( *end == 0 ) && ( cl->timeout >= 0 ) ) ? 1 : -1 ;
+    }
+
+    if( strncmp( word, "memory=", 7 ) == 0 )
+        return parse_size( word + 7, &cl->memory ) ? 1 : -1 ;
+
+    if( strncmp( word, "cpu=", 4 ) == 0 )
+        return parse_size( word + 4, &cl->cpu ) ? 1 : -1 ;
+
+    if( strncmp( word, "max-output=", 11 ) == 0 )
+        return parse_size( word + 11, &cl->max_output ) ? 1 : -1 ;
+
+    return 0 ;
+}
+
+
+/* The child side : take the pipes as stdin and stdout, set the limits
+ * and start the command
+ */
+static void command_child( const char *command, int in, int out, command_limits_t *cl )
+{
+    struct rlimit rl ;
+
+    /* its own process group, so whatever it starts can be killed too
+     */
+    setpgid( 0, 0 ) ;
+
+    dup2( in, 0 ) ;
+    dup2( out, 1 ) ;
+
+    if( cl->memory > 0 )
+    {
+        rl.rlim_cur = rl.rlim_max = (rlim_t)cl->memory ;
+        setrlimit( RLIMIT_AS, &rl ) ;
+    }
+
+    if( cl->cpu > 0 )
+    {
+        /* SIGXCPU at the limit, and SIGKILL a second later
+         */
+        rl.rlim_cur = (rlim_t)cl->cpu ;
+        rl.rlim_max = (rlim_t)cl->cpu + 1 ;
+        setrlimit( RLIMIT_CPU, &rl ) ;
+    }
+
+    signal( SIGPIPE, SIG_DFL ) ;
+
+    execlp( command, command, NULL ) ;
+
+    fprintf( stderr, "cap: cannot run %s : %s\n", command, strerror( errno ) ) ;
+
+    _exit( 127 ) ;
+}
+
+
+/* Write the block to the child and copy what it writes to the output,
+ * or to capture, until it closes its stdout.  Returns why it stopped
+ * early, if it did.
+ */
+static int command_talk( int in, int out, const char *input, size_t inlen, command_limits_t *cl, double deadline,
+                         FILE *capture )
+{
+    struct pollfd pfd[2] ;
+    char buf[ 65536 ] ;
+    size_t inpos = 0 ;
+    unsigned long long outlen = 0 ;
+    ssize_t n = 0 ;
+    int wait_ms = -1 ;
+    int r = 0 ;
+
+    if( inlen == 0 )
+    {
+        close( in ) ;
+        in = -1 ;
+    }
+
+    while( TRUE )
+    {
+        pfd[0].fd = out ;
+        pfd[0].events = POLLIN ;
+        pfd[1].fd = in ;
+        pfd[1].events = POLLOUT ;
+
+        if( deadline > 0 )
+        {
+            wait_ms = (int)( ( deadline - time_now() ) * 1000.0 ) + 1 ;
+
+            if( wait_ms <= 0 )
+                return COMMAND_TIMED_OUT ;
+        }
+
+        r = poll( pfd, ( in >= 0 ) ? 2 : 1, wait_ms ) ;
+
+        if( ( r < 0 ) && ( errno == EINTR ) )
+            continue ;
+
+        if( r < 0 )
+            break ;
+
+        if( r == 0 )
+            return COMMAND_TIMED_OUT ;
+
+        if( pfd[0].revents != 0 )
+        {
+            n = read( out, buf, sizeof(buf) ) ;
+
+            if( ( n < 0 ) && ( errno == EINTR ) )
+                continue ;
+
+            if( n <= 0 )
+                break ;
+
+            if( ( cl->max_output > 0 ) && ( outlen + (unsigned long long)n > cl->max_output ) )
+                return COMMAND_TOO_MUCH ;
+
+            if( capture != NULL )
+            {
+                fwrite( buf, 1, (size_t)n, capture ) ;
+            }
+            else
+            {
+                fout_write( buf, (size_t)n ) ;
+            }
+
+            outlen += (unsigned long long)n ;
+        }
+
+        if( ( in >= 0 ) && ( pfd[1].revents != 0 ) )
+        {
+            n = 0 ;
+
+            if( pfd[1].revents & POLLOUT )
+            {
+                n = write( in, input + inpos, inlen - inpos ) ;
+
+                if( n > 0 )
+                    inpos += (size_t)n ;
+            }
+
+            /* all written, or the child does not want the rest
+             */
+            if( ( inpos == inlen ) || ! ( pfd[1].revents & POLLOUT ) ||
+                ( ( n < 0 ) && ( errno != EINTR ) && ( errno != EAGAIN ) ) )
+            {
+                close( in ) ;
+                in = -1 ;
+            }
+        }
+    };
+
+    if( in >= 0 )
+        close( in ) ;
+
+    return COMMAND_RAN ;
+}
+
+
+/* Wait for the child, killing it if it has gone past a limit or goes
+ * past the deadline.  Returns its wait() status.
+ */
+static int command_wait( pid_t pid, int *breachp, double deadline )
+{
+    struct timespec nap = { 0, 1000000 } ;
+    double kill_at = 0 ;
+    int status = 0 ;
+
+    if( *breachp != COMMAND_RAN )
+    {
+        kill( -pid, SIGTERM ) ;
+        kill_at = time_now() + COMMAND_KILL_DELAY ;
+    }
+
+    if( ( *breachp == COMMAND_RAN ) && ( deadline == 0 ) )
+    {
+        while( ( waitpid( pid, &status, 0 ) < 0 ) && ( errno == EINTR ) )
+            ;
+
+        return status ;
+    }
+
+    while( waitpid( pid, &status, WNOHANG ) == 0 )
+    {
+        if( ( *breachp == COMMAND_RAN ) && ( time_now() >= deadline ) )
+        {
+            *breachp = COMMAND_TIMED_OUT ;
+
+            kill( -pid, SIGTERM ) ;
+            kill_at = time_now() + COMMAND_KILL_DELAY ;
+        }
+        else if( ( kill_at > 0 ) && ( time_now() >= kill_at ) )
+        {
+            kill( -pid, SIGKILL ) ;
+            kill_at = 0 ;
+        }
+
+        nanosleep( &nap, NULL ) ;
+
+        if( nap.tv_nsec < 20000000 )
+            nap.tv_nsec *= 2 ;
+    };
+
+    /* and anything it left behind
+     */
+    if( *breachp != COMMAND_RAN )
+        kill( -pid, SIGKILL ) ;
+
+    return status ;
+}
+
+
+/* Run a command over the text of its block, writing its output, or
+ * keeping it in capture.  Problems are reported against the line of
+ * the #command.
+ */
+static void command_run( const char *command, const char *input, size_t inlen, command_limits_t *cl, unsigned int line,
+                         FILE *capture )
+{
+    int inpipe[2] = { -1, -1 } ;
+    int outpipe[2] = { -1, -1 } ;
+    int breach = COMMAND_RAN ;
+    double deadline = 0 ;
+    void (*old_sigpipe)( int ) = NULL ;
+    pid_t pid = 0 ;
+    int status = 0 ;
+    int exit_status = 0 ;
+
+    if( ( pipe2( inpipe, O_CLOEXEC ) < 0 ) || ( pipe2( outpipe, O_CLOEXEC ) < 0 ) )
+    {
+        cap_error_at( line, "cannot run #command '%s' : %s", command, strerror( errno ) ) ;
+
+        goto err_exit ;
+    }
+
+    pid = fork() ;
+
+    if( pid < 0 )
+    {
+        cap_error_at( line, "cannot run #command '%s' : %s", command, strerror( errno ) ) ;
+
+        goto err_exit ;
+    }
+
+    if( pid == 0 )
+    {
+        command_child( command, inpipe[0], outpipe[1], cl ) ;
+    }
+
+    /* set here as well, so it is done before any kill()
+     */
+    setpgid( pid, pid ) ;
+
+    close( inpipe[0] ) ;
+    close( outpipe[1] ) ;
+    inpipe[0] = outpipe[1] = -1 ;
+
+    fcntl( inpipe[1], F_SETFL, O_NONBLOCK ) ;
+
+    if( cl->timeout > 0 )
+        deadline = time_now() + cl->timeout ;
+
+    /* a child that stops reading must not kill cap
+     */
+    old_sigpipe = signal( SIGPIPE, SIG_IGN ) ;
+
+    breach = command_talk( inpipe[1], outpipe[0], input, inlen, cl, deadline, capture ) ;
+
+    signal( SIGPIPE, old_sigpipe ) ;
+
+    inpipe[1] = -1 ;
+
+    close( outpipe[0] ) ;
+    outpipe[0] = -1 ;
+
+    status = command_wait( pid, &breach, deadline ) ;
+
+    if( breach == COMMAND_TIMED_OUT )
+    {
+        cap_error_at( line, "#command '%s' timed out after %g seconds", command, cl->timeout ) ;
+
+        exit_status = 124 ;
+    }
+    else if( breach == COMMAND_TOO_MUCH )
+    {
+        cap_error_at( line, "#command '%s' wrote more than %llu bytes", command, cl->max_output ) ;
+
+        exit_status = 1 ;
+    }
+    else if( WIFSIGNALED( status ) && ( WTERMSIG( status ) == SIGXCPU ) )
+    {
+        cap_error_at( line, "#command '%s' used more than %llu seconds of CPU", command, cl->cpu ) ;
+
+        exit_status = 128 + SIGXCPU ;
+    }
+    else if( WIFSIGNALED( status ) )
+    {
+        cap_error_at( line, "#command '%s' was killed by signal %d ( %s )%s", command, WTERMSIG( status ),
+                        strsignal( WTERMSIG( status ) ), ( cl->memory > 0 ) ? ", maybe at its memory limit" : "" ) ;
+
+        exit_status = 128 + WTERMSIG( status ) ;
+    }
+    else if( WIFEXITED( status ) && ( WEXITSTATUS( status ) != 0 ) )
+    {
+        cap_error_at( line, "#command '%s' failed with exit status %d", command, WEXITSTATUS( status ) ) ;
+
+        exit_status = WEXITSTATUS( status ) ;
+    }
+
+    if( command_exit_status == 0 )
+        command_exit_status = exit_status ;
+
+err_exit:
+
+    if( inpipe[0] >= 0 )    close( inpipe[0] ) ;
+    if( inpipe[1] >= 0 )    close( inpipe[1] ) ;
+    if( outpipe[0] >= 0 )   close( outpipe[0] ) ;
+    if( outpipe[1] >= 0 )   close( outpipe[1] ) ;
+}
+
+
+/* #command, or #command-expand where expand is set, which processes the
+ * command's output as if it had been in the input in place of the block
+ */
+int process_command( boolean_t expand )
+{
+    int retv = 0 ;
+    int c = 0 ;
+    int r = 0 ;
+
+    unsigned int line = linenum ;
+    command_limits_t limits = command_limits ;
+
+    char *command = NULL ;
+    char *p = NULL ;
+
+    boolean_t bad_limit = FALSE ;
+
+    FILE *fs = NULL ;
+    char *input = NULL ;
+    size_t inlen = 0 ;
+
+    FILE *capture = NULL ;
+    char *output = NULL ;
+    size_t outlen = 0 ;
+
+
+    /* get the command
+     */
+    retv = read_to_eol() ;
+
+    if( retv < 0 )
+        return retv ;
+
+    /* and the limits before it
+     */
+    command = buff ;
+
+    while( TRUE )
+    {
+        char space = 0 ;
+
+        while( isspace( (unsigned char)*command ) )
+            command++ ;
+
+        for( p = command ; ( *p != 0 ) && ! isspace( (unsigned char)*p ) ; p++ )
+            ;
+
+        space = *p ;
+
+        if( *p != 0 )
+            *p++ = 0 ;
+
+        r = command_limit_word( &limits, command ) ;
+
+        /* not a limit, so the command starts here
+         */
+        if( r == 0 )
+        {
+            if( space != 0 )
+                p[-1] = space ;
+
+            break ;
+        }
+
+        if( r < 0 )
+        {
+            cap_error_at( line, "#command has a bad limit '%s'", command ) ;
+
+            bad_limit = TRUE ;
+        }
+
+        command = p ;
+    };
+
+    /* read the block, to be given to the command
+     */
+    fs = open_memstream( &input, &inlen ) ;
+
+    c = nextchar() ;
+
+    while( c != -1 )
+    {
+        if( c == (int)macrochar )
+        {
+            c = nextchar() ;
+
+            if( c == (int)'\n' )
+                break ;
+
+            if( fs != NULL )
+                fputc( (int)macrochar, fs ) ;
+
+            continue ;
+        }
+
+        if( fs != NULL )
+            fputc( c, fs ) ;
+
+        c = nextchar() ;
+    };
+
+    if( fs != NULL )
+        fclose( fs ) ;
+
+    if( ! allow_commands || bad_limit )
+    {
+        /* processing untrusted input ( e.g. when fuzzing ), or a
+         * mistake, so the block is swallowed without starting anything
+         */
+    }
+    else if( ( *command == 0 ) || ( fs == NULL ) )
+    {
+        cap_error_at( line, ( fs == NULL ) ? "no memory for the #command block" : "#command needs a command" ) ;
+    }
+    else if( ! expand )
+    {
+        command_run( command, input, inlen, &limits, line, NULL ) ;
+    }
+    else if( command_expand_depth >= COMMAND_EXPAND_MAX_DEPTH )
+    {
+        cap_error_at( line, "#command-expand nested more than %d deep at '%s'", COMMAND_EXPAND_MAX_DEPTH, command ) ;
+    }
+    else if( ( capture = open_memstream( &output, &outlen ) ) == NULL )
+    {
+        cap_error_at( line, "no memory for the #command-expand output" ) ;
+    }
+    else
+    {
+        command_run( command, input, inlen, &limits, line, capture ) ;
+
+        fclose( capture ) ;
+
+        /* the output, even of a command that failed, goes through the
+         * engine
+         */
+        command_expand_depth++ ;
+
+        expand_process_text( output, outlen, line, "command-expand" ) ;
+
+        command_expand_depth-- ;
+    }
+
+    safe_free( input ) ;
+    safe_free( output ) ;
+
+    return 0 ;
+}
+
+
+/* #command-deps <file> ...
+ *
+ * Names files a #command block reads, so they go in the dependency
+ * output.  Nothing is written to the output.  A name with spaces is
+ * given in double quotes, where \" and \\ stand for " and \.
+ */
+int process_command_deps()
+{
+    int retv = 0 ;
+    char *p = NULL ;
+    char *q = NULL ;
+    char *w = NULL ;
+
+    retv = read_to_eol() ;
+
+    if( retv < 0 )
+        return retv ;
+
+    p = buff ;
+
+    while( *p != 0 )
+    {
+        while( isspace( (unsigned char)*p ) )
+            p++ ;
+
+        if( *p == 0 )
+            break ;
+
+        if( *p == '"' )
+        {
+            /* unquote in place
+             */
+            q = ++p ;
+            w = p ;
+
+            while( ( *q != 0 ) && ( *q != '"' ) )
+            {
+                if( ( *q == '\\' ) && ( ( q[1] == '"' ) || ( q[1] == '\\' ) ) )
+                    q++ ;
+
+                *w++ = *q++ ;
+            };
+
+            if( *q == 0 )
+            {
+                cap_error( "#command-deps name is not terminated" ) ;
+
+                return 0 ;
+            }
+
+            *w = 0 ;
+            q++ ;
+        }
+        else
+        {
+            q = p ;
+
+            while( ( *q != 0 ) && !isspace( (unsigned char)*q ) )
+                q++ ;
+
+            if( *q != 0 )
+                *q++ = 0 ;
+        }
+
+        dep_add( p ) ;
+
+        p = q ;
+    };
+
+    return 0 ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* #capinclude "path" and #capinclude <path>
+ *
+ * Process another file inline with the same machinery as the files
+ * given on the command line.  Quoted names are looked for next to the
+ * including file first and then in the -I directories.  Names in angle
+ * brackets are only looked for in the -I directories.
+ *
+ * The included file starts with whatever macrochar, brace and return
+ * macro settings are in force, and any changes it makes to them carry
+ * on after it, just as if its text had been in the including file.
+ *
+ * The output of each included file is cached for the whole run, keyed
+ * on its path, modification time and those entry settings.  So a
+ * header pulled in by many files is only processed once.  Files with
+ * an include guard or a #pragma once are only included once per input
+ * file.
+ */
+
+int process_stream() ;
+
+static void reset_input_state() ;
+
+static char *read_file( const char *path, size_t *lenp ) ;
+
+static int capif_depth ;
+
+static void capif_check_end( int depth ) ;
+
+static int make_parent_dirs( const char *path ) ;
+
+static int open_temp_for( const char *path, char **tmppathp ) ;
+
+static boolean_t same_contents( const char *a, const char *b ) ;
+
+static int replace_output( const char *tmppath, const char *path ) ;
+
+
+#define MAX_INCLUDE_DEPTH   64
+
+static char **include_dirs = NULL ;
+static int include_ndirs = 0 ;
+
+static int include_depth = 0 ;
+
+
+#ifndef CAP_FUZZER
+
+static void add_include_dir( const char *dir )
+{
+    char **p = (char **)realloc( include_dirs, ( include_ndirs + 1 ) * sizeof(char *) ) ;
+
+    if( p == NULL )
+        return ;
+
+    include_dirs = p ;
+    include_dirs[ include_ndirs++ ] = (char *)dir ;
+}
+
+#endif /* CAP_FUZZER */
+
+
+static char *safe_strdup( const char *str )
+{
+    if( str == NULL )
+        return NULL ;
+
+    return strdup( str ) ;
+}
+
+
+static boolean_t same_string( const char *a, const char *b )
+{
+    if( ( a == NULL ) || ( b == NULL ) )
+        return ( a == b ) ;
+
+    return ( strcmp( a, b ) == 0 ) ;
+}
+
+
+/* The directive state which is both an input to and an output of
+ * processing an included file
+ */
+struct directive_state_s {
+    char    macrochar ;
+    int     apply_brace_macros ;
+    int     apply_return_macro ;
+    char    *open_brace_macro ;
+    char    *close_brace_macro ;
+    char    *return_macro ;
+    } ;
+
+typedef struct directive_state_s    directive_state_t ;
+
+
+static void directive_state_save( directive_state_t *ds )
+{
+    ds->macrochar           = macrochar ;
+    ds->apply_brace_macros  = apply_brace_macros ;
+    ds->apply_return_macro  = apply_return_macro ;
+    ds->open_brace_macro    = safe_strdup( open_brace_macro ) ;
+    ds->close_brace_macro   = safe_strdup( close_brace_macro ) ;
+    ds->return_macro        = safe_strdup( return_macro ) ;
+}
+
+
+static void directive_state_restore( directive_state_t *ds )
+{
+    macrochar           = ds->macrochar ;
+    apply_brace_macros  = ds->apply_brace_macros ;
+    apply_return_macro  = ds->apply_return_macro ;
+
+    safe_free( open_brace_macro ) ;
+    safe_free( close_brace_macro ) ;
+    safe_free( return_macro ) ;
+
+    open_brace_macro    = safe_strdup( ds->open_brace_macro ) ;
+    close_brace_macro   = safe_strdup( ds->close_brace_macro ) ;
+    return_macro        = safe_strdup( ds->return_macro ) ;
+}
+
+
+static void directive_state_free( directive_state_t *ds )
+{
+    safe_free( ds->open_brace_macro ) ;
+    safe_free( ds->close_brace_macro ) ;
+    safe_free( ds->return_macro ) ;
+}
+
+
+static boolean_t directive_state_is_current( directive_state_t *ds )
+{
+    return ( ds->macrochar == macrochar ) &&
+            ( ds->apply_brace_macros == apply_brace_macros ) &&
+            ( ds->apply_return_macro == apply_return_macro ) &&
+            same_string( ds->open_brace_macro, open_brace_macro ) &&
+            same_string( ds->close_brace_macro, close_brace_macro ) &&
+            same_string( ds->return_macro, return_macro ) ;
+}
+
+
+struct include_dep_s {
+    char                *path ;
+    struct timespec     mtime ;
+    off_t               size ;
+    } ;
+
+typedef struct include_dep_s    include_dep_t ;
+
+
+struct include_cache_s {
+    struct include_cache_s  *next ;
+
+    char                *path ;     /* canonical path, the cache key */
+    char                *name ;     /* path as first found, for #line */
+    struct timespec     mtime ;
+    off_t               size ;
+
+    directive_state_t   entry ;
+    directive_state_t   exit ;
+
+    char                *output ;
+    size_t              outlen ;
+
+    boolean_t           guarded ;
+
+    /* source map records made while processing the file, with output
+     * lines relative to the start of its output
+     */
+    uint32_t            *srcmap ;
+    uint32_t            nsrcmap ;
+
+    /* every file the output depended on ( nested #capinclude files,
+     * #command-deps names ) as it was when the file was processed
+     */
+    include_dep_t       *deps ;
+    int                 ndeps ;
+    } ;
+
+typedef struct include_cache_s  include_cache_t ;
+
+static include_cache_t *include_cache = NULL ;
+
+/* the entry whose file is being processed, which dep_add() notes
+ * dependencies for
+ */
+static include_cache_t *include_recording = NULL ;
+
+
+/* the state of a dependency, a size of -1 when it could not be read
+ */
+static void include_dep_stat( const char *path, struct timespec *mtime, off_t *size )
+{
+    struct stat st ;
+
+    if( stat( path, &st ) == 0 )
+    {
+        *mtime = st.st_mtim ;
+        *size = st.st_size ;
+    }
+    else
+    {
+        memset( mtime, 0, sizeof(*mtime) ) ;
+        *size = -1 ;
+    }
+}
+
+
+static void include_dep_note( const char *path )
+{
+    include_cache_t *ic = include_recording ;
+    include_dep_t *p = NULL ;
+    int i = 0 ;
+
+    if( ic == NULL )
+        return ;
+
+    for( i = 0 ; i < ic->ndeps ; i++ )
+    {
+        if( strcmp( ic->deps[i].path, path ) == 0 )
+            return ;
+    }
+
+    p = (include_dep_t *)realloc( ic->deps, ( ic->ndeps + 1 ) * sizeof(include_dep_t) ) ;
+
+    if( p == NULL )
+        return ;
+
+    ic->deps = p ;
+    p += ic->ndeps ;
+
+    p->path = strdup( path ) ;
+
+    if( p->path == NULL )
+        return ;
+
+    include_dep_stat( path, &p->mtime, &p->size ) ;
+
+    ic->ndeps++ ;
+}
+
+
+/* TRUE if none of the files the cached output depended on changed
+ */
+static boolean_t include_deps_current( include_cache_t *ic )
+{
+    struct timespec mtime ;
+    off_t size = 0 ;
+    int i = 0 ;
+
+    for( i = 0 ; i < ic->ndeps ; i++ )
+    {
+        include_dep_stat( ic->deps[i].path, &mtime, &size ) ;
+
+        if( ( size != ic->deps[i].size ) ||
+            ( mtime.tv_sec != ic->deps[i].mtime.tv_sec ) ||
+            ( mtime.tv_nsec != ic->deps[i].mtime.tv_nsec ) )
+        {
+            return FALSE ;
+        }
+    }
+
+    return TRUE ;
+}
+
+
+/* Guarded files already included by the current input file
+ */
+static char **included_guarded = NULL ;
+static int included_nguarded = 0 ;
+
+/* Whether #capinclude was used, as a chunk processed in parallel can
+ * not see the guarded files included before it
+ */
+static boolean_t chunk_included = FALSE ;
+
+
+static void forget_include_guards()
+{
+    if( include_depth > 0 )
+        return ;
+
+    while( included_nguarded > 0 )
+    {
+        included_nguarded-- ;
+
+        free( included_guarded[ included_nguarded ] ) ;
+    };
+}
+
+
+static boolean_t already_included( const char *path )
+{
+    int i = 0 ;
+
+    for( i = 0 ; i < included_nguarded ; i++ )
+    {
+        if( strcmp( included_guarded[i], path ) == 0 )
+            return TRUE ;
+    }
+
+    return FALSE ;
+}
+
+
+static void remember_guarded( const char *path )
+{
+    char **p = (char **)realloc( included_guarded, ( included_nguarded + 1 ) * sizeof(char *) ) ;
+
+    if( p == NULL )
+        return ;
+
+    included_guarded = p ;
+    included_guarded[ included_nguarded ] = strdup( path ) ;
+
+    if( included_guarded[ included_nguarded ] != NULL )
+        included_nguarded++ ;
+}
+
+
+/* Read the directive name ( and its first argument ) from a line of
+ * output text if it is a directive.  Returns FALSE if not.
+ */
+static boolean_t guard_directive( const char *p, const char *end, char *name, char *arg )
+{
+    int k = 0 ;
+
+    while( ( p < end ) && iswhitespace( *p ) )
+        p++ ;
+
+    if( ( p == end ) || ( *p != '#' ) )
+        return FALSE ;
+
+    p++ ;
+
+    while( ( p < end ) && iswhitespace( *p ) )
+        p++ ;
+
+    for( k = 0 ; ( p < end ) && isalpha( (unsigned char)*p ) && ( k < 15 ) ; k++ )
+        name[k] = *p++ ;
+
+    name[k] = 0 ;
+
+    while( ( p < end ) && iswhitespace( *p ) )
+        p++ ;
+
+    for( k = 0 ; ( p < end ) && issymbolchar( (unsigned char)*p ) && ( k < 127 ) ; k++ )
+        arg[k] = *p++ ;
+
+    arg[k] = 0 ;
+
+    return TRUE ;
+}
+
+
+/* Check whether processed text is include guarded - either it has a
+ * #pragma once, or everything other than blank lines, comments and
+ * #line markers is inside #ifndef X / #define X ... #endif
+ *
+ * Once cap has used a #pragma once it is emptied from the text, leaving
+ * its newline so the line count holds.  Passed on, it would only have
+ * the compiler warn about a #pragma once in the main file.
+ */
+static boolean_t is_include_guarded( char *text, size_t *lenp )
+{
+    char *p = text ;
+    char *end = text + *lenp ;
+    char *eol = NULL ;
+
+    char name[16] ;
+    char arg[128] ;
+    char guard[128] ;
+
+    int significant = 0 ;
+    int depth = 0 ;
+    boolean_t closed = FALSE ;
+    boolean_t in_block_comment = FALSE ;
+    boolean_t guarded = TRUE ;
+
+    guard[0] = 0 ;
+
+    while( p < end )
+    {
+        eol = memchr( p, '\n', (size_t)( end - p ) ) ;
+
+        if( eol == NULL )
+            eol = end ;
+
+        if( in_block_comment )
+        {
+            const char *q = p ;
+
+            while( ( q + 1 < eol ) && !( ( q[0] == '*' ) && ( q[1] == '/' ) ) )
+                q++ ;
+
+            in_block_comment = ( q + 1 >= eol ) ;
+
+            p = eol + 1 ;
+
+            continue ;
+        }
+
+        {
+            const char *q = p ;
+
+            while( ( q < eol ) && isspace( (unsigned char)*q ) )
+                q++ ;
+
+            if( ( q == eol ) || ( ( q + 1 < eol ) && ( q[0] == '/' ) && ( q[1] == '/' ) ) )
+            {
+                p = eol + 1 ;
+                continue ;
+            }
+
+            if( ( q + 1 < eol ) && ( q[0] == '/' ) && ( q[1] == '*' ) )
+            {
+                const char *r = q + 2 ;
+
+                while( ( r + 1 < eol ) && !( ( r[0] == '*' ) && ( r[1] == '/' ) ) )
+                    r++ ;
+
+                if( r + 1 >= eol )
+                {
+                    in_block_comment = TRUE ;
+                }
+
+                /* only a comment on the line ?
+                 */
+                if( in_block_comment || ( r + 2 >= eol ) )
+                {
+                    p = eol + 1 ;
+                    continue ;
+                }
+            }
+        }
+
+        if( ! guard_directive( p, eol, name, arg ) )
+        {
+            /* ordinary text is only allowed inside the guard
+             */
+            if( ( depth == 0 ) || closed )
+                guarded = FALSE ;
+
+            p = eol + 1 ;
+
+            continue ;
+        }
+
+        if( ( strcmp( name, "pragma" ) == 0 ) && ( strcmp( arg, "once" ) == 0 ) )
+        {
+            memmove( p, eol, (size_t)( end - eol ) ) ;
+
+            *lenp -= (size_t)( eol - p ) ;
+
+            return TRUE ;
+        }
+
+        if( strcmp( name, "line" ) == 0 )
+        {
+            p = eol + 1 ;
+            continue ;
+        }
+
+        significant++ ;
+
+        if( significant == 1 )
+        {
+            if( ( strcmp( name, "ifndef" ) != 0 ) || ( arg[0] == 0 ) )
+                guarded = FALSE ;
+
+            strcpy( guard, arg ) ;
+        }
+        else if( significant == 2 )
+        {
+            if( ( strcmp( name, "define" ) != 0 ) || ( strcmp( arg, guard ) != 0 ) )
+                guarded = FALSE ;
+        }
+
+        if( ( name[0] == 'i' ) && ( name[1] == 'f' ) )
+        {
+            if( closed )
+                guarded = FALSE ;
+
+            depth++ ;
+        }
+        else if( strcmp( name, "endif" ) == 0 )
+        {
+            depth-- ;
+
+            if( depth == 0 )
+                closed = TRUE ;
+        }
+        else if( ( depth == 0 ) || closed )
+        {
+            guarded = FALSE ;
+        }
+
+        p = eol + 1 ;
+    };
+
+    return guarded && closed && ( significant >= 3 ) ;
+}
+
+
+/* Look for an included file.  Returns a malloc()ed path or NULL.
+ */
+static char *find_include( const char *name, boolean_t quoted )
+{
+    char *path = NULL ;
+    const char *slash = NULL ;
+    struct stat st ;
+    int i = 0 ;
+
+    if( name[0] == '/' )
+    {
+        return ( stat( name, &st ) == 0 ) ? strdup( name ) : NULL ;
+    }
+
+    path = (char *)malloc( strlen( name ) + strlen( infilename ) + 2 ) ;
+
+    if( path == NULL )
+        return NULL ;
+
+    if( quoted )
+    {
+        slash = strrchr( infilename, '/' ) ;
+
+        if( slash != NULL )
+        {
+            sprintf( path, "%.*s/%s", (int)( slash - infilename ), infilename, name ) ;
+        }
+        else
+        {
+            strcpy( path, name ) ;
+        }
+
+        if( ( stat( path, &st ) == 0 ) && S_ISREG( st.st_mode ) )
+            return path ;
+    }
+
+    for( i = 0 ; i < include_ndirs ; i++ )
+    {
+        free( path ) ;
+
+        path = (char *)malloc( strlen( include_dirs[i] ) + strlen( name ) + 2 ) ;
+
+        if( path == NULL )
+            return NULL ;
+
+        sprintf( path, "%s/%s", include_dirs[i], name ) ;
+
+        if( ( stat( path, &st ) == 0 ) && S_ISREG( st.st_mode ) )
+            return path ;
+    }
+
+    free( path ) ;
+
+    return NULL ;
+}
+
+
+static include_cache_t *find_cached_include( const char *path, struct stat *st )
+{
+    include_cache_t *ic = include_cache ;
+
+    while( ic != NULL )
+    {
+        if( ( strcmp( ic->path, path ) == 0 ) &&
+            ( ic->mtime.tv_sec == st->st_mtim.tv_sec ) &&
+            ( ic->mtime.tv_nsec == st->st_mtim.tv_nsec ) &&
+            ( ic->size == st->st_size ) &&
+            directive_state_is_current( &ic->entry ) &&
+            include_deps_current( ic ) )
+        {
+            return ic ;
+        }
+
+        ic = ic->next ;
+    };
+
+    return NULL ;
+}
+
+
+#ifndef CAP_FUZZER
+
+/* Drop cached output for a file which has changed
+ */
+static void forget_cached_include( const char *path )
+{
+    include_cache_t **pp = &include_cache ;
+    include_cache_t *ic = NULL ;
+
+    while( *pp != NULL )
+    {
+        ic = *pp ;
+
+        if( strcmp( ic->path, path ) != 0 )
+        {
+            pp = &ic->next ;
+            continue ;
+        }
+
+        *pp = ic->next ;
+
+        directive_state_free( &ic->entry ) ;
+        directive_state_free( &ic->exit ) ;
+
+        while( ic->ndeps > 0 )
+            free( ic->deps[ --ic->ndeps ].path ) ;
+
+        free( ic->path ) ;
+        free( ic->name ) ;
+        safe_free( ic->output ) ;
+        safe_free( ic->srcmap ) ;
+        safe_free( ic->deps ) ;
+        free( ic ) ;
+    };
+}
+
+#endif /* CAP_FUZZER */
+
+
+/* Write the output of an included file and make the state what it was
+ * after processing it
+ */
+static void emit_include( include_cache_t *ic )
+{
+    uint32_t k = 0 ;
+    int i = 0 ;
+    unsigned int base = 0 ;
+
+    directive_state_restore( &ic->exit ) ;
+
+    /* the includer depends on whatever the included file did
+     */
+    for( i = 0 ; i < ic->ndeps ; i++ )
+    {
+        dep_add( ic->deps[i].path ) ;
+    }
+
+    if( ic->guarded )
+    {
+        remember_guarded( ic->path ) ;
+    }
+
+    if( ic->outlen == 0 )
+        return ;
+
+    if( ! out_at_bol )
+    {
+        FPUT( '\n' ) ;
+    }
+
+    /* the output starts with its own marker, which replaces one held
+     * back here
+     */
+    if( ( ic->outlen > 6 ) && ( strncmp( ic->output, "#line ", 6 ) == 0 ) )
+    {
+        marker_drop() ;
+
+        outline_delta = - (int)outlinenum ;
+    }
+    else
+    {
+        marker_flush() ;
+    }
+
+    base = outlinenum - 1 ;
+
+    fout_write( ic->output, ic->outlen ) ;
+
+    if( ! out_at_bol )
+    {
+        FPUT( '\n' ) ;
+    }
+
+    for( k = 0 ; k < ic->nsrcmap ; k++ )
+    {
+        const char *saved = infilename ;
+
+        infilename = srcmap_files[ ic->srcmap[ k * 3 + 1 ] ] ;
+
+        srcmap_add( base + ic->srcmap[ k * 3 ], ic->srcmap[ k * 3 + 2 ] ) ;
+
+        infilename = saved ;
+    }
+
+    /* the next line of the including file needs a marker
+     */
+    outline_delta = - (int)outlinenum ;
+}
+
+
+/* Everything about the input being read, so another input can be
+ * processed in the middle of it and then reading carry on
+ */
+struct input_state_s {
+    FILE                *fin ;
+    const unsigned char *inbuf ;
+    size_t              inbuf_len ;
+    size_t              inbuf_pos ;
+    boolean_t           inbuf_eof ;
+    int                 inbuf_type ;
+
+    const char          *infilename ;
+    unsigned int        linenum ;
+    int                 lastchar_read ;
+    int                 currentchar_read ;
+    int                 pendingchar ;
+    int                 lastchar ;
+    int                 in_comment ;
+    int                 in_quotes ;
+    int                 inside_quotes ;
+    int                 quote_pending ;
+    int                 escape_pending ;
+    boolean_t           skip_is_on ;
+
+    char                deferredbuffer[ BUFFLEN + 1 ] ;
+    int                 deferredbuffer_idx ;
+    char                buff[ BUFFLEN + 1 ] ;
+    } ;
+
+typedef struct input_state_s    input_state_t ;
+
+
+static void input_state_save( input_state_t *is )
+{
+    is->fin                 = fin ;
+    is->inbuf               = inbuf ;
+    is->inbuf_len           = inbuf_len ;
+    is->inbuf_pos           = inbuf_pos ;
+    is->inbuf_eof           = inbuf_eof ;
+    is->inbuf_type          = inbuf_type ;
+
+    is->infilename          = infilename ;
+    is->linenum             = linenum ;
+    is->lastchar_read       = lastchar_read ;
+    is->currentchar_read    = currentchar_read ;
+    is->pendingchar         = pendingchar ;
+    is->lastchar            = lastchar ;
+    is->in_comment          = in_comment ;
+    is->in_quotes           = in_quotes ;
+    is->inside_quotes       = inside_quotes ;
+    is->quote_pending       = quote_pending ;
+    is->escape_pending      = escape_pending ;
+    is->skip_is_on          = skip_is_on ;
+
+    memcpy( is->deferredbuffer, deferredbuffer, sizeof(is->deferredbuffer) ) ;
+    is->deferredbuffer_idx  = BUFFER_INDEX( deferredbuffer ) ;
+    memcpy( is->buff, buff, sizeof(is->buff) ) ;
+}
+
+
+static void input_state_restore( input_state_t *is )
+{
+    fin                 = is->fin ;
+    inbuf               = is->inbuf ;
+    inbuf_len           = is->inbuf_len ;
+    inbuf_pos           = is->inbuf_pos ;
+    inbuf_eof           = is->inbuf_eof ;
+    inbuf_type          = is->inbuf_type ;
+
+    infilename          = is->infilename ;
+    linenum             = is->linenum ;
+    lastchar_read       = is->lastchar_read ;
+    currentchar_read    = is->currentchar_read ;
+    pendingchar         = is->pendingchar ;
+    lastchar            = is->lastchar ;
+    in_comment          = is->in_comment ;
+    in_quotes           = is->in_quotes ;
+    inside_quotes       = is->inside_quotes ;
+    quote_pending       = is->quote_pending ;
+    escape_pending      = is->escape_pending ;
+    skip_is_on          = is->skip_is_on ;
+
+    memcpy( deferredbuffer, is->deferredbuffer, sizeof(is->deferredbuffer) ) ;
+    BUFFER_INDEX( deferredbuffer ) = is->deferredbuffer_idx ;
+    memcpy( buff, is->buff, sizeof(is->buff) ) ;
+}
+
+
+/* Process an included file into a new cache entry
+ */
+static include_cache_t *process_include_file( const char *key, const char *path, struct stat *st )
+{
+    include_cache_t *ic = NULL ;
+
+    /* everything about the input and output we are in the middle of
+     */
+    input_state_t saved ;
+
+    FILE *old_fout = fout ;
+    unsigned int old_outlinenum = outlinenum ;
+    boolean_t old_out_at_bol = out_at_bol ;
+    int old_outline_delta = outline_delta ;
+    boolean_t old_mark_file_start = mark_file_start ;
+    uint32_t old_nrecords = srcmap_nrecords ;
+    squeeze_state_t old_squeeze = squeeze ;
+    int old_capif_depth = 0 ;
+    include_cache_t *old_recording = include_recording ;
+    line_marker_t old_marker ;
+
+    char *data = NULL ;
+    size_t len = 0 ;
+
+    ic = (include_cache_t *)calloc( 1, sizeof(include_cache_t) ) ;
+
+    if( ic == NULL )
+        return NULL ;
+
+    ic->path = strdup( key ) ;
+    ic->name = strdup( path ) ;
+    ic->mtime = st->st_mtim ;
+    ic->size = st->st_size ;
+
+    directive_state_save( &ic->entry ) ;
+
+    input_state_save( &saved ) ;
+
+    if( engine == ENGINE_FAST )
+    {
+        data = read_file( path, &len ) ;
+        fin = NULL ;
+    }
+    else
+    {
+        fin = fopen( path, "r" ) ;
+    }
+
+    if( ( ic->path == NULL ) || ( ic->name == NULL ) || ( ( data == NULL ) && ( fin == NULL ) ) )
+    {
+        safe_free( data ) ;
+        input_state_restore( &saved ) ;
+        return NULL ;
+    }
+
+    fout = open_memstream( &ic->output, &ic->outlen ) ;
+
+    if( fout == NULL )
+    {
+        safe_free( data ) ;
+        FCLOSE( fin ) ;
+        input_state_restore( &saved ) ;
+        fout = old_fout ;
+        return NULL ;
+    }
+
+    marker_save( &old_marker ) ;
+
+    if( data != NULL )
+    {
+        set_input_buffer( data, len ) ;
+        inbuf_type = INBUF_MALLOCED ;
+    }
+    else
+    {
+        inbuf = NULL ;
+    }
+
+    infilename = ic->name ;
+
+    reset_input_state() ;
+    reset_output_lines() ;
+
+    inside_quotes = FALSE ;
+    lastchar = -1 ;
+
+    /* the included output always says where it comes from
+     */
+    emit_line_marker( 1 ) ;
+
+    include_depth++ ;
+    old_capif_depth = capif_depth ;
+    include_recording = ic ;
+
+    process_stream() ;
+
+    include_recording = old_recording ;
+    capif_check_end( old_capif_depth ) ;
+    include_depth-- ;
+
+    fclose( fout ) ;
+
+    if( data != NULL )
+    {
+        unload_input() ;
+    }
+    else
+    {
+        FCLOSE( fin ) ;
+    }
+
+    /* keep the source map records made for the included file with
+     * the cache entry
+     */
+    if( srcmap_nrecords > old_nrecords )
+    {
+        ic->nsrcmap = srcmap_nrecords - old_nrecords ;
+        ic->srcmap = (uint32_t *)malloc( ic->nsrcmap * 3 * sizeof(uint32_t) ) ;
+
+        if( ic->srcmap != NULL )
+        {
+            memcpy( ic->srcmap, srcmap_records + old_nrecords * 3, ic->nsrcmap * 3 * sizeof(uint32_t) ) ;
+        }
+        else
+        {
+            ic->nsrcmap = 0 ;
+        }
+
+        srcmap_nrecords = old_nrecords ;
+    }
+
+    directive_state_save( &ic->exit ) ;
+
+    ic->guarded = is_include_guarded( ic->output, &ic->outlen ) ;
+
+    /* and back to where we were
+     */
+    input_state_restore( &saved ) ;
+
+    fout = old_fout ;
+    outlinenum = old_outlinenum ;
+    out_at_bol = old_out_at_bol ;
+    outline_delta = old_outline_delta ;
+    mark_file_start = old_mark_file_start ;
+    squeeze = old_squeeze ;
+
+    /* a marker left at the end of the included output is not needed,
+     * emit_include() has the next line marked anyway
+     */
+    marker_restore( &old_marker ) ;
+
+    ic->next = include_cache ;
+    include_cache = ic ;
+
+    return ic ;
+}
+
+
+int process_capinclude()
+{
+    int retv = 0 ;
+    char *p = NULL ;
+    char *q = NULL ;
+    char *path = NULL ;
+    char *key = NULL ;
+    char endchar = '"' ;
+    boolean_t quoted = TRUE ;
+    include_cache_t *ic = NULL ;
+    struct stat st ;
+
+    read_to_eol() ;
+
+    p = buff ;
+
+    while( iswhitespace( *p ) )
+        p++ ;
+
+    if( *p == '<' )
+    {
+        endchar = '>' ;
+        quoted = FALSE ;
+    }
+    else if( *p != '"' )
+    {
+        cap_error( "#capinclude expects \"file\" or <file>" ) ;
+
+        return 0 ;
+    }
+
+    p++ ;
+
+    q = strchr( p, endchar ) ;
+
+    if( q == NULL )
+    {
+        cap_error( "#capinclude name is not terminated" ) ;
+
+        return 0 ;
+    }
+
+    *q = 0 ;
+
+    path = find_include( p, quoted ) ;
+
+    if( path == NULL )
+    {
+        cap_error( "cannot find #capinclude file '%s'", p ) ;
+
+        return 0 ;
+    }
+
+    key = realpath( path, NULL ) ;
+
+    if( key == NULL )
+    {
+        cap_error( "cannot read #capinclude file '%s'", path ) ;
+
+        goto err_exit ;
+    }
+
+    dep_add( path ) ;
+
+    chunk_included = TRUE ;
+
+    if( already_included( key ) )
+        goto err_exit ;
+
+    if( stat( key, &st ) != 0 )
+    {
+        cap_error( "cannot read #capinclude file '%s'", path ) ;
+
+        goto err_exit ;
+    }
+
+    ic = find_cached_include( key, &st ) ;
+
+    if( ic == NULL )
+    {
+        if( include_depth >= MAX_INCLUDE_DEPTH )
+        {
+            cap_error( "#capinclude nested too deeply at '%s'", path ) ;
+
+            goto err_exit ;
+        }
+
+        ic = process_include_file( key, path, &st ) ;
+    }
+
+    if( ic == NULL )
+    {
+        cap_error( "cannot process #capinclude file '%s'", path ) ;
+
+        goto err_exit ;
+    }
+
+    emit_include( ic ) ;
+
+err_exit:
+
+    safe_free( key ) ;
+    free( path ) ;
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* #repeat <var> <from> <to> [step] processes the lines up to the next
+ * single macrochar on a line once for each value of the counter, from
+ * from up to but not including to.
+ */
+
+#define REPEAT_MAX_ITER     ( 1 << 20 )
+
+static boolean_t plugin_is_block( const char *word, size_t len ) ;
+
+/* The directives that take the lines up to a single macrochar, so the
+ * end of a #repeat is not taken from a block inside it
+ */
+static const char *block_directive_names[] = {
+        "quote", "comment", "def", "constants", "flags",
+        "constants-values", "constants-negative", "perfect_hash",
+        "command", "command-expand", "repeat", "unity",
+        NULL
+    } ;
+
+
+/* Is the line the start of a block ( 1 ), the end of one ( -1 ) or
+ * neither ( 0 )
+ */
+static int repeat_line_nesting( const char *line, size_t len )
+{
+    size_t i = 1 ;
+    size_t start = 0 ;
+    int k = 0 ;
+
+    if( ( len == 0 ) || ( line[0] != macrochar ) )
+        return 0 ;
+
+    if( len == 1 )
+        return -1 ;
+
+    while( ( i < len ) && iswhitespace( line[i] ) )
+        i++ ;
+
+    start = i ;
+
+    while( ( i < len ) && ! isspace( (unsigned char)line[i] ) )
+        i++ ;
+
+    for( k = 0 ; block_directive_names[k] != NULL ; k++ )
+    {
+        if( ( strlen( block_directive_names[k] ) == i - start ) &&
+            ( strncmp( line + start, block_directive_names[k], i - start ) == 0 ) )
+            return 1 ;
+    }
+
+    return plugin_is_block( line + start, i - start ) ? 1 : 0 ;
+}
+
+
+/* Work out a start, end or step, which may be an expression
+ */
+static boolean_t repeat_number( const char *str, long long *value )
+{
+    table_expr_t te ;
+
+    memset( &te, 0, sizeof(te) ) ;
+
+    if( str == NULL )
+        return FALSE ;
+
+    te.p = str ;
+    te.constant_only = TRUE ;
+
+    table_parse_expr( &te ) ;
+    table_skip_space( &te ) ;
+
+    if( ( te.error == NULL ) && ( *te.p == 0 ) )
+        *value = (long long)table_eval( &te, 0, te.ncode, 0, 0, 0 ) ;
+
+    safe_free( te.code ) ;
+
+    return ( te.error == NULL ) && ( *te.p == 0 ) ;
+}
+
+
+/* Write one line of the body with the counter put in place of the
+ * var tokens outside quotes.  var is on the word stack, as the
+ * parameters of a #def are, and tokens are looked up there the same
+ * way.  Where evaluate is set the $( ... ) expressions are worked out
+ * too, otherwise they are left for the #repeat the line is nested in.
+ * Errors are reported when report_line is set, so only once for the
+ * whole #repeat.
+ */
+static void repeat_expand_line( FILE *fs, const char *line, size_t len, const char *var, long long value,
+                                boolean_t evaluate, unsigned int report_line )
+{
+    size_t i = 0 ;
+    size_t j = 0 ;
+    size_t varlen = strlen( var ) ;
+    char quote = 0 ;
+    char word[ BUFFLEN + 1 ] ;
+    table_expr_t te ;
+
+    while( i < len )
+    {
+        char c = line[i] ;
+
+        if( quote != 0 )
+        {
+            fputc( c, fs ) ;
+            i++ ;
+
+            if( ( c == '\\' ) && ( i < len ) )
+            {
+                fputc( line[ i++ ], fs ) ;
+            }
+            else if( c == quote )
+            {
+                quote = 0 ;
+            }
+
+            continue ;
+        }
+
+        if( ( c == '"' ) || ( c == '\'' ) )
+        {
+            quote = c ;
+        }
+        else if( issymbolchar( c ) )
+        {
+            /* a whole token, as #def does for its parameters
+             */
+            for( j = i ; ( j < len ) && issymbolchar( line[j] ) ; j++ )
+                ;
+
+            word[0] = 0 ;
+
+            if( j - i < sizeof(word) )
+            {
+                memcpy( word, line + i, j - i ) ;
+                word[ j - i ] = 0 ;
+            }
+
+            if( ( word[0] != 0 ) && symbol_on_stack( word ) )
+            {
+                fprintf( fs, ( value < 0 ) ? "(%lld)" : "%lld", value ) ;
+            }
+            else
+            {
+                fwrite( line + i, 1, j - i, fs ) ;
+            }
+
+            i = j ;
+
+            continue ;
+        }
+        else if( evaluate && ( c == '$' ) && ( i + 1 < len ) && ( line[ i + 1 ] == '(' ) )
+        {
+            memset( &te, 0, sizeof(te) ) ;
+
+            te.p = line + i + 2 ;
+            te.constant_only = TRUE ;
+            te.var = var ;
+            te.varlen = varlen ;
+            te.var_value = (uint64_t)value ;
+
+            table_parse_expr( &te ) ;
+            table_expect( &te, ")" ) ;
+
+            if( ( te.error == NULL ) && ( te.p > line + len ) )
+                te.error = "missing )" ;
+
+            if( te.error == NULL )
+            {
+                fprintf( fs, "%lld", (long long)table_eval( &te, 0, te.ncode, 0, 0, 0 ) ) ;
+
+                i = (size_t)( te.p - line ) ;
+            }
+            else if( report_line != 0 )
+            {
+                unsigned int old_linenum = linenum ;
+
+                linenum = report_line ;
+
+                cap_error( "#repeat %s : %s in $( ... )", var, te.error ) ;
+
+                linenum = old_linenum ;
+            }
+
+            safe_free( te.code ) ;
+
+            if( te.error == NULL )
+                continue ;
+        }
+
+        fputc( c, fs ) ;
+        i++ ;
+    };
+}
+
+
+/* Process one pass of the expanded body in place of the directive
+ */
+static void repeat_process_text( char *text, size_t len, unsigned int line )
+{
+    input_state_t saved ;
+
+    if( len == 0 )
+        return ;
+
+    input_state_save( &saved ) ;
+
+    if( engine == ENGINE_FAST )
+    {
+        set_input_buffer( text, len ) ;
+        fin = NULL ;
+    }
+    else
+    {
+        inbuf = NULL ;
+        fin = fmemopen( text, len, "r" ) ;
+
+        if( fin == NULL )
+        {
+            input_state_restore( &saved ) ;
+            return ;
+        }
+    }
+
+    reset_input_state() ;
+
+    inside_quotes = FALSE ;
+    lastchar = -1 ;
+
+    linenum = line ;
+
+    /* each pass says it comes from the body
+     */
+    sync_output_line( line, FALSE ) ;
+
+    process_stream() ;
+
+    if( inbuf == NULL )
+    {
+        FCLOSE( fin ) ;
+    }
+
+    input_state_restore( &saved ) ;
+}
+
+
+/* Process generated text in place of the directive on line.  The
+ * text does not line up with the input as a #repeat body does, so its
+ * lines are marked as coming from a file named after the directive,
+ * e.g. z.c:3 #command-expand, and the file's own name is put back with
+ * a marker after it.
+ */
+static void expand_process_text( char *text, size_t len, unsigned int line, const char *keyword )
+{
+    const char *old_infilename = infilename ;
+    char *name = NULL ;
+
+    if( len == 0 )
+        return ;
+
+    name = (char *)malloc( strlen( infilename ) + strlen( keyword ) + 16 ) ;
+
+    if( name == NULL )
+    {
+        cap_error_at( line, "no memory for the #%s output", keyword ) ;
+
+        return ;
+    }
+
+    sprintf( name, "%s:%u #%s", infilename, line, keyword ) ;
+
+    infilename = name ;
+
+    outline_delta = - (int)outlinenum ;
+
+    repeat_process_text( text, len, 1 ) ;
+
+    infilename = old_infilename ;
+
+    free( name ) ;
+
+    /* whatever comes next needs a marker
+     */
+    outline_delta = - (int)outlinenum ;
+}
+
+
+int process_repeat()
+{
+    int retv = 0 ;
+    int c = 0 ;
+    int nest = 0 ;
+    int depth = 0 ;
+    char *p = NULL ;
+    char *var = NULL ;
+    char *arg[3] ;
+    long long from = 0 ;
+    long long to = 0 ;
+    long long step = 1 ;
+    long long value = 0 ;
+    unsigned long long count = 0 ;
+    unsigned long long n = 0 ;
+    boolean_t good = TRUE ;
+    boolean_t closed = FALSE ;
+    boolean_t old_apply_brace_macros = apply_brace_macros ;
+    unsigned int body_line = 0 ;
+    unsigned int lineidx = 0 ;
+    FILE *fs = NULL ;
+    char *body = NULL ;
+    size_t bodylen = 0 ;
+    size_t used = 0 ;
+    size_t start = 0 ;
+    size_t end = 0 ;
+    char *text = NULL ;
+    size_t textlen = 0 ;
+    wordstack_t *mark = wordstackp ;
+
+    read_to_eol() ;
+
+    p = buff ;
+
+    var = strtok_r( p, " \t\r", &p ) ;
+    arg[0] = strtok_r( NULL, " \t\r", &p ) ;
+    arg[1] = strtok_r( NULL, " \t\r", &p ) ;
+    arg[2] = strtok_r( NULL, " \t\r", &p ) ;
+
+    if( ( var == NULL ) || ( arg[1] == NULL ) || ! ( isalpha( (unsigned char)*var ) || ( *var == '_' ) ) )
+    {
+        cap_error( "#repeat needs a name, a start and an end" ) ;
+
+        good = FALSE ;
+    }
+    else if( ! repeat_number( arg[0], &from ) || ! repeat_number( arg[1], &to ) ||
+             ( ( arg[2] != NULL ) && ! repeat_number( arg[2], &step ) ) || ( step == 0 ) )
+    {
+        cap_error( "#repeat %s has a bad start, end or step", var ) ;
+
+        good = FALSE ;
+    }
+
+    var = ( var != NULL ) ? strdup( var ) : NULL ;
+
+    body_line = linenum + 1 ;
+
+    /* take the body as it is, brace macros are applied as it is
+     * processed
+     */
+    fs = open_memstream( &body, &bodylen ) ;
+
+    if( fs == NULL )
+    {
+        safe_free( var ) ;
+        return -1 ;
+    }
+
+    apply_brace_macros = FALSE ;
+
+    while( c != -1 )
+    {
+        fflush( fs ) ;
+        start = bodylen ;
+
+        while( ( ( c = nextchar() ) != -1 ) && ( c != '\n' ) )
+        {
+            fputc( c, fs ) ;
+        };
+
+        fflush( fs ) ;
+
+        nest = repeat_line_nesting( body + start, bodylen - start ) ;
+
+        if( ( nest < 0 ) && ( depth == 0 ) )
+        {
+            closed = TRUE ;
+            break ;
+        }
+
+        depth += nest ;
+
+        if( c == '\n' )
+            fputc( '\n', fs ) ;
+    };
+
+    apply_brace_macros = old_apply_brace_macros ;
+
+    fclose( fs ) ;
+
+    used = start ;
+
+    if( ! closed )
+    {
+        cap_error( "#repeat has no closing %c", macrochar ) ;
+
+        good = FALSE ;
+    }
+
+    if( ! good )
+        goto err_exit ;
+
+    if( ( step > 0 ) && ( from < to ) )
+    {
+        count = ( (unsigned long long)to - (unsigned long long)from - 1 ) / (unsigned long long)step + 1 ;
+    }
+    else if( ( step < 0 ) && ( from > to ) )
+    {
+        count = ( (unsigned long long)from - (unsigned long long)to - 1 ) / ( 0ULL - (unsigned long long)step ) + 1 ;
+    }
+
+    if( count > REPEAT_MAX_ITER )
+    {
+        cap_error( "#repeat %s would repeat %llu times", var, count ) ;
+
+        goto err_exit ;
+    }
+
+    stackcopybuffer( var, 1 ) ;
+
+    for( n = 0, value = from ; n < count ; n++, value += step )
+    {
+        fs = open_memstream( &text, &textlen ) ;
+
+        if( fs == NULL )
+        {
+            retv = -1 ;
+            goto err_exit ;
+        }
+
+        depth = 0 ;
+
+        for( start = 0, lineidx = 0 ; start < used ; start = end + 1, lineidx++ )
+        {
+            p = (char *)memchr( body + start, '\n', used - start ) ;
+            end = ( p != NULL ) ? (size_t)( p - body ) : used ;
+
+            nest = repeat_line_nesting( body + start, end - start ) ;
+
+            if( nest < 0 )
+                depth-- ;
+
+            repeat_expand_line( fs, body + start, end - start, var, value,
+                                depth == 0, ( n == 0 ) ? body_line + lineidx : 0 ) ;
+
+            if( nest > 0 )
+                depth++ ;
+
+            if( end < used )
+                fputc( '\n', fs ) ;
+        }
+
+        fclose( fs ) ;
+
+        repeat_process_text( text, textlen, body_line ) ;
+
+        safe_free( text ) ;
+    }
+
+err_exit:
+
+    while( ( wordstackp != NULL ) && ( wordstackp != mark ) )
+    {
+        stackpop() ;
+    };
+
+    safe_free( body ) ;
+    safe_free( var ) ;
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* #embed <file> <symbol> [align N] [incbin] writes the bytes of a file
+ * as a constant array, with <symbol>_len for its length.
+ *
+ * The file is mmap()ed and each byte written from a table of ready
+ * made "0xXX," strings into a large buffer, so megabytes go through
+ * far faster than by way of #command and xxd.  With incbin nothing is
+ * copied, the assembler reads the file itself.
+ */
+
+#define EMBED_PER_LINE      16
+#define EMBED_OUTBUFF       65536
+
+static char embed_hex[ 256 ][ 5 ] ;
+
+
+static void embed_write_array( const unsigned char *data, size_t len )
+{
+    static const char digits[] = "0123456789abcdef" ;
+    char *out = NULL ;
+    size_t used = 0 ;
+    size_t i = 0 ;
+    int k = 0 ;
+
+    if( embed_hex[0][0] == 0 )
+    {
+        for( k = 0 ; k < 256 ; k++ )
+        {
+            embed_hex[k][0] = '0' ;
+            embed_hex[k][1] = 'x' ;
+            embed_hex[k][2] = digits[ k >> 4 ] ;
+            embed_hex[k][3] = digits[ k & 15 ] ;
+            embed_hex[k][4] = ',' ;
+        }
+    }
+
+    out = (char *)malloc( EMBED_OUTBUFF ) ;
+
+    if( out == NULL )
+        return ;
+
+    for( i = 0 ; i < len ; i++ )
+    {
+        if( ( i % EMBED_PER_LINE ) == 0 )
+        {
+            if( used > EMBED_OUTBUFF - ( 16 + EMBED_PER_LINE * 5 ) )
+            {
+                fout_write( out, used ) ;
+                used = 0 ;
+            }
+
+            memcpy( out + used, "\n        ", 9 ) ;
+            used += 9 ;
+        }
+
+        memcpy( out + used, embed_hex[ data[i] ], 5 ) ;
+        used += 5 ;
+    }
+
+    /* no comma after the last byte, and an empty file still needs
+     * something in the array
+     */
+    if( len > 0 )
+    {
+        used-- ;
+    }
+    else
+    {
+        memcpy( out + used, "\n        0", 10 ) ;
+        used += 10 ;
+    }
+
+    fout_write( out, used ) ;
+
+    free( out ) ;
+}
+
+
+int process_embed()
+{
+    int retv = 0 ;
+    char *p = NULL ;
+    char *q = NULL ;
+    char *name = NULL ;
+    char *symbol = NULL ;
+    char *path = NULL ;
+    char *key = NULL ;
+    boolean_t quoted = TRUE ;
+    boolean_t incbin = FALSE ;
+    unsigned long align = 0 ;
+    FILE *fs = NULL ;
+    unsigned char *data = NULL ;
+    size_t len = 0 ;
+    boolean_t mapped = FALSE ;
+    struct stat st ;
+
+    read_to_eol() ;
+
+    p = buff ;
+
+    while( iswhitespace( *p ) )
+        p++ ;
+
+    /* the name can be "file", <file> or just file
+     */
+    if( ( *p == '"' ) || ( *p == '<' ) )
+    {
+        quoted = ( *p == '"' ) ;
+
+        name = p + 1 ;
+
+        q = strchr( name, quoted ? '"' : '>' ) ;
+
+        if( q == NULL )
+        {
+            cap_error( "#embed name is not terminated" ) ;
+
+            return 0 ;
+        }
+
+        *q = 0 ;
+        p = q + 1 ;
+    }
+    else
+    {
+        name = strtok_r( p, " \t\r", &p ) ;
+    }
+
+    symbol = strtok_r( p, " \t\r", &p ) ;
+
+    if( ( name == NULL ) || ( *name == 0 ) || ( symbol == NULL ) ||
+        ! ( isalpha( (unsigned char)*symbol ) || ( *symbol == '_' ) ) )
+    {
+        cap_error( "#embed needs a file and a symbol" ) ;
+
+        return 0 ;
+    }
+
+    while( ( q = strtok_r( NULL, " \t\r", &p ) ) != NULL )
+    {
+        if( strcmp( q, "incbin" ) == 0 )
+        {
+            incbin = TRUE ;
+        }
+        else if( ( strcmp( q, "align" ) == 0 ) && ( ( q = strtok_r( NULL, " \t\r", &p ) ) != NULL ) )
+        {
+            align = strtoul( q, &q, 0 ) ;
+
+            if( ( *q != 0 ) || ( align == 0 ) || ( ( align & ( align - 1 ) ) != 0 ) )
+            {
+                cap_error( "#embed %s needs a power of two to align to", symbol ) ;
+
+                return 0 ;
+            }
+        }
+        else
+        {
+            cap_error( "#embed %s has an unknown option '%s'", symbol, q ) ;
+
+            return 0 ;
+        }
+    };
+
+    path = find_include( name, quoted ) ;
+
+    if( path == NULL )
+    {
+        cap_error( "cannot find #embed file '%s'", name ) ;
+
+        return 0 ;
+    }
+
+    dep_add( path ) ;
+
+    fs = fopen( path, "rb" ) ;
+
+    if( ( fs == NULL ) || ( fstat( fileno(fs), &st ) != 0 ) )
+    {
+        cap_error( "cannot read #embed file '%s'", path ) ;
+
+        goto err_exit ;
+    }
+
+    if( incbin )
+    {
+        /* the assembler runs somewhere else, so give it the full path
+         */
+        key = realpath( path, NULL ) ;
+
+        if( ( key == NULL ) || ( strpbrk( key, "\"\\\n" ) != NULL ) || ! S_ISREG( st.st_mode ) )
+        {
+            cap_error( "cannot use .incbin for #embed file '%s'", path ) ;
+
+            goto err_exit ;
+        }
+
+        fout_printf( "__asm__(\n"
+                     "    \"    .section .rodata\\n\"\n"
+                     "    \"    .global %s\\n\"\n"
+                     "    \"    .type %s, %%object\\n\"\n", symbol, symbol ) ;
+
+        if( align > 1 )
+        {
+            fout_printf( "    \"    .balign %lu\\n\"\n", align ) ;
+        }
+
+        fout_printf( "    \"%s:\\n\"\n"
+                     "    \"    .incbin \\\"%s\\\"\\n\"\n"
+                     "    \"    .size %s, . - %s\\n\"\n"
+                     "    \"    .previous\\n\"\n"
+                     "    ) ;\n"
+                     "extern const unsigned char %s[] ;\n",
+                     symbol, key, symbol, symbol, symbol ) ;
+
+        len = (size_t)st.st_size ;
+    }
+    else
+    {
+        if( S_ISREG( st.st_mode ) && ( st.st_size > 0 ) )
+        {
+            data = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fs), 0 ) ;
+
+            if( data != MAP_FAILED )
+            {
+                madvise( data, (size_t)st.st_size, MADV_SEQUENTIAL ) ;
+
+                len = (size_t)st.st_size ;
+                mapped = TRUE ;
+            }
+            else
+            {
+                data = NULL ;
+            }
+        }
+
+        if( ! mapped )
+        {
+            data = (unsigned char *)read_file( path, &len ) ;
+
+            if( data == NULL )
+            {
+                cap_error( "cannot read #embed file '%s'", path ) ;
+
+                goto err_exit ;
+            }
+        }
+
+        fout_printf( "static const unsigned char %s[]", symbol ) ;
+
+        if( align > 1 )
+        {
+            fout_printf( " __attribute__(( aligned( %lu ) ))", align ) ;
+        }
+
+        fout_printf( " = {" ) ;
+
+        embed_write_array( data, len ) ;
+
+        fout_printf( "\n    } ;\n" ) ;
+    }
+
+    fout_printf( "static const size_t %s_len = %llu ;\n", symbol, (unsigned long long)len ) ;
+
+err_exit:
+
+    if( mapped )
+    {
+        munmap( data, len ) ;
+    }
+    else
+    {
+        safe_free( data ) ;
+    }
+
+    FCLOSE( fs ) ;
+    safe_free( key ) ;
+    free( path ) ;
+
+    return retv ;
+}
+
+/*******************************************************************
+ *
+ * With the fast engine the text of ordinary lines is scanned by a
+ * state machine instead of the character at a time ladder in
+ * process_stream().  Every character of such a line is output as it
+ * is, so the scanner only has to find how far it can copy before
+ * something needs the ladder : the end of the line, a brace or return
+ * for the brace and return macros, or anything the ladder treats in
+ * an odd way.
+ *
+ * The states say what the last character means : plain code, code
+ * after a space, a / or a \, or inside a comment, string or character
+ * constant.  The table gives the next state for each state and class
+ * of byte, or an action to take.
+ *
+ * There is a table for each setting of the brace and return macros
+ * and --strip-comments, so the scan itself never looks at them.  With
+ * them off a brace or an r is just another character, and that table
+ * also finds the line starts where the engine looks for directives.
+ */
+
+enum lex_state_e {
+    LEX_CODE, LEX_WS, LEX_SLASH, LEX_BSLASH,
+    LEX_COMMENT, LEX_COMMENT_STAR,
+    LEX_DQ, LEX_DQ_ESC, LEX_DQ_OCT1, LEX_DQ_OCT2,
+    LEX_SQ, LEX_SQ_ESC, LEX_SQ_OCT1, LEX_SQ_OCT2,
+    LEX_STATES
+    } ;
+
+/* the actions, after the states
+ */
+enum lex_action_e {
+    LEX_EOL = LEX_STATES,   /* take this newline and stop */
+    LEX_ENTER_COMMENT,      /* the start of something the scanner may */
+    LEX_ENTER_DQ,           /* have to give back                      */
+    LEX_ENTER_SQ,
+    LEX_LINE_COMMENT,       /* a // comment */
+    LEX_STOP,               /* leave this character to the ladder */
+    LEX_STOP_BEFORE,        /* ... and the one before it */
+    LEX_GIVE_BACK           /* give back to where the comment or string started */
+    } ;
+
+enum lex_class_e {
+    LC_OTHER, LC_NL, LC_WS, LC_SLASH, LC_STAR, LC_BSLASH, LC_DQ, LC_SQ, LC_OCT, LC_R, LC_BRACE,
+    LEX_CLASSES
+    } ;
+
+#define LEX_MODE_BRACE      1
+#define LEX_MODE_RETURN     2
+#define LEX_MODE_STRIP      4
+#define LEX_MODES           8
+
+#define LEX_MODE()          ( ( apply_brace_macros ? LEX_MODE_BRACE : 0 ) | ( apply_return_macro ? LEX_MODE_RETURN : 0 ) | \
+                              ( strip_comments ? LEX_MODE_STRIP : 0 ) )
+
+static unsigned char lex_class[ 256 ] ;
+
+static unsigned char lex_next[ LEX_MODES ][ LEX_STATES ][ LEX_CLASSES ] ;
+
+
+/* Fill in a string or character constant's states.  An octal escape
+ * reads one character too many and puts it back, which counts a
+ * newline twice, so a newline there is given back to the ladder.
+ */
+static void lex_init_quoted( unsigned char (*t)[ LEX_CLASSES ], int st, int esc, int oct1, int oct2, int endclass )
+{
+    int k = 0 ;
+
+    for( k = 0 ; k < LEX_CLASSES ; k++ )
+    {
+        t[ st ][k] = st ;
+        t[ esc ][k] = st ;
+    }
+
+    t[ st ][ endclass ] = LEX_CODE ;
+    t[ st ][ LC_BSLASH ] = esc ;
+    t[ st ][ LC_NL ] = LEX_EOL ;
+
+    t[ esc ][ LC_OCT ] = oct1 ;
+
+    for( k = 0 ; k < LEX_CLASSES ; k++ )
+    {
+        t[ oct1 ][k] = t[ st ][k] ;
+        t[ oct2 ][k] = t[ st ][k] ;
+    }
+
+    t[ oct1 ][ LC_OCT ] = oct2 ;
+    t[ oct1 ][ LC_NL ] = LEX_GIVE_BACK ;
+    t[ oct2 ][ LC_NL ] = LEX_GIVE_BACK ;
+}
+
+
+static void lex_init_mode( int mode )
+{
+    unsigned char (*t)[ LEX_CLASSES ] = lex_next[ mode ] ;
+    int st = 0 ;
+    int k = 0 ;
+
+    /* code
+     */
+    for( st = LEX_CODE ; st <= LEX_BSLASH ; st++ )
+    {
+        for( k = 0 ; k < LEX_CLASSES ; k++ )
+            t[ st ][k] = LEX_CODE ;
+
+        t[ st ][ LC_NL ] = LEX_EOL ;
+        t[ st ][ LC_WS ] = LEX_WS ;
+        t[ st ][ LC_SLASH ] = LEX_SLASH ;
+        t[ st ][ LC_BSLASH ] = LEX_BSLASH ;
+        t[ st ][ LC_DQ ] = LEX_ENTER_DQ ;
+        t[ st ][ LC_SQ ] = LEX_ENTER_SQ ;
+    }
+
+    t[ LEX_SLASH ][ LC_SLASH ] = LEX_LINE_COMMENT ;
+    t[ LEX_SLASH ][ LC_STAR ] = LEX_ENTER_COMMENT ;
+
+    t[ LEX_BSLASH ][ LC_DQ ] = LEX_CODE ;
+    t[ LEX_BSLASH ][ LC_SQ ] = LEX_CODE ;
+
+    /* comments, where the star that opens one can also close it
+     */
+    for( k = 0 ; k < LEX_CLASSES ; k++ )
+    {
+        t[ LEX_COMMENT ][k] = LEX_COMMENT ;
+        t[ LEX_COMMENT_STAR ][k] = LEX_COMMENT ;
+    }
+
+    t[ LEX_COMMENT ][ LC_STAR ] = LEX_COMMENT_STAR ;
+    t[ LEX_COMMENT_STAR ][ LC_STAR ] = LEX_COMMENT_STAR ;
+    t[ LEX_COMMENT_STAR ][ LC_SLASH ] = LEX_SLASH ;
+
+    lex_init_quoted( t, LEX_DQ, LEX_DQ_ESC, LEX_DQ_OCT1, LEX_DQ_OCT2, LC_DQ ) ;
+    lex_init_quoted( t, LEX_SQ, LEX_SQ_ESC, LEX_SQ_OCT1, LEX_SQ_OCT2, LC_SQ ) ;
+
+    if( mode & LEX_MODE_RETURN )
+    {
+        t[ LEX_WS ][ LC_R ] = LEX_STOP ;
+    }
+
+    /* nextchar() puts the brace macros in for braces anywhere but in
+     * double quotes and comments
+     */
+    if( mode & LEX_MODE_BRACE )
+    {
+        for( st = LEX_CODE ; st <= LEX_BSLASH ; st++ )
+            t[ st ][ LC_BRACE ] = LEX_STOP ;
+
+        for( st = LEX_SQ ; st <= LEX_SQ_OCT2 ; st++ )
+            t[ st ][ LC_BRACE ] = LEX_GIVE_BACK ;
+    }
+
+    /* with --strip-comments the ladder drops comments, so it is given
+     * the / that starts one
+     */
+    if( mode & LEX_MODE_STRIP )
+    {
+        t[ LEX_SLASH ][ LC_SLASH ] = LEX_STOP_BEFORE ;
+        t[ LEX_SLASH ][ LC_STAR ] = LEX_STOP_BEFORE ;
+    }
+}
+
+
+static void lex_init()
+{
+    int k = 0 ;
+
+    for( k = 0 ; k < 256 ; k++ )
+        lex_class[k] = LC_OTHER ;
+
+    lex_class[ '\n' ] = LC_NL ;
+    lex_class[ ' ' ] = LC_WS ;
+    lex_class[ '\t' ] = LC_WS ;
+    lex_class[ '/' ] = LC_SLASH ;
+    lex_class[ '*' ] = LC_STAR ;
+    lex_class[ '\\' ] = LC_BSLASH ;
+    lex_class[ '"' ] = LC_DQ ;
+    lex_class[ '\'' ] = LC_SQ ;
+    lex_class[ 'r' ] = LC_R ;
+    lex_class[ '{' ] = LC_BRACE ;
+    lex_class[ '}' ] = LC_BRACE ;
+
+    for( k = '0' ; k <= '7' ; k++ )
+        lex_class[k] = LC_OCT ;
+
+    for( k = 0 ; k < LEX_MODES ; k++ )
+        lex_init_mode( k ) ;
+}
+
+
+/* Find the next line from p that starts with the macro character, as
+ * the engine comes to them : the lines inside a comment are passed
+ * over.  Where odd is given it is set for a // comment on the way that
+ * read_to_eol() would not take as it is.  Returns NULL if there is no
+ * such line.
+ */
+static const unsigned char *lex_find_macro_line( const unsigned char *p, const unsigned char *end, boolean_t *odd )
+{
+    const unsigned char *q = NULL ;
+    unsigned char (*t)[ LEX_CLASSES ] = NULL ;
+    boolean_t at_start = TRUE ;
+    int state = LEX_CODE ;
+    int next = 0 ;
+
+    if( lex_class[ '\n' ] != LC_NL )
+        lex_init() ;
+
+    t = lex_next[ 0 ] ;
+
+    while( p < end )
+    {
+        if( at_start && ( *p == (unsigned char)macrochar ) )
+            return p ;
+
+        at_start = FALSE ;
+
+        next = t[ state ][ lex_class[ *p ] ] ;
+
+        if( next < LEX_STATES )
+        {
+            state = next ;
+            p++ ;
+
+            continue ;
+        }
+
+        switch( next )
+        {
+            case LEX_ENTER_COMMENT :    state = LEX_COMMENT_STAR ;  p++ ;   break ;
+            case LEX_ENTER_DQ :         state = LEX_DQ ;            p++ ;   break ;
+            case LEX_ENTER_SQ :         state = LEX_SQ ;            p++ ;   break ;
+
+            case LEX_LINE_COMMENT :
+            {
+                q = memchr( p, '\n', (size_t)( end - p ) ) ;
+
+                if( q == NULL )
+                    q = end ;
+
+                if( ( odd != NULL ) && ( ( q - p >= BUFFLEN - 1 ) || ( memchr( p, 0, (size_t)( q - p ) ) != NULL ) ) )
+                    *odd = TRUE ;
+
+                p = q ;
+                state = LEX_CODE ;
+
+                break ;
+            }
+
+            default :
+            {
+                /* the end of the line, even after a \ as the engine
+                 * does not join lines
+                 */
+                at_start = TRUE ;
+                state = LEX_CODE ;
+                p++ ;
+
+                break ;
+            }
+        }
+    };
+
+    return NULL ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* #capif <expression>, #capelif <expression>, #capelse and #capendif
+ * keep or drop lines the way #if and its friends do, but in cap itself
+ * and on the names given with -D :
+ *
+ *      #capif defined( USE_SSE ) && LEVEL > 2
+ *      ...
+ *      #capelse
+ *      ...
+ *      #capendif
+ *
+ * The expression is the one #table uses, on unsigned 64 bit integers.
+ * A name is its -D value ( 1 when given without one ) or 0 when it was
+ * not given, and defined( name ) says whether it was given.
+ *
+ * The lines of a branch not taken are passed over unprocessed.  Only
+ * lines starting with the macro character are looked at, for nested
+ * #capif and the end of the branch, and the fast engine finds those
+ * with memchr() without reading the lines in between.  The output gets
+ * a #line marker after the dropped lines so line numbers stay right.
+ */
+
+#define CAPIF_MAX_DEPTH     64
+
+struct capif_level_s {
+    boolean_t       taken ;     /* a branch has been kept */
+    boolean_t       else_seen ;
+    unsigned int    line ;      /* of the #capif, for messages */
+    } ;
+
+static struct capif_level_s capif_stack[ CAPIF_MAX_DEPTH ] ;
+static int capif_depth = 0 ;
+
+
+/* Step the in memory input on to p, with the line count and the last
+ * characters read left as nextchar() would leave them
+ */
+static void advance_input( const unsigned char *p )
+{
+    const unsigned char *start = inbuf + inbuf_pos ;
+    const unsigned char *q = NULL ;
+
+    if( p == start )
+        return ;
+
+    /* nextchar() counts a line when it reads the character after a
+     * newline
+     */
+    if( currentchar_read == (int)'\n' )
+        linenum++ ;
+
+    for( q = start ; ( q = memchr( q, '\n', (size_t)( p - 1 - q ) ) ) != NULL ; q++ )
+    {
+        linenum++ ;
+    };
+
+    lastchar_read = ( p - start >= 2 ) ? p[-2] : currentchar_read ;
+    currentchar_read = p[-1] ;
+
+    inbuf_pos += (size_t)( p - start ) ;
+}
+
+
+/* ... and the same for reading the end of the input
+ */
+static void advance_input_to_eof()
+{
+    advance_input( inbuf + inbuf_len ) ;
+
+    lastchar_read = currentchar_read ;
+    currentchar_read = -1 ;
+    inbuf_eof = TRUE ;
+
+    if( lastchar_read == (int)'\n' )
+        linenum++ ;
+}
+
+
+/* Work out a #capif or #capelif expression, reporting any error.  A
+ * comment after the expression is cut off.
+ */
+static boolean_t capif_eval( char *expr, const char *what )
+{
+    table_expr_t te ;
+    uint64_t value = 0 ;
+    char *p = NULL ;
+
+    for( p = expr ; *p != 0 ; p++ )
+    {
+        if( ( p[0] == '/' ) && ( ( p[1] == '/' ) || ( p[1] == '*' ) ) )
+        {
+            *p = 0 ;
+            break ;
+        }
+    }
+
+    memset( &te, 0, sizeof(te) ) ;
+
+    te.p = expr ;
+    te.constant_only = TRUE ;
+    te.defines = TRUE ;
+
+    table_parse_expr( &te ) ;
+    table_skip_space( &te ) ;
+
+    if( ( te.error == NULL ) && ( *te.p != 0 ) )
+        te.error = "unexpected text" ;
+
+    if( te.error != NULL )
+    {
+        cap_error( "#%s : %s at '%.20s'", what, te.error, te.p ) ;
+    }
+    else
+    {
+        value = table_eval( &te, 0, te.ncode, 0, 0, 0 ) ;
+    }
+
+    safe_free( te.code ) ;
+
+    return ( value != 0 ) ;
+}
+
+
+/* Read the rest of a directive line into buff, unless the keyword
+ * ended it
+ */
+static void capif_read_args()
+{
+    if( currentchar_read == (int)'\n' )
+    {
+        buff[0] = 0 ;
+    }
+    else
+    {
+        read_to_eol() ;
+    }
+}
+
+
+/* Pass over lines to the next one that starts with the macro character
+ * and put what follows that character in line.  Lines inside a comment
+ * are passed over, as the engine passes over them.  Returns FALSE at
+ * the end of the input.
+ */
+static boolean_t capif_next_line( char *line )
+{
+    const unsigned char *q = NULL ;
+    const unsigned char *end = NULL ;
+    const unsigned char *nl = NULL ;
+    unsigned char (*t)[ LEX_CLASSES ] = NULL ;
+    boolean_t at_start = TRUE ;
+    int state = LEX_CODE ;
+    int next = 0 ;
+    size_t len = 0 ;
+    int c = 0 ;
+
+    line[0] = 0 ;
+
+    if( ( engine == ENGINE_FAST ) && ( inbuf != NULL ) && ( currentchar_read == (int)'\n' ) &&
+        ( pendingchar == -1 ) && ( BUFFER_INDEX( deferredbuffer ) == 0 ) )
+    {
+        end = inbuf + inbuf_len ;
+
+        q = lex_find_macro_line( inbuf + inbuf_pos, end, NULL ) ;
+
+        if( q == NULL )
+        {
+            advance_input_to_eof() ;
+
+            return FALSE ;
+        }
+
+        nl = memchr( q, '\n', (size_t)( end - q ) ) ;
+
+        len = (size_t)( ( ( nl != NULL ) ? nl : end ) - ( q + 1 ) ) ;
+
+        if( len > BUFFLEN - 1 )
+            len = BUFFLEN - 1 ;
+
+        memcpy( line, q + 1, len ) ;
+        line[len] = 0 ;
+
+        if( nl != NULL )
+        {
+            advance_input( nl + 1 ) ;
+        }
+        else
+        {
+            advance_input_to_eof() ;
+        }
+
+        return TRUE ;
+    }
+
+    /* the same a character at a time, on the tables
+     * lex_find_macro_line() uses
+     */
+    if( lex_class[ '\n' ] != LC_NL )
+        lex_init() ;
+
+    t = lex_next[ 0 ] ;
+
+    while( ( c = nextchar() ) != -1 )
+    {
+        if( at_start && ( c == (int)macrochar ) )
+        {
+            while( ( ( c = nextchar() ) != -1 ) && ( c != (int)'\n' ) )
+            {
+                if( len < BUFFLEN - 1 )
+                    line[ len++ ] = (char)c ;
+            };
+
+            line[len] = 0 ;
+
+            return TRUE ;
+        }
+
+        at_start = FALSE ;
+
+        next = t[ state ][ lex_class[ (unsigned char)c ] ] ;
+
+        if( next < LEX_STATES )
+        {
+            state = next ;
+
+            continue ;
+        }
+
+        switch( next )
+        {
+            case LEX_ENTER_COMMENT :    state = LEX_COMMENT_STAR ;  break ;
+            case LEX_ENTER_DQ :         state = LEX_DQ ;            break ;
+            case LEX_ENTER_SQ :         state = LEX_SQ ;            break ;
+
+            case LEX_LINE_COMMENT :
+            {
+                while( ( c != (int)'\n' ) && ( c != -1 ) )
+                {
+                    c = nextchar() ;
+                };
+
+                at_start = TRUE ;
+                state = LEX_CODE ;
+
+                break ;
+            }
+
+            default :
+            {
+                at_start = TRUE ;
+                state = LEX_CODE ;
+
+                break ;
+            }
+        }
+
+        if( c == -1 )
+            break ;
+    };
+
+    return FALSE ;
+}
+
+
+/* Pass over a branch not taken, up to the #capendif of the #capif on
+ * top of the stack or to a #capelif or #capelse that is taken
+ */
+static int capif_skip()
+{
+    struct capif_level_s *level = &capif_stack[ capif_depth - 1 ] ;
+    boolean_t old_apply_brace_macros = apply_brace_macros ;
+    int nested = 0 ;
+    char line[ BUFFLEN ] ;
+    char *word = NULL ;
+    char *args = NULL ;
+
+    /* the dropped lines must be read as they are
+     */
+    apply_brace_macros = FALSE ;
+
+    while( capif_next_line( line ) )
+    {
+        for( word = line ; iswhitespace( *word ) ; word++ )
+            ;
+
+        for( args = word ; ( *args != 0 ) && ! isspace( (unsigned char)*args ) ; args++ )
+            ;
+
+        if( *args != 0 )
+            *args++ = 0 ;
+
+        if( strcmp( word, "capif" ) == 0 )
+        {
+            nested++ ;
+        }
+        else if( strcmp( word, "capendif" ) == 0 )
+        {
+            if( nested == 0 )
+            {
+                capif_depth-- ;
+                goto err_exit ;
+            }
+
+            nested-- ;
+        }
+        else if( nested > 0 )
+        {
+            continue ;
+        }
+        else if( strcmp( word, "capelse" ) == 0 )
+        {
+            if( level->else_seen )
+                cap_error( "#capelse after #capelse" ) ;
+
+            level->else_seen = TRUE ;
+
+            if( ! level->taken )
+            {
+                level->taken = TRUE ;
+                goto err_exit ;
+            }
+        }
+        else if( strcmp( word, "capelif" ) == 0 )
+        {
+            if( level->else_seen )
+            {
+                cap_error( "#capelif after #capelse" ) ;
+            }
+            else if( ! level->taken && capif_eval( args, "capelif" ) )
+            {
+                level->taken = TRUE ;
+                goto err_exit ;
+            }
+        }
+    };
+
+    cap_error( "#capif from line %u has no #capendif", level->line ) ;
+
+    capif_depth-- ;
+
+err_exit:
+
+    apply_brace_macros = old_apply_brace_macros ;
+
+    return 0 ;
+}
+
+
+int process_capif()
+{
+    struct capif_level_s *level = NULL ;
+
+    capif_read_args() ;
+
+    if( capif_depth == CAPIF_MAX_DEPTH )
+    {
+        cap_error( "#capif nested more than %d deep", CAPIF_MAX_DEPTH ) ;
+
+        return 0 ;
+    }
+
+    level = &capif_stack[ capif_depth++ ] ;
+
+    level->line = linenum ;
+    level->else_seen = FALSE ;
+    level->taken = capif_eval( buff, "capif" ) ;
+
+    if( ! level->taken )
+        return capif_skip() ;
+
+    return 0 ;
+}
+
+
+/* #capelif and #capelse are only met here at the end of a branch that
+ * was taken, so the rest are dropped
+ */
+int process_capelse( boolean_t is_else )
+{
+    struct capif_level_s *level = NULL ;
+
+    capif_read_args() ;
+
+    if( capif_depth == 0 )
+    {
+        cap_error( "#%s without #capif", is_else ? "capelse" : "capelif" ) ;
+
+        return 0 ;
+    }
+
+    level = &capif_stack[ capif_depth - 1 ] ;
+
+    if( level->else_seen )
+        cap_error( "#%s after #capelse", is_else ? "capelse" : "capelif" ) ;
+
+    if( is_else )
+        level->else_seen = TRUE ;
+
+    level->taken = TRUE ;
+
+    return capif_skip() ;
+}
+
+
+int process_capendif()
+{
+    capif_read_args() ;
+
+    if( capif_depth == 0 )
+    {
+        cap_error( "#capendif without #capif" ) ;
+
+        return 0 ;
+    }
+
+    capif_depth-- ;
+
+    return 0 ;
+}
+
+
+/* Report any #capif left open at the end of a file, from depth on
+ */
+static void capif_check_end( int depth )
+{
+    while( capif_depth > depth )
+    {
+        capif_depth-- ;
+
+        cap_error( "#capif from line %u has no #capendif", capif_stack[ capif_depth ].line ) ;
+    };
+}
+
+
+/*******************************************************
+ */
+
+
+/* #output <file> sends the text that follows to another file and
+ * #output - sends it back to the main output.  #output-both <file> ...
+ * sends it to all the files named at once, where - is the main output.
+ * So a header and its source can be made from the same definitions in
+ * one pass over them.
+ *
+ * Each file has its own buffered stream and line tracking.  Text for
+ * more than one goes through a stream whose writes are copied to each
+ * of theirs.  The files are written to temporaries next to them and
+ * put in place when the input file ends, but only if they changed.
+ */
+
+#define OUTPUT_MAX_SINKS    64
+
+struct output_sink_s {
+    char            *path ;         /* NULL for the main output */
+    char            *tmppath ;
+    FILE            *fs ;
+
+    /* the line tracking while it is not being written
+     */
+    unsigned int    outlinenum ;
+    boolean_t       out_at_bol ;
+    int             outline_delta ;
+    } ;
+
+typedef struct output_sink_s        output_sink_t ;
+
+/* The main output is sink 0 once #output has been used
+ */
+static output_sink_t output_sinks[ OUTPUT_MAX_SINKS ] ;
+static int output_nsinks = 0 ;
+
+/* the sinks being written, and the stream copying to them if there is
+ * more than one
+ */
+static int output_current[ OUTPUT_MAX_SINKS ] ;
+static int output_ncurrent = 0 ;
+static FILE *output_tee = NULL ;
+
+/* outlinenum when the current sinks started to be written
+ */
+static unsigned int output_start_line = 1 ;
+
+/* A chunk processed in parallel can not write the files, so it only
+ * says that it met #output
+ */
+static boolean_t parallel_child = FALSE ;
+static boolean_t chunk_output = FALSE ;
+
+
+static ssize_t output_tee_write( void *cookie, const char *p, size_t len )
+{
+    ssize_t retv = (ssize_t)len ;
+    int k = 0 ;
+
+    for( k = 0 ; k < output_ncurrent ; k++ )
+    {
+        if( fwrite( p, 1, len, output_sinks[ output_current[k] ].fs ) != len )
+            retv = -1 ;
+    }
+
+    return retv ;
+}
+
+
+/* Whether the text is going anywhere but just the main output
+ */
+static boolean_t output_redirected()
+{
+    return ( output_nsinks > 0 ) && ( ( output_ncurrent > 1 ) || ( output_current[0] != 0 ) ) ;
+}
+
+
+/* Find the sink for a path, opening it the first time it is named.
+ * Returns its index or -1.
+ */
+static int output_sink( const char *path )
+{
+    output_sink_t *os = NULL ;
+    int fd = -1 ;
+    int k = 0 ;
+
+    if( strcmp( path, "-" ) == 0 )
+        return 0 ;
+
+    for( k = 1 ; k < output_nsinks ; k++ )
+    {
+        if( strcmp( output_sinks[k].path, path ) == 0 )
+            return k ;
+    }
+
+    if( output_nsinks == OUTPUT_MAX_SINKS )
+    {
+        cap_error( "more than %d #output files", OUTPUT_MAX_SINKS - 1 ) ;
+
+        return -1 ;
+    }
+
+    os = &output_sinks[ output_nsinks ] ;
+
+    memset( os, 0, sizeof(output_sink_t) ) ;
+
+    if( make_parent_dirs( path ) != 0 )
+    {
+        cap_error( "cannot create directory for #output file '%s'", path ) ;
+
+        return -1 ;
+    }
+
+    fd = open_temp_for( path, &os->tmppath ) ;
+
+    if( fd < 0 )
+    {
+        cap_error( "cannot write #output file '%s'", path ) ;
+
+        return -1 ;
+    }
+
+    os->fs = fdopen( fd, "w" ) ;
+    os->path = strdup( path ) ;
+
+    if( ( os->fs == NULL ) || ( os->path == NULL ) )
+    {
+        cap_error( "cannot write #output file '%s'", path ) ;
+
+        if( os->fs != NULL )
+        {
+            fclose( os->fs ) ;
+        }
+        else
+        {
+            close( fd ) ;
+        }
+
+        unlink( os->tmppath ) ;
+
+        safe_free( os->tmppath ) ;
+        safe_free( os->path ) ;
+
+        return -1 ;
+    }
+
+    /* the file does not know the input's name yet, so the line it
+     * is on is unknown and the first line written gets a marker
+     */
+    os->outlinenum = 1 ;
+    os->out_at_bol = TRUE ;
+    os->outline_delta = -1 ;
+
+    return output_nsinks++ ;
+}
+
+
+/* Stop writing the current sinks, finishing their last line and
+ * leaving each with its own line tracking
+ */
+static void output_leave()
+{
+    output_sink_t *os = NULL ;
+    unsigned int lines = 0 ;
+    int k = 0 ;
+
+    marker_flush() ;
+
+    if( ! out_at_bol )
+    {
+        FPUT( '\n' ) ;
+    }
+
+    /* blank lines held back by --squeeze-blank-lines are dropped, so
+     * they no longer count in outline_delta
+     */
+    outline_delta -= (int)squeeze.blanks ;
+
+    squeeze.blanks = 0 ;
+    squeeze.nws = 0 ;
+
+    if( output_tee != NULL )
+    {
+        fclose( output_tee ) ;
+        output_tee = NULL ;
+    }
+
+    lines = outlinenum - output_start_line ;
+
+    for( k = 0 ; k < output_ncurrent ; k++ )
+    {
+        os = &output_sinks[ output_current[k] ] ;
+
+        os->outlinenum += lines ;
+        os->out_at_bol = TRUE ;
+        os->outline_delta = (int)( outlinenum + outline_delta ) - (int)os->outlinenum ;
+    }
+
+    output_ncurrent = 0 ;
+}
+
+
+/* Start writing the given sinks.  The line tracking is that of the
+ * main output if it is one of them, or else of the first.  If they
+ * do not agree on the line cpp is on then the next line gets a marker.
+ */
+static int output_enter( const int *sinks, int nsinks )
+{
+    static cookie_io_functions_t tee_io = { NULL, output_tee_write, NULL, NULL } ;
+
+    output_sink_t *os = &output_sinks[ sinks[0] ] ;
+    boolean_t agree = TRUE ;
+    int k = 0 ;
+
+    output_is_main = FALSE ;
+
+    for( k = 0 ; k < nsinks ; k++ )
+    {
+        if( sinks[k] == 0 )
+        {
+            os = &output_sinks[0] ;
+            output_is_main = TRUE ;
+        }
+
+        if( output_sinks[ sinks[k] ].outlinenum + output_sinks[ sinks[k] ].outline_delta !=
+            output_sinks[ sinks[0] ].outlinenum + output_sinks[ sinks[0] ].outline_delta )
+        {
+            agree = FALSE ;
+        }
+
+        output_current[k] = sinks[k] ;
+    }
+
+    output_ncurrent = nsinks ;
+
+    outlinenum = os->outlinenum ;
+    out_at_bol = os->out_at_bol ;
+    outline_delta = agree ? os->outline_delta : - (int)os->outlinenum ;
+
+    output_start_line = outlinenum ;
+
+    if( nsinks == 1 )
+    {
+        fout = os->fs ;
+
+        return 0 ;
+    }
+
+    output_tee = fopencookie( NULL, "w", tee_io ) ;
+
+    if( output_tee == NULL )
+    {
+        cap_error( "cannot write to several #output files" ) ;
+
+        output_ncurrent = 1 ;
+        output_current[0] = (int)( os - output_sinks ) ;
+
+        fout = os->fs ;
+
+        return -1 ;
+    }
+
+    fout = output_tee ;
+
+    return 0 ;
+}
+
+
+int process_output( boolean_t both )
+{
+    char *names[ OUTPUT_MAX_SINKS ] ;
+    int sinks[ OUTPUT_MAX_SINKS ] ;
+    int nnames = 0 ;
+    int nsinks = 0 ;
+    int k = 0 ;
+    int n = 0 ;
+    char *p = NULL ;
+    char *name = NULL ;
+    const char *what = both ? "output-both" : "output" ;
+
+    capif_read_args() ;
+
+    if( parallel_child )
+    {
+        chunk_output = TRUE ;
+
+        return 0 ;
+    }
+
+    /* an included file's output is cached and replayed as one piece
+     */
+    if( include_depth > 0 )
+    {
+        cap_error( "#%s can not be used in a #capinclude file", what ) ;
+
+        return 0 ;
+    }
+
+    p = buff ;
+
+    while( TRUE )
+    {
+        while( isspace( (unsigned char)*p ) )
+            p++ ;
+
+        if( ( *p == 0 ) || ( ( p[0] == '/' ) && ( ( p[1] == '/' ) || ( p[1] == '*' ) ) ) )
+            break ;
+
+        if( *p == '"' )
+        {
+            name = ++p ;
+            p = strchr( p, '"' ) ;
+
+            if( p == NULL )
+            {
+                cap_error( "#%s name is not terminated", what ) ;
+
+                return 0 ;
+            }
+        }
+        else
+        {
+            for( name = p ; ( *p != 0 ) && ! isspace( (unsigned char)*p ) ; p++ )
+                ;
+        }
+
+        if( *p != 0 )
+            *p++ = 0 ;
+
+        if( *name == 0 )
+        {
+            cap_error( "#%s has an empty file name", what ) ;
+
+            return 0 ;
+        }
+
+        if( nnames == OUTPUT_MAX_SINKS )
+        {
+            cap_error( "#%s names more than %d files", what, OUTPUT_MAX_SINKS ) ;
+
+            return 0 ;
+        }
+
+        names[ nnames++ ] = name ;
+    };
+
+    if( nnames == 0 )
+    {
+        cap_error( "#%s needs a file, or - for the main output", what ) ;
+
+        return 0 ;
+    }
+
+    if( ( nnames > 1 ) && ! both )
+    {
+        cap_error( "#output takes one file, #output-both takes several" ) ;
+
+        return 0 ;
+    }
+
+    /* the main output is made a sink on first use
+     */
+    if( output_nsinks == 0 )
+    {
+        output_sinks[0].path = NULL ;
+        output_sinks[0].tmppath = NULL ;
+        output_sinks[0].fs = fout ;
+
+        output_nsinks = 1 ;
+        output_ncurrent = 1 ;
+        output_current[0] = 0 ;
+        output_start_line = outlinenum ;
+    }
+
+    for( n = 0 ; n < nnames ; n++ )
+    {
+        sinks[ nsinks ] = output_sink( names[n] ) ;
+
+        if( sinks[ nsinks ] < 0 )
+            return 0 ;
+
+        for( k = 0 ; sinks[k] != sinks[ nsinks ] ; k++ )
+            ;
+
+        if( k == nsinks )
+            nsinks++ ;
+    }
+
+    /* nothing to do if it is where the text is going already
+     */
+    if( ( nsinks == 1 ) && ( output_ncurrent == 1 ) && ( sinks[0] == output_current[0] ) )
+        return 0 ;
+
+    output_leave() ;
+
+    output_enter( sinks, nsinks ) ;
+
+    return 0 ;
+}
+
+
+/* At the end of an input file go back to the main output and put the
+ * #output files in place, or drop them if the file failed
+ */
+static int output_finish( int retv )
+{
+    output_sink_t *os = NULL ;
+    int k = 0 ;
+
+    if( output_nsinks == 0 )
+        return retv ;
+
+    if( output_redirected() )
+    {
+        output_leave() ;
+
+        os = &output_sinks[0] ;
+
+        fout = os->fs ;
+        outlinenum = os->outlinenum ;
+        out_at_bol = os->out_at_bol ;
+        outline_delta = os->outline_delta ;
+    }
+
+    output_is_main = TRUE ;
+
+    for( k = 1 ; k < output_nsinks ; k++ )
+    {
+        os = &output_sinks[k] ;
+
+        if( fclose( os->fs ) != 0 )
+        {
+            fprintf( stderr, "cap: cannot write %s : %s\n", os->path, strerror( errno ) ) ;
+
+            unlink( os->tmppath ) ;
+
+            retv = -1 ;
+        }
+        else if( ( retv != 0 ) || same_contents( os->tmppath, os->path ) )
+        {
+            unlink( os->tmppath ) ;
+        }
+        else if( replace_output( os->tmppath, os->path ) != 0 )
+        {
+            retv = -1 ;
+        }
+
+        safe_free( os->path ) ;
+        safe_free( os->tmppath ) ;
+    }
+
+    output_nsinks = 0 ;
+    output_ncurrent = 0 ;
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* Unity builds : cap --unity <out.c> [--unity-rename] <files>, or a
+ * #unity block listing the files, one to a line, up to a single
+ * macrochar.
+ *
+ * Each file is processed as if it had been given on its own and the
+ * results are put one after another, each starting with a marker
+ * naming its file.  With --unity-rename the names a file declares
+ * static at file scope are given a #define to a name with the file's
+ * number in before it and an #undef after it, so two files can have
+ * statics of the same name.  Statics declared by macros are not seen.
+ */
+
+int main_process() ;
+
+static int parallel_jobs ;
+
+static boolean_t unity_mode = FALSE ;
+static boolean_t unity_rename = FALSE ;
+
+/* the files written so far, to number the renames
+ */
+static unsigned int unity_nfiles = 0 ;
+
+/* set while a #unity block is processing its files
+ */
+static boolean_t unity_nested = FALSE ;
+
+/* Words that take a bracketed group which is not part of the name
+ */
+static const char *unity_skip_words[] = {
+        "__attribute__", "__attribute", "__declspec", "_Alignas",
+        "alignas", "__asm__", "__asm", "asm",
+        NULL
+    } ;
+
+
+/* Skip a string or character constant starting at i
+ */
+static size_t unity_skip_quoted( const char *text, size_t len, size_t i )
+{
+    char quote = text[ i++ ] ;
+
+    while( ( i < len ) && ( text[i] != quote ) && ( text[i] != '\n' ) )
+    {
+        if( ( text[i] == '\\' ) && ( i + 1 < len ) )
+            i++ ;
+
+        i++ ;
+    };
+
+    return ( i < len ) ? i + 1 : len ;
+}
+
+
+/* Skip white space and comments, and preprocessor lines with bol set.
+ * bol is kept up to date.
+ */
+static size_t unity_skip_space( const char *text, size_t len, size_t i, boolean_t *bol )
+{
+    const char *p = NULL ;
+
+    while( i < len )
+    {
+        if( text[i] == '\n' )
+        {
+            *bol = TRUE ;
+            i++ ;
+        }
+        else if( isspace( (unsigned char)text[i] ) )
+        {
+            i++ ;
+        }
+        else if( ( text[i] == '/' ) && ( i + 1 < len ) && ( text[ i + 1 ] == '*' ) )
+        {
+            p = memmem( text + i + 2, len - i - 2, "*/", 2 ) ;
+            i = ( p != NULL ) ? (size_t)( p - text ) + 2 : len ;
+        }
+        else if( ( text[i] == '/' ) && ( i + 1 < len ) && ( text[ i + 1 ] == '/' ) )
+        {
+            while( ( i < len ) && ( text[i] != '\n' ) )
+                i++ ;
+        }
+        else if( *bol && ( text[i] == '#' ) )
+        {
+            while( ( i < len ) && ( text[i] != '\n' ) )
+            {
+                if( ( text[i] == '\\' ) && ( i + 1 < len ) )
+                    i++ ;
+
+                i++ ;
+            };
+        }
+        else
+        {
+            break ;
+        }
+    };
+
+    return i ;
+}
+
+
+static void unity_add_name( char ***namesp, int *nnamesp, const char *name, size_t len )
+{
+    char **names = NULL ;
+    int k = 0 ;
+
+    for( k = 0 ; k < *nnamesp ; k++ )
+    {
+        if( ( strlen( (*namesp)[k] ) == len ) && ( strncmp( (*namesp)[k], name, len ) == 0 ) )
+            return ;
+    }
+
+    names = (char **)realloc( *namesp, ( *nnamesp + 1 ) * sizeof(char *) ) ;
+
+    if( names == NULL )
+        return ;
+
+    *namesp = names ;
+
+    names[ *nnamesp ] = strndup( name, len ) ;
+
+    if( names[ *nnamesp ] != NULL )
+        (*nnamesp)++ ;
+}
+
+
+/* Find the names declared static at file scope in the output of a
+ * file.  The name of each declarator is the last word before its (,
+ * [, =, comma or ;, or the word after the * of a ( * name ) one.
+ */
+static int unity_statics( const char *text, size_t len, char ***namesp )
+{
+    int nnames = 0 ;
+    int depth = 0 ;
+    size_t i = 0 ;
+    size_t j = 0 ;
+    size_t k = 0 ;
+    const char *last = NULL ;
+    size_t lastlen = 0 ;
+    boolean_t bol = TRUE ;
+    boolean_t in_decl = FALSE ;     /* after a static, to its ; */
+    boolean_t in_body = FALSE ;     /* in the body of a static function */
+    boolean_t named = FALSE ;       /* the declarator has its name */
+    boolean_t in_init = FALSE ;
+    boolean_t fnptr = FALSE ;
+    char c = 0 ;
+
+    *namesp = NULL ;
+
+    while( TRUE )
+    {
+        i = unity_skip_space( text, len, i, &bol ) ;
+
+        if( i >= len )
+            break ;
+
+        bol = FALSE ;
+        c = text[i] ;
+
+        if( ( c == '"' ) || ( c == '\'' ) )
+        {
+            i = unity_skip_quoted( text, len, i ) ;
+
+            continue ;
+        }
+
+        if( issymbolchar( c ) )
+        {
+            for( j = i ; ( j < len ) && issymbolchar( text[j] ) ; j++ )
+                ;
+
+            if( ! in_decl )
+            {
+                if( ( depth == 0 ) && ( j - i == 6 ) && ( strncmp( text + i, "static", 6 ) == 0 ) )
+                {
+                    in_decl = TRUE ;
+                    named = in_init = fnptr = FALSE ;
+                    last = NULL ;
+                }
+            }
+            else if( ! in_body && ! in_init && ! isdigit( (unsigned char)c ) )
+            {
+                for( k = 0 ; unity_skip_words[k] != NULL ; k++ )
+                {
+                    if( ( strlen( unity_skip_words[k] ) == j - i ) && ( strncmp( text + i, unity_skip_words[k], j - i ) == 0 ) )
+                        break ;
+                }
+
+                if( unity_skip_words[k] != NULL )
+                {
+                    /* and its bracketed group
+                     */
+                    j = unity_skip_space( text, len, j, &bol ) ;
+
+                    if( ( j < len ) && ( text[j] == '(' ) )
+                    {
+                        for( k = 0 ; j < len ; )
+                        {
+                            if( ( text[j] == '"' ) || ( text[j] == '\'' ) )
+                            {
+                                j = unity_skip_quoted( text, len, j ) ;
+
+                                continue ;
+                            }
+
+                            if( text[j] == '(' )
+                                k++ ;
+
+                            if( ( text[j++] == ')' ) && ( --k == 0 ) )
+                                break ;
+                        };
+                    }
+                }
+                else if( ( depth == 0 ) && ! named )
+                {
+                    last = text + i ;
+                    lastlen = j - i ;
+                }
+                else if( fnptr && ( depth == 1 ) && ! named )
+                {
+                    unity_add_name( namesp, &nnames, text + i, j - i ) ;
+
+                    named = TRUE ;
+                }
+            }
+
+            i = j ;
+
+            continue ;
+        }
+
+        i++ ;
+
+        if( ! in_decl )
+        {
+            if( ( c == '(' ) || ( c == '[' ) || ( c == '{' ) )
+                depth++ ;
+            else if( ( ( c == ')' ) || ( c == ']' ) || ( c == '}' ) ) && ( depth > 0 ) )
+                depth-- ;
+
+            continue ;
+        }
+
+        if( ( depth == 0 ) && ! named && ! in_init && ( ( c == '(' ) || ( c == '[' ) || ( c == '=' ) || ( c == ',' ) || ( c == ';' ) ) )
+        {
+            j = unity_skip_space( text, len, i, &bol ) ;
+
+            if( ( c == '(' ) && ( j < len ) && ( text[j] == '*' ) )
+            {
+                fnptr = TRUE ;
+            }
+            else if( last != NULL )
+            {
+                unity_add_name( namesp, &nnames, last, lastlen ) ;
+
+                named = TRUE ;
+            }
+        }
+
+        if( ( c == '(' ) || ( c == '[' ) )
+        {
+            depth++ ;
+        }
+        else if( ( c == ')' ) || ( c == ']' ) )
+        {
+            if( depth > 0 )
+                depth-- ;
+        }
+        else if( c == '{' )
+        {
+            if( ( depth == 0 ) && ! in_init )
+            {
+                /* a function body, or a struct, union or enum whose tag
+                 * is not the name
+                 */
+                if( named )
+                    in_body = TRUE ;
+                else
+                    last = NULL ;
+            }
+
+            depth++ ;
+        }
+        else if( c == '}' )
+        {
+            if( depth > 0 )
+                depth-- ;
+
+            if( in_body && ( depth == 0 ) )
+                in_decl = in_body = FALSE ;
+        }
+        else if( ( c == '=' ) && ( depth == 0 ) )
+        {
+            in_init = TRUE ;
+        }
+        else if( ( c == ',' ) && ( depth == 0 ) )
+        {
+            named = in_init = fnptr = FALSE ;
+            last = NULL ;
+        }
+        else if( ( c == ';' ) && ( depth == 0 ) )
+        {
+            in_decl = FALSE ;
+        }
+    };
+
+    return nnames ;
+}
+
+
+/* Write the processed output of a file with its statics renamed around
+ * it.  srcmap holds the source map records made for it, with lines
+ * relative to its start.
+ */
+static void unity_write_renamed( const char *text, size_t len, uint32_t *srcmap, uint32_t nsrcmap )
+{
+    char **names = NULL ;
+    int nnames = 0 ;
+    int k = 0 ;
+    uint32_t r = 0 ;
+    unsigned int base = 0 ;
+
+    nnames = unity_statics( text, len, &names ) ;
+
+    if( ! out_at_bol )
+    {
+        FPUT( '\n' ) ;
+    }
+
+    for( k = 0 ; k < nnames ; k++ )
+    {
+        fout_printf( "#define %s %s_unity%u\n", names[k], names[k], unity_nfiles ) ;
+    }
+
+    base = outlinenum - 1 ;
+
+    fout_write( text, len ) ;
+
+    if( ! out_at_bol )
+    {
+        FPUT( '\n' ) ;
+    }
+
+    for( r = 0 ; r < nsrcmap ; r++ )
+    {
+        const char *saved = infilename ;
+
+        infilename = srcmap_files[ srcmap[ r * 3 + 1 ] ] ;
+
+        srcmap_add( base + srcmap[ r * 3 ], srcmap[ r * 3 + 2 ] ) ;
+
+        infilename = saved ;
+    }
+
+    for( k = 0 ; k < nnames ; k++ )
+    {
+        fout_printf( "#undef %s\n", names[k] ) ;
+
+        free( names[k] ) ;
+    }
+
+    safe_free( names ) ;
+
+    /* whatever comes next needs a marker
+     */
+    outline_delta = - (int)outlinenum ;
+}
+
+
+/* Process one file of a unity build, as main_process() would with the
+ * file given on its own, and put the result on the output
+ */
+static int unity_file( const char *path )
+{
+    int retv = 0 ;
+
+    input_state_t saved ;
+    directive_state_t ds ;
+
+    int old_capif_depth = capif_depth ;
+    int old_parallel_jobs = parallel_jobs ;
+    boolean_t old_mark_file_start = mark_file_start ;
+
+    FILE *old_fout = fout ;
+    unsigned int old_outlinenum = outlinenum ;
+    boolean_t old_out_at_bol = out_at_bol ;
+    int old_outline_delta = outline_delta ;
+    squeeze_state_t old_squeeze = squeeze ;
+    uint32_t old_nrecords = srcmap_nrecords ;
+    line_marker_t old_marker ;
+
+    char *text = NULL ;
+    size_t textlen = 0 ;
+    uint32_t *srcmap = NULL ;
+    uint32_t nsrcmap = 0 ;
+
+    input_state_save( &saved ) ;
+    directive_state_save( &ds ) ;
+
+    fin = fopen( path, "r" ) ;
+
+    if( fin == NULL )
+    {
+        if( unity_nested )
+            cap_error( "cannot read #unity file '%s'", path ) ;
+        else
+            fprintf( stderr, "cap: cannot read %s : %s\n", path, strerror( errno ) ) ;
+
+        retv = -1 ;
+
+        goto err_exit ;
+    }
+
+    inbuf = NULL ;
+    infilename = path ;
+
+    dep_add( path ) ;
+
+    if( engine == ENGINE_FAST )
+    {
+        load_input( fin ) ;
+    }
+
+    unity_nfiles++ ;
+
+    /* every file starts with a marker naming it
+     */
+    mark_file_start = TRUE ;
+
+    /* the file containing the #unity may be being shared out already
+     */
+    if( unity_nested )
+        parallel_jobs = 1 ;
+
+    if( unity_rename )
+    {
+        fout = open_memstream( &text, &textlen ) ;
+
+        if( fout == NULL )
+        {
+            fout = old_fout ;
+            retv = -1 ;
+
+            goto err_exit ;
+        }
+
+        marker_save( &old_marker ) ;
+        reset_output_lines() ;
+    }
+
+    retv = main_process() ;
+
+    if( unity_rename )
+    {
+        fclose( fout ) ;
+
+        fout = old_fout ;
+        outlinenum = old_outlinenum ;
+        out_at_bol = old_out_at_bol ;
+        outline_delta = old_outline_delta ;
+        squeeze = old_squeeze ;
+        marker_restore( &old_marker ) ;
+
+        /* the records for the text are put back after the renames
+         */
+        if( srcmap_nrecords > old_nrecords )
+        {
+            nsrcmap = srcmap_nrecords - old_nrecords ;
+            srcmap = (uint32_t *)malloc( nsrcmap * 3 * sizeof(uint32_t) ) ;
+
+            if( srcmap != NULL )
+                memcpy( srcmap, srcmap_records + old_nrecords * 3, nsrcmap * 3 * sizeof(uint32_t) ) ;
+            else
+                nsrcmap = 0 ;
+
+            srcmap_nrecords = old_nrecords ;
+        }
+
+        unity_write_renamed( text, textlen, srcmap, nsrcmap ) ;
+    }
+
+err_exit:
+
+    unload_input() ;
+    FCLOSE( fin ) ;
+
+    safe_free( text ) ;
+    safe_free( srcmap ) ;
+
+    input_state_restore( &saved ) ;
+    directive_state_restore( &ds ) ;
+    directive_state_free( &ds ) ;
+
+    capif_depth = old_capif_depth ;
+    parallel_jobs = old_parallel_jobs ;
+    mark_file_start = old_mark_file_start ;
+
+    /* the file the #unity is in carries on after a marker
+     */
+    if( unity_nested )
+        outline_delta = - (int)outlinenum ;
+
+    return retv ;
+}
+
+
+int process_unity()
+{
+    int c = 0 ;
+    char *p = NULL ;
+    char *q = NULL ;
+    char *path = NULL ;
+    unsigned int line = linenum ;
+
+    FILE *fs = NULL ;
+    char *list = NULL ;
+    size_t listlen = 0 ;
+
+    /* the names of the files, up to a single macrochar
+     */
+    fs = open_memstream( &list, &listlen ) ;
+
+    c = nextchar() ;
+
+    while( c != -1 )
+    {
+        if( c == (int)macrochar )
+        {
+            c = nextchar() ;
+
+            if( c == (int)'\n' )
+                break ;
+
+            if( fs != NULL )
+                fputc( (int)macrochar, fs ) ;
+
+            continue ;
+        }
+
+        if( fs != NULL )
+            fputc( c, fs ) ;
+
+        c = nextchar() ;
+    };
+
+    if( fs == NULL )
+    {
+        cap_error_at( line, "no memory for the #unity block" ) ;
+
+        return 0 ;
+    }
+
+    fclose( fs ) ;
+
+    if( parallel_child )
+    {
+        /* the files are processed when the chunk is done again in order
+         */
+        chunk_output = TRUE ;
+    }
+    else if( include_depth > 0 )
+    {
+        cap_error_at( line, "#unity can not be used in a #capinclude file" ) ;
+    }
+    else if( unity_nested || unity_mode )
+    {
+        cap_error_at( line, "#unity can not be used in a file of a unity build" ) ;
+    }
+    else if( ( capif_depth > 0 ) || ( output_nsinks != 0 ) )
+    {
+        cap_error_at( line, "#unity can not be used inside a #capif or after #output" ) ;
+    }
+    else
+    {
+        unity_nested = TRUE ;
+
+        for( p = strtok_r( list, "\n", &q ) ; p != NULL ; p = strtok_r( NULL, "\n", &q ) )
+        {
+            while( isspace( (unsigned char)*p ) )
+                p++ ;
+
+            if( *p == '"' )
+                p++ ;
+
+            path = p + strlen( p ) ;
+
+            while( ( path > p ) && ( isspace( (unsigned char)path[-1] ) || ( path[-1] == '"' ) ) )
+                path-- ;
+
+            *path = 0 ;
+
+            if( ( *p == 0 ) || ( ( p[0] == '/' ) && ( p[1] == '/' ) ) )
+                continue ;
+
+            path = find_include( p, TRUE ) ;
+
+            if( path == NULL )
+            {
+                cap_error_at( line, "cannot find #unity file '%s'", p ) ;
+
+                continue ;
+            }
+
+            /* a file that fails has been reported with cap_error(), and
+             * the directive itself was still understood
+             */
+            unity_file( path ) ;
+
+            free( path ) ;
+        };
+
+        unity_nested = FALSE ;
+    }
+
+    safe_free( list ) ;
+
+    return 0 ;
+}
+
+/*******************************************************
+ */
+
+
+/* process checks the keyword we read in and if it finds a valid
+ * word it does our extension processing
+ *
+ * This returns 0 if a keyword was found and processed and
+ * -1 if processing failed or no keyword was found.
+ */
+
+#define process_keyword( _kw, _proc ) \
+    \
+    if( iskeyword( #_kw ) ) \
+    { \
+        changes_made = TRUE ; \
+        \
+        retv = process_ ## _proc ; \
+        \
+        debugf( "Accepted keyword :: " #_kw "\n" ) ; \
+        \
+        goto err_exit ; \
+    }
+
+#define flag_keyword( _kw, _flag, _value ) \
+    \
+    if( iskeyword( #_kw ) ) \
+    { \
+        (_flag) = (_value) ; \
+        \
+        changes_made = TRUE ; \
+        \
+        debugf( "Accepted flag:: " #_kw "\n" ) ; \
+        \
+        retv = 0 ; \
+        \
+        goto err_exit ; \
+    }
+    
+
+/* Every directive process() knows after #skipoff, in the order it
+ * tries them.  directive_names[] is made from the same list, so the
+ * input can be checked for directives without processing it.
+ */
+#define CAP_DIRECTIVES( _keyword, _flag ) \
+    _flag( skipon, skip_is_on, TRUE ) \
+    _keyword( macrochar, macrochar() ) \
+    _keyword( debugon, debug( TRUE ) ) \
+    _keyword( debugoff, debug( FALSE ) ) \
+    _keyword( quote, quote() ) \
+    _keyword( comment, comment() ) \
+    _keyword( def, def() ) \
+    _keyword( constants, constants(0) ) \
+    _keyword( flags, constants(1) ) \
+    _keyword( constants-values, constants(2) ) \
+    _keyword( constants-negative, constants(3) ) \
+    _keyword( perfect_hash, perfect_hash() ) \
+    _keyword( table, table() ) \
+    _keyword( repeat, repeat() ) \
+    _keyword( embed, embed() ) \
+    _keyword( command, command( FALSE ) ) \
+    _keyword( command-expand, command( TRUE ) ) \
+    _keyword( redefine, redefine() ) \
+    _keyword( capinclude, capinclude() ) \
+    _keyword( command-deps, command_deps() ) \
+    _keyword( capif, capif() ) \
+    _keyword( capelif, capelse( FALSE ) ) \
+    _keyword( capelse, capelse( TRUE ) ) \
+    _keyword( capendif, capendif() ) \
+    _keyword( output, output( FALSE ) ) \
+    _keyword( output-both, output( TRUE ) ) \
+    _keyword( unity, unity() ) \
+    _flag( brace_macros_on, apply_brace_macros, TRUE ) \
+    _flag( brace_macros_off, apply_brace_macros, FALSE ) \
+    _keyword( def_open_brace, def_open_brace() ) \
+    _keyword( def_close_brace, def_close_brace() ) \
+    _flag( return_macro_on, apply_return_macro, TRUE ) \
+    _flag( return_macro_off, apply_return_macro, FALSE ) \
+    _keyword( def_return_macro, def_return_macro() )
+
+#define keyword_name( _kw, _proc )          #_kw,
+#define flag_name( _kw, _flag, _value )     #_kw,
+
+static const char *directive_names[] = {
+        "skipoff",
+        CAP_DIRECTIVES( keyword_name, flag_name )
+        NULL
+    } ;
+
+
+/* turn debug reporting from caps on or off
+ */
+static int process_debug( boolean_t on )
+{
+    if( on )
+        debug_on() ;
+    else
+        debug_off() ;
+
+    return 0 ;
+}
+
+
+static int plugin_process() ;
+
+
+int process()
+{
+    int retv = -1 ;
+
+    /* for safety
+     */
+    buff[BUFFLEN] = '\0' ;
+    
+    // debugf( "prebuff  = [%s]\n", prebuff ) ;
+    // debugf( "buff     = [%s]\n", buff ) ;
+    // debugf( "postbuff = [%s]\n", postbuff ) ;
+    
+    flag_keyword( skipoff, skip_is_on, FALSE ) ;
+    
+    /* NOTE :
+     *
+     * The following check for skip_is_on must only be made
+     * AFTER checking for a skipoff directive.
+     *
+     * If it's done before that then we never check for skipoff
+     * and we could skip forever !
+     */
+
+    if( skip_is_on )
+    {
+        return -1 ;
+    }
+
+    CAP_DIRECTIVES( process_keyword, flag_keyword )
+
+    retv = plugin_process() ;
+    
+err_exit:
+    
+    return retv ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* Plugins : cap --plugin lib.so loads a shared library into cap and
+ * its cap_plugin_init() adds directives, which are then called in
+ * place at the cost of a function call.  The interface is in
+ * cap_plugin.h.
+ */
+
+struct plugin_directive_s {
+    char                *keyword ;
+    int                 flags ;
+    cap_directive_fn    fn ;
+    void                *user ;
+    const char          *plugin ;   /* the library, for messages */
+    } ;
+
+typedef struct plugin_directive_s   plugin_directive_t ;
+
+static plugin_directive_t *plugin_directives = NULL ;
+static int plugin_ndirectives = 0 ;
+
+struct cap_sink_s {
+    FILE                *capture ;  /* or NULL for the output */
+    plugin_directive_t  *pd ;
+    unsigned int        line ;
+    boolean_t           failed ;
+    } ;
+
+
+static plugin_directive_t *plugin_find( const char *word, size_t len )
+{
+    int k = 0 ;
+
+    for( k = 0 ; k < plugin_ndirectives ; k++ )
+    {
+        if( ( strlen( plugin_directives[k].keyword ) == len ) &&
+            ( strncmp( plugin_directives[k].keyword, word, len ) == 0 ) )
+            return &plugin_directives[k] ;
+    }
+
+    return NULL ;
+}
+
+
+static boolean_t plugin_is_block( const char *word, size_t len )
+{
+    plugin_directive_t *pd = plugin_find( word, len ) ;
+
+    return ( pd != NULL ) && ( ( pd->flags & CAP_DIRECTIVE_BLOCK ) != 0 ) ;
+}
+
+
+/* plugins are only loaded from the command line
+ */
+#ifndef CAP_FUZZER
+
+/* the library whose cap_plugin_init() is running
+ */
+static const char *plugin_loading = NULL ;
+
+
+static int plugin_add_directive( const char *keyword, int flags, cap_directive_fn fn, void *user )
+{
+    plugin_directive_t *pd = NULL ;
+    const char *why = NULL ;
+    const char *p = NULL ;
+    size_t len = ( keyword != NULL ) ? strlen( keyword ) : 0 ;
+    int k = 0 ;
+
+    for( p = keyword ; ( p != NULL ) && ( *p != 0 ) && ( issymbolchar( *p ) || ( *p == '-' ) ) ; p++ )
+        ;
+
+    if( plugin_loading == NULL )
+    {
+        return -1 ;
+    }
+    else if( ( len == 0 ) || ( len >= 32 ) || ( *p != 0 ) || ( fn == NULL ) )
+    {
+        why = "not a keyword" ;
+    }
+    else if( plugin_find( keyword, len ) != NULL )
+    {
+        why = "added already" ;
+    }
+    else
+    {
+        for( k = 0 ; directive_names[k] != NULL ; k++ )
+        {
+            if( strcmp( directive_names[k], keyword ) == 0 )
+                why = "one of cap's own" ;
+        }
+    }
+
+    if( why != NULL )
+    {
+        fprintf( stderr, "cap: plugin %s can not add #%s : %s\n", plugin_loading, ( keyword != NULL ) ? keyword : "", why ) ;
+
+        return -1 ;
+    }
+
+    pd = (plugin_directive_t *)realloc( plugin_directives, ( plugin_ndirectives + 1 ) * sizeof(plugin_directive_t) ) ;
+
+    if( pd == NULL )
+        return -1 ;
+
+    plugin_directives = pd ;
+
+    pd = &plugin_directives[ plugin_ndirectives ] ;
+
+    pd->keyword = strdup( keyword ) ;
+    pd->flags = flags ;
+    pd->fn = fn ;
+    pd->user = user ;
+    pd->plugin = plugin_loading ;
+
+    if( pd->keyword == NULL )
+        return -1 ;
+
+    plugin_ndirectives++ ;
+
+    return 0 ;
+}
+
+
+static void plugin_write( cap_sink_t *sink, const char *data, size_t len )
+{
+    if( sink->capture != NULL )
+    {
+        fwrite( data, 1, len, sink->capture ) ;
+    }
+    else
+    {
+        fout_write( data, len ) ;
+    }
+}
+
+
+static void plugin_error( cap_sink_t *sink, const char *fmt, ... )
+{
+    char message[ 512 ] ;
+    va_list ap ;
+
+    va_start( ap, fmt ) ;
+    vsnprintf( message, sizeof(message), fmt, ap ) ;
+    va_end( ap ) ;
+
+    cap_error_at( sink->line, "#%s : %s", sink->pd->keyword, message ) ;
+
+    sink->failed = TRUE ;
+}
+
+
+static const cap_host_t plugin_host = {
+        CAP_PLUGIN_ABI_VERSION,
+        sizeof(cap_host_t),
+        plugin_add_directive,
+        plugin_write,
+        plugin_error
+    } ;
+
+
+static int plugin_load( const char *path )
+{
+    void *lib = NULL ;
+    cap_plugin_init_fn init = NULL ;
+    int old_ndirectives = plugin_ndirectives ;
+    int r = 0 ;
+
+    lib = dlopen( path, RTLD_NOW | RTLD_LOCAL ) ;
+
+    if( lib == NULL )
+    {
+        fprintf( stderr, "cap: cannot load plugin %s : %s\n", path, dlerror() ) ;
+
+        return -1 ;
+    }
+
+    init = (cap_plugin_init_fn)dlsym( lib, CAP_PLUGIN_INIT ) ;
+
+    if( init == NULL )
+    {
+        fprintf( stderr, "cap: plugin %s has no %s()\n", path, CAP_PLUGIN_INIT ) ;
+
+        dlclose( lib ) ;
+
+        return -1 ;
+    }
+
+    plugin_loading = path ;
+
+    r = init( &plugin_host ) ;
+
+    plugin_loading = NULL ;
+
+    if( r != 0 )
+    {
+        fprintf( stderr, "cap: plugin %s failed to start\n", path ) ;
+
+        while( plugin_ndirectives > old_ndirectives )
+        {
+            free( plugin_directives[ --plugin_ndirectives ].keyword ) ;
+        };
+
+        dlclose( lib ) ;
+
+        return -1 ;
+    }
+
+    /* the library stays loaded for the rest of the run
+     */
+    return 0 ;
+}
+
+#endif /* CAP_FUZZER */
+
+
+/* Run a plugin's directive, if the keyword in buff is one
+ */
+static int plugin_process()
+{
+    plugin_directive_t *pd = NULL ;
+    cap_block_t block ;
+    cap_sink_t sink ;
+    char *word = buff + 1 ;
+    int c = 0 ;
+    int r = 0 ;
+
+    FILE *fs = NULL ;
+    char *body = NULL ;
+    size_t bodylen = 0 ;
+    char *output = NULL ;
+    size_t outlen = 0 ;
+
+    while( iswhitespace( *word ) )
+        word++ ;
+
+    pd = plugin_find( word, strlen( word ) ) ;
+
+    if( pd == NULL )
+        return -1 ;
+
+    changes_made = TRUE ;
+
+    memset( &block, 0, sizeof(block) ) ;
+    memset( &sink, 0, sizeof(sink) ) ;
+
+    sink.pd = pd ;
+    sink.line = linenum ;
+
+    block.keyword = pd->keyword ;
+    block.file = infilename ;
+    block.line = linenum ;
+
+    capif_read_args() ;
+
+    block.args = buff ;
+
+    if( pd->flags & CAP_DIRECTIVE_BLOCK )
+    {
+        fs = open_memstream( &body, &bodylen ) ;
+
+        c = nextchar() ;
+
+        while( c != -1 )
+        {
+            if( c == (int)macrochar )
+            {
+                c = nextchar() ;
+
+                if( c == (int)'\n' )
+                    break ;
+
+                if( fs != NULL )
+                    fputc( (int)macrochar, fs ) ;
+
+                continue ;
+            }
+
+            if( fs != NULL )
+                fputc( c, fs ) ;
+
+            c = nextchar() ;
+        };
+
+        if( fs == NULL )
+        {
+            cap_error_at( sink.line, "no memory for the #%s block", pd->keyword ) ;
+
+            return 0 ;
+        }
+
+        fclose( fs ) ;
+
+        block.body = body ;
+        block.body_len = bodylen ;
+    }
+
+    if( pd->flags & CAP_DIRECTIVE_EXPAND )
+    {
+        if( command_expand_depth >= COMMAND_EXPAND_MAX_DEPTH )
+        {
+            cap_error_at( sink.line, "#%s nested more than %d deep", pd->keyword, COMMAND_EXPAND_MAX_DEPTH ) ;
+
+            goto err_exit ;
+        }
+
+        sink.capture = open_memstream( &output, &outlen ) ;
+
+        if( sink.capture == NULL )
+        {
+            cap_error_at( sink.line, "no memory for the #%s output", pd->keyword ) ;
+
+            goto err_exit ;
+        }
+    }
+
+    r = pd->fn( pd->user, &block, &sink ) ;
+
+    if( ( r != 0 ) && ! sink.failed )
+    {
+        cap_error_at( sink.line, "#%s failed in plugin %s", pd->keyword, pd->plugin ) ;
+    }
+
+    if( sink.capture != NULL )
+    {
+        fclose( sink.capture ) ;
+
+        command_expand_depth++ ;
+
+        expand_process_text( output, outlen, sink.line, pd->keyword ) ;
+
+        command_expand_depth-- ;
+    }
+
+err_exit:
+
+    safe_free( body ) ;
+    safe_free( output ) ;
+
+    return 0 ;
+}
+
+
+/* Reset the reading state for the start of a new input
+ */
+static void reset_input_state()
+{
+    BUFFER_INIT( deferredbuffer ) ;
+    
+    escape_pending = FALSE ;
+    
+    in_comment = FALSE ;
+    in_quotes = FALSE ;
+    
+    lastchar_read = -1 ;
+    currentchar_read = -1 ;
+    
+    BUFFER_INIT( prebuff ) ;
+    BUFFER_INIT( buff ) ;
+    BUFFER_INIT( postbuff ) ;
+
+    
+    BUFFER_INIT( rotatingbuffer ) ;
+    
+    pendingchar = -1 ;
+    
+    quote_pending = FALSE ;
+    
+    skip_is_on = FALSE ;
+    
+    linenum = 1 ;
+}
+
+
+/*******************************************************************
+ *
+ * Most files have no directives at all, and cap's output for them is
+ * the input unchanged.  For those the fast engine copies the file
+ * across without looking at the characters, in the kernel where it
+ * can.
+ */
+
+
+/* Is the line from p to eol a directive line naming one of names, or
+ * a plugin directive where plugins is set
+ */
+static boolean_t directive_line_in( const unsigned char *p, const unsigned char *eol, const char **names,
+                                    boolean_t plugins )
+{
+    const unsigned char *w = NULL ;
+    int k = 0 ;
+
+    if( ( p >= eol ) || ( *p != (unsigned char)macrochar ) )
+        return FALSE ;
+
+    p++ ;
+
+    while( ( p < eol ) && iswhitespace( *p ) )
+        p++ ;
+
+    for( w = p ; ( p < eol ) && !isspace( *p ) ; p++ )
+        ;
+
+    for( k = 0 ; names[k] != NULL ; k++ )
+    {
+        if( ( strlen( names[k] ) == (size_t)( p - w ) ) && ( memcmp( names[k], w, (size_t)( p - w ) ) == 0 ) )
+            return TRUE ;
+    }
+
+    if( plugins && ( plugin_find( (const char *)w, (size_t)( p - w ) ) != NULL ) )
+        return TRUE ;
+
+    return FALSE ;
+}
+
+
+/* Check whether the input can only come out unchanged.
+ *
+ * A directive can only start where the macrochar begins a line, so
+ * the lines the engine would look at are found with the lexer tables
+ * and checked against the directive names.  The engine reads those
+ * lines and // comments into the directive buffer, which drops what
+ * follows a NUL and cuts long lines, so input with such lines is left
+ * to it as well.
+ */
+static boolean_t is_directive_free( const unsigned char *data, size_t len )
+{
+    const unsigned char *p = data ;
+    const unsigned char *end = data + len ;
+    const unsigned char *eol = NULL ;
+    boolean_t odd = FALSE ;
+
+    if( apply_brace_macros || apply_return_macro )
+        return FALSE ;
+
+    while( ( p = lex_find_macro_line( p, end, &odd ) ) != NULL )
+    {
+        eol = memchr( p, '\n', (size_t)( end - p ) ) ;
+
+        if( eol == NULL )
+            eol = end ;
+
+        if( ( eol - p >= BUFFLEN ) || ( memchr( p, 0, (size_t)( eol - p ) ) != NULL ) )
+            return FALSE ;
+
+        if( directive_line_in( p, eol, directive_names, TRUE ) )
+            return FALSE ;
+
+        p = eol + 1 ;
+    };
+
+    return ! odd ;
+}
+
+
+/* Copy the whole input to the output unchanged
+ */
+static int copy_through()
+{
+    const char *q = (const char *)inbuf ;
+    const char *end = (const char *)inbuf + inbuf_len ;
+    loff_t off = 0 ;
+    ssize_t n = 0 ;
+    int fd = -1 ;
+
+    if( inbuf_len == 0 )
+        return 0 ;
+
+    marker_flush() ;
+
+    fflush( fout ) ;
+
+    fd = fileno( fout ) ;
+
+    /* copy_file_range() can share the blocks on filesystems that
+     * support it, and sendfile() covers pipes and sockets.  Both need
+     * the input to be a real file.
+     */
+    if( ( inbuf_type == INBUF_MAPPED ) && ( fin != NULL ) && ( fd >= 0 ) )
+    {
+        while( (size_t)off < inbuf_len )
+        {
+            n = copy_file_range( fileno( fin ), &off, fd, NULL, inbuf_len - (size_t)off, 0 ) ;
+
+            if( n <= 0 )
+                break ;
+        };
+
+        while( (size_t)off < inbuf_len )
+        {
+            n = sendfile( fd, fileno( fin ), &off, inbuf_len - (size_t)off ) ;
+
+            if( n <= 0 )
+                break ;
+        };
+    }
+
+    /* and anything left through stdio
+     */
+    if( (size_t)off < inbuf_len )
+    {
+        fwrite( inbuf + off, 1, inbuf_len - (size_t)off, fout ) ;
+    }
+
+    while( ( q = memchr( q, '\n', (size_t)( end - q ) ) ) != NULL )
+    {
+        outlinenum++ ;
+        linenum++ ;
+        q++ ;
+    };
+
+    out_at_bol = ( end[-1] == '\n' ) ;
+
+    inbuf_pos = inbuf_len ;
+    inbuf_eof = TRUE ;
+
+    return 0 ;
+}
+
+
+/*******************************************************************
+ *
+ * A big file can be processed in parallel.  It is cut into chunks at
+ * line starts and a child process runs each chunk, guessing that it
+ * starts in the state the file started in : outside any comment,
+ * string, block or #capif, with the same macrochar and macro settings
+ * and skipping off.
+ *
+ * The chunks are then taken in order.  Each chunk runs on past its
+ * end to the first line start where nothing is part done, and if that
+ * is exactly where the next chunk starts and the state there is the
+ * guessed one then the next chunk's output is right and is used.
+ * Otherwise the next part is processed here as it would have been
+ * without the children.  Files that never change their settings, the
+ * usual case, go almost as many times faster as there are jobs.
+ */
+
+#define PARALLEL_MIN_CHUNK  ( 1024 * 1024 )
+
+static int parallel_jobs = 1 ;
+
+/* where process_stream() is to stop for the current chunk
+ */
+static const unsigned char *chunk_inbuf = NULL ;
+static size_t chunk_end = 0 ;
+static boolean_t chunk_stopped = FALSE ;
+
+
+struct parallel_chunk_s {
+    size_t          start ;
+    unsigned int    line ;      /* input line the chunk starts on */
+
+    pid_t           pid ;
+
+    FILE            *out ;      /* the chunk's output */
+    FILE            *err ;      /* and its messages */
+    FILE            *state ;    /* and how it ended */
+    } ;
+
+typedef struct parallel_chunk_s     parallel_chunk_t ;
+
+
+static void parallel_write_string( FILE *fs, char tag, const char *str )
+{
+    if( str != NULL )
+    {
+        fprintf( fs, "%c%s\n", tag, str ) ;
+    }
+}
+
+
+/* Process one chunk in a child process and write how it ended
+ */
+static void parallel_run_chunk( parallel_chunk_t *pc, size_t end )
+{
+    int k = 0 ;
+
+    dup2( fileno( pc->err ), 2 ) ;
+
+    fout = pc->out ;
+
+    /* as the engine is at the start of a line
+     */
+    inbuf_pos = pc->start ;
+    pendingchar = -1 ;
+    BUFFER_INIT( deferredbuffer ) ;
+    currentchar_read = (int)'\n' ;
+    linenum = pc->line - 1 ;
+
+    outlinenum = pc->line ;
+    outline_delta = 0 ;
+    out_at_bol = TRUE ;
+
+    cap_errors = 0 ;
+    dep_nfiles = 0 ;
+
+    chunk_inbuf = inbuf ;
+    chunk_end = end ;
+    chunk_stopped = FALSE ;
+    chunk_included = FALSE ;
+    capif_depth = 0 ;
+    parallel_child = TRUE ;
+    chunk_output = FALSE ;
+
+    process_stream() ;
+
+    /* the parent goes on from the state here, so a marker held back
+     * has to be in the output
+     */
+    marker_flush() ;
+
+    fprintf( pc->state, "%lu %u %d %d %d %u %d %d %d %d %d %d %d %d %d %d\n",
+                (unsigned long)inbuf_pos, linenum, chunk_stopped, out_at_bol,
+                outline_delta, outlinenum, cap_errors, chunk_included,
+                (int)(unsigned char)macrochar, apply_brace_macros, apply_return_macro,
+                skip_is_on, inside_quotes, quote_pending || escape_pending, capif_depth,
+                chunk_output ) ;
+
+    parallel_write_string( pc->state, 'O', open_brace_macro ) ;
+    parallel_write_string( pc->state, 'C', close_brace_macro ) ;
+    parallel_write_string( pc->state, 'R', return_macro ) ;
+
+    for( k = 0 ; k < included_nguarded ; k++ )
+    {
+        parallel_write_string( pc->state, 'G', included_guarded[k] ) ;
+    }
+
+    for( k = 0 ; k < dep_nfiles ; k++ )
+    {
+        parallel_write_string( pc->state, 'D', dep_files[k] ) ;
+    }
+
+    fflush( pc->out ) ;
+    fflush( pc->state ) ;
+
+    _exit( 0 ) ;
+}
+
+
+/* Take the result of a child if it is the output the chunk should
+ * have.  Returns FALSE if it has to be processed here instead.
+ */
+static boolean_t parallel_use_chunk( parallel_chunk_t *pc, directive_state_t *guess )
+{
+    unsigned long pos = 0 ;
+    unsigned int line = 0 ;
+    int stopped = 0 ;
+    int bol = 0 ;
+    int delta = 0 ;
+    unsigned int lines = 0 ;
+    int errors = 0 ;
+    int included = 0 ;
+    int mc = 0 ;
+    int brace = 0 ;
+    int ret = 0 ;
+    int skip = 0 ;
+    int quotes = 0 ;
+    int pending = 0 ;
+    int capifs = 0 ;
+    int outputs = 0 ;
+    int status = 0 ;
+    char *str = NULL ;
+    size_t sz = 0 ;
+    ssize_t len = 0 ;
+    char *data = NULL ;
+    long outlen = 0 ;
+
+    /* the state here has to be the one that was guessed
+     */
+    if( ( inbuf_pos != pc->start ) || ! chunk_stopped || ! out_at_bol ||
+        ( outlinenum + outline_delta != pc->line ) ||
+        ! directive_state_is_current( guess ) || skip_is_on ||
+        inside_quotes || quote_pending || escape_pending || ( capif_depth != 0 ) ||
+        output_redirected() )
+        return FALSE ;
+
+    if( ( waitpid( pc->pid, &status, 0 ) != pc->pid ) || ! WIFEXITED( status ) || ( WEXITSTATUS( status ) != 0 ) )
+        return FALSE ;
+
+    pc->pid = 0 ;
+
+    rewind( pc->state ) ;
+
+    if( fscanf( pc->state, "%lu %u %d %d %d %u %d %d %d %d %d %d %d %d %d %d\n",
+                &pos, &line, &stopped, &bol, &delta, &lines, &errors, &included,
+                &mc, &brace, &ret, &skip, &quotes, &pending, &capifs, &outputs ) != 16 )
+        return FALSE ;
+
+    /* a child can not know which guarded files were included before,
+     * its #capif stack is not passed back and it can not write #output
+     * files
+     */
+    if( ( included && ( included_nguarded > 0 ) ) || ( capifs != 0 ) || outputs )
+        return FALSE ;
+
+    fflush( pc->out ) ;
+
+    outlen = ftell( pc->out ) ;
+
+    if( outlen > 0 )
+    {
+        data = mmap( NULL, (size_t)outlen, PROT_READ, MAP_PRIVATE, fileno( pc->out ), 0 ) ;
+
+        if( data == MAP_FAILED )
+            return FALSE ;
+
+        fout_write( data, (size_t)outlen ) ;
+
+        munmap( data, (size_t)outlen ) ;
+    }
+
+    /* and carry on from where it stopped, in its state
+     */
+    outline_delta = (int)( lines + delta ) - (int)outlinenum ;
+    out_at_bol = bol ;
+
+    inbuf_pos = (size_t)pos ;
+    linenum = line ;
+    chunk_stopped = stopped ;
+    cap_errors += errors ;
+
+    if( ! stopped )
+    {
+        inbuf_pos = inbuf_len ;
+        inbuf_eof = TRUE ;
+    }
+
+    macrochar = (char)mc ;
+    apply_brace_macros = brace ;
+    apply_return_macro = ret ;
+    skip_is_on = skip ;
+    inside_quotes = quotes ;
+    quote_pending = pending ;
+
+    safe_free( open_brace_macro ) ;
+    safe_free( close_brace_macro ) ;
+    safe_free( return_macro ) ;
+
+    while( ( len = getline( &str, &sz, pc->state ) ) > 0 )
+    {
+        if( str[ len - 1 ] == '\n' )
+            str[ len - 1 ] = 0 ;
+
+        switch( str[0] )
+        {
+            case 'O' :  open_brace_macro = strdup( str + 1 ) ;      break ;
+            case 'C' :  close_brace_macro = strdup( str + 1 ) ;     break ;
+            case 'R' :  return_macro = strdup( str + 1 ) ;          break ;
+            case 'G' :  remember_guarded( str + 1 ) ;               break ;
+            case 'D' :  dep_add( str + 1 ) ;                        break ;
+        }
+    };
+
+    safe_free( str ) ;
+
+    /* and the messages it gave
+     */
+    rewind( pc->err ) ;
+
+    while( ( len = getline( &str, &sz, pc->err ) ) > 0 )
+    {
+        fwrite( str, 1, (size_t)len, stderr ) ;
+    };
+
+    safe_free( str ) ;
+
+    return TRUE ;
+}
+
+
+static void parallel_end_chunk( parallel_chunk_t *pc )
+{
+    int status = 0 ;
+
+    if( pc->pid > 0 )
+    {
+        kill( pc->pid, SIGKILL ) ;
+        waitpid( pc->pid, &status, 0 ) ;
+    }
+
+    pc->pid = 0 ;
+
+    FCLOSE( pc->out ) ;
+    FCLOSE( pc->err ) ;
+    FCLOSE( pc->state ) ;
+}
+
+
+/* The directives that act outside the output.  A child would run
+ * them for a chunk whose output may be thrown away, so a file holding
+ * any of them is processed in order.  #capinclude files can hold them
+ * too, and after #macrochar the lines can not be checked at all.
+ * Children guess that they start outside a comment, so the lines in
+ * comments are checked here too.
+ */
+static const char *parallel_unsafe_names[] = {
+        "command", "command-expand", "output", "output-both", "capinclude", "macrochar",
+        NULL
+    } ;
+
+
+/* Can the chunks of the input be guessed at in children
+ */
+static boolean_t parallel_is_safe( const unsigned char *data, size_t len )
+{
+    const unsigned char *p = data ;
+    const unsigned char *end = data + len ;
+    const unsigned char *eol = NULL ;
+
+    while( p < end )
+    {
+        eol = memchr( p, '\n', (size_t)( end - p ) ) ;
+
+        if( eol == NULL )
+            eol = end ;
+
+        if( directive_line_in( p, eol, parallel_unsafe_names, TRUE ) )
+            return FALSE ;
+
+        p = eol + 1 ;
+    };
+
+    return TRUE ;
+}
+
+
+/* Process the whole of the in memory input using parallel_jobs
+ * processes.  Returns as process_stream() does.
+ */
+static int process_parallel()
+{
+    int retv = 0 ;
+    int nchunks = 0 ;
+    int k = 0 ;
+    size_t want = 0 ;
+    size_t at = 0 ;
+    unsigned int line = 1 ;
+    const unsigned char *q = NULL ;
+    parallel_chunk_t *chunks = NULL ;
+    directive_state_t guess ;
+
+    nchunks = (int)( inbuf_len / PARALLEL_MIN_CHUNK ) ;
+
+    if( nchunks > parallel_jobs )
+        nchunks = parallel_jobs ;
+
+    if( ( nchunks < 2 ) || ! parallel_is_safe( inbuf, inbuf_len ) )
+        return process_stream() ;
+
+    chunks = (parallel_chunk_t *)calloc( (size_t)nchunks, sizeof(parallel_chunk_t) ) ;
+
+    if( chunks == NULL )
+        return process_stream() ;
+
+    /* cut at the first line start after each even share, counting the
+     * lines on the way
+     */
+    for( k = 0 ; k < nchunks ; k++ )
+    {
+        want = ( inbuf_len / (size_t)nchunks ) * (size_t)k ;
+
+        while( at < want )
+        {
+            q = memchr( inbuf + at, '\n', inbuf_len - at ) ;
+
+            if( q == NULL )
+            {
+                at = inbuf_len ;
+                break ;
+            }
+
+            at = (size_t)( q - inbuf ) + 1 ;
+            line++ ;
+        };
+
+        if( ( at >= inbuf_len ) || ( ( k > 0 ) && ( at == chunks[ k - 1 ].start ) ) )
+            break ;
+
+        chunks[k].start = at ;
+        chunks[k].line = line ;
+    }
+
+    nchunks = k ;
+
+    directive_state_save( &guess ) ;
+
+    marker_flush() ;
+
+    fflush( fout ) ;
+    fflush( stdout ) ;
+    fflush( stderr ) ;
+
+    /* the first chunk is done here, the others in children
+     */
+    for( k = 1 ; k < nchunks ; k++ )
+    {
+        chunks[k].out = tmpfile() ;
+        chunks[k].err = tmpfile() ;
+        chunks[k].state = tmpfile() ;
+
+        if( ( chunks[k].out == NULL ) || ( chunks[k].err == NULL ) || ( chunks[k].state == NULL ) )
+            continue ;
+
+        chunks[k].pid = fork() ;
+
+        if( chunks[k].pid == 0 )
+        {
+            parallel_run_chunk( &chunks[k], ( k + 1 < nchunks ) ? chunks[ k + 1 ].start : inbuf_len + 1 ) ;
+        }
+    }
+
+    chunk_inbuf = inbuf ;
+    chunk_end = chunks[1].start ;
+    chunk_stopped = FALSE ;
+
+    retv = process_stream() ;
+
+    k = 1 ;
+
+    while( ( k < nchunks ) && chunk_stopped )
+    {
+        if( ( chunks[k].pid > 0 ) && parallel_use_chunk( &chunks[k], &guess ) )
+        {
+            parallel_end_chunk( &chunks[k++] ) ;
+            continue ;
+        }
+
+        /* this chunk is processed here, and processing may run on past
+         * the start of the next few
+         */
+        parallel_end_chunk( &chunks[k++] ) ;
+
+        while( ( k < nchunks ) && ( inbuf_pos > chunks[k].start ) )
+        {
+            parallel_end_chunk( &chunks[k++] ) ;
+        };
+
+        if( ( k < nchunks ) && ( inbuf_pos == chunks[k].start ) )
+            continue ;
+
+        chunk_end = ( k < nchunks ) ? chunks[k].start : inbuf_len + 1 ;
+        chunk_stopped = FALSE ;
+
+        retv = process_stream() ;
+    };
+
+    while( k < nchunks )
+    {
+        parallel_end_chunk( &chunks[k++] ) ;
+    };
+
+    chunk_inbuf = NULL ;
+    chunk_end = 0 ;
+
+    directive_state_free( &guess ) ;
+
+    free( chunks ) ;
+
+    return retv ;
+}
+
+
+/*******************************************************************
+ *
+ * main_process() processes each individual file passed to cap
+ *
+ * There is no cross-file communication.  Each file starts with a
+ * clean state in cap.
+ *
+ */
+int main_process()
+{
+    int retv = 0 ;
+
+    if( ( fin == NULL ) && ( inbuf == NULL ) )
+    {
+        return 0 ;
+    }
+    
+    /* Initialize the state variables for a new file
+     */
+    
+    apply_brace_macros = FALSE ;
+    
+    macrochar = initial_macrochar ;
+    
+    reset_input_state() ;
+    
+    forget_include_guards() ;
+
+    capif_depth = 0 ;
+
+    /* If this file does not start the output ( e.g. it follows another
+     * file ) then a marker is needed to say where it comes from
+     */
+    if( mark_file_start )
+    {
+        if( ! out_at_bol )
+        {
+            FPUT( '\n' ) ;
+        }
+
+        emit_line_marker( 1 ) ;
+    }
+    else if( out_at_bol && ( outlinenum + outline_delta == 1 ) )
+    {
+        srcmap_add( outlinenum, 1 ) ;
+    }
+    else
+    {
+        sync_output_line( 1, FALSE ) ;
+    }
+
+    if( ( engine == ENGINE_FAST ) && ( inbuf != NULL ) && ! strip_comments && ! squeeze_blank_lines &&
+        is_directive_free( inbuf, inbuf_len ) )
+    {
+        return copy_through() ;
+    }
+
+    /* the blank lines squeezed out where the chunks join would need
+     * markers the children can not know about
+     */
+    if( ( engine == ENGINE_FAST ) && ( inbuf != NULL ) && ( parallel_jobs > 1 ) && ( srcmap_path == NULL ) &&
+        ! squeeze_blank_lines )
+    {
+        retv = process_parallel() ;
+    }
+    else
+    {
+        retv = process_stream() ;
+    }
+
+    capif_check_end( 0 ) ;
+
+    retv = output_finish( retv ) ;
+
+    return retv ;
+}
+
+
+/*******************************************************************
+ *
+ * The scan of ordinary lines with the fast engine, on the tables above
+ */
+
+
+/* Whether the scanner can be used for the rest of the current line
+ */
+#define LEX_USABLE()    ( ( inbuf != NULL ) && ( engine == ENGINE_FAST ) && \
+                          ( pendingchar == -1 ) && ( BUFFER_INDEX( deferredbuffer ) == 0 ) )
+
+
+/* Copy as much of the current line as can be copied unchanged, and
+ * leave the reading state as if the ladder had read it.  Returns the
+ * last character taken, as process_stream() keeps it.
+ */
+static int lex_scan_line()
+{
+    const unsigned char *start = inbuf + inbuf_pos ;
+    const unsigned char *p = start ;
+    const unsigned char *end = inbuf + inbuf_len ;
+    const unsigned char *mark = start ;
+    const unsigned char *nl = NULL ;
+    unsigned char (*t)[ LEX_CLASSES ] = NULL ;
+    int prev = currentchar_read ;
+    int state = LEX_CODE ;
+    int next = 0 ;
+
+    if( lex_class[ '\n' ] != LC_NL )
+        lex_init() ;
+
+    t = lex_next[ LEX_MODE() ] ;
+
+    /* a / the ladder has passed with --strip-comments does not start
+     * a comment, and the scanner can not give it back
+     */
+    if( ( prev == (int)'/' ) && ! strip_comments )
+        state = LEX_SLASH ;
+    else if( prev == (int)'\\' )
+        state = LEX_BSLASH ;
+    else if( iswhitespace( prev ) )
+        state = LEX_WS ;
+
+    while( p < end )
+    {
+        next = t[ state ][ lex_class[ *p ] ] ;
+
+        if( next < LEX_STATES )
+        {
+            state = next ;
+            p++ ;
+            continue ;
+        }
+
+        if( next == LEX_EOL )
+        {
+            p++ ;
+            state = LEX_CODE ;
+            break ;
+        }
+
+        if( next == LEX_ENTER_COMMENT )
+        {
+            mark = p++ ;
+            state = LEX_COMMENT_STAR ;
+        }
+        else if( next == LEX_ENTER_DQ )
+        {
+            mark = p++ ;
+            state = LEX_DQ ;
+        }
+        else if( next == LEX_ENTER_SQ )
+        {
+            mark = p++ ;
+            state = LEX_SQ ;
+        }
+        else if( next == LEX_LINE_COMMENT )
+        {
+            /* read_to_eol() drops anything after a NUL, mangles lines
+             * longer than its buffer and puts in brace macros, so leave
+             * those
+             */
+            nl = memchr( p + 1, '\n', (size_t)( end - p - 1 ) ) ;
+
+            if( ( nl != NULL ) && ( nl - p < BUFFLEN - 1 ) && ( memchr( p + 1, 0, (size_t)( nl - p - 1 ) ) == NULL ) &&
+                ! ( apply_brace_macros && ( ( memchr( p + 1, '{', (size_t)( nl - p - 1 ) ) != NULL ) ||
+                                            ( memchr( p + 1, '}', (size_t)( nl - p - 1 ) ) != NULL ) ) ) )
+            {
+                p = nl + 1 ;
+            }
+
+            break ;
+        }
+        else
+        {
+            if( next == LEX_GIVE_BACK )
+                p = mark ;
+            else if( next == LEX_STOP_BEFORE )
+                p-- ;
+
+            break ;
+        }
+    };
+
+    /* a comment or string the input ends in is left to the ladder
+     */
+    if( state >= LEX_COMMENT )
+        p = mark ;
+
+    if( p == start )
+        return currentchar_read ;
+
+    fout_write( (const char *)start, (size_t)( p - start ) ) ;
+
+    advance_input( p ) ;
+
+    return currentchar_read ;
+}
+
+
+/* With --strip-comments the ladder drops each comment it comes to
+ */
+static boolean_t comment_follows( int c )
+{
+    int next = 0 ;
+
+    if( ! strip_comments || ( c != (int)'/' ) )
+        return FALSE ;
+
+    next = peekchar() ;
+
+    return ( next == (int)'/' ) || ( next == (int)'*' ) ;
+}
+
+
+/* Drop the comment started by the / just read.  A block comment leaves
+ * a space, or a newline for each newline in it so the lines stay in
+ * step, and a line comment leaves nothing.  A line comment ending in a
+ * backslash goes on over the next line, so //\ is left to keep it
+ * doing that.  Returns the last character read, as the ladder keeps it.
+ *
+ * In a macro the lines are continued, so the newlines in a block
+ * comment are written continued too, and a line comment leaves its
+ * newline unwritten for the caller to continue.
+ */
+static int strip_comment( boolean_t in_macro )
+{
+    int c = nextchar() ;
+    int prev = 0 ;
+    int last = 0 ;
+    boolean_t newline = FALSE ;
+
+    in_comment = TRUE ;
+
+    if( c == (int)'*' )
+    {
+        while( ( ( c = nextchar() ) != -1 ) && ! ( ( c == (int)'/' ) && ( prev == (int)'*' ) ) )
+        {
+            if( c == (int)'\n' )
+            {
+                if( in_macro )
+                    FPUTS( " \\" ) ;
+
+                FPUT( '\n' ) ;
+                newline = TRUE ;
+            }
+
+            prev = c ;
+        };
+
+        if( ! newline )
+            FPUT( ' ' ) ;
+    }
+    else
+    {
+        while( ( ( c = nextchar() ) != -1 ) && ( c != (int)'\n' ) )
+        {
+            if( ( c != (int)' ' ) && ( c != (int)'\t' ) && ( c != (int)'\r' ) )
+                last = c ;
+        };
+
+        if( ! in_macro )
+        {
+            if( last == (int)'\\' )
+                FPUTS( "//\\" ) ;
+
+            FPUT( c ) ;
+        }
+    }
+
+    in_comment = FALSE ;
+
+    return c ;
+}
+
+
+/* Write the rest of a directive line cap does not know, up to the
+ * newline that ends it.  Where strip is set its comments go too, but a
+ * block comment over several lines is still part of the directive, so
+ * its newlines are written continued.  Returns the last character read.
+ */
+static int pass_directive_line( boolean_t strip )
+{
+    int c = nextchar() ;
+    int quote = 0 ;
+    boolean_t escaped = FALSE ;
+
+    while( ( c != -1 ) && ( !INEOF() ) && ! istrueeol() )
+    {
+        if( strip && ( quote == 0 ) && comment_follows( c ) )
+        {
+            c = strip_comment( peekchar() == (int)'*' ) ;
+
+            /* a line comment has written the newline
+             */
+            if( c == (int)'\n' )
+                return c ;
+        }
+        else
+        {
+            quote = quote_after( quote, c, &escaped ) ;
+
+            FPUT( c ) ;
+        }
+
+        c = nextchar() ;
+    };
+
+    FPUT( c ) ;
+
+    return c ;
+}
+
+
+/*******************************************************************
+ *
+ * process_stream() runs the directive engine over the current input
+ * until it is used up.  It is used for whole files by main_process()
+ * and for included files by #capinclude.
+ */
+int process_stream()
+{
+    int retv = 0 ;
+    int c = 0 ;
+    int i = 0 ;
+    int j = 0 ;
+    
+    int leadingspaces = 0 ;
+    
+    unsigned int directive_line = 0 ;
+    
+    /* blank chars is needed because a blank might be a character
+     * other than a space ( e.g. a tab ) and we want to output that
+     * character, not just a space.  So we have to record blank chars
+     */
+    char blankchars[BUFFLEN] ;
+
+    /* Now process the file ... 
+     */
+
+    while( ( c != -1 ) && ( !INEOF() ) )
+    {
+        // DBGLINE() ;
+        
+        /* a chunk of a file processed in parallel stops at the first
+         * line start past its end where nothing is left part done
+         */
+        if( ( chunk_inbuf != NULL ) && ( inbuf == chunk_inbuf ) && ( inbuf_pos >= chunk_end ) &&
+            ( currentchar_read == (int)'\n' ) &&
+            ( pendingchar == -1 ) && ( BUFFER_INDEX( deferredbuffer ) == 0 ) )
+        {
+            chunk_stopped = TRUE ;
+            break ;
+        }
+        
+        c = nextchar() ;
+        
+        if( c == -1 )
+            break ;
+        
+        if( c != (int)macrochar )
+        {
+            /* not a macrochar ( normally hash ) as first char on line
+             * then output everything until we
+             * we reach EOL or EOF with special handling.
+             */
+            
+            // DBGLINE() ;
+            
+            if( comment_follows( c ) )
+            {
+                c = strip_comment( FALSE ) ;
+            }
+            else if( strip_comments && ( ( c == '"' ) || ( c == '\'' ) ) )
+            {
+                /* leave a quote to the loop below, which knows strings,
+                 * so nothing in the string is taken for a comment
+                 */
+                pendchar( c ) ;
+                c = 0 ;
+            }
+            else
+            {
+                FPUT(c) ;
+            }
+
+            while( ( c != '\n' ) && ( c != -1 ) && ( !INEOF() ) )
+            {
+                if( LEX_USABLE() )
+                {
+                    c = lex_scan_line() ;
+
+                    if( c == '\n' )
+                        break ;
+                }
+
+                c = nextchar() ;
+
+                if( c == -1 )
+                    break ;
+                
+                if( comment_follows( c ) )
+                {
+                    c = strip_comment( FALSE ) ;
+                }
+                else if( ( c == '\'' ) && ( lastchar_read != '\\' ) )
+                {
+                    /* a single char in quotes - could be escaped
+                     * treat like a quoted string
+                     */
+                    
+                    FPUT( c ) ;
+                    
+                    pass_chars_in_quotes( '\'' ) ;
+                    
+                    c = currentchar_read ;
+                }
+                else if( ( c == '/' ) && ( lastchar_read == '/' ) && ! strip_comments )
+                {
+                    // Single line comment - read and output to EOL
+                    
+                    read_to_eol() ;
+                    
+                    FPUT( c ) ;
+                    FPUTS( buff ) ;
+                    FPUT( currentchar_read ) ;
+                    
+                    c = currentchar_read ;
+                    
+                    // fprintf( stderr, "single line comment at %d : [%c%s]\n", linenum, (char)c, buff ) ;
+                }
+                else if( ( c == '*' ) && ( lastchar_read == '/' ) && ! strip_comments )
+                {
+                    DBGLINE() ;
+                
+                    /* a C comment
+                     * read everything and output it unchanged until EOF
+                     * or we detect the end of comment pair of chars
+                     */
+                    
+                    in_comment = TRUE ;
+                    
+                    FPUT(c) ;
+                    
+                    while( ( c != -1 ) && ( !INEOF() ) )
+                    {
+                        if( ( c == '/' ) && ( lastchar_read == '*' ) )
+                        {
+                            /* end of comment
+                             */
+                            
+                            break ;
+                        }
+                        
+                        c = nextchar() ;
+                        
+                        FPUT(c) ;
+                    };
+                    
+                    in_comment = FALSE ;
+                }
+                else if( ( ( c == '"' ) && ( lastchar_read != '\\' ) /* && ( lastchar_read != '\'' ) */ ) && ! in_quotes )
+                {
+                    DBGLINE() ;
+                    
+                    /* a double quotes character starting something in quotes
+                     */
+                    
+                    FPUT( c ) ;
+                    
+                    in_quotes = TRUE ;
+                    
+                    pass_chars_in_quotes( (int)'\"' ) ;
+                    
+                    c = currentchar_read ;
+                    
+                    in_quotes = FALSE ;
+                    
+                    if( c == -1 )
+                    {
+                        debugf( "c was -1\n" ) ;
+                    }
+                    
+                    DBGLINE() ;
+                }
+                else if( apply_return_macro && ( c == 'r' ) && ( ( lastchar_read == '\n' ) || iswhitespace(lastchar_read) ) )
+                {
+                    DBGLINE() ;
+                
+                    /* check for possible return statement
+                     *
+                     * we don't do this if we're not applting brace macros
+                     */
+                    
+                    char tempbuff[BUFFLEN] ;
+                    
+                    char *returnstr = "return" ;
+                    
+                    memset( tempbuff, 0, 8 ) ;
+                    
+                    int k = 0 ;
+                    
+                    while( ( c == returnstr[k] ) && ( k < 6 ) )
+                    {
+                        tempbuff[k] = returnstr[k] ;
+                        k++ ;
+                        
+                        c = nextchar() ;
+                    };
+                    
+                    tempbuff[k] = c ;
+                    tempbuff[k+1] = 0 ;
+                    
+                    if( ( k == 6 ) && ( iswhitespace(c) || ( c == ';' ) || ( c == '(' ) ) )
+                    {
+                        /* a match to a the C return keyword !
+                         *
+                         * with brace macros on we need to ensure that the
+                         * closing brace macro is placed before the return
+                         *
+                         * There are three forms :
+                         *    return ;
+                         *    return(...) ;
+                         *    return x ;
+                         */
+                        
+                        FPUT( '{' ) ;
+                        
+                        FPUTS( return_macro ) ;
+                        
+                        if( c == ';' )
+                        {
+                            FPUTS( tempbuff ) ;
+                        }
+                        else
+                        {
+                            FPUTS( tempbuff ) ;
+                            
+                            c = nextchar() ;
+                            
+                            while( ( c != -1 ) && ( c != ';' ) && ( !INEOF() ) )
+                            {
+                                FPUT( c ) ;
+                                c = nextchar() ;
+                            };
+                            
+                            FPUT( c ) ;
+                        }
+                        
+                        FPUT( '}' ) ;
+                    }
+                    else
+                    {
+                        /* Not a match - just output what we have
+                         */
+                        
+                        FPUTS( tempbuff ) ;
+                    }
+                }
+                else
+                {
+                    FPUT(c) ;
+                }
+            };
+
+            if( c == -1 )
+                break ;
+        }
+        else
+        {
+            /* a possible preprocessor directive
+             * check if it is one of our extension keywords
+             *
+             * If it is pass processing to the extension module
+             * and if not then output the directive
+             */
+
+            /* read characters into a buffer until EOL, EOF or a space
+             * check this string againsts the key word lists
+             *
+             * Note that isspace() also checks for EOL
+             *
+             * As we permit leading spaces after the hash and before the
+             * directive we need to first check for this.
+             */
+
+            *buff = macrochar ;
+            
+            i = 1 ;
+            
+            c = nextchar() ;
+            
+            leadingspaces = 0 ;
+            
+            while( iswhitespace((char)c) )
+            {
+                blankchars[ leadingspaces++ ] = (char)c ;
+                
+                c = nextchar() ;
+            };
+            
+            blankchars[ leadingspaces ] = 0 ;
+
+            while( ( i < BUFFLEN ) && ( c != -1 ) && ( !isspace((char)c) ) )
+            {
+                buff[i] = (char)c ;
+                i++ ;
+
+                c = nextchar() ;
+            };
+
+            buff[i] = '\0' ;
+            
+            debugf( "buff = %s\n", buff ) ;
+            
+            if( ( i == BUFFLEN ) || ( c == -1 ) )
+            {
+                /* ran out of room in buffer or EOF
+                 * so we can treat that as not being a keyword
+                 */
+                
+                DBGLINE() ;
+                
+                FPUT( macrochar ) ;
+                
+                FPUTS( blankchars ) ;
+                leadingspaces = 0 ;
+
+                j = 1 ;
+
+                while( j < i )
+                {
+                    FPUT( buff[j] ) ;
+                    j++ ;
+                };
+
+                if( c != -1 )
+                {
+                    FPUT( c ) ;
+                }
+                
+                DBGLINE() ;
+            }
+            else
+            {
+                /* a space or EOL terminated the sequence
+                 *
+                 * in either case we check for a keyword and we output it as given
+                 * if no keyword is found.
+                 */
+                
+                DBGLINE() ;
+                
+                directive_line = linenum ;
+                
+                retv = process() ;
+
+                if( retv != 0 )
+                {
+                    DBGLINE() ;
+                
+                    /* ouput the buffer if we did not recognize the word
+                     */
+
+                    FPUT( macrochar ) ;
+                    
+                    FPUTS( blankchars ) ;
+                    leadingspaces = 0 ;
+
+                    j = 1 ;
+                    
+                    while( j < i )
+                    {
+                        FPUT( buff[j] ) ;
+                        j++ ;
+                    };
+                    
+                    /* .. and finally the last character read !
+                     */
+                    
+                    FPUT( c ) ;
+                    
+                    /* Now write out everything until EOL without continuation mark
+                     *
+                     * but check if the last char was a newline, in which case we had
+                     * some like '  #  else\n' as a line and reading another char will
+                     * put us on the next line !
+                     */
+                    
+                    /* a comment or string may have started in the word
+                     * itself, and then the rest is left as it is
+                     */
+                    if( c != (int)'\n' )
+                    {
+                        c = pass_directive_line( strpbrk( buff, "/\"'" ) == NULL ) ;
+                    }
+                }
+                else if( currentchar_read != -1 )
+                {
+                    /* A directive was processed.
+                     *
+                     * If it did not read past its own line then the rest of
+                     * that line still follows, so output the character that
+                     * ended the keyword.  If it stopped at the end of its
+                     * own line it leaves an empty line behind, unless the
+                     * output is out of step anyway and needs a marker.
+                     */
+                    
+                    boolean_t mid_line = ( currentchar_read != (int)'\n' ) || ( pendingchar != -1 ) ;
+                    
+                    if( linenum == directive_line )
+                    {
+                        if( ! mid_line )
+                        {
+                            if( ( ! out_at_bol ) || ( outlinenum + outline_delta == linenum ) )
+                                FPUT( '\n' ) ;
+                        }
+                        else if( iswhitespace(c) )
+                        {
+                            FPUT( c ) ;
+                        }
+                    }
+                    
+                    sync_output_line( mid_line ? linenum : linenum + 1, mid_line ) ;
+                }
+            }
+        }
+    };
+    
+    /* The result of the last directive is not a result for the file
+     */
+    retv = 0 ;
+    
+err_exit:
+    
+    /* DEBUG Stuff
+     */
+     
+    /*
+    {
+        int ii = 0 ;
+    
+        ii = rotatingbuffer_idx - 10 ;
+    
+        if( ii < 0 ){ ii = 0  ;}
+    
+        fprintf( stderr, "END buff = [%s] indicies ( 0 to %d->%d )\n", rotatingbuffer+ii, rotatingbuffer_idx, ii ) ;
+    }
+    */
+    
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* reset the state that main_process() carries over from one file to
+ * the next, so a run starts exactly as a freshly started cap would.
+ */
+static void reset_state()
+{
+    safe_free( open_brace_macro ) ;
+    safe_free( close_brace_macro ) ;
+    safe_free( return_macro ) ;
+
+    apply_return_macro = FALSE ;
+
+    inside_quotes = FALSE ;
+    quote_pending = FALSE ;
+    escape_pending = FALSE ;
+
+    pendingchar = -1 ;
+    lastchar = -1 ;
+
+    stackfree() ;
+}
+
+/*******************************************************
+ */
+
+
+/* Process an in memory input with the given engine and return the
+ * output in a malloc()ed buffer in *outp ( which the caller frees ).
+ *
+ * This is the in memory API used by the engine comparison harness.
+ * fin, fout and the selected engine are restored afterwards.
+ */
+static int process_memory( int eng, const char *data, size_t len, char **outp, size_t *outlenp )
+{
+    int retv = 0 ;
+
+    FILE *old_fin = fin ;
+    FILE *old_fout = fout ;
+    int old_engine = engine ;
+
+    unsigned int old_outlinenum = outlinenum ;
+    boolean_t old_out_at_bol = out_at_bol ;
+    int old_outline_delta = outline_delta ;
+    line_marker_t old_marker ;
+
+    *outp = NULL ;
+    *outlenp = 0 ;
+
+    fout = open_memstream( outp, outlenp ) ;
+
+    if( fout == NULL )
+    {
+        fout = old_fout ;
+        return -1 ;
+    }
+
+    marker_save( &old_marker ) ;
+
+    reset_state() ;
+    reset_output_lines() ;
+
+    engine = eng ;
+
+    if( eng == ENGINE_REFERENCE )
+    {
+        /* fmemopen() does not like zero length buffers
+         */
+        if( len > 0 )
+        {
+            fin = fmemopen( (void *)data, len, "r" ) ;
+        }
+        else
+        {
+            fin = fopen( "/dev/null", "r" ) ;
+        }
+
+        if( fin != NULL )
+        {
+            retv = main_process() ;
+
+            FCLOSE( fin ) ;
+        }
+        else
+        {
+            retv = -1 ;
+        }
+    }
+    else
+    {
+        fin = NULL ;
+
+        set_input_buffer( data, len ) ;
+
+        retv = main_process() ;
+
+        unload_input() ;
+    }
+
+    fclose( fout ) ;
+
+    fin = old_fin ;
+    fout = old_fout ;
+    engine = old_engine ;
+
+    outlinenum = old_outlinenum ;
+    out_at_bol = old_out_at_bol ;
+    outline_delta = old_outline_delta ;
+
+    marker_restore( &old_marker ) ;
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* Read a whole file into a malloc()ed buffer.  Returns NULL on error.
+ */
+static char *read_file( const char *path, size_t *lenp )
+{
+    FILE *fs = NULL ;
+    char *data = NULL ;
+    size_t len = 0 ;
+    size_t sz = 4096 ;
+    size_t n = 0 ;
+
+    *lenp = 0 ;
+
+    fs = fopen( path, "r" ) ;
+
+    if( fs == NULL )
+        return NULL ;
+
+    data = (char *)malloc( sz ) ;
+
+    while( ( data != NULL ) && ( ( n = fread( data + len, 1, sz - len, fs ) ) > 0 ) )
+    {
+        len += n ;
+
+        if( len == sz )
+        {
+            char *p = (char *)realloc( data, sz * 2 ) ;
+
+            if( p == NULL )
+            {
+                safe_free( data ) ;
+                break ;
+            }
+
+            data = p ;
+            sz *= 2 ;
+        }
+    };
+
+    FCLOSE( fs ) ;
+
+    *lenp = len ;
+
+    return data ;
+}
+
+/*******************************************************
+ */
+
+
+/* Find the output line holding offset off and work out which input
+ * line it came from, using the nearest preceding #line marker.
+ */
+static void output_line_context( const char *out, size_t len, size_t off,
+                                    unsigned int *outlinep, unsigned int *inlinep, size_t *linestartp )
+{
+    unsigned int outline = 1 ;
+    unsigned int markerline = 0 ;
+    unsigned int markervalue = 0 ;
+    size_t linestart = 0 ;
+    size_t i = 0 ;
+
+    for( i = 0 ; ( i < off ) && ( i < len ) ; i++ )
+    {
+        if( out[i] == '\n' )
+        {
+            outline++ ;
+            linestart = i + 1 ;
+
+            if( ( linestart + 6 < len ) && ( strncmp( out + linestart, "#line ", 6 ) == 0 ) )
+            {
+                markerline = outline ;
+                markervalue = (unsigned int)strtoul( out + linestart + 6, NULL, 10 ) ;
+            }
+        }
+    }
+
+    if( ( len >= 6 ) && ( strncmp( out, "#line ", 6 ) == 0 ) && ( markerline == 0 ) )
+    {
+        markerline = 1 ;
+        markervalue = (unsigned int)strtoul( out + 6, NULL, 10 ) ;
+    }
+
+    *outlinep = outline ;
+    *linestartp = linestart ;
+
+    if( ( markerline != 0 ) && ( outline > markerline ) )
+    {
+        *inlinep = markervalue + ( outline - markerline - 1 ) ;
+    }
+    else
+    {
+        *inlinep = outline ;
+    }
+}
+
+
+static void report_line( const char *label, const char *out, size_t len, size_t linestart )
+{
+    size_t i = linestart ;
+
+    fprintf( stderr, "  %-9s : ", label ) ;
+
+    while( ( i < len ) && ( out[i] != '\n' ) && ( i - linestart < 160 ) )
+    {
+        ERRC( isprint( (unsigned char)out[i] ) ? out[i] : '?' ) ;
+        i++ ;
+    }
+
+    if( i >= len )
+    {
+        fprintf( stderr, "<EOF>" ) ;
+    }
+
+    ERRC( '\n' ) ;
+}
+
+/*******************************************************
+ */
+
+
+/* Run both engines over the same input and report the first place
+ * their output differs.
+ *
+ * Returns 0 if the outputs are identical.
+ */
+static int compare_engines( const char *name, const char *data, size_t len )
+{
+    int retv = 0 ;
+
+    char *refout = NULL ;
+    size_t reflen = 0 ;
+    char *fastout = NULL ;
+    size_t fastlen = 0 ;
+
+    size_t off = 0 ;
+    unsigned int outline = 0 ;
+    unsigned int inputline = 0 ;
+    size_t refstart = 0 ;
+    size_t faststart = 0 ;
+
+    process_memory( ENGINE_REFERENCE, data, len, &refout, &reflen ) ;
+    process_memory( ENGINE_FAST, data, len, &fastout, &fastlen ) ;
+
+    if( ( refout == NULL ) || ( fastout == NULL ) )
+    {
+        fprintf( stderr, "cap: %s : could not capture engine output\n", name ) ;
+
+        retv = -1 ;
+
+        goto err_exit ;
+    }
+
+    while( ( off < reflen ) && ( off < fastlen ) && ( refout[off] == fastout[off] ) )
+        off++ ;
+
+    if( ( off == reflen ) && ( off == fastlen ) )
+        goto err_exit ;
+
+    retv = -1 ;
+
+    output_line_context( refout, reflen, off, &outline, &inputline, &refstart ) ;
+    output_line_context( fastout, fastlen, off, &outline, &inputline, &faststart ) ;
+
+    fprintf( stderr, "cap: %s : engines differ at output offset %lu ( output line %u, input line %u )\n",
+                name, (unsigned long)off, outline, inputline ) ;
+
+    report_line( "reference", refout, reflen, refstart ) ;
+    report_line( "fast", fastout, fastlen, faststart ) ;
+
+err_exit:
+
+    safe_free( refout ) ;
+    safe_free( fastout ) ;
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+static double time_now()
+{
+    struct timespec ts ;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts ) ;
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9 ;
+}
+
+/*******************************************************
+ */
+
+/* the random input generator, --compare-random and the benchmark are
+ * only reachable from the command line
+ */
+#ifndef CAP_FUZZER
+
+/* A small generator of random, directive rich, inputs for comparing
+ * the engines.  Each input is fully determined by its seed so any
+ * failure can be reproduced with --random-input <seed>.
+ */
+
+static unsigned int rand_state = 1 ;
+
+static unsigned int rand_next()
+{
+    /* xorshift32
+     */
+    rand_state ^= rand_state << 13 ;
+    rand_state ^= rand_state >> 17 ;
+    rand_state ^= rand_state << 5 ;
+
+    return rand_state ;
+}
+
+#define RAND_PICK(n)    ( rand_next() % (unsigned int)(n) )
+
+static const char *rand_words[] = {
+        "a", "b", "c", "x", "foo", "bar_1", "_tmp", "value",
+        "return", "returned", "retval", "if", "else", "int", "0x1F", "42"
+    } ;
+
+static const char *rand_puncts[] = {
+        " ", "  ", "\t", "(", ")", ";", ",", "+", "-", "*", "/", "=",
+        "{", "}", "[", "]", "<", ">", "&", "|", "^", "!", "\\", "#", "?", ":"
+    } ;
+
+static const char *rand_strings[] = {
+        "\"plain\"", "\"with \\\"escaped\\\" quotes\"", "\"\\x41\\x4g\"", "\"\\101\\7z\"",
+        "\"a { brace }\"", "\"// not a comment\"", "\"/* nor this */\"", "\"unterminated",
+        "'c'", "'\\''", "'\\n'", "'{'", "'\"'", "'\\x7f'", "L\"wide\"", "\"\\u00e9\"",
+        "\"\\1", "'\\12", "\"a\\\n b\"", "\"\\\\\"", "\\\"", "\\'x'"
+    } ;
+
+static const char *rand_comments[] = {
+        "// line comment { }", "/* block */", "/* multi\n   line { comment } */", "/*/ odd */",
+        "/* \"quoted\" */", "// \"string\" in comment", "/**/", "/* return x ; */",
+        "/* a **/", "*//* b */", "/* c *//", "// tab\t return x ;"
+    } ;
+
+
+#define RAND_ITEM( _arr )   ( _arr [ RAND_PICK( sizeof( _arr ) / sizeof( _arr [0] ) ) ] )
+
+
+static void gen_code_line( FILE *g, int mc )
+{
+    int n = RAND_PICK( 12 ) ;
+    int i = 0 ;
+
+    /* occasionally start a line with whitespace or a lone macrochar
+     * that is not a directive
+     */
+    if( RAND_PICK( 8 ) == 0 )
+        fputc( ' ', g ) ;
+
+    for( i = 0 ; i < n ; i++ )
+    {
+        switch( RAND_PICK( 10 ) )
+        {
+            case 0 :
+                fputs( RAND_ITEM( rand_strings ), g ) ;
+                break ;
+
+            case 1 :
+                fputs( RAND_ITEM( rand_comments ), g ) ;
+                break ;
+
+            case 2 :
+                fputs( "return", g ) ;
+                fputs( RAND_ITEM( rand_puncts ), g ) ;
+                break ;
+
+            case 3 :
+                fputc( mc, g ) ;
+                break ;
+
+            case 4 :
+            case 5 :
+            case 6 :
+                fputs( RAND_ITEM( rand_puncts ), g ) ;
+                break ;
+
+            default :
+                fputs( RAND_ITEM( rand_words ), g ) ;
+                fputc( ' ', g ) ;
+                break ;
+        }
+    }
+
+    if( RAND_PICK( 60 ) == 0 )
+    {
+        /* something longer than the internal buffers
+         */
+        for( i = 0 ; i < BUFFLEN + 50 ; i++ )
+            fputc( 'a' + ( i % 26 ), g ) ;
+    }
+
+    if( RAND_PICK( 80 ) == 0 )
+        fputc( RAND_PICK( 256 ), g ) ;
+
+    fputc( '\n', g ) ;
+}
+
+
+static void gen_random_input( unsigned int seed, char **bufp, size_t *lenp )
+{
+    FILE *g = NULL ;
+
+    int mc = DEFAULT_MACROCHAR ;
+    int lines = 0 ;
+    int i = 0 ;
+    int k = 0 ;
+
+    rand_state = ( seed == 0 ) ? 0x9E3779B9 : seed ;
+
+    g = open_memstream( bufp, lenp ) ;
+
+    if( g == NULL )
+        return ;
+
+    lines = 5 + RAND_PICK( 120 ) ;
+
+    for( i = 0 ; i < lines ; i++ )
+    {
+        if( RAND_PICK( 3 ) != 0 )
+        {
+            gen_code_line( g, mc ) ;
+            continue ;
+        }
+
+        switch( RAND_PICK( 20 ) )
+        {
+            case 0 :
+                fprintf( g, "%cquote #define m%d(a,b)\n", mc, i ) ;
+                for( k = RAND_PICK( 4 ) ; k > 0 ; k-- )
+                    gen_code_line( g, mc ) ;
+                fprintf( g, "%c\n", mc ) ;
+                break ;
+
+            case 1 :
+                fprintf( g, "%cdef d%d( a, b, value )\n", mc, i ) ;
+                for( k = RAND_PICK( 4 ) ; k > 0 ; k-- )
+                    gen_code_line( g, mc ) ;
+                fprintf( g, "%c\n", mc ) ;
+                break ;
+
+            case 2 :
+                fprintf( g, "%ccomment\n", mc ) ;
+                for( k = RAND_PICK( 4 ) ; k > 0 ; k-- )
+                    gen_code_line( g, mc ) ;
+                fprintf( g, "%c\n", mc ) ;
+                break ;
+
+            case 3 :
+                fprintf( g, "%c%s P%d S\n", mc,
+                            RAND_ITEM( ( (const char *[]){ "constants", "flags", "constants-values", "constants-negative" } ) ), i ) ;
+                for( k = 1 + RAND_PICK( 5 ) ; k > 0 ; k-- )
+                    fprintf( g, "%s%d\n", RAND_PICK( 2 ) ? "NAME" : "  other_", k ) ;
+                fprintf( g, "%c\n", mc ) ;
+                break ;
+
+            case 4 :
+                fprintf( g, "%credefine r%d( x ) x + \\\n    1\n", mc, i ) ;
+                break ;
+
+            case 5 :
+                fprintf( g, "%cdef_open_brace { OPEN%d() ;\n", mc, i ) ;
+                break ;
+
+            case 6 :
+                fprintf( g, "%cdef_close_brace CLOSE() ; }\n", mc ) ;
+                break ;
+
+            case 7 :
+                fprintf( g, "%cbrace_macros_%s\n", mc, RAND_PICK( 2 ) ? "on" : "off" ) ;
+                break ;
+
+            case 8 :
+                fprintf( g, "%cdef_return_macro before_return() ;\n", mc ) ;
+                break ;
+
+            case 9 :
+                fprintf( g, "%creturn_macro_%s\n", mc, RAND_PICK( 2 ) ? "on" : "off" ) ;
+                break ;
+
+            case 10 :
+                fprintf( g, "%cskip%s\n", mc, RAND_PICK( 2 ) ? "on" : "off" ) ;
+                break ;
+
+            case 11 :
+                if( mc == DEFAULT_MACROCHAR )
+                {
+                    mc = '@' ;
+                    fprintf( g, "%cmacrochar @\n", DEFAULT_MACROCHAR ) ;
+                }
+                else
+                {
+                    fprintf( g, "%cmacrochar %c\n", mc, DEFAULT_MACROCHAR ) ;
+                    mc = DEFAULT_MACROCHAR ;
+                }
+                break ;
+
+            case 12 :
+                fprintf( g, "%ccommand cat\n", mc ) ;
+                for( k = RAND_PICK( 3 ) ; k > 0 ; k-- )
+                    gen_code_line( g, mc ) ;
+                fprintf( g, "%c\n", mc ) ;
+                break ;
+
+            case 13 :
+                fprintf( g, "%c  include <stdio.h>\n", mc ) ;
+                break ;
+
+            case 14 :
+                fprintf( g, "%cdefine X%d \"str\" \\\n  // more\n", mc, i ) ;
+                break ;
+
+            case 15 :
+                fprintf( g, "%c%s\n", mc, RAND_ITEM( rand_words ) ) ;
+                break ;
+
+            case 16 :
+                /* an unterminated block at the end of input
+                 */
+                if( RAND_PICK( 10 ) == 0 )
+                {
+                    fprintf( g, "%cquote\n", mc ) ;
+                }
+                break ;
+
+            case 17 :
+                fprintf( g, "%c%s\n", mc,
+                            RAND_ITEM( ( (const char *[]){ "capif 0", "capif 1", "capif !defined( x ) // c",
+                                                           "capelif x + 1 > 0", "capelse", "capendif" } ) ) ) ;
+                break ;
+
+            case 18 :
+                /* a #def in a #repeat, which must leave the counter for
+                 * the passes after it
+                 */
+                fprintf( g, "%crepeat i 0 %d\n%cdef g%d_$(i)( x )\nx * i\n%c\n%c\n", mc, 1 + RAND_PICK( 3 ), mc, i, mc, mc ) ;
+                break ;
+
+            default :
+                fprintf( g, "%c\n", mc ) ;
+                break ;
+        }
+    }
+
+    /* sometimes leave off the final newline
+     */
+    if( RAND_PICK( 4 ) == 0 )
+        fputs( "last", g ) ;
+
+    fclose( g ) ;
+}
+
+
+/* Compare the engines over count randomly generated inputs.
+ *
+ * Returns 0 if there were no differences.
+ */
+static int compare_random( unsigned int count, unsigned int seed )
+{
+    int retv = 0 ;
+    unsigned int n = 0 ;
+    unsigned int failures = 0 ;
+
+    char *data = NULL ;
+    size_t len = 0 ;
+    char name[64] ;
+
+    for( n = 0 ; n < count ; n++ )
+    {
+        gen_random_input( seed + n, &data, &len ) ;
+
+        if( data == NULL )
+            return -1 ;
+
+        snprintf( name, sizeof(name), "random input seed %u", seed + n ) ;
+
+        infilename = name ;
+
+        if( compare_engines( name, data, len ) != 0 )
+        {
+            failures++ ;
+        }
+
+        safe_free( data ) ;
+    }
+
+    fprintf( stderr, "cap: compared engines over %u random inputs, %u differed\n", count, failures ) ;
+
+    if( failures != 0 )
+        retv = -1 ;
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* Adversarial input benchmark.
+ *
+ * Each pattern below is an input shape that could make cap scan for
+ * a long time or go superlinear ( the #def parameter walk in
+ * symbolonstack(), a deep wordstackp, lines longer than BUFFLEN,
+ * unterminated quotes and comments, dense braces and returns with the
+ * brace and return macros on ).  Each is generated at 1, 2, 4 and 8
+ * times a base scale and the time per input byte compared.  For a
+ * linear pattern that stays roughly constant.
+ */
+
+typedef void (*bench_gen_fn)( FILE *g, unsigned int n ) ;
+
+static void bench_def_params( FILE *g, unsigned int n )
+{
+    unsigned int i = 0 ;
+
+    fprintf( g, "#def m( p0" ) ;
+
+    for( i = 1 ; i < n ; i++ )
+        fprintf( g, ", p%u", i ) ;
+
+    fprintf( g, " )\n" ) ;
+
+    for( i = 0 ; i < n ; i++ )
+        fprintf( g, "p%u + q%u%s", i, i, ( ( i % 8 ) == 7 ) ? "\n" : " " ) ;
+
+    fprintf( g, "\n#\n" ) ;
+}
+
+static void bench_wordstack_depth( FILE *g, unsigned int n )
+{
+    unsigned int i = 0 ;
+
+    for( i = 0 ; i < n / 4 ; i++ )
+        fprintf( g, "#constants P%u S\nX\n#\n", i ) ;
+
+    fprintf( g, "#def m( a )\n" ) ;
+
+    for( i = 0 ; i < n / 4 ; i++ )
+        fprintf( g, "a + b%u ;\n", i ) ;
+
+    fprintf( g, "#\n" ) ;
+}
+
+static void bench_long_line( FILE *g, unsigned int n )
+{
+    unsigned int i = 0 ;
+
+    for( i = 0 ; i < n ; i++ )
+        fputs( "x = y + 1 ; ", g ) ;
+
+    fputc( '\n', g ) ;
+
+    fputc( '#', g ) ;
+
+    for( i = 0 ; i < n ; i++ )
+        fputs( "longdirective", g ) ;
+
+    fputc( '\n', g ) ;
+
+    fputs( "// ", g ) ;
+
+    for( i = 0 ; i < n ; i++ )
+        fputs( "comment text", g ) ;
+
+    fputc( '\n', g ) ;
+}
+
+static void bench_unterminated_quote( FILE *g, unsigned int n )
+{
+    unsigned int i = 0 ;
+
+    fputs( "s = \"", g ) ;
+
+    for( i = 0 ; i < n ; i++ )
+        fputs( "never ending \\\" ", g ) ;
+}
+
+static void bench_unterminated_comment( FILE *g, unsigned int n )
+{
+    unsigned int i = 0 ;
+
+    fputs( "/*", g ) ;
+
+    for( i = 0 ; i < n ; i++ )
+        fputs( "never * ending / \n", g ) ;
+}
+
+static void bench_dense_braces( FILE *g, unsigned int n )
+{
+    unsigned int i = 0 ;
+
+    fputs( "#def_open_brace { enter() ;\n#def_close_brace leave() ; }\n#brace_macros_on\n", g ) ;
+
+    for( i = 0 ; i < n ; i++ )
+        fputs( ( ( i % 16 ) == 15 ) ? "{}\n" : "{}", g ) ;
+}
+
+static void bench_dense_returns( FILE *g, unsigned int n )
+{
+    unsigned int i = 0 ;
+
+    fputs( "#def_return_macro before() ;\n#return_macro_on\n", g ) ;
+
+    for( i = 0 ; i < n ; i++ )
+        fputs( " return x ; return( y ) ;\n", g ) ;
+}
+
+
+static struct {
+        const char      *name ;
+        bench_gen_fn    gen ;
+    } bench_patterns[] = {
+        { "def-params",             bench_def_params },
+        { "wordstack-depth",        bench_wordstack_depth },
+        { "long-lines",             bench_long_line },
+        { "unterminated-quote",     bench_unterminated_quote },
+        { "unterminated-comment",   bench_unterminated_comment },
+        { "dense-braces",           bench_dense_braces },
+        { "dense-returns",          bench_dense_returns },
+        { NULL,                     NULL }
+    } ;
+
+
+/* growth in time per byte from the smallest to the largest size
+ * above which a pattern is reported as superlinear
+ */
+#define BENCH_GROWTH_LIMIT  3.0
+
+#define BENCH_STEPS         4
+
+
+/* time one run of the current engine over an in memory input, taking
+ * the best of a few runs to reduce noise
+ */
+static double time_processing( const char *data, size_t len )
+{
+    double best = -1.0 ;
+    double t = 0.0 ;
+    char *out = NULL ;
+    size_t outlen = 0 ;
+    int k = 0 ;
+
+    for( k = 0 ; k < 3 ; k++ )
+    {
+        t = time_now() ;
+
+        process_memory( engine, data, len, &out, &outlen ) ;
+
+        t = time_now() - t ;
+
+        safe_free( out ) ;
+
+        if( ( best < 0.0 ) || ( t < best ) )
+            best = t ;
+    }
+
+    return best ;
+}
+
+
+/* Run the adversarial benchmark with base scale n.
+ *
+ * Returns 0 if every pattern scaled linearly.
+ */
+static int bench_adversarial( unsigned int n )
+{
+    int retv = 0 ;
+    int p = 0 ;
+    int step = 0 ;
+
+    char *data = NULL ;
+    size_t len = 0 ;
+    FILE *g = NULL ;
+
+    double t = 0.0 ;
+    double first = 0.0 ;
+    double last = 0.0 ;
+
+    boolean_t old_allow_commands = allow_commands ;
+
+    allow_commands = FALSE ;
+
+    printf( "%-22s %10s %10s %10s\n", "pattern", "bytes", "ms", "ns/byte" ) ;
+
+    for( p = 0 ; bench_patterns[p].name != NULL ; p++ )
+    {
+        for( step = 0 ; step < BENCH_STEPS ; step++ )
+        {
+            g = open_memstream( &data, &len ) ;
+
+            if( g == NULL )
+                return -1 ;
+
+            bench_patterns[p].gen( g, n << step ) ;
+
+            fclose( g ) ;
+
+            t = time_processing( data, len ) ;
+
+            safe_free( data ) ;
+
+            last = ( len > 0 ) ? ( t * 1e9 / (double)len ) : 0.0 ;
+
+            if( step == 0 )
+                first = last ;
+
+            printf( "%-22s %10lu %10.2f %10.2f\n", bench_patterns[p].name, (unsigned long)len, t * 1e3, last ) ;
+        }
+
+        if( ( first > 0.0 ) && ( last / first > BENCH_GROWTH_LIMIT ) )
+        {
+            printf( "%-22s SUPERLINEAR : time per byte grew %.1f times over a %u times larger input\n",
+                        bench_patterns[p].name, last / first, 1u << ( BENCH_STEPS - 1 ) ) ;
+
+            retv = -1 ;
+        }
+    }
+
+    allow_commands = old_allow_commands ;
+
+    return retv ;
+}
+
+#endif /* CAP_FUZZER */
+
+/*******************************************************
+ */
+
+
+/* Fuzzing entry point.
+ *
+ * Build with -DCAP_FUZZER and -fsanitize=fuzzer to get a libFuzzer
+ * target over the in memory API.  Each input is run through both
+ * engines ( which must agree ) and any input whose processing time
+ * per byte goes above CAP_FUZZ_NS_PER_BYTE is treated as a crash.
+ * #command is never run on fuzzed input.
+ */
+#ifdef CAP_FUZZER
+
+#ifndef CAP_FUZZ_NS_PER_BYTE
+#  define CAP_FUZZ_NS_PER_BYTE  20000.0
+#endif
+
+/* small inputs are dominated by fixed costs so allow this much time
+ * regardless of size
+ */
+#ifndef CAP_FUZZ_MIN_NS
+#  define CAP_FUZZ_MIN_NS       5000000.0
+#endif
+
+int LLVMFuzzerTestOneInput( const uint8_t *data, size_t size )
+{
+    char *out = NULL ;
+    size_t outlen = 0 ;
+    double t = 0.0 ;
+    double limit = 0.0 ;
+
+    allow_commands = FALSE ;
+
+    fout = stdout ;
+
+    t = time_now() ;
+
+    process_memory( ENGINE_FAST, (const char *)data, size, &out, &outlen ) ;
+
+    t = ( time_now() - t ) * 1e9 ;
+
+    safe_free( out ) ;
+
+    limit = CAP_FUZZ_MIN_NS + CAP_FUZZ_NS_PER_BYTE * (double)size ;
+
+    if( t > limit )
+    {
+        fprintf( stderr, "cap: slow input - %lu bytes took %.0f ns ( %.0f ns/byte )\n",
+                    (unsigned long)size, t, ( size > 0 ) ? t / (double)size : t ) ;
+
+        abort() ;
+    }
+
+    if( compare_engines( "fuzz input", (const char *)data, size ) != 0 )
+    {
+        abort() ;
+    }
+
+    return 0 ;
+}
+
+#endif /* CAP_FUZZER */
+
+/*******************************************************
+ */
+
+/* everything from here on is the command line front end
+ */
+#ifndef CAP_FUZZER
+
+/* Compiler wrapper mode
+ *
+ *      cap [cap options] --cc <compiler> [compiler arguments]
+ *
+ * Every C source in the compiler arguments is run through cap into an
+ * anonymous in memory file ( memfd_create() ) which the compiler is
+ * then given as /proc/self/fd/N.  So cap can be used as CC in a
+ * Makefile with no temporary files and no shell pipeline.
+ *
+ * Each output starts with a #line marker naming the original file so
+ * compiler diagnostics point at it.
+ */
+
+/* compiler options which take their value as the next argument
+ */
+static const char *cc_value_options[] = {
+        "-o", "-MF", "-MT", "-MQ", "-I", "-D", "-U", "-include", "-imacros",
+        "-isystem", "-iquote", "-idirafter", "-iprefix", "-iwithprefix",
+        "-x", "-L", "-Xlinker", "-Xassembler", "-Xpreprocessor", "-aux-info",
+        "--param", "-T", "-u", "-z", "-e",
+        NULL
+    } ;
+
+
+static boolean_t cc_takes_value( const char *arg )
+{
+    int i = 0 ;
+
+    for( i = 0 ; cc_value_options[i] != NULL ; i++ )
+    {
+        if( strcmp( arg, cc_value_options[i] ) == 0 )
+            return TRUE ;
+    }
+
+    return FALSE ;
+}
+
+
+static boolean_t cc_is_source( const char *arg )
+{
+    size_t len = strlen( arg ) ;
+
+    return ( arg[0] != '-' ) && ( len > 2 ) && ( strcmp( arg + len - 2, ".c" ) == 0 ) ;
+}
+
+
+/* cc_preprocess() ran the source but cap reported errors in it
+ */
+#define CC_CAP_FAILED   -2
+
+/* Run one source through cap into an anonymous file.
+ *
+ * Returns the file descriptor, positioned at the start of the output,
+ * -1 if the source could not be read or CC_CAP_FAILED.  The descriptor
+ * is not close-on-exec so the compiler inherits it.
+ */
+static int cc_preprocess( const char *path )
+{
+    int fd = -1 ;
+    int r = 0 ;
+    int errors = cap_errors ;
+    FILE *old_fout = fout ;
+    FILE *out = NULL ;
+
+    fin = fopen( path, "r" ) ;
+
+    if( fin == NULL )
+        return -1 ;
+
+    fd = memfd_create( "cap", 0 ) ;
+
+    if( fd < 0 )
+    {
+        /* no memfd so use an unnamed file
+         */
+        fd = open( P_tmpdir, O_TMPFILE | O_RDWR, 0600 ) ;
+    }
+
+    if( fd >= 0 )
+    {
+        out = fdopen( dup( fd ), "w" ) ;
+    }
+
+    if( out == NULL )
+    {
+        if( fd >= 0 )
+            close( fd ) ;
+
+        FCLOSE( fin ) ;
+
+        return -1 ;
+    }
+
+    fout = out ;
+    infilename = path ;
+
+    reset_state() ;
+    reset_output_lines() ;
+
+    if( engine == ENGINE_FAST )
+    {
+        load_input( fin ) ;
+    }
+
+    r = main_process() ;
+
+    unload_input() ;
+
+    FCLOSE( fin ) ;
+
+    fclose( out ) ;
+
+    fout = old_fout ;
+
+    /* never hand the compiler the output of a file cap failed on
+     */
+    if( ( r != 0 ) || ( cap_errors != errors ) || ( command_exit_status != 0 ) )
+    {
+        close( fd ) ;
+
+        return CC_CAP_FAILED ;
+    }
+
+    lseek( fd, 0, SEEK_SET ) ;
+
+    return fd ;
+}
+
+
+/* The compiler writes the /proc/self/fd/N names it was given into any
+ * dependency file, so put the real source names back.
+ */
+static int cc_fix_depfile( const char *depfile, char **fdpaths, char **sources, int count )
+{
+    char *data = NULL ;
+    size_t len = 0 ;
+    size_t pos = 0 ;
+    size_t plen = 0 ;
+    FILE *fs = NULL ;
+    int k = 0 ;
+
+    data = read_file( depfile, &len ) ;
+
+    if( data == NULL )
+        return -1 ;
+
+    fs = fopen( depfile, "w" ) ;
+
+    if( fs == NULL )
+    {
+        free( data ) ;
+        return -1 ;
+    }
+
+    while( pos < len )
+    {
+        for( k = 0 ; k < count ; k++ )
+        {
+            plen = strlen( fdpaths[k] ) ;
+
+            if( ( pos + plen <= len ) && ( memcmp( data + pos, fdpaths[k], plen ) == 0 ) &&
+                ( ( pos + plen == len ) || !isdigit( (unsigned char)data[ pos + plen ] ) ) )
+            {
+                break ;
+            }
+        }
+
+        if( k == count )
+        {
+            fputc( data[pos], fs ) ;
+            pos++ ;
+
+            continue ;
+        }
+
+        make_escape( fs, sources[k] ) ;
+
+        pos += plen ;
+    };
+
+    /* the compiler knows nothing of the files cap pulled in, so add
+     * them as prerequisites of its first target
+     */
+    if( dep_nfiles > 0 )
+    {
+        for( pos = 0 ; pos < len ; pos++ )
+        {
+            if( ( data[pos] == ':' ) && ( ( pos + 1 == len ) || isspace( (unsigned char)data[ pos + 1 ] ) ) )
+                break ;
+        }
+
+        if( pos < len )
+        {
+            char *target = strndup( data, pos ) ;
+
+            if( target != NULL )
+            {
+                fputc( '\n', fs ) ;
+                dep_write_rule( fs, target ) ;
+
+                free( target ) ;
+            }
+        }
+    }
+
+    FCLOSE( fs ) ;
+
+    free( data ) ;
+
+    return 0 ;
+}
+
+
+static int cc_main( int argc, char **argv )
+{
+    int retv = 0 ;
+    int i = 0 ;
+    int n = 0 ;
+    int fd = -1 ;
+    int status = 0 ;
+
+    char **args = NULL ;
+    char **fdpaths = NULL ;
+    char **sources = NULL ;
+    int count = 0 ;
+
+    boolean_t compile_only = FALSE ;
+    boolean_t assemble_only = FALSE ;
+    boolean_t depgen = FALSE ;
+    boolean_t has_mf = FALSE ;
+
+    const char *outpath = NULL ;
+    char *made_outpath = NULL ;
+    char *depfile = NULL ;
+    char *quotedir = NULL ;
+    char *p = NULL ;
+
+    pid_t childpid ;
+
+    /* record what each source pulls in, in case the compiler is
+     * asked for a depfile
+     */
+    dep_record = TRUE ;
+
+    if( argc < 1 )
+    {
+        fprintf( stderr, "cap: --cc needs a compiler\n" ) ;
+
+        return -1 ;
+    }
+
+    args = (char **)calloc( (size_t)argc * 7 + 8, sizeof(char *) ) ;
+    fdpaths = (char **)calloc( (size_t)argc, sizeof(char *) ) ;
+    sources = (char **)calloc( (size_t)argc, sizeof(char *) ) ;
+
+    if( ( args == NULL ) || ( fdpaths == NULL ) || ( sources == NULL ) )
+        return -1 ;
+
+    mark_file_start = TRUE ;
+
+    args[ n++ ] = argv[0] ;
+
+    for( i = 1 ; i < argc ; i++ )
+    {
+        if( cc_takes_value( argv[i] ) && ( i + 1 < argc ) )
+        {
+            if( strcmp( argv[i], "-o" ) == 0 )
+                outpath = argv[ i + 1 ] ;
+
+            if( strcmp( argv[i], "-MF" ) == 0 )
+                has_mf = TRUE ;
+
+            args[ n++ ] = argv[ i++ ] ;
+            args[ n++ ] = argv[i] ;
+
+            continue ;
+        }
+
+        if( strcmp( argv[i], "-c" ) == 0 )
+            compile_only = TRUE ;
+
+        if( strcmp( argv[i], "-S" ) == 0 )
+            assemble_only = TRUE ;
+
+        if( ( strcmp( argv[i], "-MD" ) == 0 ) || ( strcmp( argv[i], "-MMD" ) == 0 ) )
+            depgen = TRUE ;
+
+        if( ! cc_is_source( argv[i] ) )
+        {
+            args[ n++ ] = argv[i] ;
+
+            continue ;
+        }
+
+        fd = cc_preprocess( argv[i] ) ;
+
+        if( fd == CC_CAP_FAILED )
+        {
+            /* go on so every source gets its errors reported
+             */
+            retv = ( command_exit_status != 0 ) ? command_exit_status : -1 ;
+
+            continue ;
+        }
+
+        if( fd < 0 )
+        {
+            /* let the compiler report on it
+             */
+            args[ n++ ] = argv[i] ;
+
+            continue ;
+        }
+
+        fdpaths[ count ] = (char *)malloc( 32 ) ;
+
+        if( fdpaths[ count ] == NULL )
+            return -1 ;
+
+        snprintf( fdpaths[ count ], 32, "/proc/self/fd/%d", fd ) ;
+
+        sources[ count ] = argv[i] ;
+
+        /* the compiler looks for an #include "name" next to the file it
+         * is given, which is /proc/self/fd, so it is told where the
+         * source is
+         */
+        p = strrchr( argv[i], '/' ) ;
+
+        if( p == NULL )
+        {
+            quotedir = strdup( "." ) ;
+        }
+        else
+        {
+            quotedir = strndup( argv[i], ( p == argv[i] ) ? 1 : (size_t)( p - argv[i] ) ) ;
+        }
+
+        if( quotedir == NULL )
+            return -1 ;
+
+        args[ n++ ] = "-iquote" ;
+        args[ n++ ] = quotedir ;
+        args[ n++ ] = "-x" ;
+        args[ n++ ] = "c" ;
+        args[ n++ ] = fdpaths[ count ] ;
+        args[ n++ ] = "-x" ;
+        args[ n++ ] = "none" ;
+
+        count++ ;
+    }
+
+    if( retv != 0 )
+        return retv ;
+
+    /* The compiler would name its output after /proc/self/fd/N so name
+     * it after the source as it would have done.
+     */
+    if( ( count == 1 ) && ( outpath == NULL ) && ( compile_only || assemble_only ) )
+    {
+        p = strrchr( sources[0], '/' ) ;
+        p = ( p == NULL ) ? sources[0] : p + 1 ;
+
+        made_outpath = strdup( p ) ;
+
+        if( made_outpath == NULL )
+            return -1 ;
+
+        made_outpath[ strlen( made_outpath ) - 1 ] = assemble_only ? 's' : 'o' ;
+
+        outpath = made_outpath ;
+
+        args[ n++ ] = "-o" ;
+        args[ n++ ] = made_outpath ;
+    }
+
+    if( depgen && ( count > 0 ) && ( outpath != NULL ) && ! has_mf )
+    {
+        /* name the dependency file ourselves so we know where it is
+         */
+        depfile = (char *)malloc( strlen( outpath ) + 3 ) ;
+
+        if( depfile == NULL )
+            return -1 ;
+
+        strcpy( depfile, outpath ) ;
+
+        p = strrchr( depfile, '.' ) ;
+
+        if( ( p != NULL ) && ( strchr( p, '/' ) == NULL ) )
+            *p = 0 ;
+
+        strcat( depfile, ".d" ) ;
+
+        args[ n++ ] = "-MF" ;
+        args[ n++ ] = depfile ;
+    }
+
+    args[n] = NULL ;
+
+    fflush( stdout ) ;
+
+    if( ! depgen || ( count == 0 ) )
+    {
+        execvp( args[0], args ) ;
+
+        fprintf( stderr, "cap: cannot run %s : %s\n", args[0], strerror( errno ) ) ;
+
+        return -1 ;
+    }
+
+    /* With dependency output we have to wait for the compiler so that
+     * the dependency file can be fixed up afterwards
+     */
+    childpid = fork() ;
+
+    if( childpid == 0 )
+    {
+        execvp( args[0], args ) ;
+
+        fprintf( stderr, "cap: cannot run %s : %s\n", args[0], strerror( errno ) ) ;
+
+        _exit( 127 ) ;
+    }
+
+    if( childpid < 0 )
+        return -1 ;
+
+    waitpid( childpid, &status, 0 ) ;
+
+    if( WIFEXITED( status ) )
+    {
+        retv = WEXITSTATUS( status ) ;
+    }
+    else
+    {
+        retv = -1 ;
+    }
+
+    for( i = 1 ; i < n ; i++ )
+    {
+        if( strcmp( args[ i - 1 ], "-MF" ) == 0 )
+        {
+            cc_fix_depfile( args[i], fdpaths, sources, count ) ;
+        }
+    }
+
+    return retv ;
+}
+
+/*******************************************************
+ */
+
+
+/* --list-directives and --check read files for their directives
+ * without processing them, which is quick enough to do over a whole
+ * tree before each build.
+ *
+ * Line starts are found with the tables of the line scanner, so a
+ * macro character in a comment or on a continued line does not start
+ * a directive, as in process_stream().  The text of a block is passed
+ * over to the lone macro character that ends it, except that the body
+ * of a #repeat is read for the directives in it.
+ *
+ * --list-directives writes an index of the files that use directives,
+ * one JSON object a line :
+ *
+ *      {"file":"x.cap","directives":[[3,"def",7],...],"problems":[[12,"..."]]}
+ *
+ * Each directive has its line, its keyword and the last line of its
+ * block, or of its #capif ... #capendif.  --list-directives=binary
+ * writes the same with 32 bit little endian numbers :
+ *
+ *      "CAPDIRS1"
+ *      <keyword count>     then for each <length> <bytes>
+ *      then for each file
+ *          <name length> <name bytes>
+ *          <directive count>   then for each <line> <keyword index> <last line>
+ *          <problem count>     then for each <line> <length> <message bytes>
+ *
+ * Problems are reported as errors too, and --check only reports them.
+ * The brace and return macros are not followed, so odd input that has
+ * them read on past a line can be seen differently.
+ */
+
+#define SCAN_OFF            0
+#define SCAN_CHECK          1
+#define SCAN_JSON           2
+#define SCAN_BINARY         3
+
+static int scan_mode = SCAN_OFF ;
+
+static boolean_t scan_started = FALSE ;
+
+#define SCAN_MAX_DEPTH      64
+
+struct scan_entry_s {
+    unsigned int    line ;
+    unsigned int    last ;
+    int             keyword ;       /* in directive_names[] */
+    } ;
+
+typedef struct scan_entry_s         scan_entry_t ;
+
+struct scan_problem_s {
+    unsigned int    line ;
+    char            *message ;
+    } ;
+
+typedef struct scan_problem_s       scan_problem_t ;
+
+static scan_entry_t *scan_entries = NULL ;
+static int scan_nentries = 0 ;
+static int scan_maxentries = 0 ;
+
+static scan_problem_t *scan_problems = NULL ;
+static int scan_nproblems = 0 ;
+static int scan_maxproblems = 0 ;
+
+/* the open #repeat and #capif blocks, by entry
+ */
+struct scan_level_s {
+    int             entry ;
+    boolean_t       else_seen ;
+    } ;
+
+static struct scan_level_s scan_stack[ SCAN_MAX_DEPTH ] ;
+static int scan_depth = 0 ;
+
+/* after #skipon only #skipoff is a directive
+ */
+static boolean_t scan_skipping = FALSE ;
+
+
+/* Directives that do nothing useful without arguments.  A #def is
+ * checked more closely.
+ */
+static const char *scan_needs_args[] = {
+        "macrochar", "constants", "flags", "constants-values",
+        "constants-negative", "perfect_hash", "table", "repeat", "embed",
+        "command", "command-expand", "redefine", "capinclude", "capif", "capelif",
+        "output", "output-both",
+        NULL
+    } ;
+
+
+static void scan_problem( unsigned int line, const char *fmt, ... )
+{
+    char message[ 256 ] ;
+    scan_problem_t *sp = NULL ;
+    va_list ap ;
+
+    va_start( ap, fmt ) ;
+    vsnprintf( message, sizeof(message), fmt, ap ) ;
+    va_end( ap ) ;
+
+    cap_error_at( line, "%s", message ) ;
+
+    if( scan_nproblems == scan_maxproblems )
+    {
+        scan_maxproblems = ( scan_maxproblems == 0 ) ? 16 : scan_maxproblems * 2 ;
+
+        sp = (scan_problem_t *)realloc( scan_problems, (size_t)scan_maxproblems * sizeof(scan_problem_t) ) ;
+
+        if( sp == NULL )
+        {
+            scan_maxproblems = scan_nproblems ;
+            return ;
+        }
+
+        scan_problems = sp ;
+    }
+
+    scan_problems[ scan_nproblems ].line = line ;
+    scan_problems[ scan_nproblems ].message = strdup( message ) ;
+
+    if( scan_problems[ scan_nproblems ].message != NULL )
+        scan_nproblems++ ;
+}
+
+
+static int scan_add( unsigned int line, int keyword )
+{
+    scan_entry_t *se = NULL ;
+
+    if( scan_nentries == scan_maxentries )
+    {
+        scan_maxentries = ( scan_maxentries == 0 ) ? 64 : scan_maxentries * 2 ;
+
+        se = (scan_entry_t *)realloc( scan_entries, (size_t)scan_maxentries * sizeof(scan_entry_t) ) ;
+
+        if( se == NULL )
+        {
+            scan_maxentries = scan_nentries ;
+            return -1 ;
+        }
+
+        scan_entries = se ;
+    }
+
+    scan_entries[ scan_nentries ].line = line ;
+    scan_entries[ scan_nentries ].last = line ;
+    scan_entries[ scan_nentries ].keyword = keyword ;
+
+    return scan_nentries++ ;
+}
+
+
+static boolean_t scan_is_name( const char *name, const char **names )
+{
+    int k = 0 ;
+
+    for( k = 0 ; names[k] != NULL ; k++ )
+    {
+        if( strcmp( names[k], name ) == 0 )
+            return TRUE ;
+    }
+
+    return FALSE ;
+}
+
+
+static const unsigned char *scan_skip_ws( const unsigned char *p, const unsigned char *end )
+{
+    while( ( p < end ) && isspace( *p ) )
+        p++ ;
+
+    return p ;
+}
+
+
+static const unsigned char *scan_symbol( const unsigned char *p, const unsigned char *end )
+{
+    if( ( p == end ) || ! ( isalpha( *p ) || ( *p == '_' ) ) )
+        return NULL ;
+
+    while( ( p < end ) && ( isalnum( *p ) || ( *p == '_' ) ) )
+        p++ ;
+
+    return p ;
+}
+
+
+/* Whether a #repeat is open around the line being looked at
+ */
+static boolean_t scan_in_repeat()
+{
+    int i = 0 ;
+
+    for( i = 0 ; i < scan_depth ; i++ )
+    {
+        if( strcmp( directive_names[ scan_entries[ scan_stack[ i ].entry ].keyword ], "repeat" ) == 0 )
+            return TRUE ;
+    }
+
+    return FALSE ;
+}
+
+
+/* Pass over the name of a #def.  Inside a #repeat the name can hold
+ * $( ... ) expressions of the counter, as in F_$(i), which are not
+ * checked.  Returns NULL if there is no name.
+ */
+static const unsigned char *scan_def_name( const unsigned char *p, const unsigned char *end )
+{
+    const unsigned char *start = p ;
+    int depth = 0 ;
+
+    if( ! scan_in_repeat() )
+        return scan_symbol( p, end ) ;
+
+    while( p < end )
+    {
+        if( ( depth == 0 ) && ( *p == '$' ) && ( p + 1 < end ) && ( p[1] == '(' ) )
+        {
+            depth = 1 ;
+            p += 2 ;
+        }
+        else if( depth > 0 )
+        {
+            if( *p == '(' )
+                depth++ ;
+            else if( *p == ')' )
+                depth-- ;
+
+            p++ ;
+        }
+        else if( ( isalnum( *p ) || ( *p == '_' ) ) && ( ( p > start ) || ! isdigit( *p ) ) )
+            p++ ;
+        else
+            break ;
+    };
+
+    return ( ( p == start ) || ( depth > 0 ) ) ? NULL : p ;
+}
+
+
+/* Check a #def header is a name and a bracketed list of parameters
+ */
+static boolean_t scan_def_header( const unsigned char *p, const unsigned char *end )
+{
+    p = scan_def_name( scan_skip_ws( p, end ), end ) ;
+
+    if( p == NULL )
+        return FALSE ;
+
+    p = scan_skip_ws( p, end ) ;
+
+    if( ( p == end ) || ( *p++ != '(' ) )
+        return FALSE ;
+
+    p = scan_skip_ws( p, end ) ;
+
+    if( ( p < end ) && ( *p == ')' ) )
+        return TRUE ;
+
+    while( p < end )
+    {
+        if( ( end - p >= 3 ) && ( memcmp( p, "...", 3 ) == 0 ) )
+        {
+            p = scan_skip_ws( p + 3, end ) ;
+
+            return ( p < end ) && ( *p == ')' ) ;
+        }
+
+        p = scan_symbol( p, end ) ;
+
+        if( p == NULL )
+            return FALSE ;
+
+        p = scan_skip_ws( p, end ) ;
+
+        if( ( p < end ) && ( *p == ')' ) )
+            return TRUE ;
+
+        if( ( p == end ) || ( *p++ != ',' ) )
+            return FALSE ;
+
+        p = scan_skip_ws( p, end ) ;
+    };
+
+    return FALSE ;
+}
+
+
+/* Pass over the text of a block from the line after its directive.
+ * A #def or #comment can also end with the macro character at the end
+ * of a line.  Returns where the line after the block starts.
+ */
+static const unsigned char *scan_block( const unsigned char *p, const unsigned char *end, unsigned int *linep, int entry )
+{
+    const unsigned char *eol = NULL ;
+    const char *name = directive_names[ scan_entries[ entry ].keyword ] ;
+    boolean_t at_eol = ( strcmp( name, "def" ) == 0 ) || ( strcmp( name, "comment" ) == 0 ) ;
+
+    while( p < end )
+    {
+        eol = memchr( p, '\n', (size_t)( end - p ) ) ;
+
+        if( eol == NULL )
+            break ;
+
+        ( *linep )++ ;
+
+        if( ( ( eol - p == 1 ) || ( at_eol && ( eol > p ) ) ) && ( eol[-1] == (unsigned char)macrochar ) )
+        {
+            scan_entries[ entry ].last = *linep - 1 ;
+
+            return eol + 1 ;
+        }
+
+        p = eol + 1 ;
+    };
+
+    scan_problem( scan_entries[ entry ].line, "#%s block is not closed", name ) ;
+
+    return end ;
+}
+
+
+/* Look at a line starting with the macro character.  Returns where the
+ * next line starts, or NULL if it is not one of ours.
+ */
+static const unsigned char *scan_directive( const unsigned char *p, const unsigned char *end, unsigned int *linep )
+{
+    const unsigned char *eol = NULL ;
+    const unsigned char *w = NULL ;
+    const unsigned char *args = NULL ;
+    char word[ 32 ] ;
+    unsigned int line = *linep ;
+    int keyword = 0 ;
+    int entry = 0 ;
+    struct scan_level_s *level = NULL ;
+
+    eol = memchr( p, '\n', (size_t)( end - p ) ) ;
+
+    /* process_stream() does not see a directive on a last line that
+     * has no newline
+     */
+    if( eol == NULL )
+        return NULL ;
+
+    for( w = p + 1 ; ( w < eol ) && iswhitespace( *w ) ; w++ )
+        ;
+
+    for( args = w ; ( args < eol ) && ! isspace( *args ) ; args++ )
+        ;
+
+    /* a lone macro character ends a #repeat
+     */
+    if( args == w )
+    {
+        if( ( scan_depth > 0 ) && ( w == p + 1 ) &&
+            ( strcmp( directive_names[ scan_entries[ scan_stack[ scan_depth - 1 ].entry ].keyword ], "repeat" ) == 0 ) )
+        {
+            scan_entries[ scan_stack[ --scan_depth ].entry ].last = line ;
+        }
+
+        return NULL ;
+    }
+
+    if( (size_t)( args - w ) >= sizeof(word) )
+        return NULL ;
+
+    memcpy( word, w, (size_t)( args - w ) ) ;
+    word[ args - w ] = 0 ;
+
+    for( keyword = 0 ; directive_names[ keyword ] != NULL ; keyword++ )
+    {
+        if( strcmp( directive_names[ keyword ], word ) == 0 )
+            break ;
+    }
+
+    if( ( directive_names[ keyword ] == NULL ) || ( scan_skipping && ( strcmp( word, "skipoff" ) != 0 ) ) )
+        return NULL ;
+
+    scan_skipping = ( strcmp( word, "skipon" ) == 0 ) ;
+
+    entry = scan_add( line, keyword ) ;
+
+    if( entry < 0 )
+        return NULL ;
+
+    *linep = line + 1 ;
+
+    if( scan_is_name( word, scan_needs_args ) && ( scan_skip_ws( args, eol ) == eol ) )
+    {
+        scan_problem( line, "#%s needs arguments", word ) ;
+    }
+    else if( ( strcmp( word, "def" ) == 0 ) && ! scan_def_header( args, eol ) )
+    {
+        scan_problem( line, "malformed #def header, expected a name and its parameters in brackets" ) ;
+    }
+    else if( strcmp( word, "macrochar" ) == 0 )
+    {
+        macrochar = (char)args[1] ;
+    }
+
+    if( strcmp( word, "repeat" ) == 0 )
+    {
+        if( scan_depth == SCAN_MAX_DEPTH )
+        {
+            scan_problem( line, "#repeat and #capif nested more than %d deep", SCAN_MAX_DEPTH ) ;
+
+            return scan_block( eol + 1, end, linep, entry ) ;
+        }
+
+        scan_stack[ scan_depth ].entry = entry ;
+        scan_stack[ scan_depth++ ].else_seen = FALSE ;
+    }
+    else if( scan_is_name( word, block_directive_names ) )
+    {
+        /* a #def or #comment can end on its own line
+         */
+        if( ( ( strcmp( word, "def" ) == 0 ) || ( strcmp( word, "comment" ) == 0 ) ) &&
+            ( eol[-1] == (unsigned char)macrochar ) && ( eol - 1 > args ) )
+        {
+            return eol + 1 ;
+        }
+
+        return scan_block( eol + 1, end, linep, entry ) ;
+    }
+    else if( strcmp( word, "capif" ) == 0 )
+    {
+        if( scan_depth == SCAN_MAX_DEPTH )
+        {
+            scan_problem( line, "#repeat and #capif nested more than %d deep", SCAN_MAX_DEPTH ) ;
+        }
+        else
+        {
+            scan_stack[ scan_depth ].entry = entry ;
+            scan_stack[ scan_depth++ ].else_seen = FALSE ;
+        }
+    }
+    else if( ( strcmp( word, "capelif" ) == 0 ) || ( strcmp( word, "capelse" ) == 0 ) || ( strcmp( word, "capendif" ) == 0 ) )
+    {
+        level = ( scan_depth > 0 ) ? &scan_stack[ scan_depth - 1 ] : NULL ;
+
+        if( ( level == NULL ) || ( strcmp( directive_names[ scan_entries[ level->entry ].keyword ], "capif" ) != 0 ) )
+        {
+            scan_problem( line, "#%s without #capif", word ) ;
+        }
+        else if( strcmp( word, "capendif" ) == 0 )
+        {
+            scan_entries[ level->entry ].last = line ;
+            scan_depth-- ;
+        }
+        else if( level->else_seen )
+        {
+            scan_problem( line, "#%s after #capelse", word ) ;
+        }
+        else
+        {
+            level->else_seen = ( strcmp( word, "capelse" ) == 0 ) ;
+        }
+    }
+
+    return eol + 1 ;
+}
+
+
+/* Find the directives in a buffer
+ */
+static void scan_buffer( const unsigned char *p, size_t len )
+{
+    const unsigned char *end = p + len ;
+    const unsigned char *q = NULL ;
+    unsigned char (*t)[ LEX_CLASSES ] = NULL ;
+    unsigned int line = 1 ;
+    boolean_t at_start = TRUE ;
+    int state = LEX_CODE ;
+    int next = 0 ;
+
+    if( lex_class[ '\n' ] != LC_NL )
+        lex_init() ;
+
+    t = lex_next[ 0 ] ;
+
+    scan_nentries = 0 ;
+    scan_nproblems = 0 ;
+    scan_depth = 0 ;
+    scan_skipping = FALSE ;
+
+    macrochar = initial_macrochar ;
+
+    while( p < end )
+    {
+        if( at_start && ( *p == (unsigned char)macrochar ) )
+        {
+            q = scan_directive( p, end, &line ) ;
+
+            if( q != NULL )
+            {
+                p = q ;
+                continue ;
+            }
+        }
+
+        at_start = FALSE ;
+
+        next = t[ state ][ lex_class[ *p ] ] ;
+
+        if( next < LEX_STATES )
+        {
+            /* a newline here is in a comment or a continued string
+             */
+            if( *p == '\n' )
+                line++ ;
+
+            state = next ;
+            p++ ;
+
+            continue ;
+        }
+
+        switch( next )
+        {
+            case LEX_ENTER_COMMENT :    state = LEX_COMMENT_STAR ;  p++ ;   break ;
+            case LEX_ENTER_DQ :         state = LEX_DQ ;            p++ ;   break ;
+            case LEX_ENTER_SQ :         state = LEX_SQ ;            p++ ;   break ;
+
+            case LEX_LINE_COMMENT :
+            {
+                /* a // comment ending in a \ runs on to the next line
+                 */
+                q = memchr( p, '\n', (size_t)( end - p ) ) ;
+
+                p = ( q != NULL ) ? q : end ;
+                state = ( p[-1] == '\\' ) ? LEX_BSLASH : LEX_CODE ;
+
+                break ;
+            }
+
+            default :
+            {
+                /* the end of the line, which only ends a \ line
+                 * continued
+                 */
+                at_start = ( state != LEX_BSLASH ) ;
+                state = LEX_CODE ;
+
+                line++ ;
+                p++ ;
+
+                break ;
+            }
+        }
+    };
+
+    while( scan_depth > 0 )
+    {
+        scan_depth-- ;
+
+        if( strcmp( directive_names[ scan_entries[ scan_stack[ scan_depth ].entry ].keyword ], "capif" ) == 0 )
+        {
+            scan_problem( scan_entries[ scan_stack[ scan_depth ].entry ].line, "#capif has no #capendif" ) ;
+        }
+        else
+        {
+            scan_problem( scan_entries[ scan_stack[ scan_depth ].entry ].line, "#repeat block is not closed" ) ;
+        }
+    };
+}
+
+
+static void scan_json_string( const char *str )
+{
+    FPUT( '"' ) ;
+
+    for( ; *str != 0 ; str++ )
+    {
+        if( ( *str == '"' ) || ( *str == '\\' ) )
+        {
+            FPUT( '\\' ) ;
+            FPUT( *str ) ;
+        }
+        else if( (unsigned char)*str < ' ' )
+        {
+            fout_printf( "\\u%04x", (unsigned int)(unsigned char)*str ) ;
+        }
+        else
+        {
+            FPUT( *str ) ;
+        }
+    }
+
+    FPUT( '"' ) ;
+}
+
+
+static void scan_write( const char *name )
+{
+    int k = 0 ;
+
+    if( scan_mode == SCAN_JSON )
+    {
+        if( ( scan_nentries == 0 ) && ( scan_nproblems == 0 ) )
+            return ;
+
+        FPUTS( "{\"file\":" ) ;
+        scan_json_string( name ) ;
+        FPUTS( ",\"directives\":[" ) ;
+
+        for( k = 0 ; k < scan_nentries ; k++ )
+        {
+            fout_printf( "%s[%u,\"%s\",%u]", ( k > 0 ) ? "," : "",
+                            scan_entries[k].line, directive_names[ scan_entries[k].keyword ], scan_entries[k].last ) ;
+        }
+
+        FPUTS( "],\"problems\":[" ) ;
+
+        for( k = 0 ; k < scan_nproblems ; k++ )
+        {
+            fout_printf( "%s[%u,", ( k > 0 ) ? "," : "", scan_problems[k].line ) ;
+            scan_json_string( scan_problems[k].message ) ;
+            FPUT( ']' ) ;
+        }
+
+        FPUTS( "]}\n" ) ;
+    }
+    else if( scan_mode == SCAN_BINARY )
+    {
+        if( ( scan_nentries == 0 ) && ( scan_nproblems == 0 ) )
+            return ;
+
+        srcmap_put32( fout, (uint32_t)strlen( name ) ) ;
+        fwrite( name, 1, strlen( name ), fout ) ;
+
+        srcmap_put32( fout, (uint32_t)scan_nentries ) ;
+
+        for( k = 0 ; k < scan_nentries ; k++ )
+        {
+            srcmap_put32( fout, scan_entries[k].line ) ;
+            srcmap_put32( fout, (uint32_t)scan_entries[k].keyword ) ;
+            srcmap_put32( fout, scan_entries[k].last ) ;
+        }
+
+        srcmap_put32( fout, (uint32_t)scan_nproblems ) ;
+
+        for( k = 0 ; k < scan_nproblems ; k++ )
+        {
+            srcmap_put32( fout, scan_problems[k].line ) ;
+            srcmap_put32( fout, (uint32_t)strlen( scan_problems[k].message ) ) ;
+            fwrite( scan_problems[k].message, 1, strlen( scan_problems[k].message ), fout ) ;
+        }
+    }
+
+    for( k = 0 ; k < scan_nproblems ; k++ )
+    {
+        safe_free( scan_problems[k].message ) ;
+    }
+}
+
+
+/* Scan one file, or stdin for - .  Returns -1 if it can not be read.
+ */
+static int scan_file( const char *path )
+{
+    FILE *fs = NULL ;
+    int k = 0 ;
+
+    if( ! scan_started && ( scan_mode == SCAN_BINARY ) )
+    {
+        fwrite( "CAPDIRS1", 1, 8, fout ) ;
+
+        for( k = 0 ; directive_names[k] != NULL ; k++ )
+            ;
+
+        srcmap_put32( fout, (uint32_t)k ) ;
+
+        for( k = 0 ; directive_names[k] != NULL ; k++ )
+        {
+            srcmap_put32( fout, (uint32_t)strlen( directive_names[k] ) ) ;
+            fwrite( directive_names[k], 1, strlen( directive_names[k] ), fout ) ;
+        }
+    }
+
+    scan_started = TRUE ;
+
+    if( strcmp( path, "-" ) == 0 )
+    {
+        fs = stdin ;
+        infilename = "<stdin>" ;
+    }
+    else
+    {
+        fs = fopen( path, "r" ) ;
+        infilename = path ;
+    }
+
+    if( ( fs == NULL ) || ( load_input( fs ) != 0 ) )
+    {
+        fprintf( stderr, "cap: cannot read %s\n", path ) ;
+
+        if( ( fs != NULL ) && ( fs != stdin ) )
+            fclose( fs ) ;
+
+        return -1 ;
+    }
+
+    if( fs != stdin )
+        fclose( fs ) ;
+
+    scan_buffer( inbuf, inbuf_len ) ;
+
+    unload_input() ;
+
+    scan_write( infilename ) ;
+
+    return 0 ;
+}
+
+#endif /* CAP_FUZZER */
+
+/*******************************************************
+ */
+
+
+/* Processing a file to a named output.
+ *
+ * The output is written to a hidden temporary file next to the target
+ * and renamed over it, so a reader never sees a partial file.
+ *
+ * With --write-if-changed a target whose contents would not change is
+ * left alone, so its time stamp does not cause make to rebuild
+ * everything that depends on it.  -o outputs are written the same way.
+ */
+
+static boolean_t write_if_changed = FALSE ;
+
+
+static int make_parent_dirs( const char *path )
+{
+    char *p = strdup( path ) ;
+    char *s = NULL ;
+
+    if( p == NULL )
+        return -1 ;
+
+    for( s = strchr( p + 1, '/' ) ; s != NULL ; s = strchr( s + 1, '/' ) )
+    {
+        *s = 0 ;
+
+        if( ( mkdir( p, 0777 ) != 0 ) && ( errno != EEXIST ) )
+        {
+            free( p ) ;
+            return -1 ;
+        }
+
+        *s = '/' ;
+    }
+
+    free( p ) ;
+
+    return 0 ;
+}
+
+
+/* Make a hidden temporary file in the same directory as path, so it
+ * can be renamed over it.  Returns the descriptor and sets *tmppathp
+ * to a malloc()ed name, or returns -1.
+ */
+static int open_temp_for( const char *path, char **tmppathp )
+{
+    int fd = -1 ;
+    char *tmppath = NULL ;
+    const char *base = NULL ;
+
+    base = strrchr( path, '/' ) ;
+    base = ( base != NULL ) ? base + 1 : path ;
+
+    tmppath = (char *)malloc( strlen( path ) + 16 ) ;
+
+    if( tmppath == NULL )
+        return -1 ;
+
+    sprintf( tmppath, "%.*s.%s.capXXXXXX", (int)( base - path ), path, base ) ;
+
+    fd = mkstemp( tmppath ) ;
+
+    if( fd < 0 )
+    {
+        fprintf( stderr, "cap: cannot write %s : %s\n", path, strerror( errno ) ) ;
+
+        free( tmppath ) ;
+
+        return -1 ;
+    }
+
+    *tmppathp = tmppath ;
+
+    return fd ;
+}
+
+
+/* Compare two files, the sizes first and then the contents
+ */
+static boolean_t same_contents( const char *a, const char *b )
+{
+    struct stat sta ;
+    struct stat stb ;
+    char bufa[ 65536 ] ;
+    char bufb[ 65536 ] ;
+    ssize_t na = 0 ;
+    ssize_t nb = 0 ;
+    int fda = -1 ;
+    int fdb = -1 ;
+    boolean_t same = FALSE ;
+
+    if( ( stat( a, &sta ) != 0 ) || ( stat( b, &stb ) != 0 ) ||
+        ( sta.st_size != stb.st_size ) || ! S_ISREG( stb.st_mode ) )
+    {
+        return FALSE ;
+    }
+
+    fda = open( a, O_RDONLY ) ;
+    fdb = open( b, O_RDONLY ) ;
+
+    if( ( fda >= 0 ) && ( fdb >= 0 ) )
+    {
+        do
+        {
+            na = read( fda, bufa, sizeof(bufa) ) ;
+            nb = read( fdb, bufb, (size_t)( ( na > 0 ) ? na : 1 ) ) ;
+
+            if( ( na < 0 ) || ( na != nb ) || ( memcmp( bufa, bufb, (size_t)na ) != 0 ) )
+                break ;
+
+            same = ( na == 0 ) ;
+        }
+        while( ! same ) ;
+    }
+
+    if( fda >= 0 )
+        close( fda ) ;
+
+    if( fdb >= 0 )
+        close( fdb ) ;
+
+    return same ;
+}
+
+
+/* Put a finished temporary file in place of the target
+ */
+static int replace_output( const char *tmppath, const char *path )
+{
+    mode_t mask = 0 ;
+    struct stat st ;
+
+    if( write_if_changed && same_contents( tmppath, path ) )
+    {
+        unlink( tmppath ) ;
+
+        return 0 ;
+    }
+
+    /* keep the permissions of the file being replaced, or those a new
+     * file would have had
+     */
+    if( ( stat( path, &st ) == 0 ) && S_ISREG( st.st_mode ) )
+    {
+        chmod( tmppath, st.st_mode & 07777 ) ;
+    }
+    else
+    {
+        mask = umask( 0 ) ;
+        umask( mask ) ;
+
+        chmod( tmppath, 0666 & ~mask ) ;
+    }
+
+    if( rename( tmppath, path ) != 0 )
+    {
+        fprintf( stderr, "cap: cannot write %s : %s\n", path, strerror( errno ) ) ;
+
+        unlink( tmppath ) ;
+
+        return -1 ;
+    }
+
+    return 0 ;
+}
+
+#ifndef CAP_FUZZER
+
+/* the temporary file behind the current -o output
+ */
+static char *output_tmppath = NULL ;
+
+
+/* Open an -o output
+ */
+static FILE *open_output( const char *path )
+{
+    FILE *fs = NULL ;
+    int fd = -1 ;
+
+    if( ! write_if_changed )
+        return fopen( path, "w" ) ;
+
+    fd = open_temp_for( path, &output_tmppath ) ;
+
+    if( fd < 0 )
+        return NULL ;
+
+    fs = fdopen( fd, "w" ) ;
+
+    if( fs == NULL )
+    {
+        close( fd ) ;
+        unlink( output_tmppath ) ;
+        safe_free( output_tmppath ) ;
+    }
+
+    return fs ;
+}
+
+
+/* Finish the current -o output, if it is a file
+ */
+static int close_output()
+{
+    int retv = 0 ;
+
+    if( ( fout == NULL ) || ( fout == stdout ) )
+        return 0 ;
+
+    if( fclose( fout ) != 0 )
+        retv = -1 ;
+
+    fout = NULL ;
+
+    if( output_tmppath != NULL )
+    {
+        if( retv == 0 )
+        {
+            retv = replace_output( output_tmppath, output_path ) ;
+        }
+        else
+        {
+            unlink( output_tmppath ) ;
+        }
+
+        safe_free( output_tmppath ) ;
+    }
+
+    return retv ;
+}
+
+
+static int process_file_to( const char *inpath, const char *outpath )
+{
+    int retv = 0 ;
+    int fd = -1 ;
+    int errors = cap_errors ;
+    int old_command_exit_status = command_exit_status ;
+    char *tmppath = NULL ;
+    FILE *old_fout = fout ;
+    struct stat inst ;
+    struct stat outst ;
+
+    /* e.g. -O . on a file in the current directory
+     */
+    if( ( stat( inpath, &inst ) == 0 ) && ( stat( outpath, &outst ) == 0 ) &&
+        ( inst.st_dev == outst.st_dev ) && ( inst.st_ino == outst.st_ino ) )
+    {
+        fprintf( stderr, "cap: %s would be written over its own input\n", outpath ) ;
+
+        return -1 ;
+    }
+
+    if( make_parent_dirs( outpath ) != 0 )
+    {
+        fprintf( stderr, "cap: cannot create directory for %s\n", outpath ) ;
+
+        return -1 ;
+    }
+
+    fd = open_temp_for( outpath, &tmppath ) ;
+
+    if( fd < 0 )
+        return -1 ;
+
+    fin = fopen( inpath, "r" ) ;
+    fout = fdopen( fd, "w" ) ;
+
+    if( ( fin == NULL ) || ( fout == NULL ) )
+    {
+        fprintf( stderr, "cap: cannot read %s : %s\n", inpath, strerror( errno ) ) ;
+
+        retv = -1 ;
+
+        goto err_exit ;
+    }
+
+    infilename = inpath ;
+
+    dep_add( inpath ) ;
+
+    reset_output_lines() ;
+
+    if( engine == ENGINE_FAST )
+    {
+        load_input( fin ) ;
+    }
+
+    retv = main_process() ;
+
+    unload_input() ;
+
+    if( fflush( fout ) != 0 )
+        retv = -1 ;
+
+    /* a file cap reported errors in is not written, and the output
+     * keeps its old contents and time stamp
+     */
+    if( ( cap_errors != errors ) || ( command_exit_status != old_command_exit_status ) )
+        retv = -1 ;
+
+err_exit:
+
+    FCLOSE( fin ) ;
+
+    if( fout != NULL )
+    {
+        fclose( fout ) ;
+    }
+    else
+    {
+        close( fd ) ;
+    }
+
+    fout = old_fout ;
+
+    if( retv == 0 )
+    {
+        retv = replace_output( tmppath, outpath ) ;
+    }
+    else
+    {
+        unlink( tmppath ) ;
+    }
+
+    free( tmppath ) ;
+
+    return retv ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* Batch mode : cap -O <outdir> [--ext .x] <files, dirs or @lists>
+ *
+ * Each input file is written to <outdir>/<its path>, and each file
+ * under an input directory to <outdir>/<its path within the directory>.
+ * An input is skipped when its output is newer than it, the cap binary
+ * and everything it pulled in the last time ( #capinclude files and
+ * #command-deps names ), so rerunning over a tree only does the changed
+ * files.  Those dependencies are kept one a line in a hidden file next
+ * to the output, .<output name>.deps.
+ */
+
+static const char *output_ext = NULL ;
+
+static struct timespec cap_binary_mtime ;
+
+
+/* Only ordinary, visible files are inputs.  Editors and cap itself
+ * write temporary files whose names start with a dot.
+ */
+static boolean_t is_input_name( const char *name )
+{
+    return ( name[0] != '.' ) && ( name[ strlen( name ) - 1 ] != '~' ) ;
+}
+
+
+/* The output for an input at rel under outdir, with the extension
+ * changed by --ext.  The output has to stay under outdir, so empty and
+ * . parts of rel are dropped and a .. part is refused.  Returns a
+ * malloc()ed path, or NULL.
+ */
+static char *map_output_path( const char *outdir, const char *rel )
+{
+    char *path = NULL ;
+    char *dot = NULL ;
+    char *base = NULL ;
+    char *t = NULL ;
+    const char *p = NULL ;
+    const char *q = NULL ;
+    size_t len = 0 ;
+
+    path = (char *)malloc( strlen( outdir ) + strlen( rel ) + ( ( output_ext != NULL ) ? strlen( output_ext ) : 0 ) + 2 ) ;
+
+    if( path == NULL )
+        return NULL ;
+
+    t = path + sprintf( path, "%s", outdir ) ;
+
+    for( p = rel ; *p != 0 ; p = ( *q == 0 ) ? q : q + 1 )
+    {
+        q = strchr( p, '/' ) ;
+
+        if( q == NULL )
+            q = p + strlen( p ) ;
+
+        len = (size_t)( q - p ) ;
+
+        if( ( len == 0 ) || ( ( len == 1 ) && ( p[0] == '.' ) ) )
+            continue ;
+
+        if( ( len == 2 ) && ( p[0] == '.' ) && ( p[1] == '.' ) )
+        {
+            fprintf( stderr, "cap: %s would be written outside %s\n", rel, outdir ) ;
+
+            free( path ) ;
+
+            return NULL ;
+        }
+
+        *t++ = '/' ;
+
+        memcpy( t, p, len ) ;
+
+        t += len ;
+    };
+
+    *t = 0 ;
+
+    if( output_ext != NULL )
+    {
+        base = strrchr( path, '/' ) + 1 ;
+        dot = strrchr( base, '.' ) ;
+
+        if( ( dot == NULL ) || ( dot == base ) )
+            dot = base + strlen( base ) ;
+
+        strcpy( dot, output_ext ) ;
+    }
+
+    return path ;
+}
+
+
+static boolean_t newer_than( struct timespec *a, struct timespec *b )
+{
+    return ( a->tv_sec > b->tv_sec ) || ( ( a->tv_sec == b->tv_sec ) && ( a->tv_nsec > b->tv_nsec ) ) ;
+}
+
+
+/* The hidden file that lists what the output at outpath depended on.
+ * Returns a malloc()ed path.
+ */
+static char *batch_deps_path( const char *outpath )
+{
+    const char *base = strrchr( outpath, '/' ) ;
+    size_t dirlen = 0 ;
+    char *path = NULL ;
+
+    base = ( base == NULL ) ? outpath : base + 1 ;
+    dirlen = (size_t)( base - outpath ) ;
+
+    path = (char *)malloc( strlen( outpath ) + 8 ) ;
+
+    if( path != NULL )
+    {
+        sprintf( path, "%.*s.%s.deps", (int)dirlen, outpath, base ) ;
+    }
+
+    return path ;
+}
+
+
+/* TRUE if the dependencies listed in depspath are all there and none
+ * is newer than mtime.  A missing list means the output was never
+ * made here, so it is not up to date.
+ */
+static boolean_t batch_deps_older( const char *depspath, struct timespec *mtime )
+{
+    boolean_t retv = FALSE ;
+    FILE *fs = NULL ;
+    char *line = NULL ;
+    size_t size = 0 ;
+    ssize_t len = 0 ;
+    struct stat st ;
+
+    fs = fopen( depspath, "r" ) ;
+
+    if( fs == NULL )
+        return FALSE ;
+
+    while( ( len = getline( &line, &size, fs ) ) > 0 )
+    {
+        if( line[ len - 1 ] == '\n' )
+            line[ len - 1 ] = 0 ;
+
+        if( ( stat( line, &st ) != 0 ) || newer_than( &st.st_mtim, mtime ) )
+            goto err_exit ;
+    };
+
+    retv = TRUE ;
+
+err_exit:
+
+    free( line ) ;
+    fclose( fs ) ;
+
+    return retv ;
+}
+
+
+/* Write the dependencies recorded while processing an input
+ */
+static int batch_write_deps( const char *depspath )
+{
+    FILE *fs = NULL ;
+    char *real = NULL ;
+    int i = 0 ;
+
+    fs = fopen( depspath, "w" ) ;
+
+    if( fs == NULL )
+        return -1 ;
+
+    for( i = 0 ; i < dep_nfiles ; i++ )
+    {
+        real = realpath( dep_files[i], NULL ) ;
+
+        fprintf( fs, "%s\n", ( real != NULL ) ? real : dep_files[i] ) ;
+
+        safe_free( real ) ;
+    }
+
+    if( fclose( fs ) != 0 )
+    {
+        unlink( depspath ) ;
+
+        return -1 ;
+    }
+
+    return 0 ;
+}
+
+
+static int batch_file( const char *outdir, const char *path, const char *rel )
+{
+    int retv = 0 ;
+    char *outpath = NULL ;
+    char *depspath = NULL ;
+    char **old_dep_files = dep_files ;
+    int old_dep_nfiles = dep_nfiles ;
+    boolean_t old_dep_record = dep_record ;
+    struct stat inst ;
+    struct stat outst ;
+
+    if( stat( path, &inst ) != 0 )
+    {
+        fprintf( stderr, "cap: cannot read %s : %s\n", path, strerror( errno ) ) ;
+
+        return -1 ;
+    }
+
+    outpath = map_output_path( outdir, rel ) ;
+    depspath = ( outpath != NULL ) ? batch_deps_path( outpath ) : NULL ;
+
+    if( depspath == NULL )
+    {
+        safe_free( outpath ) ;
+
+        return -1 ;
+    }
+
+    if( ( stat( outpath, &outst ) == 0 ) &&
+        newer_than( &outst.st_mtim, &inst.st_mtim ) &&
+        newer_than( &outst.st_mtim, &cap_binary_mtime ) &&
+        batch_deps_older( depspath, &outst.st_mtim ) )
+    {
+        goto err_exit ;
+    }
+
+    /* each file starts as a fresh cap would, and has its own list of
+     * what it pulls in
+     */
+    reset_state() ;
+
+    dep_files = NULL ;
+    dep_nfiles = 0 ;
+    dep_record = TRUE ;
+
+    retv = process_file_to( path, outpath ) ;
+
+    if( retv == 0 )
+    {
+        if( batch_write_deps( depspath ) != 0 )
+        {
+            fprintf( stderr, "cap: cannot write %s : %s\n", depspath, strerror( errno ) ) ;
+
+            retv = -1 ;
+        }
+    }
+    else
+    {
+        /* so the next run does it again
+         */
+        unlink( depspath ) ;
+    }
+
+    while( dep_nfiles > 0 )
+        free( dep_files[ --dep_nfiles ] ) ;
+
+    safe_free( dep_files ) ;
+
+    dep_files = old_dep_files ;
+    dep_nfiles = old_dep_nfiles ;
+    dep_record = old_dep_record ;
+
+err_exit:
+
+    free( depspath ) ;
+    free( outpath ) ;
+
+    return retv ;
+}
+
+
+/* Process everything under a directory.  skip is the length of the
+ * directory given on the command line, which is left out of the
+ * output paths.
+ */
+static int batch_dir( const char *outdir, const char *dir, size_t skip )
+{
+    int retv = 0 ;
+    DIR *d = NULL ;
+    struct dirent *de = NULL ;
+    struct stat st ;
+    char *path = NULL ;
+
+    d = opendir( dir ) ;
+
+    if( d == NULL )
+    {
+        fprintf( stderr, "cap: cannot read %s : %s\n", dir, strerror( errno ) ) ;
+
+        return -1 ;
+    }
+
+    while( ( de = readdir( d ) ) != NULL )
+    {
+        if( ! is_input_name( de->d_name ) )
+            continue ;
+
+        path = (char *)malloc( strlen( dir ) + strlen( de->d_name ) + 2 ) ;
+
+        if( path == NULL )
+        {
+            retv = -1 ;
+            break ;
+        }
+
+        sprintf( path, "%s/%s", dir, de->d_name ) ;
+
+        if( stat( path, &st ) == 0 )
+        {
+            if( S_ISDIR( st.st_mode ) )
+            {
+                if( batch_dir( outdir, path, skip ) != 0 )
+                    retv = -1 ;
+            }
+            else if( S_ISREG( st.st_mode ) )
+            {
+                if( batch_file( outdir, path, path + skip ) != 0 )
+                    retv = -1 ;
+            }
+        }
+
+        free( path ) ;
+    };
+
+    closedir( d ) ;
+
+    return retv ;
+}
+
+
+static int batch_input( const char *outdir, const char *arg ) ;
+
+
+/* A response file lists inputs separated by white space.  Names with
+ * spaces in can be put in double quotes.
+ */
+static int batch_response_file( const char *outdir, const char *file )
+{
+    int retv = 0 ;
+    char *data = NULL ;
+    size_t len = 0 ;
+    char *p = NULL ;
+    char *q = NULL ;
+    char *end = NULL ;
+
+    data = read_file( file, &len ) ;
+
+    if( data == NULL )
+    {
+        fprintf( stderr, "cap: cannot read response file %s\n", file ) ;
+
+        return -1 ;
+    }
+
+    p = data ;
+    end = data + len ;
+
+    while( p < end )
+    {
+        while( ( p < end ) && isspace( (unsigned char)*p ) )
+            p++ ;
+
+        if( p == end )
+            break ;
+
+        if( *p == '"' )
+        {
+            p++ ;
+
+            q = memchr( p, '"', (size_t)( end - p ) ) ;
+
+            if( q == NULL )
+                q = end ;
+        }
+        else
+        {
+            for( q = p ; ( q < end ) && !isspace( (unsigned char)*q ) ; q++ )
+                ;
+        }
+
+        {
+            char *name = strndup( p, (size_t)( q - p ) ) ;
+
+            if( ( name == NULL ) || ( batch_input( outdir, name ) != 0 ) )
+                retv = -1 ;
+
+            safe_free( name ) ;
+        }
+
+        p = ( q < end ) ? q + 1 : end ;
+    };
+
+    free( data ) ;
+
+    return retv ;
+}
+
+
+static int batch_input( const char *outdir, const char *arg )
+{
+    struct stat st ;
+    size_t skip = 0 ;
+
+    if( arg[0] == '@' )
+        return batch_response_file( outdir, arg + 1 ) ;
+
+    if( ( stat( arg, &st ) == 0 ) && S_ISDIR( st.st_mode ) )
+    {
+        skip = strlen( arg ) ;
+
+        while( ( skip > 1 ) && ( arg[ skip - 1 ] == '/' ) )
+            skip-- ;
+
+        return batch_dir( outdir, arg, skip ) ;
+    }
+
+    return batch_file( outdir, arg, arg ) ;
+}
+
+
+/*******************************************************
+ */
+
+
+/* Watch mode : cap --watch <dir> -O <outdir>
+ *
+ * Every file under <dir> is processed to the same relative path under
+ * <outdir>, then cap stays running and uses inotify to reprocess a file
+ * whenever it, or a file it pulls in with #capinclude or names with
+ * #command-deps, is written.  Events are collected until the tree has
+ * been quiet for WATCH_DEBOUNCE_MS so an editor saving several files
+ * only causes one pass.
+ *
+ * The work is done in this process, one file after another, so the
+ * #capinclude cache stays warm between events.  cap keeps its state in
+ * globals and so cannot process files on several threads at once.
+ */
+
+#define WATCH_DEBOUNCE_MS   20
+
+struct watch_input_s {
+    char    *path ;         /* input as found under the watched dir */
+    char    *outpath ;
+    char    **deps ;        /* real paths of everything it read */
+    int     ndeps ;
+    boolean_t   dirty ;
+    } ;
+
+typedef struct watch_input_s    watch_input_t ;
+
+static watch_input_t *watch_inputs = NULL ;
+static int watch_ninputs = 0 ;
+
+struct watch_dir_s {
+    int     wd ;
+    char    *path ;
+    } ;
+
+static struct watch_dir_s *watch_dirs = NULL ;
+static int watch_ndirs = 0 ;
+
+static int watch_fd = -1 ;
+
+static const char *watch_root = NULL ;
+static const char *watch_outdir = NULL ;
+static char *watch_outreal = NULL ;
+
+
+static void free_string_list( char **list, int count )
+{
+    int i = 0 ;
+
+    for( i = 0 ; i < count ; i++ )
+    {
+        free( list[i] ) ;
+    }
+
+    free( list ) ;
+}
+
+
+/* Process one watched input, remembering what it depends on
+ */
+static void watch_process( watch_input_t *wi )
+{
+    int i = 0 ;
+    int errors = cap_errors ;
+    double start = time_now() ;
+
+    free_string_list( wi->deps, wi->ndeps ) ;
+
+    wi->deps = NULL ;
+    wi->ndeps = 0 ;
+    wi->dirty = FALSE ;
+
+    dep_files = NULL ;
+    dep_nfiles = 0 ;
+
+    /* each rebuild starts as a fresh cap would, not with the macros
+     * the last file processed left set
+     */
+    reset_state() ;
+
+    if( process_file_to( wi->path, wi->outpath ) == 0 )
+    {
+        fprintf( stderr, "cap: %s -> %s ( %.1f ms )\n", wi->path, wi->outpath,
+                    ( time_now() - start ) * 1000.0 ) ;
+    }
+    else if( cap_errors != errors )
+    {
+        fprintf( stderr, "cap: %s has errors, %s is left as it was\n", wi->path, wi->outpath ) ;
+    }
+
+    /* keep the dependencies as real paths to compare with events
+     */
+    for( i = 0 ; i < dep_nfiles ; i++ )
+    {
+        char *real = realpath( dep_files[i], NULL ) ;
+
+        free( dep_files[i] ) ;
+
+        if( real != NULL )
+            dep_files[ wi->ndeps++ ] = real ;
+    }
+
+    wi->deps = dep_files ;
+
+    dep_files = NULL ;
+    dep_nfiles = 0 ;
+}
+
+
+static watch_input_t *watch_find_input( const char *path )
+{
+    int i = 0 ;
+
+    for( i = 0 ; i < watch_ninputs ; i++ )
+    {
+        if( strcmp( watch_inputs[i].path, path ) == 0 )
+            return &watch_inputs[i] ;
+    }
+
+    return NULL ;
+}
+
+
+static watch_input_t *watch_add_input( const char *path )
+{
+    watch_input_t *p = NULL ;
+    watch_input_t *wi = watch_find_input( path ) ;
+
+    if( wi != NULL )
+        return wi ;
+
+    p = (watch_input_t *)realloc( watch_inputs, ( watch_ninputs + 1 ) * sizeof(watch_input_t) ) ;
+
+    if( p == NULL )
+        return NULL ;
+
+    watch_inputs = p ;
+
+    wi = &watch_inputs[ watch_ninputs ] ;
+
+    memset( wi, 0, sizeof(watch_input_t) ) ;
+
+    wi->path = strdup( path ) ;
+    wi->outpath = map_output_path( watch_outdir, path + strlen( watch_root ) ) ;
+
+    if( ( wi->path == NULL ) || ( wi->outpath == NULL ) )
+    {
+        safe_free( wi->path ) ;
+        safe_free( wi->outpath ) ;
+
+        return NULL ;
+    }
+
+    watch_ninputs++ ;
+
+    return wi ;
+}
+
+
+static void watch_remove_input( const char *path )
+{
+    watch_input_t *wi = watch_find_input( path ) ;
+
+    if( wi == NULL )
+        return ;
+
+    unlink( wi->outpath ) ;
+
+    free( wi->path ) ;
+    free( wi->outpath ) ;
+    free_string_list( wi->deps, wi->ndeps ) ;
+
+    *wi = watch_inputs[ --watch_ninputs ] ;
+}
+
+
+/* Add a directory and everything under it, marking new files dirty
+ */
+static int watch_scan_dir( const char *dir )
+{
+    DIR *d = NULL ;
+    struct dirent *de = NULL ;
+    struct stat st ;
+    char *path = NULL ;
+    char *real = NULL ;
+    struct watch_dir_s *p = NULL ;
+    int wd = -1 ;
+
+    /* do not watch our own output
+     */
+    real = realpath( dir, NULL ) ;
+
+    if( ( real != NULL ) && ( watch_outreal != NULL ) && ( strcmp( real, watch_outreal ) == 0 ) )
+    {
+        free( real ) ;
+        return 0 ;
+    }
+
+    safe_free( real ) ;
+
+    wd = inotify_add_watch( watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                            IN_CREATE | IN_DELETE | IN_ONLYDIR ) ;
+
+    if( wd < 0 )
+    {
+        fprintf( stderr, "cap: cannot watch %s : %s\n", dir, strerror( errno ) ) ;
+
+        return -1 ;
+    }
+
+    p = (struct watch_dir_s *)realloc( watch_dirs, ( watch_ndirs + 1 ) * sizeof(struct watch_dir_s) ) ;
+
+    if( p == NULL )
+        return -1 ;
+
+    watch_dirs = p ;
+    watch_dirs[ watch_ndirs ].wd = wd ;
+    watch_dirs[ watch_ndirs ].path = strdup( dir ) ;
+    watch_ndirs++ ;
+
+    d = opendir( dir ) ;
+
+    if( d == NULL )
+        return -1 ;
+
+    while( ( de = readdir( d ) ) != NULL )
+    {
+        if( ! is_input_name( de->d_name ) )
+            continue ;
+
+        path = (char *)malloc( strlen( dir ) + strlen( de->d_name ) + 2 ) ;
+
+        if( path == NULL )
+            break ;
+
+        sprintf( path, "%s/%s", dir, de->d_name ) ;
+
+        if( stat( path, &st ) == 0 )
+        {
+            if( S_ISDIR( st.st_mode ) )
+            {
+                watch_scan_dir( path ) ;
+            }
+            else if( S_ISREG( st.st_mode ) )
+            {
+                watch_input_t *wi = watch_add_input( path ) ;
+
+                if( wi != NULL )
+                    wi->dirty = TRUE ;
+            }
+        }
+
+        free( path ) ;
+    };
+
+    closedir( d ) ;
+
+    return 0 ;
+}
+
+
+static const char *watch_dir_path( int wd )
+{
+    int i = 0 ;
+
+    for( i = 0 ; i < watch_ndirs ; i++ )
+    {
+        if( watch_dirs[i].wd == wd )
+            return watch_dirs[i].path ;
+    }
+
+    return NULL ;
+}
+
+
+/* A file was written - mark it and everything that read it as dirty
+ */
+static void watch_changed( const char *path )
+{
+    char *real = realpath( path, NULL ) ;
+    watch_input_t *wi = NULL ;
+    int i = 0 ;
+    int k = 0 ;
+
+    if( real == NULL )
+        return ;
+
+    forget_cached_include( real ) ;
+
+    for( i = 0 ; i < watch_ninputs ; i++ )
+    {
+        wi = &watch_inputs[i] ;
+
+        for( k = 0 ; k < wi->ndeps ; k++ )
+        {
+            if( strcmp( wi->deps[k], real ) == 0 )
+            {
+                wi->dirty = TRUE ;
+                break ;
+            }
+        }
+    }
+
+    free( real ) ;
+}
+
+
+/* Read and act on a batch of inotify events
+ */
+static void watch_read_events()
+{
+    char events[ 16 * 1024 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) )) ;
+    const struct inotify_event *ev = NULL ;
+    const char *dir = NULL ;
+    char *path = NULL ;
+    ssize_t len = 0 ;
+    char *p = NULL ;
+
+    len = read( watch_fd, events, sizeof(events) ) ;
+
+    for( p = events ; ( len > 0 ) && ( p < events + len ) ; p += sizeof(struct inotify_event) + ev->len )
+    {
+        ev = (const struct inotify_event *)p ;
+
+        dir = watch_dir_path( ev->wd ) ;
+
+        if( ( dir == NULL ) || ( ev->len == 0 ) || ! is_input_name( ev->name ) )
+            continue ;
+
+        path = (char *)malloc( strlen( dir ) + strlen( ev->name ) + 2 ) ;
+
+        if( path == NULL )
+            continue ;
+
+        sprintf( path, "%s/%s", dir, ev->name ) ;
+
+        if( ev->mask & IN_ISDIR )
+        {
+            if( ev->mask & ( IN_CREATE | IN_MOVED_TO ) )
+                watch_scan_dir( path ) ;
+        }
+        else if( ev->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+        {
+            watch_remove_input( path ) ;
+        }
+        else if( ev->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) )
+        {
+            watch_input_t *wi = watch_add_input( path ) ;
+
+            if( wi != NULL )
+                wi->dirty = TRUE ;
+
+            watch_changed( path ) ;
+        }
+
+        free( path ) ;
+    }
+}
+
+
+static int watch_main( const char *dir, const char *outdir )
+{
+    struct pollfd pfd ;
+    int i = 0 ;
+
+    if( outdir == NULL )
+    {
+        fprintf( stderr, "cap: --watch needs -O <outdir>\n" ) ;
+
+        return -1 ;
+    }
+
+    watch_root = dir ;
+    watch_outdir = outdir ;
+
+    if( ( mkdir( outdir, 0777 ) != 0 ) && ( errno != EEXIST ) )
+    {
+        fprintf( stderr, "cap: cannot create %s : %s\n", outdir, strerror( errno ) ) ;
+
+        return -1 ;
+    }
+
+    watch_outreal = realpath( outdir, NULL ) ;
+
+    watch_fd = inotify_init1( IN_CLOEXEC ) ;
+
+    if( watch_fd < 0 )
+    {
+        fprintf( stderr, "cap: inotify : %s\n", strerror( errno ) ) ;
+
+        return -1 ;
+    }
+
+    if( watch_scan_dir( dir ) != 0 )
+        return -1 ;
+
+    dep_record = TRUE ;
+
+    pfd.fd = watch_fd ;
+    pfd.events = POLLIN ;
+
+    while( TRUE )
+    {
+        for( i = 0 ; i < watch_ninputs ; i++ )
+        {
+            if( watch_inputs[i].dirty )
+                watch_process( &watch_inputs[i] ) ;
+        }
+
+        fflush( stderr ) ;
+
+        if( poll( &pfd, 1, -1 ) < 0 )
+        {
+            if( errno == EINTR )
+                continue ;
+
+            return -1 ;
+        }
+
+        /* then wait for things to go quiet
+         */
+        do
+        {
+            watch_read_events() ;
+        }
+        while( poll( &pfd, 1, WATCH_DEBOUNCE_MS ) > 0 ) ;
+    };
+
+    return 0 ;
+}
+
+
+/*******************************************************
+ */
+
+
+static void version()
+{
+    char ver[128] = "$Revision: 1.138 $" ;
+    
+    /* Skip the RCS string preceeding the version number
+     */
+    
+    int i = 11 ;
+    
+    while( isdigit( ver[i] ) || ( ver[i] == '.' ) )
+        i++ ;
+    
+    ver[i] = 0 ;
+    
+    printf( "CAP - C Auxilary Preprocessor - version %s\n", ver+11 ) ;
+}
+
+/*******************************************************
+ */
+
+
+static int init_main( int argc, char **argv )
+{
+    int retv = 0 ;
+    int i ;
+
+    fin     = NULL ;
+    fout    = stdout ;
+
+    int input_files = 0 ;
+
+    boolean_t compare_mode = FALSE ;
+    int compare_failed = 0 ;
+
+    const char *output_dir = NULL ;
+    const char *watch_dir = NULL ;
+
+
+    inside_quotes = FALSE ;
+    quote_pending = FALSE ;
+
+    escape_pending = FALSE ;
+
+    pendingchar = -1 ;
+
+
+    i = 1 ;
+
+    while( i < argc )
+    {
+        if( ( strcmp(argv[i],"-V") == 0 ) || ( strcmp(argv[i],"--version") == 0 ) )
+        {
+            i++ ;
+            
+            version() ;
+            
+            continue ;
+        }
+        
+        if( strncmp(argv[i],"--engine=",9) == 0 )
+        {
+            /* Select the processing engine for the files that follow
+             */
+            
+            if( strcmp( argv[i]+9, "reference" ) == 0 )
+            {
+                engine = ENGINE_REFERENCE ;
+            }
+            else if( strcmp( argv[i]+9, "fast" ) == 0 )
+            {
+                engine = ENGINE_FAST ;
+            }
+            else
+            {
+                fprintf( stderr, "cap: unknown engine '%s'\n", argv[i]+9 ) ;
+                
+                return -1 ;
+            }
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--cc") == 0 )
+        {
+            /* everything after this belongs to the compiler
+             */
+            
+            return cc_main( argc - i - 1, argv + i + 1 ) ;
+        }
+        
+        if( strncmp(argv[i],"--list-directives",17) == 0 )
+        {
+            /* The files that follow are scanned for directives, which
+             * are listed rather than processed
+             */
+            
+            if( ( argv[i][17] == 0 ) || ( strcmp( argv[i]+17, "=json" ) == 0 ) )
+            {
+                scan_mode = SCAN_JSON ;
+            }
+            else if( strcmp( argv[i]+17, "=binary" ) == 0 )
+            {
+                scan_mode = SCAN_BINARY ;
+            }
+            else
+            {
+                fprintf( stderr, "cap: unknown index format '%s'\n", argv[i]+17 ) ;
+                
+                return -1 ;
+            }
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--check") == 0 )
+        {
+            /* ... or only checked for problems
+             */
+            
+            scan_mode = SCAN_CHECK ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--compare") == 0 )
+        {
+            /* The files that follow are run through both engines and
+             * the outputs compared rather than being processed.
+             */
+            
+            compare_mode = TRUE ;
+            
+            i++ ;
             
-            i = 1 ;
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--compare-random") == 0 )
+        {
+            unsigned int count = 0 ;
+            unsigned int seed = 1 ;
             
-            c = nextchar() ;
+            i++ ;
             
-            leadingspaces = 0 ;
+            if( argc <= i )
+                return -1 ;
             
-            while( iswhitespace((char)c) )
+            count = (unsigned int)strtoul( argv[i], NULL, 0 ) ;
+            
+            i++ ;
+            
+            if( ( i < argc ) && isdigit( *argv[i] ) )
             {
-                blankchars[ leadingspaces++ ] = (char)c ;
+                seed = (unsigned int)strtoul( argv[i], NULL, 0 ) ;
                 
-                c = nextchar() ;
-            };
+                i++ ;
+            }
             
-            blankchars[ leadingspaces ] = 0 ;
-
-            while( ( i < BUFFLEN ) && ( c != -1 ) && ( !isspace((char)c) ) )
+            if( compare_random( count, seed ) != 0 )
+                compare_failed++ ;
+            
+            input_files++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--bench-adversarial") == 0 )
+        {
+            unsigned int scale = 20000 ;
+            
+            i++ ;
+            
+            if( ( i < argc ) && isdigit( *argv[i] ) )
             {
-                buff[i] = (char)c ;
+                scale = (unsigned int)strtoul( argv[i], NULL, 0 ) ;
+                
                 i++ ;
-
-                c = nextchar() ;
-            };
-
-            buff[i] = '\0' ;
+            }
             
-            debugf( "buff = %s\n", buff ) ;
+            if( bench_adversarial( scale ) != 0 )
+                compare_failed++ ;
             
-            if( ( i == BUFFLEN ) || ( c == -1 ) )
+            input_files++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--random-input") == 0 )
+        {
+            /* write out the random input for a given seed so a
+             * failure reported by --compare-random can be examined
+             */
+            
+            char *data = NULL ;
+            size_t len = 0 ;
+            
+            i++ ;
+            
+            if( argc <= i )
+                return -1 ;
+            
+            gen_random_input( (unsigned int)strtoul( argv[i], NULL, 0 ), &data, &len ) ;
+            
+            if( data != NULL )
             {
-                /* ran out of room in buffer or EOF
-                 * so we can treat that as not being a keyword
-                 */
-                
-                DBGLINE() ;
+                fwrite( data, 1, len, fout ) ;
                 
-                FPUT( macrochar ) ;
+                free( data ) ;
+            }
+            
+            input_files++ ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"-m") == 0 )
+        {
+            /* Set the character used to denote a macro
+             * default char is a hash ( # ) and this lets
+             * you use something else.
+             */
+            
+            i++ ;
+            
+            if( argc <= i )
+            {
+                // not enough arguments
                 
-                FPUTS( blankchars ) ;
-                leadingspaces = 0 ;
+                return -1 ;
+            }
+            
+            initial_macrochar = *( argv[i] ) ;
+            
+            i++ ;
+            
+            continue ;
+        }
+    
+        if( strcmp(argv[i],"-o") == 0 )
+        {
+            i++ ;
 
-                j = 1 ;
+            if( i > argc )
+                return -1 ;
 
-                while( j < i )
-                {
-                    FPUT( buff[j] ) ;
-                    j++ ;
-                };
+            if( close_output() != 0 )
+                return -1 ;
 
-                if( c != -1 )
-                {
-                    FPUT( c ) ;
-                }
-                
-                DBGLINE() ;
+            if( strcmp( argv[i], "-" ) == 0 )
+            {
+                fout = stdout ;
+                output_path = NULL ;
             }
             else
             {
-                /* a space or EOL terminated the sequence
-                 *
-                 * in either case we check for a keyword and we output it as given
-                 * if no keyword is found.
-                 */
+                fout = open_output( argv[i] ) ;
+                output_path = argv[i] ;
+
+                if( fout == NULL )
+                    return -1 ;
+            }
+
+            if( fout == NULL )
+                return -1 ;
+            
+            reset_output_lines() ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strncmp(argv[i],"-I",2) == 0 )
+        {
+            /* a directory to search for #capinclude files
+             */
+            
+            if( argv[i][2] != 0 )
+            {
+                add_include_dir( argv[i] + 2 ) ;
+            }
+            else
+            {
+                i++ ;
                 
-                DBGLINE() ;
+                if( argc <= i )
+                    return -1 ;
                 
-                retv = process() ;
+                add_include_dir( argv[i] ) ;
+            }
 
-                if( retv != 0 )
-                {
-                    DBGLINE() ;
-                
-                    /* ouput the buffer if we did not recognize the word
-                     */
+            i++ ;
 
-                    FPUT( macrochar ) ;
-                    
-                    FPUTS( blankchars ) ;
-                    leadingspaces = 0 ;
+            continue ;
+        }
 
-                    j = 1 ;
-                    
-                    while( j < i )
-                    {
-                        FPUT( buff[j] ) ;
-                        j++ ;
-                    };
-                    
-                    /* .. and finally the last character read !
-                     */
-                    
-                    FPUT( c ) ;
-                    
-                    /* Now write out everything until EOL without continuation mark
-                     *
-                     * but check if the last char was a newline, in which case we had
-                     * some like '  #  else\n' as a line and reading another char will
-                     * put us on the next line !
-                     */
-                    
-                    if( c != (int)'\n' )
-                    {
-                        c = nextchar() ;
-                        
-                        while( ( c != -1 ) && ( !feof(fin) ) && ! istrueeol() )
-                        {
-                            FPUT( c ) ;
-                            
-                            c = nextchar() ;
-                        };
-                        
-                        FPUT( c ) ;
-                    }
-                }
+        if( strncmp(argv[i],"-D",2) == 0 )
+        {
+            /* a name for #capif, as name or name=value
+             */
 
-                if( isspace(c) )
-                {
-                    /* if not EOF then we still have a character we read ahead
-                     * that must be output
-                     */
-                    FPUT( c ) ;
-                }
+            if( argv[i][2] != 0 )
+            {
+                add_cap_define( argv[i] + 2 ) ;
             }
-        }
-    };
-    
-err_exit:
-    
-    /* DEBUG Stuff
-     */
-     
-    /*
-    {
-        int ii = 0 ;
-    
-        ii = rotatingbuffer_idx - 10 ;
-    
-        if( ii < 0 ){ ii = 0  ;}
-    
-        fprintf( stderr, "END buff = [%s] indicies ( 0 to %d->%d )\n", rotatingbuffer+ii, rotatingbuffer_idx, ii ) ;
-    }
-    */
-    
-    return retv ;
-}
+            else
+            {
+                i++ ;
 
-/*******************************************************
- */
+                if( argc <= i )
+                    return -1 ;
 
+                add_cap_define( argv[i] ) ;
+            }
 
-static void version()
-{
-    char ver[128] = "$Revision: 1.138 $" ;
-    
-    /* Skip the RCS string preceeding the version number
-     */
-    
-    int i = 11 ;
-    
-    while( isdigit( ver[i] ) || ( ver[i] == '.' ) )
-        i++ ;
-    
-    ver[i] = 0 ;
-    
-    printf( "CAP - C Auxilary Preprocessor - version %s\n", ver+11 ) ;
-}
+            i++ ;
 
-/*******************************************************
- */
+            continue ;
+        }
+
+        if( strcmp(argv[i],"--plugin") == 0 )
+        {
+            /* a shared library adding directives, see cap_plugin.h
+             */
 
+            if( argc <= i + 1 )
+                return -1 ;
 
-static int init_main( int argc, char **argv )
-{
-    int retv = 0 ;
-    int i ;
+            if( plugin_load( argv[i + 1] ) != 0 )
+                return -1 ;
 
-    fin     = NULL ;
-    fout    = stdout ;
+            i += 2 ;
 
-    int input_files = 0 ;
+            continue ;
+        }
 
+        if( ( strcmp(argv[i],"--command-timeout") == 0 ) || ( strcmp(argv[i],"--command-memory") == 0 ) ||
+            ( strcmp(argv[i],"--command-cpu") == 0 ) || ( strcmp(argv[i],"--command-max-output") == 0 ) )
+        {
+            /* default limits for #command children, the same as a
+             * block's own timeout=, memory=, cpu= and max-output=
+             */
 
-    inside_quotes = FALSE ;
-    quote_pending = FALSE ;
+            char word[ 64 ] ;
 
-    escape_pending = FALSE ;
+            if( argc <= i + 1 )
+                return -1 ;
 
-    pendingchar = -1 ;
+            snprintf( word, sizeof(word), "%s=%s", argv[i] + 10, argv[i + 1] ) ;
 
+            if( command_limit_word( &command_limits, word ) != 1 )
+            {
+                fprintf( stderr, "cap: bad value for %s : '%s'\n", argv[i], argv[i + 1] ) ;
 
-    i = 1 ;
+                return -1 ;
+            }
 
-    while( i < argc )
-    {
-        if( ( strcmp(argv[i],"-V") == 0 ) || ( strcmp(argv[i],"--version") == 0 ) )
+            i += 2 ;
+
+            continue ;
+        }
+
+        if( ( strcmp(argv[i],"-MD") == 0 ) || ( strcmp(argv[i],"-MP") == 0 ) )
         {
+            /* write a make style dependency file
+             */
+            
+            if( argv[i][2] == 'P' )
+                dep_phony = TRUE ;
+            
+            dep_output = TRUE ;
+            dep_record = TRUE ;
+            
             i++ ;
             
-            version() ;
+            continue ;
+        }
+        
+        if( ( strcmp(argv[i],"-MF") == 0 ) || ( strcmp(argv[i],"-MT") == 0 ) )
+        {
+            i++ ;
+            
+            if( argc <= i )
+                return -1 ;
+            
+            if( argv[i-1][2] == 'F' )
+            {
+                dep_path = argv[i] ;
+            }
+            else
+            {
+                dep_target = argv[i] ;
+            }
+            
+            dep_output = TRUE ;
+            dep_record = TRUE ;
+            
+            i++ ;
             
             continue ;
         }
         
-        if( strcmp(argv[i],"-m") == 0 )
+        if( strcmp(argv[i],"--dyndep") == 0 )
         {
-            /* Set the character used to denote a macro
-             * default char is a hash ( # ) and this lets
-             * you use something else.
+            /* write a ninja dyndep file
+             */
+            
+            i++ ;
+            
+            if( argc <= i )
+                return -1 ;
+            
+            dyndep_path = argv[i] ;
+            dep_record = TRUE ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"-O") == 0 )
+        {
+            /* the directory outputs are written to
              */
             
             i++ ;
             
             if( argc <= i )
+                return -1 ;
+            
+            output_dir = argv[i] ;
+            
+            /* outputs older than cap itself are made again
+             */
+            
             {
-                // not enough arguments
+                struct stat st ;
                 
-                return -1 ;
+                if( stat( "/proc/self/exe", &st ) == 0 )
+                    cap_binary_mtime = st.st_mtim ;
             }
             
-            initial_macrochar = *( argv[i] ) ;
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"-j") == 0 )
+        {
+            /* the number of processes a big file is shared between
+             */
+            
+            i++ ;
+            
+            if( argc <= i )
+                return -1 ;
+            
+            parallel_jobs = atoi( argv[i] ) ;
+            
+            if( parallel_jobs < 1 )
+                parallel_jobs = 1 ;
             
             i++ ;
             
             continue ;
         }
-    
-        if( strcmp(argv[i],"-o") == 0 )
+        
+        if( strcmp(argv[i],"--ext") == 0 )
         {
+            /* the extension for outputs written under -O
+             */
+            
             i++ ;
-
-            if( i > argc )
+            
+            if( argc <= i )
+                return -1 ;
+            
+            output_ext = argv[i] ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--watch") == 0 )
+        {
+            i++ ;
+            
+            if( argc <= i )
+                return -1 ;
+            
+            watch_dir = argv[i] ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--write-if-changed") == 0 )
+        {
+            /* leave outputs alone when they would not change
+             */
+            
+            write_if_changed = TRUE ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--no-line-markers") == 0 )
+        {
+            line_markers = FALSE ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--strip-comments") == 0 )
+        {
+            strip_comments = TRUE ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--squeeze-blank-lines") == 0 )
+        {
+            squeeze_blank_lines = TRUE ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--unity") == 0 )
+        {
+            /* write the files that follow as one unity build
+             */
+            
+            i++ ;
+            
+            if( argc <= i )
+                return -1 ;
+            
+            if( close_output() != 0 )
+                return -1 ;
+            
+            fout = open_output( argv[i] ) ;
+            output_path = argv[i] ;
+            
+            if( fout == NULL )
+                return -1 ;
+            
+            reset_output_lines() ;
+            
+            unity_mode = TRUE ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--unity-rename") == 0 )
+        {
+            unity_rename = TRUE ;
+            
+            i++ ;
+            
+            continue ;
+        }
+        
+        if( strcmp(argv[i],"--source-map") == 0 )
+        {
+            /* write a binary map of output lines to input lines
+             */
+            
+            i++ ;
+            
+            if( argc <= i )
                 return -1 ;
+            
+            srcmap_path = argv[i] ;
+            
+            i++ ;
+            
+            continue ;
+        }
 
-            if( fout != stdout )
-            {
-                FCLOSE( fout ) ;
-                fout = NULL ;
-            }
+        /* This has to be a filename ( or a mistake )
+         */
 
-            if( strcmp( argv[i], "-" ) == 0 )
+        if( scan_mode != SCAN_OFF )
+        {
+            if( scan_file( argv[i] ) != 0 )
+                compare_failed++ ;
+            
+            input_files++ ;
+            
+            i++ ;
+            
+            continue ;
+        }
+
+        if( compare_mode )
+        {
+            char *data = NULL ;
+            size_t len = 0 ;
+            
+            data = read_file( argv[i], &len ) ;
+            
+            if( data == NULL )
             {
-                fout = stdout ;
+                fprintf( stderr, "cap: cannot read %s\n", argv[i] ) ;
+                
+                return -1 ;
             }
-            else
-            {
-                fout = fopen( argv[i], "w" ) ;
+            
+            infilename = argv[i] ;
+            
+            if( compare_engines( argv[i], data, len ) != 0 )
+                compare_failed++ ;
+            
+            free( data ) ;
+            
+            input_files++ ;
+            
+            i++ ;
+            
+            continue ;
+        }
 
-                if( fout == NULL )
-                    return -1 ;
-            }
+        if( output_dir != NULL )
+        {
+            /* batch mode, so this may be a directory or a list
+             */
+            
+            if( batch_input( output_dir, argv[i] ) != 0 )
+                compare_failed++ ;
+            
+            input_files++ ;
+            
+            i++ ;
+            
+            continue ;
+        }
 
-            if( fout == NULL )
+        if( unity_mode )
+        {
+            if( unity_file( argv[i] ) != 0 )
                 return -1 ;
             
+            input_files++ ;
+            
             i++ ;
             
             continue ;
         }
 
-        /* This has to be a filename ( or a mistake )
-         */
-
         if( fin != stdin )
         {
             FCLOSE( fin ) ;
@@ -2578,10 +14287,14 @@ static int init_main( int argc, char **argv )
         if( strcmp( argv[i], "-" ) == 0 )
         {
             fin = stdin ;
+            infilename = "<stdin>" ;
         }
         else
         {
             fin = fopen( argv[i] , "r" ) ;
+            infilename = argv[i] ;
+            
+            dep_add( argv[i] ) ;
         }
 
         if( fin == NULL )
@@ -2589,19 +14302,46 @@ static int init_main( int argc, char **argv )
 
         input_files++ ;
 
+        if( engine == ENGINE_FAST )
+        {
+            load_input( fin ) ;
+        }
+
         retv = main_process() ;
 
+        unload_input() ;
+
         if( retv != 0 )
             return -1 ;
 
         i++ ;
     };
 
-    if( input_files == 0 )
+    if( watch_dir != NULL )
+    {
+        return watch_main( watch_dir, output_dir ) ;
+    }
+
+    if( ( input_files == 0 ) && ( scan_mode != SCAN_OFF ) )
+    {
+        if( scan_file( "-" ) != 0 )
+            compare_failed++ ;
+    }
+    else if( input_files == 0 )
     {
         retv = main_process() ;
     }
 
+    if( ( compare_failed != 0 ) || ( cap_errors != 0 ) )
+    {
+        retv = -1 ;
+    }
+
+    if( command_exit_status != 0 )
+    {
+        retv = command_exit_status ;
+    }
+
     return retv ;
 }
 
@@ -2617,14 +14357,26 @@ static int deinit_main()
 
     fflush( fout ) ;
 
+    if( srcmap_write() != 0 )
+    {
+        fprintf( stderr, "cap: cannot write source map %s\n", srcmap_path ) ;
+
+        retv = -1 ;
+    }
+
+    if( dep_write() != 0 )
+    {
+        retv = -1 ;
+    }
+
     if( fin != stdin )
     {
         FCLOSE( fin ) ;
     }
 
-    if( fout != stdout )
+    if( close_output() != 0 )
     {
-        FCLOSE( fout ) ;
+        retv = -1 ;
     }
     
     safe_free( open_brace_macro ) ;
@@ -2652,11 +14404,14 @@ int main( int argc, char **argv )
 
 fini_error:
 
-    deinit_main() ;
+    if( deinit_main() != 0 )
+        retv = -1 ;
 
     return retv ;
 }
 
+#endif /* CAP_FUZZER */
+
 
 /*******************************************************
  */
@@ -0,0 +1,77 @@
+/* cap_plugin.h
+ *
+ * The interface between cap and the plugins it loads with --plugin.
+ *
+ * A plugin is a shared library that exports
+ *
+ *      int cap_plugin_init( const cap_host_t *host ) ;
+ *
+ * cap calls it once, straight after loading the library.  It adds the
+ * plugin's directives with host->add_directive() and returns 0, or
+ * anything else to stop cap.  The library stays loaded until cap
+ * exits, so a plugin can keep state from one file to the next.
+ *
+ * When one of its directives is met the plugin's function is called
+ * with the rest of the directive line and, for a block directive, the
+ * text up to the next single macrochar.  It writes its output with
+ * host->write() and reports problems with host->error(), which gives
+ * them the file and line of the directive.  It returns 0, or anything
+ * else if it failed.
+ *
+ * New members are only ever added to the end of cap_host_t, and size
+ * says how big the one cap passed is.
+ *
+ * A plugin is built with e.g. cc -shared -fPIC -o libfoo.so foo.c
+ */
+
+#ifndef CAP_PLUGIN_H
+#define CAP_PLUGIN_H
+
+#include <stddef.h>
+
+#define CAP_PLUGIN_ABI_VERSION      1
+
+#define CAP_PLUGIN_INIT             "cap_plugin_init"
+
+/* flags for add_directive()
+ */
+#define CAP_DIRECTIVE_BLOCK         1   /* takes the lines up to a single macrochar */
+#define CAP_DIRECTIVE_EXPAND        2   /* its output is processed by cap, as #command-expand's is */
+
+/* where a directive's output goes
+ */
+typedef struct cap_sink_s   cap_sink_t ;
+
+struct cap_block_s {
+    const char      *keyword ;      /* without the macrochar */
+    const char      *args ;         /* the rest of the directive line */
+    const char      *body ;         /* the block, or NULL for a directive without one */
+    size_t          body_len ;
+    const char      *file ;
+    unsigned int    line ;          /* of the directive */
+    } ;
+
+typedef struct cap_block_s  cap_block_t ;
+
+typedef int (*cap_directive_fn)( void *user, const cap_block_t *block, cap_sink_t *sink ) ;
+
+struct cap_host_s {
+    int         abi_version ;
+    size_t      size ;
+
+    /* Only while cap_plugin_init() runs.  keyword is letters, digits,
+     * _ and -, and must not be one of cap's own or another plugin's.
+     * Returns 0, or -1 if it can not be added.
+     */
+    int         (*add_directive)( const char *keyword, int flags, cap_directive_fn fn, void *user ) ;
+
+    void        (*write)( cap_sink_t *sink, const char *data, size_t len ) ;
+
+    void        (*error)( cap_sink_t *sink, const char *fmt, ... ) ;
+    } ;
+
+typedef struct cap_host_s   cap_host_t ;
+
+typedef int (*cap_plugin_init_fn)( const cap_host_t *host ) ;
+
+#endif